@@ -0,0 +1,358 @@
+/*
+ * Copyright 2015, Daehwan Kim <infphilo@gmail.com>
+ *
+ * This file is part of HISAT.
+ *
+ * HISAT is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * HISAT is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with HISAT.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <iostream>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#endif
+#include "align_daemon.h"
+
+using namespace std;
+
+#ifndef _WIN32
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+static const uint32_t DAEMON_JOB_MAGIC = 0x48534a42; // "HSJB"
+static const uint32_t DAEMON_MAX_JOB   = 1 << 20;    // longest argument list we accept
+static const int      DAEMON_RECV_SECS = 10;         // time a client has to send its request
+
+/**
+ * Fixed-size start of a job request; the client's three descriptors
+ * ride along with it.  'len' bytes of NUL-separated strings follow: the
+ * working directory, then the arguments.
+ */
+struct DaemonJobHeader {
+	uint32_t magic;
+	uint32_t len;
+};
+
+/**
+ * Fill in 'addr' for the socket 'path'.  Prints an error and throws 1
+ * if the path is too long for a UNIX socket.
+ */
+static void daemonAddr(const string& path, struct sockaddr_un& addr) {
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if(path.empty() || path.length() >= sizeof(addr.sun_path)) {
+		cerr << "Error: Daemon socket path '" << path << "' is empty or longer than "
+		     << (sizeof(addr.sun_path) - 1) << " characters" << endl;
+		throw 1;
+	}
+	memcpy(addr.sun_path, path.c_str(), path.length());
+}
+
+/**
+ * Read exactly 'len' bytes; returns false on EOF or error.
+ */
+static bool readFull(int fd, void *buf, size_t len) {
+	char *p = (char*)buf;
+	while(len > 0) {
+		ssize_t r = read(fd, p, len);
+		if(r < 0 && errno == EINTR) continue;
+		if(r <= 0) return false;
+		p += r;
+		len -= (size_t)r;
+	}
+	return true;
+}
+
+/**
+ * Write exactly 'len' bytes; returns false on error.
+ */
+static bool writeFull(int fd, const void *buf, size_t len) {
+	const char *p = (const char*)buf;
+	while(len > 0) {
+		ssize_t r = send(fd, p, len, MSG_NOSIGNAL);
+		if(r < 0 && errno == EINTR) continue;
+		if(r <= 0) return false;
+		p += r;
+		len -= (size_t)r;
+	}
+	return true;
+}
+
+int daemonListen(const string& path) {
+	struct sockaddr_un addr;
+	daemonAddr(path, addr);
+	int lfd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if(lfd == -1) {
+		perror("socket");
+		cerr << "Error: Could not create daemon socket" << endl;
+		throw 1;
+	}
+	fcntl(lfd, F_SETFD, FD_CLOEXEC);
+	// Jobs read and write files as the daemon's user, so only that user
+	// may connect: the socket is created with mode 0600
+	mode_t oldMask = umask(0077);
+	int rc = bind(lfd, (struct sockaddr*)&addr, sizeof(addr));
+	if(rc == -1 && errno == EADDRINUSE) {
+		// Replace the socket only if it is one and nobody is answering on it
+		struct stat st;
+		if(lstat(path.c_str(), &st) == 0 && !S_ISSOCK(st.st_mode)) {
+			umask(oldMask);
+			close(lfd);
+			cerr << "Error: " << path << " exists and is not a socket; not replacing it" << endl;
+			throw 1;
+		}
+		int probe = socket(AF_UNIX, SOCK_STREAM, 0);
+		bool live = probe != -1 && connect(probe, (struct sockaddr*)&addr, sizeof(addr)) == 0;
+		if(probe != -1) close(probe);
+		if(live) {
+			umask(oldMask);
+			close(lfd);
+			cerr << "Error: A daemon is already listening on " << path << endl;
+			throw 1;
+		}
+		unlink(path.c_str());
+		rc = bind(lfd, (struct sockaddr*)&addr, sizeof(addr));
+	}
+	umask(oldMask);
+	if(rc == 0 && chmod(path.c_str(), 0600) == -1) rc = -1;
+	if(rc == -1 || listen(lfd, 64) == -1) {
+		int err = errno;
+		close(lfd);
+		cerr << "Error: Could not listen on daemon socket " << path << ": " << strerror(err) << endl;
+		throw 1;
+	}
+	return lfd;
+}
+
+/**
+ * Close whatever descriptors 'job' holds.
+ */
+static void daemonDropJob(DaemonJob& job) {
+	for(int i = 0; i < 3; i++) {
+		if(job.fds[i] != -1) close(job.fds[i]);
+		job.fds[i] = -1;
+	}
+	if(job.conn != -1) close(job.conn);
+	job.conn = -1;
+}
+
+/**
+ * Return true iff the peer on connection 'fd' runs as the daemon's own
+ * user.  Where the platform can't tell, the socket's mode is all there
+ * is to go on.
+ */
+static bool daemonPeerOk(int fd) {
+#if defined(SO_PEERCRED) && defined(__linux__)
+	struct ucred cred;
+	socklen_t len = sizeof(cred);
+	if(getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == -1) return false;
+	return cred.uid == geteuid();
+#elif defined(__APPLE__) || defined(__FreeBSD__) || defined(__OpenBSD__) || defined(__NetBSD__)
+	uid_t uid;
+	gid_t gid;
+	if(getpeereid(fd, &uid, &gid) == -1) return false;
+	return uid == geteuid();
+#else
+	return true;
+#endif
+}
+
+bool daemonAccept(int lfd, DaemonJob& job) {
+	job.cwd.clear();
+	job.args.clear();
+	do {
+		job.conn = accept(lfd, NULL, NULL);
+	} while(job.conn == -1 && errno == EINTR);
+	if(job.conn == -1) {
+		perror("accept");
+		cerr << "Error: Could not accept a connection on the daemon socket" << endl;
+		throw 1;
+	}
+	fcntl(job.conn, F_SETFD, FD_CLOEXEC);
+	if(!daemonPeerOk(job.conn)) {
+		cerr << "Warning: Ignoring a connection from another user on the daemon socket" << endl;
+		daemonDropJob(job);
+		return false;
+	}
+	// Jobs run one at a time, so a client that connects and then stalls
+	// mustn't hold up the others
+	struct timeval tv;
+	tv.tv_sec = DAEMON_RECV_SECS;
+	tv.tv_usec = 0;
+	setsockopt(job.conn, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	DaemonJobHeader hdr;
+	union {
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(3 * sizeof(int))];
+	} ctl;
+	struct iovec iov;
+	iov.iov_base = &hdr;
+	iov.iov_len = sizeof(hdr);
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = ctl.buf;
+	msg.msg_controllen = sizeof(ctl.buf);
+	ssize_t r;
+	do {
+		r = recvmsg(job.conn, &msg, 0);
+	} while(r == -1 && errno == EINTR);
+	struct cmsghdr *cm = (r > 0) ? CMSG_FIRSTHDR(&msg) : NULL;
+	if(cm != NULL &&
+	   cm->cmsg_level == SOL_SOCKET &&
+	   cm->cmsg_type == SCM_RIGHTS &&
+	   cm->cmsg_len == CMSG_LEN(3 * sizeof(int)))
+	{
+		memcpy(job.fds, CMSG_DATA(cm), 3 * sizeof(int));
+	}
+	bool ok = r > 0 &&
+	          job.fds[2] != -1 &&
+	          readFull(job.conn, (char*)&hdr + r, sizeof(hdr) - (size_t)r) &&
+	          hdr.magic == DAEMON_JOB_MAGIC &&
+	          hdr.len > 0 && hdr.len <= DAEMON_MAX_JOB;
+	string payload;
+	if(ok) {
+		payload.resize(hdr.len);
+		ok = readFull(job.conn, &payload[0], hdr.len) && payload[hdr.len - 1] == '\0';
+	}
+	if(!ok) {
+		cerr << "Warning: Ignoring malformed or stalled request on the daemon socket" << endl;
+		daemonDropJob(job);
+		return false;
+	}
+	size_t off = 0;
+	while(off < payload.length()) {
+		size_t end = payload.find('\0', off);
+		if(off == 0) {
+			job.cwd = payload.substr(off, end - off);
+		} else {
+			job.args.push_back(payload.substr(off, end - off));
+		}
+		off = end + 1;
+	}
+	return true;
+}
+
+void daemonReply(DaemonJob& job, int status) {
+	int32_t st = (int32_t)status;
+	writeFull(job.conn, &st, sizeof(st));
+	daemonDropJob(job);
+}
+
+void daemonClose(int lfd, const string& path) {
+	close(lfd);
+	unlink(path.c_str());
+}
+
+int daemonSubmit(const string& path, const EList<string>& args) {
+	struct sockaddr_un addr;
+	daemonAddr(path, addr);
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if(fd == -1 || connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == -1) {
+		int err = errno;
+		if(fd != -1) close(fd);
+		cerr << "Error: Could not connect to the HISAT daemon on " << path << ": "
+		     << strerror(err) << endl;
+		return 1;
+	}
+	char cwd[PATH_MAX];
+	if(getcwd(cwd, sizeof(cwd)) == NULL) {
+		perror("getcwd");
+		close(fd);
+		return 1;
+	}
+	string payload(cwd);
+	payload.push_back('\0');
+	for(size_t i = 0; i < args.size(); i++) {
+		payload += args[i];
+		payload.push_back('\0');
+	}
+	if(payload.length() > DAEMON_MAX_JOB) {
+		cerr << "Error: Argument list is too long to send to the HISAT daemon" << endl;
+		close(fd);
+		return 1;
+	}
+	DaemonJobHeader hdr;
+	hdr.magic = DAEMON_JOB_MAGIC;
+	hdr.len = (uint32_t)payload.length();
+	union {
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(3 * sizeof(int))];
+	} ctl;
+	memset(&ctl, 0, sizeof(ctl));
+	struct iovec iov;
+	iov.iov_base = &hdr;
+	iov.iov_len = sizeof(hdr);
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = ctl.buf;
+	msg.msg_controllen = sizeof(ctl.buf);
+	struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+	cm->cmsg_level = SOL_SOCKET;
+	cm->cmsg_type = SCM_RIGHTS;
+	cm->cmsg_len = CMSG_LEN(3 * sizeof(int));
+	const int stdfds[3] = { 0, 1, 2 };
+	memcpy(CMSG_DATA(cm), stdfds, sizeof(stdfds));
+	ssize_t r;
+	do {
+		r = sendmsg(fd, &msg, MSG_NOSIGNAL);
+	} while(r == -1 && errno == EINTR);
+	bool ok = r > 0 &&
+	          writeFull(fd, (const char*)&hdr + r, sizeof(hdr) - (size_t)r) &&
+	          writeFull(fd, payload.c_str(), payload.length());
+	int32_t st = 1;
+	if(!ok || !readFull(fd, &st, sizeof(st))) {
+		cerr << "Error: The HISAT daemon on " << path << " closed the connection "
+		     << "before the job finished" << endl;
+		st = 1;
+	}
+	close(fd);
+	return (int)st;
+}
+
+#else
+
+int daemonListen(const string& path) {
+	cerr << "Error: --daemon is not supported on this platform" << endl;
+	throw 1;
+}
+
+bool daemonAccept(int lfd, DaemonJob& job) {
+	return false;
+}
+
+void daemonReply(DaemonJob& job, int status) { }
+
+void daemonClose(int lfd, const string& path) { }
+
+int daemonSubmit(const string& path, const EList<string>& args) {
+	cerr << "Error: --connect is not supported on this platform" << endl;
+	return 1;
+}
+
+#endif
@@ -0,0 +1,82 @@
+/*
+ * Copyright 2015, Daehwan Kim <infphilo@gmail.com>
+ *
+ * This file is part of HISAT.
+ *
+ * HISAT is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * HISAT is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with HISAT.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef ALIGN_DAEMON_H_
+#define ALIGN_DAEMON_H_
+
+#include <string>
+#include "ds.h"
+
+/**
+ * Local UNIX-socket plumbing for --daemon, which keeps an index loaded
+ * and runs alignment jobs submitted by later hisat-align processes
+ * started with --connect.
+ *
+ * A client sends its working directory and its command-line arguments,
+ * and hands the daemon its standard input, output and error descriptors
+ * over the socket (SCM_RIGHTS).  The daemon runs the job with those as
+ * its own standard streams, so alignments, the alignment summary and
+ * any errors reach the client exactly as if it had run the job itself,
+ * then replies with the job's exit status.
+ */
+
+/**
+ * One job received from a client.
+ */
+struct DaemonJob {
+	DaemonJob() : conn(-1) { fds[0] = fds[1] = fds[2] = -1; }
+
+	int conn;                // connection to the client
+	int fds[3];              // client's stdin, stdout and stderr
+	std::string cwd;         // client's working directory
+	EList<std::string> args; // client's arguments, minus argv[0] and --connect
+};
+
+/**
+ * Bind and listen on the UNIX socket 'path', which only the daemon's
+ * user may use (mode 0600).  A stale socket left behind by a daemon that
+ * died is replaced; a live one, or anything at 'path' that isn't a
+ * socket, is an error.  Prints an error and throws 1 on failure.
+ */
+int daemonListen(const std::string& path);
+
+/**
+ * Wait for the next job on listening socket 'lfd'.  Returns false, after
+ * printing a warning, if a client connected but runs as another user,
+ * sent a malformed request, or didn't send it within a few seconds.
+ */
+bool daemonAccept(int lfd, DaemonJob& job);
+
+/**
+ * Send 'status' to the client and close the job's descriptors.
+ */
+void daemonReply(DaemonJob& job, int status);
+
+/**
+ * Stop listening on 'lfd' and remove the socket 'path'.
+ */
+void daemonClose(int lfd, const std::string& path);
+
+/**
+ * Submit 'args' as a job to the daemon listening on 'path', and wait for
+ * it to finish.  Returns the job's exit status.
+ */
+int daemonSubmit(const std::string& path, const EList<std::string>& args);
+
+#endif /*ALIGN_DAEMON_H_*/
@@ -27,6 +27,7 @@
 #include "ds.h"
 #include "simple_func.h"
 #include "outq.h"
+#include "bam.h"
 #include <utility>
 #include "splice_site.h"
 
@@ -1352,11 +1353,22 @@ public:
 			refnames,
 			quiet,
             ssdb),
-		samc_(samc)
+		samc_(samc),
+		bamEnc_(NULL)
 	{ }
 	
 	virtual ~AlnSinkSam() { }
 
+	/**
+	 * Write records as BAM, encoded by 'enc', instead of as SAM text.
+	 * 'nthreads' is the number of search threads.
+	 */
+	void setBam(const BamEncoder *enc, size_t nthreads) {
+		bamEnc_ = enc;
+		bamName_.resize(nthreads + 1); // thread ids may start at 1
+		bamTags_.resize(nthreads + 1);
+	}
+
 	/**
 	 * Append a single alignment result, which might be paired or
 	 * unpaired, to the given output stream in Bowtie's verbose-mode
@@ -1385,7 +1397,7 @@ public:
 		assert(rd1 != NULL || rd2 != NULL);
 		if(rd1 != NULL) {
 			assert(flags1 != NULL);
-			appendMate(o, staln, *rd1, rd2, rdid, rs1, rs2, summ, ssm1, ssm2,
+			appendMate(o, staln, threadId, *rd1, rd2, rdid, rs1, rs2, summ, ssm1, ssm2,
 			           *flags1, prm, mapq, sc);
             if(rs1 != NULL && rs1->spliced() && this->spliceSiteDB_ != NULL) {
                 this->spliceSiteDB_->addSpliceSite(*rd1, *rs1);
@@ -1393,7 +1405,7 @@ public:
 		}
 		if(rd2 != NULL && report2) {
 			assert(flags2 != NULL);
-			appendMate(o, staln, *rd2, rd1, rdid, rs2, rs1, summ, ssm2, ssm1,
+			appendMate(o, staln, threadId, *rd2, rd1, rdid, rs2, rs1, summ, ssm2, ssm1,
 			           *flags2, prm, mapq, sc);
             if(rs2 != NULL && rs2->spliced() && this->spliceSiteDB_ != NULL) {
                 this->spliceSiteDB_->addSpliceSite(*rd2, *rs2);
@@ -1411,6 +1423,7 @@ protected:
 	void appendMate(
 		BTString&     o,
 		StackedAln&   staln,
+		size_t        threadId,
 		const Read&   rd,
 		const Read*   rdo,
 		const TReadId rdid,
@@ -1424,7 +1437,37 @@ protected:
 		const Mapq& mapq,          // MAPQ calculator
 		const Scoring& sc);        // scoring scheme
 
+	/**
+	 * Append the same record as appendMate(), encoded as BAM straight
+	 * from the alignment.  The stacked alignment must be initialized.
+	 */
+	void appendMateBam(
+		BTString&     o,
+		StackedAln&   staln,
+		size_t        threadId,
+		const Read&   rd,
+		const Read*   rdo,
+		AlnRes* rs,
+		AlnRes* rso,
+		const AlnSetSumm& summ,
+		const SeedAlSumm& ssm,
+		const AlnFlags& flags,
+		const PerReadMetrics& prm, // per-read metrics
+		const Mapq& mapq,          // MAPQ calculator
+		const Scoring& sc);        // scoring scheme
+
+	/**
+	 * Return the SAM FLAG field for a mate.
+	 */
+	int samFlag(
+		const AlnFlags& flags,
+		const AlnRes* rs,
+		const AlnRes* rso) const;
+
 	const SamConfig& samc_;    // settings & routines for SAM output
+	const BamEncoder *bamEnc_; // non-NULL for BAM output
+	EList<BTString>  bamName_; // per-thread buffers for BAM read names
+	EList<BTString>  bamTags_; // per-thread buffers for optional fields
 	BTDnaString      dseq_;    // buffer for decoded read sequence
 	BTString         dqual_;   // buffer for decoded quality sequence
 };
@@ -2799,6 +2842,7 @@ template <typename index_t>
 void AlnSinkSam<index_t>::appendMate(
 									 BTString&     o,           // append to this string
 									 StackedAln&   staln,       // store stacked alignment struct here
+									 size_t        threadId,    // which thread am I?
 									 const Read&   rd,
 									 const Read*   rdo,
 									 const TReadId rdid,
@@ -2822,40 +2866,17 @@ void AlnSinkSam<index_t>::appendMate(
 		rs->initStacked(rd, staln);
 		staln.leftAlign(false /* not past MMs */);
 	}
+	if(bamEnc_ != NULL) {
+		appendMateBam(o, staln, threadId, rd, rdo, rs, rso, summ, ssm,
+		              flags, prm, mapqCalc, sc);
+		return;
+	}
 	int offAdj = 0;
 	// QNAME
 	samc_.printReadName(o, rd.name, flags.partOfPair());
 	o.append('\t');
 	// FLAG
-	int fl = 0;
-	if(flags.partOfPair()) {
-		fl |= SAM_FLAG_PAIRED;
-		if(flags.alignedConcordant()) {
-			fl |= SAM_FLAG_MAPPED_PAIRED;
- 		}
-		if(!flags.mateAligned()) {
-			// Other fragment is unmapped
-			fl |= SAM_FLAG_MATE_UNMAPPED;
-		}
-		fl |= (flags.readMate1() ?
-			   SAM_FLAG_FIRST_IN_PAIR : SAM_FLAG_SECOND_IN_PAIR);
-		if(flags.mateAligned() && rso != NULL) {
-			if(!rso->fw()) {
-				fl |= SAM_FLAG_MATE_STRAND;
-			}
-		}
-	}
-	if(!flags.isPrimary()) {
-		fl |= SAM_FLAG_NOT_PRIMARY;
-	}
-	if(rs != NULL && !rs->fw()) {
-		fl |= SAM_FLAG_QUERY_STRAND;
-	}
-	if(rs == NULL) {
-		// Failed to align
-		fl |= SAM_FLAG_UNMAPPED;
-	}
-	itoa10<int>(fl, buf);
+	itoa10<int>(samFlag(flags, rs, rso), buf);
 	o.append(buf);
 	o.append('\t');
 	// RNAME
@@ -3023,4 +3044,113 @@ void AlnSinkSam<index_t>::appendMate(
 	o.append('\n');
 }
 
+template <typename index_t>
+void AlnSinkSam<index_t>::appendMateBam(
+										BTString&     o,
+										StackedAln&   staln,
+										size_t        threadId,
+										const Read&   rd,
+										const Read*   rdo,
+										AlnRes* rs,
+										AlnRes* rso,
+										const AlnSetSumm& summ,
+										const SeedAlSumm& ssm,
+										const AlnFlags& flags,
+										const PerReadMetrics& prm,
+										const Mapq& mapqCalc,
+										const Scoring& sc)
+{
+	assert_lt(threadId, bamName_.size());
+	BTString& name = bamName_[threadId];
+	BTString& tags = bamTags_[threadId];
+	name.clear();
+	tags.clear();
+	samc_.printReadName(name, rd.name, flags.partOfPair());
+	// The fields appendMate() prints, with positions 0-based and -1
+	// standing for "*" and 0
+	char mapqInps[1024];
+	mapqInps[0] = '\0';
+	int32_t refid = (int32_t)summ.orefid();
+	int64_t pos = (summ.orefid() != -1) ? (int64_t)summ.orefoff() : -1;
+	int mapq = 0;
+	if(rs != NULL) {
+		refid = (int32_t)rs->refid();
+		pos = rs->refoff();
+		mapq = (int)mapqCalc.mapq(
+								  summ, flags, rd.mate < 2, rd.length(),
+								  rdo == NULL ? 0 : rdo->length(), mapqInps);
+		staln.buildCigar(false);
+	}
+	int32_t nextRefid = -1;
+	int64_t nextPos = -1;
+	if(rs != NULL && flags.partOfPair()) {
+		nextRefid = (rso != NULL) ? (int32_t)rso->refid() : refid;
+		nextPos = (rso != NULL) ? rso->refoff() : rs->refoff();
+	} else if(summ.orefid() != -1) {
+		nextRefid = refid;
+		nextPos = summ.orefoff();
+	}
+	int64_t tlen = 0;
+	if(rs != NULL && rs->isFraglenSet()) {
+		tlen = rs->fragmentLength();
+	}
+	const BTDnaString *seq = NULL;
+	const BTString *qual = NULL;
+	if(flags.isPrimary() || !samc_.omitSecondarySeqQual()) {
+		bool fw = (rs == NULL || rs->fw());
+		if(rd.patFw.length() > 0) seq = fw ? &rd.patFw : &rd.patRc;
+		if(rd.qual.length() > 0) qual = fw ? &rd.qual : &rd.qualRev;
+	}
+	if(rs != NULL) {
+		samc_.printAlignedOptFlags(
+								   tags, true, rd, *rs, staln, flags, summ,
+								   ssm, prm, sc, mapqInps);
+	} else {
+		samc_.printEmptyOptFlags(
+								 tags, true, rd, flags, summ, ssm, prm, sc);
+	}
+	bamEnc_->encodeRecord(
+						  o, name, samFlag(flags, rs, rso), refid, pos, mapq,
+						  rs != NULL ? &staln.cigarOps() : NULL,
+						  rs != NULL ? &staln.cigarRuns() : NULL,
+						  nextRefid, nextPos, tlen, seq, qual, tags);
+}
+
+template <typename index_t>
+int AlnSinkSam<index_t>::samFlag(
+								 const AlnFlags& flags,
+								 const AlnRes* rs,
+								 const AlnRes* rso) const
+{
+	int fl = 0;
+	if(flags.partOfPair()) {
+		fl |= SAM_FLAG_PAIRED;
+		if(flags.alignedConcordant()) {
+			fl |= SAM_FLAG_MAPPED_PAIRED;
+ 		}
+		if(!flags.mateAligned()) {
+			// Other fragment is unmapped
+			fl |= SAM_FLAG_MATE_UNMAPPED;
+		}
+		fl |= (flags.readMate1() ?
+			   SAM_FLAG_FIRST_IN_PAIR : SAM_FLAG_SECOND_IN_PAIR);
+		if(flags.mateAligned() && rso != NULL) {
+			if(!rso->fw()) {
+				fl |= SAM_FLAG_MATE_STRAND;
+			}
+		}
+	}
+	if(!flags.isPrimary()) {
+		fl |= SAM_FLAG_NOT_PRIMARY;
+	}
+	if(rs != NULL && !rs->fw()) {
+		fl |= SAM_FLAG_QUERY_STRAND;
+	}
+	if(rs == NULL) {
+		// Failed to align
+		fl |= SAM_FLAG_UNMAPPED;
+	}
+	return fl;
+}
+
 #endif /*ndef ALN_SINK_H_*/
@@ -0,0 +1,887 @@
+/*
+ * Copyright 2015, Daehwan Kim <infphilo@gmail.com>
+ *
+ * This file is part of HISAT.
+ *
+ * HISAT is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * HISAT is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with HISAT.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <iostream>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <queue>
+#include <algorithm>
+#include <functional>
+#include <fcntl.h>
+#include <unistd.h>
+#include <zlib.h>
+#include "bam.h"
+#include "assert_helpers.h"
+
+using namespace std;
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+/**
+ * Append little-endian integers to a BAM buffer.
+ */
+static inline void appendU8(BTString& o, uint8_t v) {
+	o.append((char)v);
+}
+
+static inline void appendU16(BTString& o, uint16_t v) {
+	char b[2] = { (char)(v & 0xff), (char)(v >> 8) };
+	o.append(b, 2);
+}
+
+static inline void appendU32(BTString& o, uint32_t v) {
+	char b[4] = {
+		(char)(v & 0xff), (char)((v >> 8) & 0xff),
+		(char)((v >> 16) & 0xff), (char)(v >> 24) };
+	o.append(b, 4);
+}
+
+static inline void appendU64(BTString& o, uint64_t v) {
+	appendU32(o, (uint32_t)(v & 0xffffffff));
+	appendU32(o, (uint32_t)(v >> 32));
+}
+
+/**
+ * Read little-endian integers from a BAM record.
+ */
+static inline uint16_t getU16(const char *b) {
+	const unsigned char *u = (const unsigned char *)b;
+	return (uint16_t)(u[0] | (u[1] << 8));
+}
+
+static inline uint32_t getU32(const char *b) {
+	const unsigned char *u = (const unsigned char *)b;
+	return (uint32_t)u[0] | ((uint32_t)u[1] << 8) |
+	       ((uint32_t)u[2] << 16) | ((uint32_t)u[3] << 24);
+}
+
+static inline void putU32(char *b, uint32_t v) {
+	b[0] = (char)(v & 0xff);
+	b[1] = (char)((v >> 8) & 0xff);
+	b[2] = (char)((v >> 16) & 0xff);
+	b[3] = (char)(v >> 24);
+}
+
+/**
+ * Report an optional field that can't be encoded and bail.
+ */
+static void badRecord(const char *s, const char *e, const char *why) {
+	cerr << "Error: could not convert SAM optional field to BAM (" << why << "): "
+	     << string(s, e - s) << endl;
+	throw 1;
+}
+
+/**
+ * Parse a decimal integer from [s, e); the whole range must be used.
+ */
+static bool parseInt(const char *s, const char *e, int64_t& v) {
+	if(s == e) return false;
+	bool neg = false;
+	if(*s == '-' || *s == '+') {
+		neg = (*s == '-');
+		if(++s == e) return false;
+	}
+	v = 0;
+	for(; s < e; s++) {
+		if(*s < '0' || *s > '9') return false;
+		v = v * 10 + (*s - '0');
+	}
+	if(neg) v = -v;
+	return true;
+}
+
+/**
+ * Compute the BAI bin of the 0-based, half-open interval [beg, end),
+ * as in the SAM specification.
+ */
+static inline uint16_t reg2bin(int64_t beg, int64_t end) {
+	--end;
+	if(beg >> 14 == end >> 14) return (uint16_t)(((1 << 15) - 1) / 7 + (beg >> 14));
+	if(beg >> 17 == end >> 17) return (uint16_t)(((1 << 12) - 1) / 7 + (beg >> 17));
+	if(beg >> 20 == end >> 20) return (uint16_t)(((1 <<  9) - 1) / 7 + (beg >> 20));
+	if(beg >> 23 == end >> 23) return (uint16_t)(((1 <<  6) - 1) / 7 + (beg >> 23));
+	if(beg >> 26 == end >> 26) return (uint16_t)(((1 <<  3) - 1) / 7 + (beg >> 26));
+	return 0;
+}
+
+BamEncoder::BamEncoder(const SamConfig& samc) {
+	BTString name;
+	for(size_t i = 0; i < samc.numRefs(); i++) {
+		name.clear();
+		samc.printRefNameFromIndex(name, i);
+		names_.push_back(string(name.buf(), name.length()));
+		lens_.push_back(samc.refLen(i));
+	}
+}
+
+void BamEncoder::encodeHeader(const BTString& text, BTString& o) const {
+	o.append("BAM\1", 4);
+	appendU32(o, (uint32_t)text.length());
+	o.append(text.buf(), text.length());
+	appendU32(o, (uint32_t)names_.size());
+	for(size_t i = 0; i < names_.size(); i++) {
+		appendU32(o, (uint32_t)names_[i].length() + 1);
+		o.append(names_[i].c_str(), names_[i].length() + 1);
+		appendU32(o, (uint32_t)lens_[i]);
+	}
+}
+
+void BamEncoder::encodeRecord(
+	BTString& o,
+	const BTString& name,
+	int flag,
+	int32_t refid,
+	int64_t pos,
+	int mapq,
+	const EList<char>* cigOp,
+	const EList<size_t>* cigRun,
+	int32_t nextRefid,
+	int64_t nextPos,
+	int64_t tlen,
+	const BTDnaString* seq,
+	const BTString* qual,
+	const BTString& tags) const
+{
+	// 4-bit BAM codes of A, C, G, T and N
+	static const uint8_t dnaCode[5] = { 1, 2, 4, 8, 15 };
+	// Read name, truncated to the BAM limit of 254 characters
+	size_t nameLen = min<size_t>(name.length(), 254);
+	// CIGAR: count operations and reference span
+	size_t ncigar = 0;
+	int64_t refspan = 0;
+	if(cigOp != NULL) {
+		assert(cigRun != NULL);
+		assert_eq(cigOp->size(), cigRun->size());
+		for(size_t i = 0; i < cigOp->size(); i++) {
+			if((*cigRun)[i] == 0) continue;
+			if(strchr("MDN=X", (*cigOp)[i]) != NULL) refspan += (*cigRun)[i];
+			ncigar++;
+		}
+	}
+	size_t seqLen = (seq == NULL) ? 0 : seq->length();
+	assert(qual == NULL || seq == NULL || qual->length() == seqLen);
+	// Fixed-length part of the record; block_size is filled in last
+	size_t start = o.length();
+	appendU32(o, 0);
+	appendU32(o, (uint32_t)refid);
+	appendU32(o, (uint32_t)pos);
+	appendU8(o, (uint8_t)(nameLen + 1));
+	appendU8(o, (uint8_t)mapq);
+	appendU16(o, reg2bin(pos, pos + (refspan > 0 ? refspan : 1)));
+	appendU16(o, (uint16_t)ncigar);
+	appendU16(o, (uint16_t)flag);
+	appendU32(o, (uint32_t)seqLen);
+	appendU32(o, (uint32_t)nextRefid);
+	appendU32(o, (uint32_t)nextPos);
+	appendU32(o, (uint32_t)(int32_t)tlen);
+	// read_name
+	o.append(name.buf(), nameLen);
+	o.append('\0');
+	// cigar
+	for(size_t i = 0; cigOp != NULL && i < cigOp->size(); i++) {
+		if((*cigRun)[i] == 0) continue;
+		uint32_t op = (uint32_t)(strchr("MIDNSHP=X", (*cigOp)[i]) - "MIDNSHP=X");
+		appendU32(o, ((uint32_t)(*cigRun)[i] << 4) | op);
+	}
+	// seq, two bases per byte
+	for(size_t i = 0; i < seqLen; i += 2) {
+		uint8_t b = (uint8_t)(dnaCode[(int)(*seq)[i]] << 4);
+		if(i + 1 < seqLen) b |= dnaCode[(int)(*seq)[i + 1]];
+		appendU8(o, b);
+	}
+	// qual
+	for(size_t i = 0; i < seqLen; i++) {
+		appendU8(o, qual == NULL ? 0xff : (uint8_t)((*qual)[i] - 33));
+	}
+	// Optional fields
+	const char *p = tags.buf();
+	const char *e = p + tags.length();
+	while(p < e) {
+		const char *tab = (const char *)memchr(p, '\t', e - p);
+		if(tab == NULL) tab = e;
+		if(tab > p) encodeTag(p, tab, o);
+		p = tab + 1;
+	}
+	char *bs = o.wbuf() + start;
+	putU32(bs, (uint32_t)(o.length() - start - 4));
+}
+
+void BamEncoder::encodeTag(const char *s, const char *e, BTString& o) const {
+	if(e - s < 5 || s[2] != ':' || s[4] != ':') {
+		badRecord(s, e, "bad optional field");
+	}
+	const char *v = s + 5;
+	o.append(s, 2);
+	switch(s[3]) {
+		case 'A':
+			if(e - v != 1) badRecord(s, e, "bad A field");
+			o.append('A');
+			o.append(*v);
+			break;
+		case 'i': {
+			int64_t n;
+			if(!parseInt(v, e, n)) badRecord(s, e, "bad i field");
+			// Use the smallest type that holds the value, as samtools does
+			if(n < 0) {
+				if(n >= -128) {
+					o.append('c'); appendU8(o, (uint8_t)(int8_t)n);
+				} else if(n >= -32768) {
+					o.append('s'); appendU16(o, (uint16_t)(int16_t)n);
+				} else {
+					o.append('i'); appendU32(o, (uint32_t)(int32_t)n);
+				}
+			} else {
+				if(n <= 0xff) {
+					o.append('C'); appendU8(o, (uint8_t)n);
+				} else if(n <= 0xffff) {
+					o.append('S'); appendU16(o, (uint16_t)n);
+				} else {
+					o.append('I'); appendU32(o, (uint32_t)n);
+				}
+			}
+			break;
+		}
+		case 'f': {
+			float f = (float)atof(string(v, e - v).c_str());
+			uint32_t u;
+			memcpy(&u, &f, 4);
+			o.append('f');
+			appendU32(o, u);
+			break;
+		}
+		case 'Z':
+		case 'H':
+			o.append(s[3]);
+			o.append(v, e - v);
+			o.append('\0');
+			break;
+		case 'B': {
+			if(v == e) badRecord(s, e, "bad B field");
+			char sub = *v++;
+			size_t width;
+			switch(sub) {
+				case 'c': case 'C': width = 1; break;
+				case 's': case 'S': width = 2; break;
+				case 'i': case 'I': case 'f': width = 4; break;
+				default: badRecord(s, e, "bad B field subtype"); width = 0;
+			}
+			o.append('B');
+			o.append(sub);
+			size_t countOff = o.length();
+			appendU32(o, 0);
+			uint32_t count = 0;
+			while(v < e) {
+				if(*v != ',') badRecord(s, e, "bad B field");
+				v++;
+				const char *ve = (const char *)memchr(v, ',', e - v);
+				if(ve == NULL) ve = e;
+				uint32_t u;
+				if(sub == 'f') {
+					float f = (float)atof(string(v, ve - v).c_str());
+					memcpy(&u, &f, 4);
+				} else {
+					int64_t n;
+					if(!parseInt(v, ve, n)) badRecord(s, e, "bad B field");
+					u = (uint32_t)n;
+				}
+				if(width == 1) appendU8(o, (uint8_t)u);
+				else if(width == 2) appendU16(o, (uint16_t)u);
+				else appendU32(o, u);
+				count++;
+				v = ve;
+			}
+			putU32(o.wbuf() + countOff, count);
+			break;
+		}
+		default:
+			badRecord(s, e, "unknown optional field type");
+	}
+}
+
+BgzfWriter::BgzfWriter(OutFileBuf& out, size_t nthreads, int level) :
+	out_(out),
+	level_(level),
+	cur_(0),
+	nsubmitted_(0),
+	nextJob_(0),
+	nextWrite_(0),
+	nbytes_(0),
+	stop_(false),
+	failed_(false),
+	closed_(false)
+{
+	if(nthreads == 0) nthreads = 1;
+	// A few blocks per thread keeps them all busy while the earliest
+	// block is still being written
+	blocks_.resize(nthreads * 4);
+	for(size_t i = 0; i < blocks_.size(); i++) {
+		blocks_[i].in = new char[BLOCK_SZ];
+		blocks_[i].out = new char[MAX_BLOCK_SZ];
+		blocks_[i].inLen = blocks_[i].outLen = 0;
+		blocks_[i].state = BLOCK_FREE;
+	}
+	for(size_t i = 0; i < nthreads; i++) {
+		threads_.push_back(new tthread::thread(compressWorker, (void *)this));
+	}
+}
+
+BgzfWriter::~BgzfWriter() {
+	if(!closed_) {
+		// Already unwinding from an error if close() wasn't called
+		try {
+			close();
+		} catch(int) { }
+	}
+	for(size_t i = 0; i < blocks_.size(); i++) {
+		delete[] blocks_[i].in;
+		delete[] blocks_[i].out;
+	}
+}
+
+void BgzfWriter::write(const char *b, size_t len) {
+	assert(!closed_);
+	while(len > 0) {
+		Block& blk = blocks_[cur_ % blocks_.size()];
+		size_t n = min(len, BLOCK_SZ - blk.inLen);
+		memcpy(blk.in + blk.inLen, b, n);
+		blk.inLen += n;
+		b += n;
+		len -= n;
+		if(blk.inLen == BLOCK_SZ) submit();
+	}
+}
+
+void BgzfWriter::flush() {
+	if(blocks_[cur_ % blocks_.size()].inLen > 0) submit();
+	mutex_.lock();
+	bool failed = failed_;
+	mutex_.unlock();
+	if(failed) throw 1;
+}
+
+void BgzfWriter::submit() {
+	mutex_.lock();
+	blocks_[cur_ % blocks_.size()].state = BLOCK_FULL;
+	nsubmitted_ = ++cur_;
+	workCv_.notify_one();
+	Block& next = blocks_[cur_ % blocks_.size()];
+	while(next.state != BLOCK_FREE) {
+		freeCv_.wait(mutex_);
+	}
+	next.inLen = 0;
+	mutex_.unlock();
+}
+
+void BgzfWriter::close() {
+	if(closed_) return;
+	if(blocks_[cur_ % blocks_.size()].inLen > 0) submit();
+	mutex_.lock();
+	while(nextWrite_ < nsubmitted_) {
+		freeCv_.wait(mutex_);
+	}
+	stop_ = true;
+	workCv_.notify_all();
+	bool failed = failed_;
+	mutex_.unlock();
+	for(size_t i = 0; i < threads_.size(); i++) {
+		threads_[i]->join();
+		delete threads_[i];
+	}
+	threads_.clear();
+	if(failed) {
+		closed_ = true;
+		throw 1;
+	}
+	// Empty block marking the end of the file
+	static const char eof[28] = {
+		31, (char)139, 8, 4, 0, 0, 0, 0, 0, (char)255, 6, 0, 66, 67,
+		2, 0, 27, 0, 3, 0, 0, 0, 0, 0, 0, 0, 0, 0 };
+	out_.writeChars(eof, 28);
+	out_.flush();
+	closed_ = true;
+}
+
+void BgzfWriter::compressWorker(void *vp) {
+	((BgzfWriter *)vp)->work();
+}
+
+/**
+ * Errors on the compression threads can't be thrown there, so they
+ * set failed_ instead.  From then on blocks are still taken off the
+ * ring, so that the threads filling it never wait forever, but they
+ * are dropped rather than compressed and written.  flush() and close()
+ * throw on the thread that called them.
+ */
+void BgzfWriter::work() {
+	z_stream zs;
+	memset(&zs, 0, sizeof(zs));
+	// Raw deflate; the gzip header and footer are written by hand
+	bool zok = (deflateInit2(&zs, level_, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) == Z_OK);
+	if(!zok) {
+		cerr << "Error: could not initialize zlib for BAM output" << endl;
+	}
+	mutex_.lock();
+	if(!zok) failed_ = true;
+	while(true) {
+		while(nextJob_ == nsubmitted_ && !stop_) {
+			workCv_.wait(mutex_);
+		}
+		if(nextJob_ == nsubmitted_) break; // stopping and nothing left
+		Block& blk = blocks_[nextJob_++ % blocks_.size()];
+		bool ok = !failed_;
+		mutex_.unlock();
+		if(ok) ok = compress(zs, blk);
+		mutex_.lock();
+		if(!ok) failed_ = true;
+		blk.state = BLOCK_DONE;
+		// Write out whatever is now next in line
+		bool wrote = false;
+		while(nextWrite_ < nsubmitted_) {
+			Block& w = blocks_[nextWrite_ % blocks_.size()];
+			if(w.state != BLOCK_DONE) break;
+			if(!failed_) {
+				try {
+					out_.writeChars(w.out, w.outLen);
+				} catch(int) {
+					failed_ = true;
+				}
+				blockOffs_.push_back(nbytes_);
+				nbytes_ += w.outLen;
+			}
+			w.state = BLOCK_FREE;
+			nextWrite_++;
+			wrote = true;
+		}
+		if(wrote) freeCv_.notify_all();
+	}
+	mutex_.unlock();
+	if(zok) deflateEnd(&zs);
+}
+
+bool BgzfWriter::compress(z_stream& zs, Block& blk) {
+	// 18-byte header with the BC extra subfield holding the total
+	// block size minus 1
+	static const char hdr[16] = {
+		31, (char)139, 8, 4, 0, 0, 0, 0, 0, (char)255, 6, 0, 66, 67, 2, 0 };
+	memcpy(blk.out, hdr, 16);
+	deflateReset(&zs);
+	zs.next_in = (Bytef *)blk.in;
+	zs.avail_in = (uInt)blk.inLen;
+	zs.next_out = (Bytef *)(blk.out + 18);
+	zs.avail_out = (uInt)(MAX_BLOCK_SZ - 18 - 8);
+	if(deflate(&zs, Z_FINISH) != Z_STREAM_END) {
+		cerr << "Error: BGZF block did not fit after compression" << endl;
+		return false;
+	}
+	size_t bsize = 18 + zs.total_out + 8;
+	blk.out[16] = (char)((bsize - 1) & 0xff);
+	blk.out[17] = (char)((bsize - 1) >> 8);
+	uint32_t crc = (uint32_t)crc32(crc32(0L, Z_NULL, 0), (Bytef *)blk.in, (uInt)blk.inLen);
+	putU32(blk.out + bsize - 8, crc);
+	putU32(blk.out + bsize - 4, (uint32_t)blk.inLen);
+	blk.outLen = bsize;
+	return true;
+}
+
+/**
+ * Return the number of reference bases spanned by the CIGAR of BAM
+ * record 'rec'.
+ */
+static int64_t refSpan(const char *rec) {
+	size_t lname = (unsigned char)rec[12];
+	size_t ncigar = getU16(rec + 16);
+	const char *cig = rec + 36 + lname;
+	int64_t span = 0;
+	for(size_t i = 0; i < ncigar; i++) {
+		uint32_t op = getU32(cig + i * 4);
+		switch(op & 0xf) {
+			case 0: case 2: case 3: case 7: case 8: // M, D, N, =, X
+				span += (op >> 4);
+				break;
+			default: break;
+		}
+	}
+	return span;
+}
+
+BamIndexer::BamIndexer(const SamConfig& samc) :
+	csi_(false),
+	minShift_(14),
+	depth_(5),
+	lastRef_(0),
+	lastPos_(0),
+	nnocoor_(0)
+{
+	uint64_t maxLen = 0;
+	refs_.resize(samc.numRefs());
+	for(size_t i = 0; i < refs_.size(); i++) {
+		refs_[i].beg = refs_[i].end = 0;
+		refs_[i].nmapped = refs_[i].nunmapped = 0;
+		maxLen = max<uint64_t>(maxLen, samc.refLen(i));
+	}
+	// BAI bins cover at most 2^29 bases; beyond that, add levels and
+	// switch to CSI
+	while(maxLen > (1ULL << (minShift_ + depth_ * 3))) {
+		depth_++;
+		csi_ = true;
+	}
+}
+
+uint32_t BamIndexer::reg2bin(int64_t beg, int64_t end) const {
+	--end;
+	int s = minShift_;
+	int64_t t = ((1LL << (depth_ * 3)) - 1) / 7;
+	for(int l = depth_; l > 0; l--) {
+		if(beg >> s == end >> s) return (uint32_t)(t + (beg >> s));
+		s += 3;
+		t -= 1LL << ((l - 1) * 3);
+	}
+	return 0;
+}
+
+int64_t BamIndexer::binBeg(uint32_t bin) const {
+	int l = 0;
+	int64_t t = 0; // first bin on level l
+	while(l < depth_ && ((1LL << ((l + 1) * 3)) - 1) / 7 <= (int64_t)bin) {
+		l++;
+		t = ((1LL << (l * 3)) - 1) / 7;
+	}
+	return ((int64_t)bin - t) << (minShift_ + 3 * (depth_ - l));
+}
+
+void BamIndexer::add(const char *rec, uint64_t beg, uint64_t end) {
+	int32_t ref = (int32_t)getU32(rec + 4);
+	int64_t pos = (int32_t)getU32(rec + 8);
+	uint16_t flag = getU16(rec + 18);
+	if(ref < 0) {
+		lastRef_ = -1;
+		nnocoor_++;
+		return;
+	}
+	if(lastRef_ < 0 || ref < lastRef_ || (ref == lastRef_ && pos < lastPos_)) {
+		cerr << "Error: BAM records were not indexed in coordinate order" << endl;
+		throw 1;
+	}
+	lastRef_ = ref;
+	lastPos_ = pos;
+	assert_lt((size_t)ref, refs_.size());
+	RefIndex& r = refs_[ref];
+	int64_t rbeg = pos, rend = pos;
+	if((flag & 4) == 0) rend += refSpan(rec);
+	if(rend <= rbeg) rend = rbeg + 1;
+	// Chunks starting in the block where the bin's last chunk ends are
+	// merged into it
+	EList<Chunk>& chunks = r.bins[reg2bin(rbeg, rend)];
+	if(!chunks.empty() && (chunks.back().second >> 16) == (beg >> 16)) {
+		chunks.back().second = end;
+	} else {
+		chunks.push_back(Chunk(beg, end));
+	}
+	size_t wbeg = (size_t)(rbeg >> minShift_), wend = (size_t)((rend - 1) >> minShift_);
+	while(r.lidx.size() <= wend) r.lidx.push_back(0);
+	for(size_t w = wbeg; w <= wend; w++) {
+		if(r.lidx[w] == 0) r.lidx[w] = beg;
+	}
+	if(r.nmapped + r.nunmapped == 0) r.beg = beg;
+	r.end = end;
+	if((flag & 4) != 0) r.nunmapped++;
+	else                r.nmapped++;
+}
+
+void BamIndexer::write(const string& fn, const BgzfWriter& bgzf) const {
+	OutFileBuf fout(fn.c_str(), true);
+	BgzfWriter *csiOut = csi_ ? new BgzfWriter(fout, 1) : NULL;
+	BTString o;
+	o.append(csi_ ? "CSI\1" : "BAI\1");
+	if(csi_) {
+		appendU32(o, (uint32_t)minShift_);
+		appendU32(o, (uint32_t)depth_);
+		appendU32(o, 0); // no auxiliary data
+	}
+	appendU32(o, (uint32_t)refs_.size());
+	uint32_t pseudo = (uint32_t)(((1LL << ((depth_ + 1) * 3)) - 1) / 7 + 1);
+	EList<uint64_t> lidx;
+	for(size_t i = 0; i < refs_.size(); i++) {
+		const RefIndex& r = refs_[i];
+		if(r.nmapped + r.nunmapped == 0) {
+			appendU32(o, 0); // n_bin
+			if(!csi_) appendU32(o, 0); // n_intv
+		} else {
+			// Windows with no records of their own get the offset of the
+			// window before; leading ones get the first record's
+			lidx.clear();
+			uint64_t prev = bgzf.virtualOffset(r.beg);
+			for(size_t w = 0; w < r.lidx.size(); w++) {
+				if(r.lidx[w] != 0) prev = bgzf.virtualOffset(r.lidx[w]);
+				lidx.push_back(prev);
+			}
+			appendU32(o, (uint32_t)(r.bins.size() + 1));
+			for(map<uint32_t, EList<Chunk> >::const_iterator it = r.bins.begin();
+			    it != r.bins.end(); ++it)
+			{
+				appendU32(o, it->first);
+				if(csi_) {
+					size_t w = (size_t)(binBeg(it->first) >> minShift_);
+					appendU64(o, lidx[min(w, lidx.size() - 1)]);
+				}
+				appendU32(o, (uint32_t)it->second.size());
+				for(size_t j = 0; j < it->second.size(); j++) {
+					appendU64(o, bgzf.virtualOffset(it->second[j].first));
+					appendU64(o, bgzf.virtualOffset(it->second[j].second));
+				}
+			}
+			// Pseudo-bin with the reference's extent and record counts
+			appendU32(o, pseudo);
+			if(csi_) appendU64(o, 0);
+			appendU32(o, 2);
+			appendU64(o, bgzf.virtualOffset(r.beg));
+			appendU64(o, bgzf.virtualOffset(r.end));
+			appendU64(o, r.nmapped);
+			appendU64(o, r.nunmapped);
+			if(!csi_) {
+				appendU32(o, (uint32_t)lidx.size());
+				for(size_t w = 0; w < lidx.size(); w++) {
+					appendU64(o, lidx[w]);
+				}
+			}
+		}
+		if(csiOut != NULL) {
+			csiOut->writeString(o);
+		} else {
+			fout.writeString(o);
+		}
+		o.clear();
+	}
+	appendU64(o, nnocoor_);
+	if(csiOut != NULL) {
+		csiOut->writeString(o);
+		csiOut->close();
+		delete csiOut;
+	} else {
+		fout.writeString(o);
+	}
+	fout.close();
+}
+
+BamSorter::BamSorter(const string& tmpPrefix, size_t maxMem) :
+	prefix_(tmpPrefix),
+	runMem_(max<size_t>(maxMem / 2, 1)),
+	spiller_(NULL),
+	spillFailed_(false),
+	failed_(false),
+	seq_(0)
+{ }
+
+BamSorter::~BamSorter() {
+	waitSpill();
+	removeRuns();
+}
+
+void BamSorter::removeRuns() {
+	for(size_t i = 0; i < runFds_.size(); i++) {
+		close(runFds_[i]);
+#ifdef _WIN32
+		remove(runs_[i].c_str());
+#endif
+	}
+	runs_.clear();
+	runFds_.clear();
+}
+
+uint64_t BamSorter::sortKey(const char *rec) {
+	// Unplaced records have refID -1, which sorts last as unsigned
+	uint64_t ref = getU32(rec + 4);
+	uint64_t pos = (uint32_t)((int32_t)getU32(rec + 8) + 1);
+	return (ref << 32) | pos;
+}
+
+void BamSorter::add(const BTString& recs) {
+	if(failed_) return;
+	const char *b = recs.buf();
+	size_t len = recs.length();
+	size_t off = 0;
+	while(off < len) {
+		assert_leq(off + 4, len);
+		size_t rlen = 4 + getU32(b + off);
+		assert_leq(off + rlen, len);
+		if(buf_.size() + rlen > buf_.capacity()) {
+			// Grow the batch within its budget, counting what is
+			// allocated rather than what is used, or spill it
+			size_t other = entries_.capacity() * sizeof(Entry);
+			size_t room = (runMem_ > other) ? runMem_ - other : 0;
+			size_t cap = min(max(2 * buf_.capacity(), (size_t)(64 * 1024)), room);
+			if(cap < buf_.size() + rlen && !entries_.empty()) {
+				spill();
+				if(failed_) return;
+				continue;
+			}
+			buf_.reserve(max(cap, buf_.size() + rlen));
+		}
+		Entry e;
+		e.key = sortKey(b + off);
+		e.seq = seq_++;
+		e.off = buf_.size();
+		entries_.push_back(e);
+		buf_.insert(buf_.end(), b + off, b + off + rlen);
+		off += rlen;
+	}
+}
+
+void BamSorter::spill() {
+	if(!waitSpill()) return;
+	char nbuf[32];
+	sprintf(nbuf, ".sort.%u.tmp", (unsigned)runs_.size());
+	string fn = prefix_ + nbuf;
+	int fd = open(fn.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_BINARY, 0600);
+	if(fd < 0) {
+		cerr << "Error: could not open temporary file \"" << fn
+		     << "\" for sorting BAM records" << endl;
+		failed_ = true;
+		return;
+	}
+#ifndef _WIN32
+	// From here on the run is only reached through fd
+	unlink(fn.c_str());
+#endif
+	runs_.push_back(fn);
+	runFds_.push_back(fd);
+	// The buffers of the last spill are empty but keep their capacity
+	buf_.swap(spillBuf_);
+	entries_.swap(spillEntries_);
+	buf_.clear();
+	entries_.clear();
+	spiller_ = new tthread::thread(spillWorker, (void *)this);
+}
+
+bool BamSorter::waitSpill() {
+	if(spiller_ != NULL) {
+		spiller_->join();
+		delete spiller_;
+		spiller_ = NULL;
+		if(spillFailed_) failed_ = true;
+	}
+	return !failed_;
+}
+
+void BamSorter::spillWorker(void *vp) {
+	BamSorter *s = (BamSorter *)vp;
+	s->spillFailed_ = !s->writeRun();
+}
+
+bool BamSorter::writeRun() {
+	const string& fn = runs_.back();
+	// Runs are read back once, so favor speed over size
+	gzFile f = gzdopen(dup(runFds_.back()), "wb1");
+	if(f == NULL) {
+		cerr << "Error: could not open temporary file \"" << fn
+		     << "\" for sorting BAM records" << endl;
+		return false;
+	}
+	sort(spillEntries_.begin(), spillEntries_.end());
+	bool ok = true;
+	for(size_t i = 0; i < spillEntries_.size() && ok; i++) {
+		const char *rec = &spillBuf_[spillEntries_[i].off];
+		unsigned rlen = 4 + getU32(rec);
+		ok = (gzwrite(f, rec, rlen) == (int)rlen);
+	}
+	if(gzclose(f) != Z_OK) ok = false;
+	if(!ok) {
+		cerr << "Error: could not write temporary file \"" << fn
+		     << "\" for sorting BAM records" << endl;
+	}
+	spillBuf_.clear();
+	spillEntries_.clear();
+	return ok;
+}
+
+/**
+ * Read the next record of a spilled run into 'rec'.  Returns false at
+ * the end of the run.
+ */
+static bool readRun(gzFile f, const string& fn, vector<char>& rec) {
+	char lenb[4];
+	int n = gzread(f, lenb, 4);
+	if(n == 0) return false;
+	if(n == 4) {
+		size_t rlen = getU32(lenb);
+		rec.resize(4 + rlen);
+		memcpy(&rec[0], lenb, 4);
+		if(gzread(f, &rec[4], (unsigned)rlen) == (int)rlen) return true;
+	}
+	cerr << "Error: could not read temporary file \"" << fn
+	     << "\" while sorting BAM records" << endl;
+	throw 1;
+}
+
+void BamSorter::finish(BgzfWriter& out, BamIndexer *idx) {
+	if(!waitSpill()) {
+		// The spill thread has printed the error
+		throw 1;
+	}
+	sort(entries_.begin(), entries_.end());
+	// Sources are the spilled runs, in the order they were spilled,
+	// then the records still in memory.  Ties go to the earlier source
+	// since its records were added first.
+	size_t nsrc = runs_.size() + 1;
+	vector<gzFile> files(runs_.size(), (gzFile)NULL);
+	vector<vector<char> > cur(runs_.size());
+	size_t mi = 0; // next in-memory entry
+	typedef pair<uint64_t, size_t> Head;
+	priority_queue<Head, vector<Head>, greater<Head> > heap;
+	for(size_t i = 0; i < runs_.size(); i++) {
+		lseek(runFds_[i], 0, SEEK_SET);
+		files[i] = gzdopen(dup(runFds_[i]), "rb");
+		if(files[i] == NULL) {
+			cerr << "Error: could not open temporary file \"" << runs_[i]
+			     << "\" while sorting BAM records" << endl;
+			throw 1;
+		}
+		gzbuffer(files[i], 256 * 1024);
+		if(readRun(files[i], runs_[i], cur[i])) {
+			heap.push(Head(sortKey(&cur[i][0]), i));
+		}
+	}
+	if(mi < entries_.size()) {
+		heap.push(Head(entries_[mi].key, nsrc - 1));
+	}
+	while(!heap.empty()) {
+		size_t src = heap.top().second;
+		heap.pop();
+		const char *rec = (src == nsrc - 1) ? &buf_[entries_[mi].off] : &cur[src][0];
+		uint64_t beg = out.tell();
+		out.write(rec, 4 + getU32(rec));
+		if(idx != NULL) idx->add(rec, beg, out.tell());
+		if(src == nsrc - 1) {
+			if(++mi < entries_.size()) {
+				heap.push(Head(entries_[mi].key, src));
+			}
+		} else if(readRun(files[src], runs_[src], cur[src])) {
+			heap.push(Head(sortKey(&cur[src][0]), src));
+		}
+	}
+	for(size_t i = 0; i < runs_.size(); i++) {
+		gzclose(files[i]);
+	}
+	removeRuns();
+	buf_.clear();
+	entries_.clear();
+}
@@ -0,0 +1,416 @@
+/*
+ * Copyright 2015, Daehwan Kim <infphilo@gmail.com>
+ *
+ * This file is part of HISAT.
+ *
+ * HISAT is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * HISAT is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with HISAT.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef BAM_H_
+#define BAM_H_
+
+#include <stdint.h>
+#include <string>
+#include <map>
+#include <vector>
+#include <zlib.h>
+#include "ds.h"
+#include "sstring.h"
+#include "filebuf.h"
+#include "sam.h"
+#include "tinythread.h"
+#include "assert_helpers.h"
+
+/**
+ * Encodes alignment records as BAM.  AlnSinkSam hands over the fields
+ * of each record as it holds them, so only the optional fields, which
+ * SamConfig prints as text, are converted.  Encoding is stateless, so a
+ * single BamEncoder can be shared by all the search threads.
+ */
+class BamEncoder {
+
+public:
+
+	/**
+	 * The BAM reference dictionary is taken from 'samc' and names are
+	 * printed the same way as in SAM RNAME fields.
+	 */
+	BamEncoder(const SamConfig& samc);
+
+	/**
+	 * Append the BAM header, i.e. magic number, SAM header text and
+	 * reference dictionary, to 'o'.  'text' may be empty.
+	 */
+	void encodeHeader(const BTString& text, BTString& o) const;
+
+	/**
+	 * Append one BAM record to 'o'.  'refid', 'pos', 'nextRefid' and
+	 * 'nextPos' are 0-based, with -1 for none.  'cigOp'/'cigRun' are
+	 * NULL for an unaligned read, and runs of length 0 are skipped.
+	 * 'seq' and 'qual' are NULL when they are omitted ("*" in SAM);
+	 * 'qual' holds Phred+33 characters.  'tags' holds the optional
+	 * fields as tab-separated SAM text.
+	 */
+	void encodeRecord(
+		BTString& o,
+		const BTString& name,
+		int flag,
+		int32_t refid,
+		int64_t pos,
+		int mapq,
+		const EList<char>* cigOp,
+		const EList<size_t>* cigRun,
+		int32_t nextRefid,
+		int64_t nextPos,
+		int64_t tlen,
+		const BTDnaString* seq,
+		const BTString* qual,
+		const BTString& tags) const;
+
+	/**
+	 * Return the number of references in the dictionary.
+	 */
+	size_t numRefs() const {
+		return names_.size();
+	}
+
+protected:
+
+	/**
+	 * Append one TAG:TYPE:VALUE optional field to 'o'.
+	 */
+	void encodeTag(const char *s, const char *e, BTString& o) const;
+
+	EList<std::string>         names_; // names as printed in RNAME
+	EList<size_t>              lens_;  // reference lengths
+};
+
+/**
+ * Writes BGZF, the blocked gzip format used by BAM, to an OutFileBuf.
+ * The caller's bytes are cut into blocks of up to BLOCK_SZ bytes, the
+ * blocks are deflated by a pool of worker threads, and the compressed
+ * blocks are written to the OutFileBuf in the order they were filled.
+ * Only one thread may call write()/flush()/close() at a time.  If a
+ * block can't be compressed or written, the rest of the output is
+ * dropped and the next flush() or close() throws 1.
+ */
+class BgzfWriter {
+
+public:
+
+	/**
+	 * Start 'nthreads' compression threads writing to 'out'.  'level'
+	 * is a zlib compression level.
+	 */
+	BgzfWriter(OutFileBuf& out, size_t nthreads, int level = -1);
+
+	/**
+	 * Close (see close()) if not already closed.
+	 */
+	~BgzfWriter();
+
+	/**
+	 * Append 'len' bytes to the stream.
+	 */
+	void write(const char *b, size_t len);
+
+	/**
+	 * Append a string to the stream.
+	 */
+	template<typename T>
+	void writeString(const T& s) {
+		write(s.buf(), s.length());
+	}
+
+	/**
+	 * End the current block, even if it isn't full, so that the
+	 * next byte written starts a new block.  Throws 1 if a
+	 * compression thread has failed.
+	 */
+	void flush();
+
+	/**
+	 * Flush, wait for all blocks to be written, append the BGZF
+	 * end-of-file marker and stop the compression threads.  Throws 1,
+	 * once the threads are stopped, if any block was lost.
+	 */
+	void close();
+
+	/**
+	 * Return the position the next byte written will have.  This is
+	 * a virtual file offset except that it holds the block's sequence
+	 * number, rather than its compressed file offset, in the upper 48
+	 * bits; see virtualOffset().
+	 */
+	uint64_t tell() const {
+		return (cur_ << 16) | blocks_[cur_ % blocks_.size()].inLen;
+	}
+
+	/**
+	 * Convert a position returned by tell() into a BGZF virtual file
+	 * offset.  Only valid once the block has been written, e.g. after
+	 * close().
+	 */
+	uint64_t virtualOffset(uint64_t pos) const {
+		assert_leq((pos >> 16), blockOffs_.size());
+		uint64_t blk = pos >> 16;
+		uint64_t coff = (blk < blockOffs_.size()) ? blockOffs_[(size_t)blk] : nbytes_;
+		return (coff << 16) | (pos & 0xffff);
+	}
+
+	static const size_t BLOCK_SZ = 0xff00;   // max uncompressed bytes per block
+	static const size_t MAX_BLOCK_SZ = 65536; // max compressed block size
+
+protected:
+
+	enum {
+		BLOCK_FREE = 0, // empty or being filled by the caller
+		BLOCK_FULL,     // waiting for, or undergoing, compression
+		BLOCK_DONE      // compressed, waiting to be written
+	};
+
+	struct Block {
+		char  *in;
+		size_t inLen;
+		char  *out;
+		size_t outLen;
+		int    state;
+	};
+
+	/**
+	 * Entry point for compression threads.
+	 */
+	static void compressWorker(void *vp);
+
+	/**
+	 * Compression thread loop: compress blocks as they're submitted
+	 * and write out any finished blocks that are next in line.
+	 */
+	void work();
+
+	/**
+	 * Deflate 'blk' into a BGZF block.  Returns false if it didn't
+	 * fit.
+	 */
+	bool compress(z_stream& zs, Block& blk);
+
+	/**
+	 * Hand the block being filled to the compression threads and wait
+	 * for the next one to become free.
+	 */
+	void submit();
+
+	EList<Block>  blocks_;     // ring of blocks, indexed by sequence # mod size
+	OutFileBuf&   out_;
+	int           level_;
+	uint64_t      cur_;        // sequence # of the block being filled
+	uint64_t      nsubmitted_; // blocks handed to the compression threads
+	uint64_t      nextJob_;    // next block to be compressed
+	uint64_t      nextWrite_;  // next block to be written
+	uint64_t      nbytes_;     // compressed bytes written so far
+	EList<uint64_t> blockOffs_; // file offset of each block written
+	bool          stop_;
+	bool          failed_;     // a block couldn't be compressed or written
+	bool          closed_;
+	tthread::mutex              mutex_;
+	tthread::condition_variable workCv_; // a block was submitted
+	tthread::condition_variable freeCv_; // a block was written
+	EList<tthread::thread*>     threads_;
+};
+
+/**
+ * Builds a BAI index, or a CSI index when some reference is too long
+ * for BAI, for a coordinate-sorted BAM file as its records are written.
+ * Record positions are BgzfWriter::tell() positions, converted to
+ * virtual offsets when the index is written.
+ */
+class BamIndexer {
+
+public:
+
+	/**
+	 * Set up for the references in 'samc'.
+	 */
+	BamIndexer(const SamConfig& samc);
+
+	/**
+	 * Add a record, which was written to [beg, end).  Records must be
+	 * added in coordinate order.
+	 */
+	void add(const char *rec, uint64_t beg, uint64_t end);
+
+	/**
+	 * Write the index to 'fn', converting positions to virtual offsets
+	 * with 'bgzf', which must be closed.
+	 */
+	void write(const std::string& fn, const BgzfWriter& bgzf) const;
+
+	/**
+	 * Return true iff the index will be in CSI format.
+	 */
+	bool csi() const {
+		return csi_;
+	}
+
+	/**
+	 * Return the file name extension for the index, ".bai" or ".csi".
+	 */
+	const char *extension() const {
+		return csi_ ? ".csi" : ".bai";
+	}
+
+protected:
+
+	typedef std::pair<uint64_t, uint64_t> Chunk;
+
+	struct RefIndex {
+		std::map<uint32_t, EList<Chunk> > bins;
+		EList<uint64_t> lidx;     // first position in each window
+		uint64_t beg, end;        // positions of the first/last record
+		uint64_t nmapped, nunmapped;
+	};
+
+	/**
+	 * Return the bin of [beg, end) for this index's bin scheme.
+	 */
+	uint32_t reg2bin(int64_t beg, int64_t end) const;
+
+	/**
+	 * Return the leftmost coordinate covered by bin 'bin'.
+	 */
+	int64_t binBeg(uint32_t bin) const;
+
+	bool     csi_;
+	int      minShift_; // bits in the smallest bin / linear window
+	int      depth_;    // levels in the binning scheme, not counting 0
+	EList<RefIndex> refs_;
+	int32_t  lastRef_;  // for checking the sort order
+	int64_t  lastPos_;
+	uint64_t nnocoor_;  // records with no reference
+};
+
+/**
+ * Sorts BAM records by coordinate.  Records are collected in memory
+ * until they exceed a budget, then the batch is handed to a spill
+ * thread that sorts it and writes it to a temporary file while the next
+ * batch fills up.  finish() merges the spilled runs with whatever is
+ * still in memory.  Records with the same coordinate keep the order in
+ * which they were added, and unplaced records go last.
+ */
+class BamSorter {
+
+public:
+
+	/**
+	 * Temporary files are named "<tmpPrefix>.sort.<n>.tmp".  The batch
+	 * being filled and the one being spilled together take up at most
+	 * about 'maxMem' bytes, allocated capacity included.
+	 */
+	BamSorter(const std::string& tmpPrefix, size_t maxMem);
+
+	/**
+	 * Wait for the spill thread and remove any temporary files left
+	 * behind, e.g. when unwinding from an error.  Except on Windows,
+	 * run files are unlinked as soon as they are created, so they
+	 * don't outlive the process even if it's killed.
+	 */
+	~BamSorter();
+
+	/**
+	 * Add the BAM records in 'recs', each prefixed by its block_size
+	 * as usual.  This only waits if the previous batch is still being
+	 * spilled when the current one fills up.  If a spill fails, the
+	 * error is printed and later records are dropped; finish() throws.
+	 */
+	void add(const BTString& recs);
+
+	/**
+	 * Write all records added so far, in sorted order, to 'out', and
+	 * add them to 'idx' if it's not NULL.  Throws 1 if a run couldn't
+	 * be spilled or read back.
+	 */
+	void finish(BgzfWriter& out, BamIndexer *idx);
+
+	/**
+	 * Return the number of runs spilled to disk so far.
+	 */
+	size_t numRuns() const {
+		return runs_.size();
+	}
+
+protected:
+
+	struct Entry {
+		uint64_t key;  // unsigned refID, then pos + 1
+		uint64_t seq;  // order in which records were added
+		size_t   off;  // offset of the record in buf_
+
+		bool operator<(const Entry& o) const {
+			if(key != o.key) return key < o.key;
+			return seq < o.seq;
+		}
+	};
+
+	/**
+	 * Hand the records in memory to the spill thread, which sorts them
+	 * and writes them to a new run file, and carry on with the buffers
+	 * of the previous spill.
+	 */
+	void spill();
+
+	/**
+	 * Wait for the spill thread, if running.  Returns false if any
+	 * spill so far failed.
+	 */
+	bool waitSpill();
+
+	/**
+	 * Close the run files and remove any that are still named.
+	 */
+	void removeRuns();
+
+	static void spillWorker(void *vp);
+
+	/**
+	 * Sort spillEntries_ and write the records to the last run file.
+	 */
+	bool writeRun();
+
+	/**
+	 * Return the bytes allocated for the batch being filled.
+	 */
+	size_t memUsed() const {
+		return buf_.capacity() + entries_.capacity() * sizeof(Entry);
+	}
+
+	/**
+	 * Return the sort key of BAM record 'rec'.
+	 */
+	static uint64_t sortKey(const char *rec);
+
+	std::string        prefix_;
+	size_t             runMem_;  // budget of each of the two batches
+	std::vector<char>  buf_;     // records in the batch being filled
+	std::vector<Entry> entries_; // one per record in buf_
+	std::vector<char>  spillBuf_;     // batch being spilled
+	std::vector<Entry> spillEntries_; // one per record in spillBuf_
+	tthread::thread   *spiller_; // non-NULL while a spill runs
+	bool               spillFailed_; // set by the spill thread
+	bool               failed_;  // a run couldn't be written
+	EList<std::string> runs_;    // names of spilled runs
+	EList<int>         runFds_;  // open run files, one per run
+	uint64_t           seq_;
+};
+
+#endif /*BAM_H_*/
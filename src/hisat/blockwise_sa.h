@@ -35,6 +35,7 @@
 #include "timer.h"
 #include "ds.h"
 #include "mem_ids.h"
+#include "threading.h"
 
 using namespace std;
 
@@ -213,12 +214,16 @@ public:
 	      	              bool __sanityCheck = false,
 	   	                  bool __passMemExc = false,
 	      	              bool __verbose = false,
+	                      int __nthreads = 1,
 	      	              ostream& __logger = cout) :
 	InorderBlockwiseSA<TStr>(__text, __bucketSz, __sanityCheck, __passMemExc, __verbose, __logger),
-	_sampleSuffs(EBWTB_CAT), _cur(0), _dcV(__dcV), _dc(EBWTB_CAT), _built(false)
+	_sampleSuffs(EBWTB_CAT), _cur(0), _dcV(__dcV), _dc(EBWTB_CAT), _built(false),
+	_nthreads(max(__nthreads, 1)), _threads(EBWTB_CAT), _slots(EBWTB_CAT),
+	_slotDone(EBWTB_CAT), _claim(0), _taken(0), _stop(false), _err(0),
+	_bktBuf(NULL)
 	{ _randomSrc.init(__seed); reset(); }
 
-	~KarkkainenBlockwiseSA() { }
+	~KarkkainenBlockwiseSA() { stopWorkers(); }
 
 	/**
 	 * Allocate an amount of memory that simulates the peak memory
@@ -235,11 +240,38 @@ public:
 		return bsz;
 	}
 
+	/**
+	 * Return the approximate number of bytes this builder takes at its
+	 * peak for a text of 'len' characters cut into blocks of at most
+	 * 'bucketSz' suffixes and sorted on 'nthreads' threads, not counting
+	 * the text or the difference cover: the sample suffixes with their
+	 * bucket sizes and representatives, the blocks being sorted or
+	 * waiting to be handed out, and each sorting thread's bucket-sort
+	 * scratch.  The suffixes of a block tend to share their first few
+	 * characters, so up to three of the four scratch rows can fill to
+	 * the size of a block.
+	 */
+	static uint64_t peakBytes(uint64_t len, uint64_t bucketSz, int nthreads) {
+		uint64_t bsz = max<uint64_t>(bucketSz, 2) - 1;
+		uint64_t nsamples = ((len / bsz) + 1) << 1;
+		uint64_t inflight = 1;
+		if(nthreads > 1) {
+			// Blocks end up between half and all of bucketSz long
+			inflight = min<uint64_t>(2 * nthreads + 1, nsamples + 1);
+		}
+		return nsamples * 3 * OFF_SIZE +
+		       inflight * (bucketSz + 100) * OFF_SIZE +
+		       max(nthreads, 1) * 3 * min<uint64_t>(bucketSz, BUCKET_SORT_CUTOFF) * OFF_SIZE;
+	}
+
 	/// Defined in blockwise_sa.cpp
 	virtual void nextBlock();
 
 	/// Defined in blockwise_sa.cpp
-	virtual void qsort(EList<TIndexOffU>& bucket);
+	virtual void qsort(
+		EList<TIndexOffU>& bucket,
+		bool vbose,
+		TIndexOffU** bkts = NULL);
 
 	/// Return true iff more blocks are available
 	virtual bool hasMoreBlocks() const {
@@ -249,6 +281,16 @@ public:
 	/// Return the difference-cover period
 	uint32_t dcV() const { return _dcV; }
 
+	/// Return the number of threads sorting blocks
+	int nthreads() const { return _nthreads; }
+
+	/**
+	 * Have blocks built on the calling thread bucket-sort into 'bktBuf'
+	 * rather than the global bkts[][], so that several builders can
+	 * run at once.
+	 */
+	void setBucketScratch(EList<TIndexOffU>* bktBuf) { _bktBuf = bktBuf; }
+
 protected:
 
 	/**
@@ -258,6 +300,7 @@ protected:
 	 * the first block.
 	 */
 	virtual void reset() {
+		stopWorkers();
 		if(!_built) {
 			build();
 		}
@@ -318,38 +361,77 @@ private:
 
 	void buildSamples();
 
+	/// Assemble and sort block 'cur' into 'bucket'
+	void buildBlock(
+		TIndexOffU cur,
+		EList<TIndexOffU>& bucket,
+		bool vbose,
+		EList<TIndexOffU>* bktBuf = NULL);
+
+	void startWorkers();
+	void stopWorkers();
+	void sortBlocks();
+
+	static void sortBlocksWorker(void *vp) {
+		((KarkkainenBlockwiseSA<TStr>*)vp)->sortBlocks();
+	}
+
 	EList<TIndexOffU>  _sampleSuffs; /// sample suffixes
 	TIndexOffU         _cur;         /// offset to 1st elt of next block
 	const uint32_t   _dcV;         /// difference-cover periodicity
 	PtrWrap<TDC>     _dc;          /// queryable difference-cover data
 	bool             _built;       /// whether samples/DC have been built
 	RandomSource     _randomSrc;   /// source of pseudo-randoms
+
+	// When _nthreads > 1, worker threads assemble and sort blocks ahead
+	// of the consumer.  Block b goes in slot b % _slots.size() and is
+	// only started once block b - _slots.size() has been taken, so no
+	// more than _slots.size() blocks are held at once besides the one
+	// being iterated over.  Everything below is guarded by _mutex.
+	const int                _nthreads;  /// # threads sorting blocks
+	EList<tthread::thread*>  _threads;   /// workers; empty when idle
+	ELList<TIndexOffU>       _slots;     /// blocks being built or waiting
+	EList<bool>              _slotDone;  /// slot holds a finished block
+	TIndexOffU               _claim;     /// next block for a worker to build
+	TIndexOffU               _taken;     /// # blocks taken by nextBlock()
+	bool                     _stop;      /// workers should quit
+	int                      _err;       /// 1 = bad_alloc, 2 = fatal error
+	tthread::mutex           _mutex;
+	tthread::condition_variable _cond;
+
+	EList<TIndexOffU>*       _bktBuf;    /// bucket-sort scratch for this thread
 };
 
 /**
- * Qsort the set of suffixes whose offsets are in 'bucket'.
+ * Qsort the set of suffixes whose offsets are in 'bucket'.  'bkts', if
+ * not NULL, is the bucket-sort scratch space to use instead of the
+ * global one (see mkeyQSortSufDcU8()).
  */
 template<typename TStr>
-inline void KarkkainenBlockwiseSA<TStr>::qsort(EList<TIndexOffU>& bucket) {
+inline void KarkkainenBlockwiseSA<TStr>::qsort(
+	EList<TIndexOffU>& bucket,
+	bool vbose,
+	TIndexOffU** bkts)
+{
 	const TStr& t = this->text();
 	TIndexOffU *s = bucket.ptr();
 	size_t slen = bucket.size();
 	TIndexOffU len = (TIndexOffU)t.length();
 	if(_dc.get() != NULL) {
 		// Use the difference cover as a tie-breaker if we have it
-		VMSG_NL("  (Using difference cover)");
+		if(vbose) VMSG_NL("  (Using difference cover)");
 		// Extract the 'host' array because it's faster to work
 		// with than the EList<> container
 		const uint8_t *host = (const uint8_t *)t.buf();
 		assert(_dc.get() != NULL);
 		mkeyQSortSufDcU8(t, host, len, s, slen, *_dc.get(), 4,
-		                 this->verbose(), this->sanityCheck());
+		                 vbose, this->sanityCheck(), bkts);
 	} else {
-		VMSG_NL("  (Not using difference cover)");
+		if(vbose) VMSG_NL("  (Not using difference cover)");
 		// We don't have a difference cover - just do a normal
 		// suffix sort
 		mkeyQSortSuf(t, s, slen, 4,
-		             this->verbose(), this->sanityCheck());
+		             vbose, this->sanityCheck());
 	}
 }
 
@@ -361,7 +443,9 @@ inline void KarkkainenBlockwiseSA<TStr>::qsort(EList<TIndexOffU>& bucket) {
  */
 template<>
 inline void KarkkainenBlockwiseSA<S2bDnaString>::qsort(
-	EList<TIndexOffU>& bucket)
+	EList<TIndexOffU>& bucket,
+	bool vbose,
+	TIndexOffU** bkts)
 {
 	const S2bDnaString& t = this->text();
 	TIndexOffU *s = bucket.ptr();
@@ -369,17 +453,17 @@ inline void KarkkainenBlockwiseSA<S2bDnaString>::qsort(
 	size_t len = t.length();
 	if(_dc.get() != NULL) {
 		// Use the difference cover as a tie-breaker if we have it
-		VMSG_NL("  (Using difference cover)");
+		if(vbose) VMSG_NL("  (Using difference cover)");
 		// Can't use the text's 'host' array because the backing
 		// store for the packed string is not one-char-per-elt.
 		mkeyQSortSufDcU8(t, t, len, s, slen, *_dc.get(), 4,
-		                 this->verbose(), this->sanityCheck());
+		                 vbose, this->sanityCheck(), bkts);
 	} else {
-		VMSG_NL("  (Not using difference cover)");
+		if(vbose) VMSG_NL("  (Not using difference cover)");
 		// We don't have a difference cover - just do a normal
 		// suffix sort
 		mkeyQSortSuf(t, s, slen, 4,
-		             this->verbose(), this->sanityCheck());
+		             vbose, this->sanityCheck());
 	}
 }
 
@@ -454,7 +538,7 @@ void KarkkainenBlockwiseSA<TStr>::buildSamples() {
 	{
 		Timer timer(cout, "  Multikey QSorting samples time: ", this->verbose());
 		VMSG_NL("Multikey QSorting " << _sampleSuffs.size() << " samples");
-		this->qsort(_sampleSuffs);
+		this->qsort(_sampleSuffs, this->verbose());
 	}
 	// Calculate bucket sizes
 	VMSG_NL("Calculating bucket sizes");
@@ -770,16 +854,22 @@ bool KarkkainenBlockwiseSA<TStr>::suffixCmp(
 }
 
 /**
- * Retrieve the next block.  This is the most performance-critical part
- * of the blockwise suffix sorting process.
+ * Assemble block 'cur' into 'bucket' and sort it.  This is the most
+ * performance-critical part of the blockwise suffix sorting process.
+ * Touches no member state besides what build() left behind, so worker
+ * threads can build different blocks at once as long as each passes
+ * its own 'bktBuf' for the bucket sort to use.
  */
 template<typename TStr>
-void KarkkainenBlockwiseSA<TStr>::nextBlock() {
-	EList<TIndexOffU>& bucket = this->_itrBucket;
-	VMSG_NL("Getting block " << (_cur+1) << " of " << _sampleSuffs.size()+1);
+void KarkkainenBlockwiseSA<TStr>::buildBlock(
+	TIndexOffU cur,
+	EList<TIndexOffU>& bucket,
+	bool vbose,
+	EList<TIndexOffU>* bktBuf)
+{
 	assert(_built);
 	assert_gt(_dcV, 3);
-	assert_leq(_cur, _sampleSuffs.size());
+	assert_leq(cur, _sampleSuffs.size());
 	const TStr& t = this->text();
 	TIndexOffU len = (TIndexOffU)t.length();
 	// Set up the bucket
@@ -788,8 +878,8 @@ void KarkkainenBlockwiseSA<TStr>::nextBlock() {
 	if(_sampleSuffs.size() == 0) {
 		// Special case: if _sampleSuffs is 0, then multikey-quicksort
 		// everything
-		VMSG_NL("  No samples; assembling all-inclusive block");
-		assert_eq(0, _cur);
+		if(vbose) VMSG_NL("  No samples; assembling all-inclusive block");
+		assert_eq(0, cur);
 		try {
 			if(bucket.capacity() < this->bucketSz()) {
 				bucket.reserveExact(len+1);
@@ -810,7 +900,7 @@ void KarkkainenBlockwiseSA<TStr>::nextBlock() {
 		}
 	} else {
 		try {
-			VMSG_NL("  Reserving size (" << this->bucketSz() << ") for bucket");
+			if(vbose) VMSG_NL("  Reserving size (" << this->bucketSz() << ") for bucket");
 			// BTL: Add a +100 fudge factor; there seem to be instances
 			// where a bucket ends up having one more elt than bucketSz()
 			if(bucket.size() < this->bucketSz()+100) {
@@ -830,32 +920,32 @@ void KarkkainenBlockwiseSA<TStr>::nextBlock() {
 		// calculate the Z array up to the difference-cover periodicity
 		// for both.  Be careful about first/last buckets.
 		EList<TIndexOffU> zLo(EBWTB_CAT), zHi(EBWTB_CAT);
-		assert_geq(_cur, 0);
-		assert_leq(_cur, _sampleSuffs.size());
-		bool first = (_cur == 0);
-		bool last  = (_cur == _sampleSuffs.size());
+		assert_geq(cur, 0);
+		assert_leq(cur, _sampleSuffs.size());
+		bool first = (cur == 0);
+		bool last  = (cur == _sampleSuffs.size());
 		try {
-			Timer timer(cout, "  Calculating Z arrays time: ", this->verbose());
-			VMSG_NL("  Calculating Z arrays");
+			Timer timer(cout, "  Calculating Z arrays time: ", vbose);
+			if(vbose) VMSG_NL("  Calculating Z arrays");
 			if(!last) {
 				// Not the last bucket
-				assert_lt(_cur, _sampleSuffs.size());
-				hi = _sampleSuffs[_cur];
+				assert_lt(cur, _sampleSuffs.size());
+				hi = _sampleSuffs[cur];
 				zHi.resizeExact(_dcV);
 				zHi.fillZero();
 				assert_eq(zHi[0], 0);
-				calcZ(t, hi, zHi, this->verbose(), this->sanityCheck());
+				calcZ(t, hi, zHi, vbose, this->sanityCheck());
 			}
 			if(!first) {
 				// Not the first bucket
-				assert_gt(_cur, 0);
-				assert_leq(_cur, _sampleSuffs.size());
-				lo = _sampleSuffs[_cur-1];
+				assert_gt(cur, 0);
+				assert_leq(cur, _sampleSuffs.size());
+				lo = _sampleSuffs[cur-1];
 				zLo.resizeExact(_dcV);
 				zLo.fillZero();
 				assert_gt(_dcV, 3);
 				assert_eq(zLo[0], 0);
-				calcZ(t, lo, zLo, this->verbose(), this->sanityCheck());
+				calcZ(t, lo, zLo, vbose, this->sanityCheck());
 			}
 		} catch(bad_alloc &e) {
 			if(this->_passMemExc) {
@@ -880,12 +970,12 @@ void KarkkainenBlockwiseSA<TStr>::nextBlock() {
 		bool kHiSoft = false, kLoSoft = false;
 		assert_eq(0, bucket.size());
 		{
-			Timer timer(cout, "  Block accumulator loop time: ", this->verbose());
-			VMSG_NL("  Entering block accumulator loop:");
+			Timer timer(cout, "  Block accumulator loop time: ", vbose);
+			if(vbose) VMSG_NL("  Entering block accumulator loop:");
 			TIndexOffU lenDiv10 = (len + 9) / 10;
 			for(TIndexOffU iten = 0, ten = 0; iten < len; iten += lenDiv10, ten++) {
 			TIndexOffU itenNext = iten + lenDiv10;
-			if(ten > 0) VMSG_NL("  " << (ten * 10) << "%");
+			if(vbose && ten > 0) VMSG_NL("  " << (ten * 10) << "%");
 			for(TIndexOffU i = iten; i < itenNext && i < len; i++) {
 				assert_lt(jLo, (TIndexOff)i); assert_lt(jHi, (TIndexOff)i);
 				// Advance the upper-bound comparison by one character
@@ -916,14 +1006,26 @@ void KarkkainenBlockwiseSA<TStr>::nextBlock() {
 				//assert_lt(bucket.size(), this->bucketSz());
 			}
 			} // end loop over all suffixes of t
-			VMSG_NL("  100%");
+			if(vbose) VMSG_NL("  100%");
 		}
 	} // end else clause of if(_sampleSuffs.size() == 0)
 	// Sort the bucket
 	if(bucket.size() > 0) {
-		Timer timer(cout, "  Sorting block time: ", this->verbose());
-		VMSG_NL("  Sorting block of length " << bucket.size());
-		this->qsort(bucket);
+		Timer timer(cout, "  Sorting block time: ", vbose);
+		if(vbose) VMSG_NL("  Sorting block of length " << bucket.size());
+		if(bktBuf != NULL && _dc.get() != NULL) {
+			// Bucket-sort into this thread's own scratch space
+			size_t stride = min<size_t>(bucket.size(), BUCKET_SORT_CUTOFF);
+			bktBuf->resizeNoCopy(stride * 4);
+			TIndexOffU* bkts[4] = {
+				bktBuf->ptr(),
+				bktBuf->ptr() + stride,
+				bktBuf->ptr() + stride * 2,
+				bktBuf->ptr() + stride * 3 };
+			this->qsort(bucket, vbose, bkts);
+		} else {
+			this->qsort(bucket, vbose);
+		}
 	}
 	if(hi != OFF_MASK) {
 		// Not the final bucket; throw in the sample on the RHS
@@ -932,8 +1034,137 @@ void KarkkainenBlockwiseSA<TStr>::nextBlock() {
 		// Final bucket; throw in $ suffix
 		bucket.push_back(len);
 	}
+}
+
+/**
+ * Retrieve the next block.  With one thread the block is built right
+ * here; otherwise it's taken from the slot a worker left it in.
+ */
+template<typename TStr>
+void KarkkainenBlockwiseSA<TStr>::nextBlock() {
+	EList<TIndexOffU>& bucket = this->_itrBucket;
+	VMSG_NL("Getting block " << (_cur+1) << " of " << _sampleSuffs.size()+1);
+	assert(_built);
+	assert_leq(_cur, _sampleSuffs.size());
+	if(_nthreads == 1 || _sampleSuffs.size() == 0) {
+		buildBlock(_cur, bucket, this->verbose(), _bktBuf);
+	} else {
+		if(_threads.empty()) {
+			startWorkers();
+		}
+		size_t slot = _cur % _slots.size();
+		int err = 0;
+		{
+			Timer timer(cout, "  Waiting for block time: ", this->verbose());
+			_mutex.lock();
+			while(!_slotDone[slot] && _err == 0) {
+				_cond.wait(_mutex);
+			}
+			err = _err;
+			if(err == 0) {
+				bucket.xfer(_slots[slot]);
+				_slotDone[slot] = false;
+				_taken = _cur + 1;
+				_cond.notify_all();
+			}
+			_mutex.unlock();
+		}
+		if(err != 0) {
+			stopWorkers();
+			if(err == 1) {
+				throw bad_alloc();
+			}
+			throw 1;
+		}
+	}
 	VMSG_NL("Returning block of " << bucket.size());
 	_cur++; // advance to next bucket
 }
 
+/**
+ * Start the workers that build blocks ahead of nextBlock().  There are
+ * two slots per worker, so a worker that finishes a block early can go
+ * on to another while nextBlock() waits for a slower one.
+ */
+template<typename TStr>
+void KarkkainenBlockwiseSA<TStr>::startWorkers() {
+	assert(_threads.empty());
+	TIndexOffU nblocks = (TIndexOffU)_sampleSuffs.size() + 1;
+	int nthreads = (int)min<TIndexOffU>((TIndexOffU)_nthreads, nblocks - _cur);
+	VMSG_NL("Sorting blocks on " << nthreads << " threads");
+	_slots.resize(min<TIndexOffU>((TIndexOffU)(nthreads << 1), nblocks - _cur));
+	_slotDone.resize(_slots.size());
+	for(size_t i = 0; i < _slots.size(); i++) {
+		_slots[i].clear();
+		_slotDone[i] = false;
+	}
+	_claim = _taken = _cur;
+	_stop = false;
+	_err = 0;
+	for(int i = 0; i < nthreads; i++) {
+		_threads.push_back(new tthread::thread(sortBlocksWorker, (void*)this));
+	}
+}
+
+/**
+ * Tell the workers to quit, wait for them, and free any blocks they
+ * built that weren't consumed.
+ */
+template<typename TStr>
+void KarkkainenBlockwiseSA<TStr>::stopWorkers() {
+	if(_threads.empty()) return;
+	_mutex.lock();
+	_stop = true;
+	_cond.notify_all();
+	_mutex.unlock();
+	for(size_t i = 0; i < _threads.size(); i++) {
+		_threads[i]->join();
+		delete _threads[i];
+	}
+	_threads.clear();
+	_slots.clear();
+	_slotDone.clear();
+}
+
+/**
+ * Worker loop: claim the next unclaimed block once its slot is free,
+ * build it outside the lock, and hand it over.  An error stops all
+ * workers; nextBlock() rethrows it on the consumer's thread.
+ */
+template<typename TStr>
+void KarkkainenBlockwiseSA<TStr>::sortBlocks() {
+	TIndexOffU nblocks = (TIndexOffU)_sampleSuffs.size() + 1;
+	size_t nslots = _slots.size();
+	EList<TIndexOffU> bktBuf(EBWTB_CAT);
+	while(true) {
+		TIndexOffU cur;
+		_mutex.lock();
+		while(!_stop && _err == 0 && _claim < nblocks && _claim >= _taken + nslots) {
+			_cond.wait(_mutex);
+		}
+		if(_stop || _err != 0 || _claim >= nblocks) {
+			_mutex.unlock();
+			return;
+		}
+		cur = _claim++;
+		_mutex.unlock();
+		int err = 0;
+		try {
+			buildBlock(cur, _slots[cur % nslots], false, &bktBuf);
+		} catch(bad_alloc& e) {
+			err = 1;
+		} catch(int e) {
+			err = 2;
+		}
+		_mutex.lock();
+		if(err != 0) {
+			if(_err == 0) _err = err;
+		} else {
+			_slotDone[cur % nslots] = true;
+		}
+		_cond.notify_all();
+		_mutex.unlock();
+	}
+}
+
 #endif /*BLOCKWISE_SA_H_*/
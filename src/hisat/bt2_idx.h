@@ -36,10 +36,13 @@
 #include <sys/shm.h>
 #endif
 #include "shmem.h"
+#include "hugepage.h"
+#include "shm_index.h"
 #include "alphabet.h"
 #include "assert_helpers.h"
 #include "bitpack.h"
 #include "blockwise_sa.h"
+#include "sais.h"
 #include "endian_swap.h"
 #include "word_io.h"
 #include "random_source.h"
@@ -55,9 +58,10 @@
 #include "mem_ids.h"
 #include "btypes.h"
 
-#ifdef POPCNT_CAPABILITY
 #include "processor_support.h"
-#endif
+#include "occ_simd.h"
+#include "sa_pack.h"
+#include "off40.h"
 
 #if __cplusplus <= 199711L
 #define unique_ptr auto_ptr
@@ -99,11 +103,28 @@ if(this->verbose()) { \
  */
 enum EBWT_FLAGS {
 	EBWT_COLOR = 2,     // true -> Ebwt is colorspace
-	EBWT_ENTIRE_REV = 4 // true -> reverse Ebwt is the whole
+	EBWT_ENTIRE_REV = 4, // true -> reverse Ebwt is the whole
 	                    // concatenated string reversed, rather than
 						// each stretch reversed
+	EBWT_LOCAL_ALIGNED = 8, // true -> local index sections in the .5/.6
+	                    // files start on local_index_align boundaries
+	EBWT_OCC_PACKED = 16, // true -> ebwt[] starts on an ebwt_block_align
+	                    // boundary in the .1 file and is made of
+	                    // 64-byte blocks: 48 bytes of BWT, then four
+	                    // 32-bit occ counts
+	EBWT_SA_PACKED = 32, // true -> offs[] in the .2 file is a bit stream
+	                    // of saPackBits(bwtLen)-bit values (sa_pack.h)
+	EBWT_OFF40 = 64     // true -> plen[], rstarts[], ftab[], eftab[] and
+	                    // offs[] of a 64-bit index are 5-byte off40_t
 };
 
+/**
+ * Boundary that the ebwt[] of an EBWT_OCC_PACKED index starts on, both
+ * in the .1 file and in memory, so that each of its blocks is exactly
+ * one cache line.
+ */
+static const size_t ebwt_block_align = 64;
+
 /**
  * Extended Burrows-Wheeler transform header.  This together with the
  * actual data arrays and other text-specific parameters defined in
@@ -151,11 +172,11 @@ public:
 		_offMask = std::numeric_limits<index_t>::max() << _offRate;
 		_ftabChars = ftabChars;
 		_eftabLen = _ftabChars*2;
-		_eftabSz = _eftabLen*sizeof(index_t);
+		_eftabSz = _eftabLen*sizeof(typename IndexStore<index_t>::type);
 		_ftabLen = (1 << (_ftabChars*2))+1;
-		_ftabSz = _ftabLen*sizeof(index_t);
+		_ftabSz = _ftabLen*sizeof(typename IndexStore<index_t>::type);
 		_offsLen = (_bwtLen + (1 << _offRate) - 1) >> _offRate;
-		_offsSz = _offsLen*sizeof(index_t);
+		_offsSz = _offsLen*sizeof(typename IndexStore<index_t>::type);
 		_lineSz = 1 << _lineRate;
 		_sideSz = _lineSz * 1 /* lines per side */;
 		_sideBwtSz = _sideSz - (sizeof(index_t) * 4);
@@ -202,7 +223,7 @@ public:
 		_offRate = __offRate;
 		_offMask = std::numeric_limits<index_t>::max() << _offRate;
 		_offsLen = (_bwtLen + (1 << _offRate) - 1) >> _offRate;
-		_offsSz = _offsLen*sizeof(index_t);
+		_offsSz = _offsLen*sizeof(typename IndexStore<index_t>::type);
 	}
 
 #ifndef NDEBUG
@@ -532,6 +553,12 @@ class EbwtSearchParams;
 template <class index_t = uint32_t>
 class Ebwt {
 public:
+	/// Element type of offs[], ftab[], eftab[], rstarts[] and plen[]
+	typedef typename IndexStore<index_t>::type index_store_t;
+	/// What their accessors return
+	typedef typename IndexStore<index_t>::ptr index_store_ptr;
+	typedef typename IndexStore<index_t>::const_ptr index_store_cptr;
+
 	#define Ebwt_INITS \
 	    _toBigEndian(currentlyBigEndian()), \
 	    _overrideOffRate(overrideOffRate), \
@@ -555,9 +582,15 @@ public:
 	    _ebwt(EBWT_CAT), \
 	    _useMm(false), \
 	    useShmem_(false), \
-	    _refnames(EBWT_CAT), \
-	    mmFile1_(NULL), \
-	    mmFile2_(NULL)
+	    _hugePages(false), \
+	    _shmIndex(false), \
+	    _packedOcc(false), \
+	    _occKernel(occSelectKernel()), \
+	    _packedSa(false), \
+	    _saBits(0), \
+	    _off40(false), \
+	    _offStride(sizeof(index_store_t)), \
+	    _refnames(EBWT_CAT)
 
 	/// Construct an Ebwt from the given input file
 	Ebwt(const string& in,
@@ -676,7 +709,7 @@ public:
 		index_t bmaxSqrtMult,
 		index_t bmaxDivN,
 		int dcv,
-		EList<FileBuf*>& is,
+		const PackedRef& ref,
 		EList<RefRecord>& szs,
 		index_t sztot,
 		const RefReadInParams& refparams,
@@ -684,7 +717,12 @@ public:
 		int32_t overrideOffRate = -1,
 		bool verbose = false,
 		bool passMemExc = false,
-		bool sanityCheck = false) :
+		bool sanityCheck = false,
+		bool packedOcc = false,
+		bool packedSa = false,
+		int nthreads = 1,
+		uint64_t maxMem = 0,
+		bool off40 = false) :
 		Ebwt_INITS,
 		_eh(
 			joinedLen(szs),
@@ -701,6 +739,18 @@ public:
 		_in1Str = file + ".1." + gEbwt_ext;
 		_in2Str = file + ".2." + gEbwt_ext;
 		packed_ = packed;
+		_packedOcc = packedOcc;
+		assert(!_packedOcc || (_eh._sideSz == ebwt_block_align && sizeof(index_t) == 4));
+		_packedSa = packedSa;
+		_saBits = packedSa ? saPackBits(_eh._bwtLen) : 0;
+		_off40 = off40;
+		// Loaded large indexes hold their offsets as off40_t whether or
+		// not the files do
+		if(sizeof(index_store_t) != sizeof(index_t) && !off40_t::fits(_eh._bwtLen)) {
+			cerr << "Error: Reference is " << _eh._len << " characters long; large indexes hold at most" << endl
+			     << "2^39 characters." << endl;
+			throw 1;
+		}
 		// Open output files
 		ofstream fout1(_in1Str.c_str(), ios::binary);
 		if(!fout1.good()) {
@@ -719,7 +769,7 @@ public:
 		// Build
 		initFromVector<TStr>(
 							 s,
-							 is,
+							 ref,
 							 szs,
 							 sztot,
 							 refparams,
@@ -731,7 +781,9 @@ public:
 							 bmaxDivN,
 							 dcv,
 							 seed,
-							 verbose);
+							 verbose,
+							 nthreads,
+							 maxMem);
 		// Close output files
 		fout1.flush();
 		int64_t tellpSz1 = (int64_t)fout1.tellp();
@@ -868,12 +920,13 @@ public:
 		ASSERT_ONLY(fb->reset());
 		assert(!fb->eof());
 		is.push_back(fb.get());
-		// Vector for the ordered list of "records" comprising the input
-		// sequences.  A record represents a stretch of unambiguous
-		// characters in one of the input sequences.
-		EList<RefRecord> szs(EBWT_CAT);
+		// The ordered list of "records" comprising the input sequences,
+		// and their characters.  A record represents a stretch of
+		// unambiguous characters in one of the input sequences.
+		PackedRef ref;
 		std::pair<index_t, index_t> sztot;
-		sztot = BitPairReference::szsFromFasta(is, file, bigEndian, refparams, szs, sanity);
+		sztot = BitPairReference::szsFromFasta(is, file, bigEndian, refparams, ref);
+		EList<RefRecord>& szs = ref.recs;
 		// Construct Ebwt from input strings and parameters
 		Ebwt<index_t> *ebwtFw = new Ebwt<index_t>(
 												  TStr(),
@@ -890,7 +943,7 @@ public:
 												  bmaxSqrtMult, // block size as multiplier of sqrt(len)
 												  bmaxDivN,     // block size as divisor of len
 												  dcv,          // difference-cover period
-												  is,           // list of input streams
+												  ref,          // reference sequences
 												  szs,          // list of reference sizes
 												  sztot.first,  // total size of all unambiguous ref chars
 												  refparams,    // reference read-in parameters
@@ -900,8 +953,6 @@ public:
 												  autoMem,      // pass exceptions up to the toplevel so that we can adjust memory settings automatically
 												  sanity);      // verify results and internal consistency
 		refparams.reverse = reverse;
-		szs.clear();
-		sztot = BitPairReference::szsFromFasta(is, file, bigEndian, refparams, szs, sanity);
 		// Construct Ebwt from input strings and parameters
 		Ebwt<index_t> *ebwtBw = new Ebwt<index_t>(
 												  TStr(),
@@ -918,7 +969,7 @@ public:
 												  bmaxSqrtMult, // block size as multiplier of sqrt(len)
 												  bmaxDivN,     // block size as divisor of len
 												  dcv,          // difference-cover period
-												  is,           // list of input streams
+												  ref,          // reference sequences
 												  szs,          // list of reference sizes
 												  sztot.first,  // total size of all unambiguous ref chars
 												  refparams,    // reference read-in parameters
@@ -950,7 +1001,7 @@ public:
 	 */
 	template <typename TStr>
 	void initFromVector(TStr& s,
-						EList<FileBuf*>& is,
+						const PackedRef& ref,
 	                    EList<RefRecord>& szs,
 	                    index_t sztot,
 	                    const RefReadInParams& refparams,
@@ -962,7 +1013,9 @@ public:
 	                    index_t bmaxDivN,
 	                    int dcv,
 	                    uint32_t seed,
-						bool verbose)
+						bool verbose,
+	                    int nthreads = 1,
+	                    uint64_t maxMem = 0)
 	{
 		// Compose text strings into single string
 		VMSG_NL("Calculating joined length");
@@ -978,7 +1031,7 @@ public:
 			if(refparams.reverse == REF_READ_REVERSE) {
 				{
 					Timer timer(cout, "  Time to join reference sequences: ", _verbose);
-					joinToDisk(is, szs, sztot, refparams, s, out1, out2);
+					joinToDisk(ref, szs, sztot, refparams, s, out1, out2);
 				} {
 					Timer timer(cout, "  Time to reverse reference sequence: ", _verbose);
 					EList<RefRecord> tmp(EBWT_CAT);
@@ -988,7 +1041,7 @@ public:
 				}
 			} else {
 				Timer timer(cout, "  Time to join reference sequences: ", _verbose);
-				joinToDisk(is, szs, sztot, refparams, s, out1, out2);
+				joinToDisk(ref, szs, sztot, refparams, s, out1, out2);
 				szsToDisk(szs, out1, refparams.reverse);
 			}
 			// Joined reference sequence now in 's'
@@ -1042,8 +1095,37 @@ public:
 		bool first = true;
 		streampos out1pos = out1.tellp();
 		streampos out2pos = out2.tellp();
+		// If the whole suffix array fits in the memory budget, build it
+		// in linear time with SA-IS instead of block by block
+		bool sais = false;
+		if(maxMem > 0) {
+			uint64_t est = saisMemEstimate<TStr>(_eh, isPacked());
+			VMSG_NL("Estimated peak memory with SA-IS: " << est << " bytes; budget: " << maxMem << " bytes");
+			if(est <= maxMem) {
+				try {
+					VMSG_NL("Constructing suffix array with SA-IS");
+					SaisBlockwiseSA<TStr> bsa(s, _sanity, _passMemExc, _verbose);
+					assert(bsa.suffixItrIsReset());
+					assert_eq(bsa.size(), s.length()+1);
+					VMSG_NL("Converting suffix-array elements to index image");
+					buildToDisk(bsa, s, out1, out2);
+					out1.flush(); out2.flush();
+					if(out1.fail() || out2.fail()) {
+						cerr << "An error occurred writing the index to disk.  Please check if the disk is full." << endl;
+						throw 1;
+					}
+					sais = true;
+				} catch(bad_alloc& e) {
+					VMSG_NL("  Ran out of memory with SA-IS; falling back to the blockwise algorithm.");
+					out1.seekp(out1pos);
+					out2.seekp(out2pos);
+				}
+			} else {
+				VMSG_NL("  Over budget; using the blockwise algorithm");
+			}
+		}
 		// Look for bmax/dcv parameters that work.
-		while(true) {
+		while(!sais) {
 			if(!first && bmax < 40 && _passMemExc) {
 				cerr << "Could not find approrpiate bmax/dcv settings for building this index." << endl;
 				if(!isPacked()) {
@@ -1078,7 +1160,11 @@ public:
 			}
 			iter++;
 			try {
-				{
+				if(maxMem > 0) {
+					// The parameters were fitted to the budget already,
+					// and the test itself would push the peak over it
+					VMSG_NL("  Skipping ahead-of-time memory usage test; fitted to the memory budget");
+				} else {
 					VMSG_NL("  Doing ahead-of-time memory usage test");
 					// Make a quick-and-dirty attempt to force a bad_alloc iff
 					// we would have thrown one eventually as part of
@@ -1105,7 +1191,7 @@ public:
 					VMSG_NL("");
 				}
 				VMSG_NL("Constructing suffix-array element generator");
-				KarkkainenBlockwiseSA<TStr> bsa(s, bmax, dcv, seed, _sanity, _passMemExc, _verbose);
+				KarkkainenBlockwiseSA<TStr> bsa(s, bmax, dcv, seed, _sanity, _passMemExc, _verbose, nthreads);
 				assert(bsa.suffixItrIsReset());
 				assert_eq(bsa.size(), s.length()+1);
 				VMSG_NL("Converting suffix-array elements to index image");
@@ -1142,6 +1228,46 @@ public:
 		VMSG_NL("Returning from initFromVector");
 	}
 	
+	/**
+	 * Return the approximate number of bytes taken by the joined
+	 * string and by the ftab, absorbFtab and side buffer that
+	 * buildToDisk allocates while the suffix array is in memory.
+	 */
+	static uint64_t joinedMemEstimate(const EbwtParams<index_t>& eh, bool packed) {
+		uint64_t text = packed ? ((eh._len + 3) >> 2) : eh._len;
+		return text + (uint64_t)eh._ftabLen * (sizeof(index_t) + 1) + eh._sideSz;
+	}
+
+	/**
+	 * Return the approximate peak number of bytes needed to build the
+	 * index described by 'eh' with SA-IS.
+	 */
+	template <typename TStr>
+	static uint64_t saisMemEstimate(const EbwtParams<index_t>& eh, bool packed) {
+		return joinedMemEstimate(eh, packed) + SaisBlockwiseSA<TStr>::peakBytes(eh._len);
+	}
+
+	/**
+	 * Return the approximate peak number of bytes needed to build the
+	 * index described by 'eh' with the blockwise algorithm, blocks of
+	 * at most 'bmax' suffixes, difference-cover period 'dcv' and
+	 * 'nthreads' threads.  The difference cover peaks while it's
+	 * built, before any block is.
+	 */
+	template <typename TStr>
+	static uint64_t blockwiseMemEstimate(
+		const EbwtParams<index_t>& eh,
+		bool packed,
+		index_t bmax,
+		int dcv,
+		int nthreads)
+	{
+		uint64_t dcBuild = DifferenceCoverSample<TStr>::peakBytes(eh._len, dcv, true);
+		uint64_t blocks = DifferenceCoverSample<TStr>::peakBytes(eh._len, dcv, false) +
+		                  KarkkainenBlockwiseSA<TStr>::peakBytes(eh._len, bmax, nthreads);
+		return joinedMemEstimate(eh, packed) + max(dcBuild, blocks);
+	}
+
 	/**
 	 * Return the length that the joined string of the given string
 	 * list will have.  Note that this is indifferent to how the text
@@ -1165,14 +1291,20 @@ public:
 		_rstarts.reset();
 		_offs.reset();
 		_ebwt.reset();
-		if(offs() != NULL && useShmem_) {
-			FREE_SHARED(offs());
+		_ftabHuge.free();
+		_offsHuge.free();
+		_ebwtHuge.free();
+		if(_offs.get() != NULL && useShmem_) {
+			FREE_SHARED(_offs.get());
 		}
 		if(ebwt() != NULL && useShmem_) {
 			FREE_SHARED(ebwt());
 		}
 		if (_in1 != NULL) fclose(_in1);
 		if (_in2 != NULL) fclose(_in2);
+		// Nothing points into the mapped files anymore
+		unmapIndexFile(mmFile1_);
+		unmapIndexFile(mmFile2_);
 	}
 
 	/// Accessors
@@ -1183,28 +1315,43 @@ public:
 	index_t    nPat() const        { return _nPat; }
 	index_t    nFrag() const       { return _nFrag; }
 	inline index_t*   fchr()              { return _fchr.get(); }
-	inline index_t*   ftab()              { return _ftab.get(); }
-	inline index_t*   eftab()             { return _eftab.get(); }
+	inline index_store_ptr ftab()         { return IndexStore<index_t>::wrap(_ftab.get(), _offStride); }
+	inline index_store_ptr eftab()        { return IndexStore<index_t>::wrap(_eftab.get(), _offStride); }
 #ifdef HISAT_CLASS
 	inline uint16_t*   offs()              { return _offs.get(); }
 #else
-    inline index_t*   offs()              { return _offs.get(); }
+    inline index_store_ptr offs()         { return IndexStore<index_t>::wrap(_offs.get(), _offStride); }
 #endif
-	inline index_t*   plen()              { return _plen.get(); }
-	inline index_t*   rstarts()           { return _rstarts.get(); }
+	inline index_store_ptr plen()         { return IndexStore<index_t>::wrap(_plen.get(), _offStride); }
+	inline index_store_ptr rstarts()      { return IndexStore<index_t>::wrap(_rstarts.get(), _offStride); }
 	inline uint8_t*    ebwt()              { return _ebwt.get(); }
 	inline const index_t* fchr() const    { return _fchr.get(); }
-	inline const index_t* ftab() const    { return _ftab.get(); }
-	inline const index_t* eftab() const   { return _eftab.get(); }
+	inline index_store_cptr ftab() const    { return IndexStore<index_t>::wrap(_ftab.get(), _offStride); }
+	inline index_store_cptr eftab() const   { return IndexStore<index_t>::wrap(_eftab.get(), _offStride); }
 #ifdef HISAT_CLASS
 	inline const uint16_t* offs() const    { return _offs.get(); }
 #else
-    inline const index_t* offs() const    { return _offs.get(); }
+    inline index_store_cptr offs() const    { return IndexStore<index_t>::wrap(_offs.get(), _offStride); }
 #endif
-	inline const index_t* plen() const    { return _plen.get(); }
-	inline const index_t* rstarts() const { return _rstarts.get(); }
+	inline index_store_cptr plen() const    { return IndexStore<index_t>::wrap(_plen.get(), _offStride); }
+	inline index_store_cptr rstarts() const { return IndexStore<index_t>::wrap(_rstarts.get(), _offStride); }
 	inline const uint8_t*  ebwt() const    { return _ebwt.get(); }
 	bool        toBe() const         { return _toBigEndian; }
+	bool        packedSa() const     { return _packedSa; }
+	int         occKernel() const    { return _occKernel; }
+	int         saBits() const       { return _packedSa ? _saBits : (int)(_offStride * 8); }
+
+	/**
+	 * Return SA sample 'i', unpacking it from the bit stream if this
+	 * is an EBWT_SA_PACKED index.
+	 */
+	inline index_t offAt(index_t i) const {
+		assert_lt(i, _eh._offsLen);
+		if(_packedSa) {
+			return (index_t)saPackGet((const uint8_t*)_offs.get(), i, _saBits);
+		}
+		return offs()[i];
+	}
 	bool        verbose() const      { return _verbose; }
 	bool        sanityCheck() const  { return _sanity; }
 	EList<string>& refnames()        { return _refnames; }
@@ -1269,6 +1416,56 @@ public:
 		return !isInMemory();
 	}
 
+	/**
+	 * Back the ebwt, ftab and offs arrays with huge pages the next time
+	 * the index is read into memory.  Arrays that are memory-mapped
+	 * from the index files or kept in shared memory are unaffected.
+	 */
+	void setHugePages(bool hugePages) {
+		_hugePages = hugePages;
+	}
+
+	/**
+	 * Map the index files through POSIX shared memory (see
+	 * shm_index.h) the next time they are memory-mapped.
+	 */
+	void setShmIndex(bool shmIndex) {
+		_shmIndex = shmIndex;
+	}
+
+	/**
+	 * Print which of the big index arrays got huge pages.
+	 */
+	void printHugePages(ostream& out) const {
+		out << "Huge pages for " << _in1Str << ": ";
+		if(_useMm || useShmem_) {
+			out << "none; arrays are " << (_useMm ? "memory-mapped" : "in shared memory") << endl;
+			return;
+		}
+		out << "ebwt[] " << _ebwtHuge.kindName()
+		    << ", ftab[] " << _ftabHuge.kindName()
+		    << ", offs[] " << _offsHuge.kindName() << endl;
+	}
+
+	/**
+	 * Allocate one of the big index arrays: on huge pages, held by
+	 * 'huge', if setHugePages() was called, otherwise with new[].
+	 * If 'aligned' is set, the array must start on a page boundary,
+	 * so ordinary pages are mapped through 'huge' instead of new[].
+	 * 'freeable' is set to whether the APtrWrap should delete[] it.
+	 */
+	template<typename T>
+	T *allocIndexArray(HugePageBuf& huge, size_t len, bool& freeable, bool aligned = false) {
+		if(_hugePages || aligned) {
+			T *p = (T*)huge.alloc(len * sizeof(T), _hugePages);
+			if(p == NULL) throw std::bad_alloc();
+			freeable = false;
+			return p;
+		}
+		freeable = true;
+		return new T[len];
+	}
+
 	/**
 	 * Load this Ebwt into memory by reading it in from the _in1 and
 	 * _in2 streams.
@@ -1306,6 +1503,9 @@ public:
 		_rstarts.free();
 		_offs.free(); // might not be under control of APtrWrap
 		_ebwt.free(); // might not be under control of APtrWrap
+		_ftabHuge.free();
+		_offsHuge.free();
+		_ebwtHuge.free();
 		// Keep plen; it's small and the client may want to seq it
 		// even when the others are evicted.
 		//_plen  = NULL;
@@ -1364,11 +1564,13 @@ public:
 	 * second correpsonding ui32 in the eftab.
 	 *
 	 * It's a static member because it's convenient to ask this
-	 * question before the Ebwt is fully initialized.
+	 * question before the Ebwt is fully initialized.  TPtr is index_t*
+	 * while building and index_store_cptr once loaded.
 	 */
+	template <typename TPtr>
 	static index_t ftabHi(
-		const index_t *ftab,
-		const index_t *eftab,
+		TPtr ftab,
+		TPtr eftab,
 		index_t len,
 		index_t ftabLen,
 		index_t eftabLen,
@@ -1445,9 +1647,10 @@ public:
 	 * It's a static member because it's convenient to ask this
 	 * question before the Ebwt is fully initialized.
 	 */
+	template <typename TPtr>
 	static index_t ftabLo(
-		const index_t *ftab,
-		const index_t *eftab,
+		TPtr ftab,
+		TPtr eftab,
 		index_t len,
 		index_t ftabLen,
 		index_t eftabLen,
@@ -1474,7 +1677,7 @@ public:
 		if((elt & _eh._offMask) == elt) {
 			index_t eltOff = elt >> _eh._offRate;
 			assert_lt(eltOff, _eh._offsLen);
-			index_t off = offs()[eltOff];
+			index_t off = offAt(eltOff);
 			assert_neq((index_t)OFF_MASK, off);
 			return off;
 		} else {
@@ -1607,14 +1810,14 @@ public:
 		if(offs() == NULL) {
 			out << "NULL" << endl;
 		} else {
-			out << "non-NULL, [0] = " << offs()[0] << endl;
+			out << "non-NULL, [0] = " << offAt(0) << endl;
 		}
 	}
 
 	// Building
 	template <typename TStr> static TStr join(EList<TStr>& l, uint32_t seed);
-	template <typename TStr> static TStr join(EList<FileBuf*>& l, EList<RefRecord>& szs, index_t sztot, const RefReadInParams& refparams, uint32_t seed);
-	template <typename TStr> void joinToDisk(EList<FileBuf*>& l, EList<RefRecord>& szs, index_t sztot, const RefReadInParams& refparams, TStr& ret, ostream& out1, ostream& out2);
+	template <typename TStr> static TStr join(const PackedRef& ref, EList<RefRecord>& szs, index_t sztot, const RefReadInParams& refparams, uint32_t seed);
+	template <typename TStr> void joinToDisk(const PackedRef& ref, EList<RefRecord>& szs, index_t sztot, const RefReadInParams& refparams, TStr& ret, ostream& out1, ostream& out2);
 	template <typename TStr> void buildToDisk(InorderBlockwiseSA<TStr>& sa, const TStr& s, ostream& out1, ostream& out2);
 
 	// I/O
@@ -1832,6 +2035,17 @@ public:
 	 * Function gets 11.09% in profile
 	 */
 	inline index_t countUpTo(const SideLocus<index_t>& l, int c) const {
+		if(_packedOcc) {
+			const uint64_t *block = reinterpret_cast<const uint64_t*>(l.side(this->ebwt()));
+#ifdef POPCNT_CAPABILITY
+			if(_usePOPCNTinstruction) {
+				return countInBlock<USE_POPCNT_INSTRUCTION>(block, l._charOff, c);
+			}
+			return countInBlock<USE_POPCNT_GENERIC>(block, l._charOff, c);
+#else
+			return countInBlock(block, l._charOff, c);
+#endif
+		}
 		// Count occurrences of c in each 64-bit (using bit trickery);
 		// Someday countInU64() and pop() functions should be
 		// vectorized/SSE-ized in case that helps.
@@ -1994,12 +2208,107 @@ public:
         arrs[3] += (uint32_t) tmp;
     }
 
+	/**
+	 * Count occurrences of c among the first 'charOff' characters of an
+	 * EBWT_OCC_PACKED block.  The block's 192 characters fill its first
+	 * six 64-bit words, 32 to a word, starting from the low-order bits,
+	 * so whole words are counted directly and the characters at and
+	 * after 'charOff' are shifted out of the last one.  The zeros
+	 * shifted in look like As and are taken back off.
+	 */
+#ifdef POPCNT_CAPABILITY
+	template<typename Operation>
+#endif
+	inline static index_t countInBlock(const uint64_t* block, index_t charOff, int c) {
+		assert_lt(charOff, 192);
+		const index_t words = charOff >> 5;
+		const index_t rem = charOff & 31;
+		index_t cCnt = 0;
+		for(index_t i = 0; i < words; i++) {
+#ifdef POPCNT_CAPABILITY
+			cCnt += countInU64<Operation>(c, block[i]);
+#else
+			cCnt += countInU64(c, block[i]);
+#endif
+		}
+		if(rem > 0) {
+			uint64_t dw = block[words] << ((32 - rem) << 1);
+#ifdef POPCNT_CAPABILITY
+			cCnt += countInU64<Operation>(c, dw);
+#else
+			cCnt += countInU64(c, dw);
+#endif
+			if(c == 0) cCnt -= (32 - rem);
+		}
+		return cCnt;
+	}
+
+	/**
+	 * Like countInBlock, but add the counts of all four nucleotides to
+	 * arrs[0..3].
+	 */
+#ifdef POPCNT_CAPABILITY
+	template<typename Operation>
+#endif
+	inline static void countInBlockEx(const uint64_t* block, index_t charOff, index_t* arrs) {
+		assert_lt(charOff, 192);
+		const index_t words = charOff >> 5;
+		const index_t rem = charOff & 31;
+		for(index_t i = 0; i < words; i++) {
+#ifdef POPCNT_CAPABILITY
+			countInU64Ex<Operation>(block[i], arrs);
+#else
+			countInU64Ex(block[i], arrs);
+#endif
+		}
+		if(rem > 0) {
+			uint64_t dw = block[words] << ((32 - rem) << 1);
+#ifdef POPCNT_CAPABILITY
+			countInU64Ex<Operation>(dw, arrs);
+#else
+			countInU64Ex(dw, arrs);
+#endif
+			arrs[0] -= (32 - rem);
+		}
+	}
+
 	/**
 	 * Counts the number of occurrences of all four nucleotides in the
 	 * given side up to (but not including) the given byte/bitpair (by/bp).
 	 * Count for 'a' goes in arrs[0], 'c' in arrs[1], etc.
 	 */
 	inline void countUpToEx(const SideLocus<index_t>& l, index_t* arrs) const {
+#ifdef OCC_SIMD_DISPATCH
+		// Count the whole side at once with a vector kernel if the
+		// processor has one; sides and packed blocks are laid out alike
+		if(_occKernel != OCC_KERNEL_SCALAR && !_toBigEndian) {
+			const uint64_t *words = reinterpret_cast<const uint64_t*>(l.side(this->ebwt()));
+			uint32_t cnts[4];
+			if(_occKernel == OCC_KERNEL_AVX512) {
+				occCountAVX512(words, (uint32_t)l._charOff, cnts);
+			} else {
+				occCountAVX2(words, (uint32_t)l._charOff, cnts);
+			}
+			arrs[0] += cnts[0];
+			arrs[1] += cnts[1];
+			arrs[2] += cnts[2];
+			arrs[3] += cnts[3];
+			return;
+		}
+#endif
+		if(_packedOcc) {
+			const uint64_t *block = reinterpret_cast<const uint64_t*>(l.side(this->ebwt()));
+#ifdef POPCNT_CAPABILITY
+			if(_usePOPCNTinstruction) {
+				countInBlockEx<USE_POPCNT_INSTRUCTION>(block, l._charOff, arrs);
+			} else {
+				countInBlockEx<USE_POPCNT_GENERIC>(block, l._charOff, arrs);
+			}
+#else
+			countInBlockEx(block, l._charOff, arrs);
+#endif
+			return;
+		}
 		int i = 0;
 		// Count occurrences of each nucleotide in each 64-bit word using
 		// bit trickery; note: this seems does not seem to lend a
@@ -2481,31 +2790,44 @@ public:
 	int        _zEbwtBpOff;
 	index_t    _nPat;  /// number of reference texts
 	index_t    _nFrag; /// number of fragments
-	APtrWrap<index_t> _plen;
-	APtrWrap<index_t> _rstarts; // starting offset of fragments / text indexes
+	APtrWrap<index_store_t> _plen;
+	APtrWrap<index_store_t> _rstarts; // starting offset of fragments / text indexes
 	// _fchr, _ftab and _eftab are expected to be relatively small
 	// (usually < 1MB, perhaps a few MB if _fchr is particularly large
 	// - like, say, 11).  For this reason, we don't bother with writing
 	// them to disk through separate output streams; we
 	APtrWrap<index_t> _fchr;
-	APtrWrap<index_t> _ftab;
-	APtrWrap<index_t> _eftab; // "extended" entries for _ftab
+	APtrWrap<index_store_t> _ftab;
+	APtrWrap<index_store_t> _eftab; // "extended" entries for _ftab
 	// _offs may be extremely large.  E.g. for DNA w/ offRate=4 (one
 	// offset every 16 rows), the total size of _offs is the same as
 	// the total size of the input sequence
 #ifdef HISAT_CLASS
 	APtrWrap<uint16_t> _offs;
 #else
-    APtrWrap<index_t> _offs;
+    APtrWrap<index_store_t> _offs;
 #endif
 	// _ebwt is the Extended Burrows-Wheeler Transform itself, and thus
 	// is at least as large as the input sequence.
 	APtrWrap<uint8_t> _ebwt;
 	bool       _useMm;        /// use memory-mapped files to hold the index
 	bool       useShmem_;     /// use shared memory to hold large parts of the index
+	bool       _hugePages;    /// back ebwt, ftab and offs with huge pages
+	bool       _shmIndex;     /// map the index files through POSIX shared memory
+	bool       _packedOcc;    /// ebwt[] is in EBWT_OCC_PACKED blocks
+	int        _occKernel;    /// OCC_KERNEL_* used by countUpToEx()
+	bool       _packedSa;     /// offs[] is an EBWT_SA_PACKED bit stream
+	int        _saBits;       /// bits per SA sample when _packedSa is set
+	bool       _off40;        /// write offset arrays as off40_t (EBWT_OFF40)
+	size_t     _offStride;    /// bytes per element of plen[], rstarts[], ftab[],
+	                          /// eftab[] and offs[]; 8 when a large index
+	                          /// without EBWT_OFF40 is memory-mapped
+	HugePageBuf _ebwtHuge;    /// memory behind _ebwt when _hugePages is set
+	HugePageBuf _ftabHuge;    /// memory behind _ftab when _hugePages is set
+	HugePageBuf _offsHuge;    /// memory behind _offs when _hugePages is set
 	EList<string> _refnames; /// names of the reference sequences
-	char *mmFile1_;
-	char *mmFile2_;
+	IndexFileMap mmFile1_;    /// .1 file, if memory-mapped
+	IndexFileMap mmFile2_;    /// .2 file, if memory-mapped
 	EbwtParams<index_t> _eh;
 	bool packed_;
 
@@ -2614,7 +2936,7 @@ TStr Ebwt<index_t>::join(EList<TStr>& l, uint32_t seed) {
  */
 template <typename index_t>
 template <typename TStr>
-TStr Ebwt<index_t>::join(EList<FileBuf*>& l,
+TStr Ebwt<index_t>::join(const PackedRef& ref,
                 EList<RefRecord>& szs,
                 index_t sztot,
                 const RefReadInParams& refparams,
@@ -2622,26 +2944,14 @@ TStr Ebwt<index_t>::join(EList<FileBuf*>& l,
 {
 	RandomSource rand; // reproducible given same seed
 	rand.init(seed);
-	RefReadInParams rpcp = refparams;
 	TStr ret;
 	index_t guessLen = sztot;
 	ret.resize(guessLen);
-	ASSERT_ONLY(index_t szsi = 0);
-	TIndexOffU dstoff = 0;
-	for(index_t i = 0; i < l.size(); i++) {
-		// For each sequence we can pull out of istream l[i]...
-		assert(!l[i]->eof());
-		bool first = true;
-		while(!l[i]->eof()) {
-			RefRecord rec = fastaRefReadAppend(*l[i], first, ret, dstoff, rpcp);
-			first = false;
-			index_t bases = (index_t)rec.len;
-			assert_eq(rec.off, szs[szsi].off);
-			assert_eq(rec.len, szs[szsi].len);
-			assert_eq(rec.first, szs[szsi].first);
-			ASSERT_ONLY(szsi++);
-			if(bases == 0) continue;
-		}
+	TIndexOffU dstoff = 0, srcoff = 0;
+	bool rev = (refparams.reverse == REF_READ_REVERSE_EACH);
+	for(index_t i = 0; i < szs.size(); i++) {
+		ref.copyTo(ret, dstoff, srcoff, (TIndexOffU)szs[i].len, rev);
+		srcoff += (TIndexOffU)szs[i].len;
 	}
 	return ret;
 }
@@ -2660,7 +2970,7 @@ TStr Ebwt<index_t>::join(EList<FileBuf*>& l,
 template <typename index_t>
 template <typename TStr>
 void Ebwt<index_t>::joinToDisk(
-	EList<FileBuf*>& l,
+	const PackedRef& ref,
 	EList<RefRecord>& szs,
 	index_t sztot,
 	const RefReadInParams& refparams,
@@ -2668,9 +2978,7 @@ void Ebwt<index_t>::joinToDisk(
 	ostream& out1,
 	ostream& out2)
 {
-	RefReadInParams rpcp = refparams;
 	assert_gt(szs.size(), 0);
-	assert_gt(l.size(), 0);
 	assert_gt(sztot, 0);
 	// Not every fragment represents a distinct sequence - many
 	// fragments may correspond to a single sequence.  Count the
@@ -2688,7 +2996,7 @@ void Ebwt<index_t>::joinToDisk(
 	writeIndex<index_t>(out1, this->_nPat, this->toBe());
 	// Allocate plen[]
 	try {
-		this->_plen.init(new index_t[this->_nPat], this->_nPat);
+		this->_plen.init(new index_store_t[this->_nPat], this->_nPat);
 	} catch(bad_alloc& e) {
 		cerr << "Out of memory allocating plen[] in Ebwt::join()"
 		     << " at " << __FILE__ << ":" << __LINE__ << endl;
@@ -2699,82 +3007,48 @@ void Ebwt<index_t>::joinToDisk(
 	for(index_t i = 0; i < szs.size(); i++) {
 		if(szs[i].first && szs[i].len > 0) {
 			if(npat >= 0) {
-				writeIndex<index_t>(out1, this->plen()[npat], this->toBe());
+				writeIndexStore<index_t>(out1, this->plen()[npat], this->toBe(), _off40);
 			}
 			npat++;
-			this->plen()[npat] = (szs[i].len + szs[i].off);
+			this->_plen.get()[npat] = (szs[i].len + szs[i].off);
 		} else {
-			this->plen()[npat] += (szs[i].len + szs[i].off);
+			this->_plen.get()[npat] += (szs[i].len + szs[i].off);
 		}
 	}
 	assert_eq((index_t)npat, this->_nPat-1);
-	writeIndex<index_t>(out1, this->plen()[npat], this->toBe());
+	writeIndexStore<index_t>(out1, this->plen()[npat], this->toBe(), _off40);
 	// Write the number of fragments
 	writeIndex<index_t>(out1, this->_nFrag, this->toBe());
 	index_t seqsRead = 0;
-	ASSERT_ONLY(index_t szsi = 0);
 	ASSERT_ONLY(index_t entsWritten = 0);
-	index_t dstoff = 0;
-	// For each filebuf
-	for(unsigned int i = 0; i < l.size(); i++) {
-		assert(!l[i]->eof());
-		bool first = true;
-		index_t patoff = 0;
-		// For each *fragment* (not necessary an entire sequence) we
-		// can pull out of istream l[i]...
-		while(!l[i]->eof()) {
-			string name;
-			// Push a new name onto our vector
-			_refnames.push_back("");
-			RefRecord rec = fastaRefReadAppend(
-				*l[i], first, ret, dstoff, rpcp, &_refnames.back());
-			first = false;
-			index_t bases = rec.len;
-			if(rec.first && rec.len > 0) {
+	TIndexOffU dstoff = 0, srcoff = 0;
+	size_t namei = 0;
+	bool rev = (refparams.reverse == REF_READ_REVERSE_EACH);
+	// For each *fragment* (not necessary an entire sequence)...
+	for(index_t i = 0; i < szs.size(); i++) {
+		const RefRecord& rec = szs[i];
+		if(rec.first) {
+			assert_lt(namei, ref.names.size());
+			if(rec.len > 0) {
+				// Push a new name onto our vector
+				_refnames.push_back(ref.names[namei]);
 				if(_refnames.back().length() == 0) {
 					// If name was empty, replace with an index
 					ostringstream stm;
 					stm << seqsRead;
 					_refnames.back() = stm.str();
 				}
-			} else {
-				// This record didn't actually start a new sequence so
-				// no need to add a name
-				//assert_eq(0, _refnames.back().length());
-				_refnames.pop_back();
 			}
-			assert_lt(szsi, szs.size());
-			assert_eq(rec.off, szs[szsi].off);
-			assert_eq(rec.len, szs[szsi].len);
-			assert_eq(rec.first, szs[szsi].first);
-			assert(rec.first || rec.off > 0);
-			ASSERT_ONLY(szsi++);
-			// Increment seqsRead if this is the first fragment
-			if(rec.first && rec.len > 0) seqsRead++;
-			if(bases == 0) continue;
-			assert_leq(bases, this->plen()[seqsRead-1]);
-			// Reset the patoff if this is the first fragment
-			if(rec.first) patoff = 0;
-			patoff += rec.off; // add fragment's offset from end of last frag.
-			// Adjust rpcps
-			//index_t seq = seqsRead-1;
-			ASSERT_ONLY(entsWritten++);
-			// This is where rstarts elements are written to the output stream
-			//writeU32(out1, oldRetLen, this->toBe()); // offset from beginning of joined string
-			//writeU32(out1, seq,       this->toBe()); // sequence id
-			//writeU32(out1, patoff,    this->toBe()); // offset into sequence
-			patoff += (index_t)bases;
-		}
-		assert_gt(szsi, 0);
-		l[i]->reset();
-		assert(!l[i]->eof());
-#ifndef NDEBUG
-		int c = l[i]->get();
-		assert_eq('>', c);
-		assert(!l[i]->eof());
-		l[i]->reset();
-		assert(!l[i]->eof());
-#endif
+			namei++;
+		}
+		assert(rec.first || rec.off > 0);
+		ref.copyTo(ret, dstoff, srcoff, rec.len, rev);
+		srcoff += rec.len;
+		// Increment seqsRead if this is the first fragment
+		if(rec.first && rec.len > 0) seqsRead++;
+		if(rec.len == 0) continue;
+		assert_leq(rec.len, this->plen()[seqsRead-1]);
+		ASSERT_ONLY(entsWritten++);
 	}
 	assert_eq(entsWritten, this->_nFrag);
 }
@@ -2885,6 +3159,12 @@ void Ebwt<index_t>::buildToDisk(
 	                               // array (as opposed to the padding at the
 	                               // end)
 	// Iterate over packed bwt bytes
+	if(_packedOcc) {
+		// Pad so that the blocks line up with cache lines once loaded
+		while((size_t)out1.tellp() % ebwt_block_align != 0) out1.put(0);
+	}
+	// EBWT_SA_PACKED samples go out through a bit accumulator
+	SaPackWriter saw(out2, _packedSa ? _saBits : 1);
 	VMSG_NL("Entering Ebwt loop");
 	ASSERT_ONLY(index_t beforeEbwtOff = (index_t)out1.tellp());
 	while(side < ebwtTotSz) {
@@ -2976,7 +3256,11 @@ void Ebwt<index_t>::buildToDisk(
                                     straddled2);  // straddled?
 					writeIndex<uint16_t>(out2, (uint16_t)tidx, this->toBe());
 #else
-                    writeIndex<index_t>(out2, saElt, this->toBe());
+					if(_packedSa) {
+						saw.put(saElt);
+					} else {
+						writeIndexStore<index_t>(out2, saElt, this->toBe(), _off40);
+					}
 #endif
 				}
 			} else {
@@ -3043,6 +3327,7 @@ void Ebwt<index_t>::buildToDisk(
 		}
 	}
 	VMSG_NL("Exited Ebwt loop");
+	if(_packedSa) saw.finish();
 	assert_neq(zOff, (index_t)OFF_MASK);
 	if(absorbCnt > 0) {
 		// Absorb any trailing, as-yet-unabsorbed short suffixes into
@@ -3122,11 +3407,11 @@ void Ebwt<index_t>::buildToDisk(
 	assert_eq(Ebwt<index_t>::ftabHi(ftab.ptr(), eftab.ptr(), len, ftabLen, eftabLen, ftabLen-1), len+1);
 	// Write ftab to primary file
 	for(index_t i = 0; i < ftabLen; i++) {
-		writeIndex<index_t>(out1, ftab[i], this->toBe());
+		writeIndexStore<index_t>(out1, ftab[i], this->toBe(), _off40);
 	}
 	// Write eftab to primary file
 	for(index_t i = 0; i < eftabLen; i++) {
-		writeIndex<index_t>(out1, eftab[i], this->toBe());
+		writeIndexStore<index_t>(out1, eftab[i], this->toBe(), _off40);
 	}
 
 	// Note: if you'd like to sanity-check the Ebwt, you'll have to
@@ -3286,7 +3571,7 @@ index_t Ebwt<index_t>::getOffset(index_t row) const {
 	assert(offs() != NULL);
 	assert_neq((index_t)OFF_MASK, row);
 	if(row == _zOff) return 0;
-	if((row & _eh._offMask) == row) return this->offs()[row >> _eh._offRate];
+	if((row & _eh._offMask) == row) return this->offAt(row >> _eh._offRate);
 	index_t jumps = 0;
 	SideLocus<index_t> l;
 	l.initFromRow(row, _eh, ebwt());
@@ -3299,7 +3584,7 @@ index_t Ebwt<index_t>::getOffset(index_t row) const {
 		if(row == _zOff) {
 			return jumps;
 		} else if((row & _eh._offMask) == row) {
-			return jumps + this->offs()[row >> _eh._offRate];
+			return jumps + this->offAt(row >> _eh._offRate);
 		}
 		l.initFromRow(row, _eh, ebwt());
 	}
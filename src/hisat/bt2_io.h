@@ -82,27 +82,21 @@ void Ebwt<index_t>::readIntoMemory(
 		if(_useMm /*&& !justHeader*/) {
 			const char *names[] = {_in1Str.c_str(), _in2Str.c_str()};
 			int fds[] = { fileno(_in1), fileno(_in2) };
+			IndexFileMap *maps[] = { &mmFile1_, &mmFile2_ };
+			// Mappings from an earlier read, e.g. of just the header,
+			// are replaced
+			unmapIndexFile(mmFile1_);
+			unmapIndexFile(mmFile2_);
 			for(int i = 0; i < (loadSASamp ? 2 : 1); i++) {
 				if(_verbose || startVerbose) {
 					cerr << "  Memory-mapping input file " << (i+1) << ": ";
 					logTime(cerr);
 				}
-				struct stat sbuf;
-				if (stat(names[i], &sbuf) == -1) {
-					perror("stat");
-					cerr << "Error: Could not stat index file " << names[i] << " prior to memory-mapping" << endl;
-					throw 1;
-				}
-				mmFile[i] = (char*)mmap((void *)0, (size_t)sbuf.st_size,
-										PROT_READ, MAP_SHARED, fds[(size_t)i], 0);
-				if(mmFile[i] == (void *)(-1)) {
-					perror("mmap");
-					cerr << "Error: Could not memory-map the index file " << names[i] << endl;
-					throw 1;
-				}
+				mmFile[i] = mapIndexFile(names[i], fds[(size_t)i], *maps[i], _shmIndex, _verbose || startVerbose);
+				size_t len = maps[i]->len;
 				if(mmSweep) {
 					int sum = 0;
-					for(off_t j = 0; j < sbuf.st_size; j += 1024) {
+					for(size_t j = 0; j < len; j += 1024) {
 						sum += (int) mmFile[i][j];
 					}
 					if(startVerbose) {
@@ -111,19 +105,17 @@ void Ebwt<index_t>::readIntoMemory(
 					}
 				}
 			}
-			mmFile1_ = mmFile[0];
-			mmFile2_ = loadSASamp ? mmFile[1] : NULL;
 		}
 #endif
 	}
 #ifdef BOWTIE_MM
 	else if(_useMm && !justHeader) {
-		mmFile[0] = mmFile1_;
-		mmFile[1] = mmFile2_;
+		mmFile[0] = mmFile1_.p;
+		mmFile[1] = mmFile2_.p;
 	}
 	if(_useMm && !justHeader) {
-		assert(mmFile[0] == mmFile1_);
-		assert(mmFile[1] == mmFile2_);
+		assert(mmFile[0] == mmFile1_.p);
+		assert(mmFile[1] == mmFile2_.p);
 	}
 #endif
 	
@@ -204,6 +196,9 @@ void Ebwt<index_t>::readIntoMemory(
 			throw 1;
 		}
 	} else entireRev = true;
+	bool packedOcc = (flags < 0 && (((-flags) & EBWT_OCC_PACKED) != 0));
+	bool packedSa = (flags < 0 && (((-flags) & EBWT_SA_PACKED) != 0));
+	bool off40 = (flags < 0 && (((-flags) & EBWT_OFF40) != 0));
 	bytesRead += 4;
 	
 	// Create a new EbwtParams from the entries read from primary stream
@@ -217,6 +212,59 @@ void Ebwt<index_t>::readIntoMemory(
 		eh = new EbwtParams<index_t>(len, lineRate, offRate, ftabChars, color, entireRev);
 		deleteEh = true;
 	}
+	if(packedOcc && (eh->_sideSz != ebwt_block_align || sizeof(index_t) != 4)) {
+		cerr << "Error: Index " << _in1Str.c_str() << " is marked as having 64-byte occurrence" << endl
+		     << "blocks, but its sides are " << eh->_sideSz << " bytes with " << (sizeof(index_t) * 8)
+		     << "-bit counts.  The index may be corrupt." << endl;
+		throw 1;
+	}
+	// The block counting routines assume a little-endian machine;
+	// elsewhere the blocks are counted like ordinary sides.
+	_packedOcc = packedOcc && !_toBigEndian;
+	if((_verbose || startVerbose) && packedOcc) {
+		cerr << "    occurrence counts: 64-byte blocks" << endl;
+	}
+	if(_verbose || startVerbose) {
+		cerr << "    occurrence counting kernel: " << occKernelName(_occKernel) << endl;
+	}
+#ifdef HISAT_CLASS
+	if(packedSa) {
+		cerr << "Error: Index " << _in1Str.c_str() << " has a bit-packed SA sample, which this" << endl
+		     << "build cannot read." << endl;
+		throw 1;
+	}
+#endif
+	if(off40 && sizeof(index_store_t) != sizeof(off40_t)) {
+		cerr << "Error: Index " << _in1Str.c_str() << " is marked as having 40-bit offsets, which" << endl
+		     << "only large indexes have.  The index may be corrupt." << endl;
+		throw 1;
+	}
+	// Loaded large indexes hold plen[], rstarts[], ftab[], eftab[] and
+	// offs[] as off40_t.  Files built without --off40 have full 64-bit
+	// words, which are narrowed one by one as they're read, or, when
+	// memory-mapped, read in place 8 bytes apart
+	const bool narrowOffs = (sizeof(index_store_t) != sizeof(index_t) && !off40);
+	const bool readOffsEach = narrowOffs || (switchEndian && !off40);
+	const size_t offSz = narrowOffs ? sizeof(index_t) : sizeof(index_store_t); // bytes per element in the file
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	if(narrowOffs && _useMm) {
+		cerr << "Error: Can't use memory-mapped files with a large index on a big-endian machine" << endl
+		     << "unless the index was built with --off40." << endl;
+		throw 1;
+	}
+#endif
+	_off40 = off40;
+	_offStride = _useMm ? offSz : sizeof(index_store_t);
+	_packedSa = packedSa;
+	_saBits = packedSa ? saPackBits(eh->_bwtLen) : 0;
+	if(_packedSa && _saBits > sa_pack_max_bits) {
+		cerr << "Error: Index " << _in1Str.c_str() << " has " << _saBits << "-bit packed SA samples;" << endl
+		     << "at most " << sa_pack_max_bits << " bits are supported." << endl;
+		throw 1;
+	}
+	if((_verbose || startVerbose) && _packedSa) {
+		cerr << "    SA sample: packed, " << _saBits << " bits per offset" << endl;
+	}
 	
 	// Set up overridden suffix-array-sample parameters
 	index_t offsLen = eh->_offsLen;
@@ -248,9 +296,9 @@ void Ebwt<index_t>::readIntoMemory(
 	// Read plen from primary stream
 	if(_useMm) {
 #ifdef BOWTIE_MM
-		_plen.init((index_t*)(mmFile[0] + bytesRead), _nPat, false);
-		bytesRead += _nPat*sizeof(index_t);
-		fseek(_in1, _nPat*sizeof(index_t), SEEK_CUR);
+		_plen.init((index_store_t*)(mmFile[0] + bytesRead), _nPat, false);
+		bytesRead += _nPat*offSz;
+		fseek(_in1, _nPat*offSz, SEEK_CUR);
 #endif
 	} else {
 		try {
@@ -258,15 +306,15 @@ void Ebwt<index_t>::readIntoMemory(
 				cerr << "Reading plen (" << this->_nPat << "): ";
 				logTime(cerr);
 			}
-			_plen.init(new index_t[_nPat], _nPat, true);
-			if(switchEndian) {
+			_plen.init(new index_store_t[_nPat], _nPat, true);
+			if(readOffsEach) {
 				for(index_t i = 0; i < this->_nPat; i++) {
-					plen()[i] = readIndex<index_t>(_in1, switchEndian);
+					_plen.get()[i] = readIndex<index_t>(_in1, switchEndian);
 				}
 			} else {
-				size_t r = MM_READ(_in1, (void*)(plen()), _nPat*sizeof(index_t));
-				if(r != (size_t)(_nPat*sizeof(index_t))) {
-					cerr << "Error reading _plen[] array: " << r << ", " << _nPat*sizeof(index_t) << endl;
+				size_t r = MM_READ(_in1, (void*)_plen.get(), _nPat*sizeof(index_store_t));
+				if(r != (size_t)(_nPat*sizeof(index_store_t))) {
+					cerr << "Error reading _plen[] array: " << r << ", " << _nPat*sizeof(index_store_t) << endl;
 					throw 1;
 				}
 			}
@@ -296,24 +344,24 @@ void Ebwt<index_t>::readIntoMemory(
 	if(loadRstarts) {
 		if(_useMm) {
 #ifdef BOWTIE_MM
-			_rstarts.init((index_t*)(mmFile[0] + bytesRead), _nFrag*3, false);
-			bytesRead += this->_nFrag*sizeof(index_t)*3;
-			fseek(_in1, this->_nFrag*sizeof(index_t)*3, SEEK_CUR);
+			_rstarts.init((index_store_t*)(mmFile[0] + bytesRead), _nFrag*3, false);
+			bytesRead += this->_nFrag*offSz*3;
+			fseek(_in1, this->_nFrag*offSz*3, SEEK_CUR);
 #endif
 		} else {
-			_rstarts.init(new index_t[_nFrag*3], _nFrag*3, true);
-			if(switchEndian) {
+			_rstarts.init(new index_store_t[_nFrag*3], _nFrag*3, true);
+			if(readOffsEach) {
 				for(size_t i = 0; i < (size_t)(this->_nFrag*3); i += 3) {
 					// fragment starting position in joined reference
 					// string, text id, and fragment offset within text
-					this->rstarts()[i]   = readIndex<index_t>(_in1, switchEndian);
-					this->rstarts()[i+1] = readIndex<index_t>(_in1, switchEndian);
-					this->rstarts()[i+2] = readIndex<index_t>(_in1, switchEndian);
+					_rstarts.get()[i]   = readIndex<index_t>(_in1, switchEndian);
+					_rstarts.get()[i+1] = readIndex<index_t>(_in1, switchEndian);
+					_rstarts.get()[i+2] = readIndex<index_t>(_in1, switchEndian);
 				}
 			} else {
-				size_t r = MM_READ(_in1, (void *)rstarts(), this->_nFrag*sizeof(index_t)*3);
-				if(r != (size_t)(this->_nFrag*sizeof(index_t)*3)) {
-					cerr << "Error reading _rstarts[] array: " << r << ", " << (this->_nFrag*sizeof(index_t)*3) << endl;
+				size_t r = MM_READ(_in1, (void *)_rstarts.get(), this->_nFrag*sizeof(index_store_t)*3);
+				if(r != (size_t)(this->_nFrag*sizeof(index_store_t)*3)) {
+					cerr << "Error reading _rstarts[] array: " << r << ", " << (this->_nFrag*sizeof(index_store_t)*3) << endl;
 					throw 1;
 				}
 			}
@@ -321,8 +369,15 @@ void Ebwt<index_t>::readIntoMemory(
 	} else {
 		// Skip em
 		assert(rstarts() == NULL);
-		bytesRead += this->_nFrag*sizeof(index_t)*3;
-		fseek(_in1, this->_nFrag*sizeof(index_t)*3, SEEK_CUR);
+		bytesRead += this->_nFrag*offSz*3;
+		fseek(_in1, this->_nFrag*offSz*3, SEEK_CUR);
+	}
+	
+	if(packedOcc) {
+		// Skip the padding that puts ebwt[] on a block boundary
+		size_t pad = (ebwt_block_align - (size_t)ftell(_in1) % ebwt_block_align) % ebwt_block_align;
+		bytesRead += pad;
+		fseek(_in1, pad, SEEK_CUR);
 	}
 	
 	_ebwt.reset();
@@ -351,7 +406,10 @@ void Ebwt<index_t>::readIntoMemory(
 			}
 		} else {
 			try {
-				_ebwt.init(new uint8_t[eh->_ebwtTotLen], eh->_ebwtTotLen, true);
+				bool freeable = true;
+				// Blocks must line up with cache lines
+				uint8_t *tmp = allocIndexArray<uint8_t>(_ebwtHuge, eh->_ebwtTotLen, freeable, packedOcc);
+				_ebwt.init(tmp, eh->_ebwtTotLen, freeable);
 			} catch(bad_alloc& e) {
 				cerr << "Out of memory allocating the ebwt[] array for the Bowtie index.  Please try" << endl
 				<< "again on a computer with more memory." << endl;
@@ -430,19 +488,21 @@ void Ebwt<index_t>::readIntoMemory(
 		if(loadFtab) {
 			if(_useMm) {
 #ifdef BOWTIE_MM
-				_ftab.init((index_t*)(mmFile[0] + bytesRead), eh->_ftabLen, false);
-				bytesRead += eh->_ftabLen*sizeof(index_t);
-				fseek(_in1, eh->_ftabLen*sizeof(index_t), SEEK_CUR);
+				_ftab.init((index_store_t*)(mmFile[0] + bytesRead), eh->_ftabLen, false);
+				bytesRead += eh->_ftabLen*offSz;
+				fseek(_in1, eh->_ftabLen*offSz, SEEK_CUR);
 #endif
 			} else {
-				_ftab.init(new index_t[eh->_ftabLen], eh->_ftabLen, true);
-				if(switchEndian) {
+				bool freeable = true;
+				index_store_t *tmp = allocIndexArray<index_store_t>(_ftabHuge, eh->_ftabLen, freeable);
+				_ftab.init(tmp, eh->_ftabLen, freeable);
+				if(readOffsEach) {
 					for(size_t i = 0; i < eh->_ftabLen; i++)
-						this->ftab()[i] = readIndex<index_t>(_in1, switchEndian);
+						_ftab.get()[i] = readIndex<index_t>(_in1, switchEndian);
 				} else {
-					size_t r = MM_READ(_in1, (void *)ftab(), eh->_ftabLen*sizeof(index_t));
-					if(r != (size_t)(eh->_ftabLen*sizeof(index_t))) {
-						cerr << "Error reading _ftab[] array: " << r << ", " << (eh->_ftabLen*sizeof(index_t)) << endl;
+					size_t r = MM_READ(_in1, (void *)_ftab.get(), eh->_ftabLen*sizeof(index_store_t));
+					if(r != (size_t)(eh->_ftabLen*sizeof(index_store_t))) {
+						cerr << "Error reading _ftab[] array: " << r << ", " << (eh->_ftabLen*sizeof(index_store_t)) << endl;
 						throw 1;
 					}
 				}
@@ -460,19 +520,19 @@ void Ebwt<index_t>::readIntoMemory(
 			_eftab.reset();
 			if(_useMm) {
 #ifdef BOWTIE_MM
-				_eftab.init((index_t*)(mmFile[0] + bytesRead), eh->_eftabLen, false);
-				bytesRead += eh->_eftabLen*sizeof(index_t);
-				fseek(_in1, eh->_eftabLen*sizeof(index_t), SEEK_CUR);
+				_eftab.init((index_store_t*)(mmFile[0] + bytesRead), eh->_eftabLen, false);
+				bytesRead += eh->_eftabLen*offSz;
+				fseek(_in1, eh->_eftabLen*offSz, SEEK_CUR);
 #endif
 			} else {
-				_eftab.init(new index_t[eh->_eftabLen], eh->_eftabLen, true);
-				if(switchEndian) {
+				_eftab.init(new index_store_t[eh->_eftabLen], eh->_eftabLen, true);
+				if(readOffsEach) {
 					for(size_t i = 0; i < eh->_eftabLen; i++)
-						this->eftab()[i] = readIndex<index_t>(_in1, switchEndian);
+						_eftab.get()[i] = readIndex<index_t>(_in1, switchEndian);
 				} else {
-					size_t r = MM_READ(_in1, (void *)this->eftab(), eh->_eftabLen*sizeof(index_t));
-					if(r != (size_t)(eh->_eftabLen*sizeof(index_t))) {
-						cerr << "Error reading _eftab[] array: " << r << ", " << (eh->_eftabLen*sizeof(index_t)) << endl;
+					size_t r = MM_READ(_in1, (void *)_eftab.get(), eh->_eftabLen*sizeof(index_store_t));
+					if(r != (size_t)(eh->_eftabLen*sizeof(index_store_t))) {
+						cerr << "Error reading _eftab[] array: " << r << ", " << (eh->_eftabLen*sizeof(index_store_t)) << endl;
 						throw 1;
 					}
 				}
@@ -488,11 +548,11 @@ void Ebwt<index_t>::readIntoMemory(
 			assert(ftab() == NULL);
 			assert(eftab() == NULL);
 			// Skip ftab
-			bytesRead += eh->_ftabLen*sizeof(index_t);
-			fseek(_in1, eh->_ftabLen*sizeof(index_t), SEEK_CUR);
+			bytesRead += eh->_ftabLen*offSz;
+			fseek(_in1, eh->_ftabLen*offSz, SEEK_CUR);
 			// Skip eftab
-			bytesRead += eh->_eftabLen*sizeof(index_t);
-			fseek(_in1, eh->_eftabLen*sizeof(index_t), SEEK_CUR);
+			bytesRead += eh->_eftabLen*offSz;
+			fseek(_in1, eh->_eftabLen*offSz, SEEK_CUR);
 		}
 	} catch(bad_alloc& e) {
 		cerr << "Out of memory allocating fchr[], ftab[] or eftab[] arrays for the Bowtie index." << endl
@@ -520,12 +580,114 @@ void Ebwt<index_t>::readIntoMemory(
 	}
 	
 	_offs.reset();
-	if(loadSASamp) {
+	if(loadSASamp && _packedSa) {
+		bytesRead = 4; // reset for secondary index file (already read 1-sentinel)
+		
+		// Size of the bit stream in the file and once resampled to the
+		// overriding offrate; _offs still counts whole elements
+		const uint64_t offsBytes = saPackBytes(offsLen, _saBits);
+		const uint64_t offsBytesSampled = saPackBytes(offsLenSampled, _saBits);
+		const index_t offsWords = (index_t)((offsBytesSampled + sizeof(index_store_t) - 1) / sizeof(index_store_t));
+		shmemLeader = true;
+		if(_verbose || startVerbose) {
+			cerr << "Reading offs (" << offsLenSampled << " packed " << _saBits << "-bit words): ";
+			logTime(cerr);
+		}
+		
+		if(!_useMm) {
+			if(!useShmem_) {
+				try {
+					bool freeable = true;
+					index_store_t *tmp = allocIndexArray<index_store_t>(_offsHuge, offsWords, freeable);
+					_offs.init(tmp, offsWords, freeable);
+				} catch(bad_alloc& e) {
+					cerr << "Out of memory allocating the offs[] array  for the Bowtie index." << endl
+					<< "Please try again on a computer with more memory." << endl;
+					throw 1;
+				}
+			} else {
+				index_store_t *tmp = NULL;
+				shmemLeader = ALLOC_SHARED_U32(
+					(_in2Str + "[offs]"), offsWords*sizeof(index_store_t), &tmp,
+					"offs", (_verbose || startVerbose));
+				_offs.init(tmp, offsWords, false);
+			}
+		}
+		
+		if(_overrideOffRate < 32) {
+			if(shmemLeader) {
+				if(offRateDiff > 0) {
+					assert(!_useMm);
+					// Keep every (1 << offRateDiff)th sample, repacking it
+					// into the smaller stream.  Blocks hold a multiple of
+					// 8 samples, so each one starts on a byte boundary.
+					const index_t blockMaxSzU = (index_t)((2 * 1024 * 1024 / _saBits) << 3); // # samples per block
+					const size_t blockMaxSz = (size_t)blockMaxSzU * _saBits / 8;
+					uint8_t *buf;
+					try {
+						buf = new uint8_t[blockMaxSz + 8];
+					} catch(std::bad_alloc& e) {
+						cerr << "Error: Out of memory allocating part of _offs array: '" << e.what() << "'" << endl;
+						throw e;
+					}
+					memset(buf, 0, blockMaxSz + 8);
+					uint8_t *offs = (uint8_t *)_offs.get();
+					memset(offs, 0, offsWords * sizeof(index_store_t));
+					const index_t sampMask = ((index_t)1 << offRateDiff) - 1;
+					for(index_t i = 0; i < offsLen; i += blockMaxSzU) {
+						index_t block = min<index_t>(blockMaxSzU, (index_t)(offsLen - i));
+						size_t blockSz = ((size_t)block * _saBits + 7) >> 3;
+						size_t r = MM_READ(_in2, (void *)buf, blockSz);
+						if(r != blockSz) {
+							cerr << "Error reading block of _offs[] array: " << r << ", " << blockSz << endl;
+							throw 1;
+						}
+						for(index_t j = (index_t)((-i) & sampMask); j < block; j += ((index_t)1 << offRateDiff)) {
+							assert_lt(((i + j) >> offRateDiff), offsLenSampled);
+							saPackSet(offs, (i + j) >> offRateDiff, _saBits, saPackGet(buf, j, _saBits));
+						}
+					}
+					delete[] buf;
+					fseek(_in2, 8, SEEK_CUR); // padding
+				} else {
+					if(_useMm) {
+#ifdef BOWTIE_MM
+						_offs.init((index_store_t*)(mmFile[1] + bytesRead), offsWords, false);
+						bytesRead += offsBytes;
+						fseek(_in2, offsBytes, SEEK_CUR);
+#endif
+					} else {
+						uint64_t bytesLeft = offsBytes;
+						char *offs = (char *)_offs.get();
+						while(bytesLeft > 0) {
+							size_t r = MM_READ(_in2, (void*)offs, bytesLeft);
+							if(MM_IS_IO_ERR(_in2,r,bytesLeft)) {
+								cerr << "Error reading block of _offs[] array: "
+								<< r << ", " << bytesLeft << gLastIOErrMsg << endl;
+								throw 1;
+							}
+							offs += r;
+							bytesLeft -= r;
+						}
+					}
+				}
+#ifdef BOWTIE_SHARED_MEM
+				if(useShmem_) NOTIFY_SHARED(_offs.get(), offsWords*sizeof(index_store_t));
+#endif
+			} else {
+				// Not the shmem leader
+				fseek(_in2, offsBytes, SEEK_CUR);
+#ifdef BOWTIE_SHARED_MEM
+				if(useShmem_) WAIT_SHARED(_offs.get(), offsWords*sizeof(index_store_t));
+#endif
+			}
+		}
+	} else if(loadSASamp) {
 		bytesRead = 4; // reset for secondary index file (already read 1-sentinel)
 		
 		shmemLeader = true;
 		if(_verbose || startVerbose) {
-			cerr << "Reading offs (" << offsLenSampled << " " << std::setw(2) << sizeof(index_t)*8 << "-bit words): ";
+			cerr << "Reading offs (" << offsLenSampled << " " << std::setw(2) << offSz*8 << "-bit words): ";
 			logTime(cerr);
 		}
 		
@@ -533,11 +695,13 @@ void Ebwt<index_t>::readIntoMemory(
 			if(!useShmem_) {
 				// Allocate offs_
 				try {
+					bool freeable = true;
 #ifdef HISAT_CLASS
-					_offs.init(new uint16_t[offsLenSampled], offsLenSampled, true);
+					uint16_t *tmp = allocIndexArray<uint16_t>(_offsHuge, offsLenSampled, freeable);
 #else
-                    _offs.init(new index_t[offsLenSampled], offsLenSampled, true);
+					index_store_t *tmp = allocIndexArray<index_store_t>(_offsHuge, offsLenSampled, freeable);
 #endif
+					_offs.init(tmp, offsLenSampled, freeable);
 				} catch(bad_alloc& e) {
 					cerr << "Out of memory allocating the offs[] array  for the Bowtie index." << endl
 					<< "Please try again on a computer with more memory." << endl;
@@ -551,11 +715,11 @@ void Ebwt<index_t>::readIntoMemory(
 					"offs", (_verbose || startVerbose));
 				_offs.init((uint16_t*)tmp, offsLenSampled, false);
 #else
-                index_t *tmp = NULL;
+                index_store_t *tmp = NULL;
 				shmemLeader = ALLOC_SHARED_U32(
-                                               (_in2Str + "[offs]"), offsLenSampled*sizeof(index_t), &tmp,
+                                               (_in2Str + "[offs]"), offsLenSampled*sizeof(index_store_t), &tmp,
                                                "offs", (_verbose || startVerbose));
-				_offs.init((index_t*)tmp, offsLenSampled, false);
+				_offs.init((index_store_t*)tmp, offsLenSampled, false);
 #endif
 			}
 		}
@@ -563,13 +727,13 @@ void Ebwt<index_t>::readIntoMemory(
 		if(_overrideOffRate < 32) {
 			if(shmemLeader) {
 				// Allocate offs (big allocation)
-				if(switchEndian || offRateDiff > 0) {
+				if((readOffsEach && !_useMm) || offRateDiff > 0) {
 					assert(!_useMm);
 					const index_t blockMaxSz = (index_t)(2 * 1024 * 1024); // 2 MB block size
 #ifdef HISAT_CLASS
 					const index_t blockMaxSzU = (blockMaxSz / sizeof(uint16_t)); // # U32s per block
 #else
-                    const index_t blockMaxSzU = (blockMaxSz / sizeof(index_t)); // # U32s per block
+                    const index_t blockMaxSzU = (blockMaxSz / offSz); // # U32s per block
 #endif
 					char *buf;
 					try {
@@ -596,17 +760,19 @@ void Ebwt<index_t>::readIntoMemory(
 							idx++;
 						}
 #else
-                        size_t r = MM_READ(_in2, (void *)buf, block * sizeof(index_t));
-                        if(r != (size_t)(block * sizeof(index_t))) {
-							cerr << "Error reading block of _offs[] array: " << r << ", " << (block * sizeof(index_t)) << endl;
+                        size_t r = MM_READ(_in2, (void *)buf, block * offSz);
+                        if(r != (size_t)(block * offSz)) {
+							cerr << "Error reading block of _offs[] array: " << r << ", " << (block * offSz) << endl;
 							throw 1;
 						}
                         index_t idx = i >> offRateDiff;
 						for(index_t j = 0; j < block; j += (1 << offRateDiff)) {
 							assert_lt(idx, offsLenSampled);
-							this->offs()[idx] = ((index_t*)buf)[j];
-							if(switchEndian) {
-								this->offs()[idx] = endianSwapIndex(this->offs()[idx]);
+							if(offSz == sizeof(index_t)) {
+								index_t off = ((index_t*)buf)[j];
+								_offs.get()[idx] = (switchEndian ? endianSwapIndex(off) : off);
+							} else {
+								_offs.get()[idx] = ((index_store_t*)buf)[j];
 							}
 							idx++;
 						}
@@ -618,9 +784,9 @@ void Ebwt<index_t>::readIntoMemory(
 #ifdef BOWTIE_MM
 #  ifdef HISAT_CLASS
 #  else
-						_offs.init((index_t*)(mmFile[1] + bytesRead), offsLen, false);
-						bytesRead += (offsLen * sizeof(index_t));
-						fseek(_in2, (offsLen * sizeof(index_t)), SEEK_CUR);
+						_offs.init((index_store_t*)(mmFile[1] + bytesRead), offsLen, false);
+						bytesRead += (offsLen * offSz);
+						fseek(_in2, (offsLen * offSz), SEEK_CUR);
 #  endif
 #endif
 					} else {
@@ -630,9 +796,9 @@ void Ebwt<index_t>::readIntoMemory(
 #ifdef HISAT_CLASS
                         uint64_t bytesLeft = (offsLen * sizeof(uint16_t));
 #else
-                        uint64_t bytesLeft = (offsLen * sizeof(index_t));
+                        uint64_t bytesLeft = (offsLen * sizeof(index_store_t));
 #endif
-                        char *offs = (char *)this->offs();
+                        char *offs = (char *)_offs.get();
                         
                         while(bytesLeft > 0) {
                             size_t r = MM_READ(_in2, (void*)offs, bytesLeft);
@@ -647,13 +813,13 @@ void Ebwt<index_t>::readIntoMemory(
 					}
 				}
 #ifdef BOWTIE_SHARED_MEM				
-				if(useShmem_) NOTIFY_SHARED(offs(), offsLenSampled*sizeof(index_t));
+				if(useShmem_) NOTIFY_SHARED(_offs.get(), offsLenSampled*sizeof(index_store_t));
 #endif
 			} else {
 				// Not the shmem leader
-				fseek(_in2, offsLenSampled*sizeof(index_t), SEEK_CUR);
+				fseek(_in2, offsLen*offSz, SEEK_CUR);
 #ifdef BOWTIE_SHARED_MEM				
-				if(useShmem_) WAIT_SHARED(offs(), offsLenSampled*sizeof(index_t));
+				if(useShmem_) WAIT_SHARED(_offs.get(), offsLenSampled*sizeof(index_store_t));
 #endif
 			}
 		}
@@ -708,20 +874,32 @@ void readEbwtRefnames(istream& in, EList<string>& refnames) {
 	int32_t flags = readI32(in, switchEndian);
 	bool color = false;
 	bool entireReverse = false;
+	bool packedOcc = false;
+	bool off40 = false;
 	if(flags < 0) {
 		color = (((-flags) & EBWT_COLOR) != 0);
 		entireReverse = (((-flags) & EBWT_ENTIRE_REV) != 0);
+		packedOcc = (((-flags) & EBWT_OCC_PACKED) != 0);
+		off40 = (((-flags) & EBWT_OFF40) != 0);
 	}
+	// Bytes per element of plen, rstarts, ftab and eftab
+	const size_t offSz = off40 ? sizeof(off40_t) : sizeof(index_t);
 	
 	// Create a new EbwtParams from the entries read from primary stream
 	EbwtParams<index_t> eh(len, lineRate, offRate, ftabChars, color, entireReverse);
 	
 	index_t nPat = readIndex<index_t>(in, switchEndian); // nPat
-	in.seekg(nPat*sizeof(index_t), ios_base::cur); // skip plen
+	in.seekg(nPat*offSz, ios_base::cur); // skip plen
 	
 	// Skip rstarts
 	index_t nFrag = readIndex<index_t>(in, switchEndian);
-	in.seekg(nFrag*sizeof(index_t)*3, ios_base::cur);
+	in.seekg(nFrag*offSz*3, ios_base::cur);
+	
+	// Skip padding before ebwt
+	if(packedOcc) {
+		size_t pad = (ebwt_block_align - (size_t)in.tellg() % ebwt_block_align) % ebwt_block_align;
+		in.seekg(pad, ios_base::cur);
+	}
 	
 	// Skip ebwt
 	in.seekg(eh._ebwtTotLen, ios_base::cur);
@@ -733,10 +911,10 @@ void readEbwtRefnames(istream& in, EList<string>& refnames) {
 	in.seekg(5 * sizeof(index_t), ios_base::cur);
 	
 	// Skip ftab
-	in.seekg(eh._ftabLen*sizeof(index_t), ios_base::cur);
+	in.seekg(eh._ftabLen*offSz, ios_base::cur);
 	
 	// Skip eftab
-	in.seekg(eh._eftabLen*sizeof(index_t), ios_base::cur);
+	in.seekg(eh._eftabLen*offSz, ios_base::cur);
 	
 	// Read reference sequence names from primary index file
 	while(true) {
@@ -869,6 +1047,9 @@ void Ebwt<index_t>::writeFromMemory(bool justHeader,
 	int32_t flags = 1;
 	if(eh._color) flags |= EBWT_COLOR;
 	if(eh._entireReverse) flags |= EBWT_ENTIRE_REV;
+	if(_packedOcc) flags |= EBWT_OCC_PACKED;
+	if(_packedSa) flags |= EBWT_SA_PACKED;
+	if(_off40 && sizeof(index_store_t) != sizeof(index_t)) flags |= EBWT_OFF40;
 	writeI32(out1, -flags, be); // BTL: chunkRate is now deprecated
 	
 	if(!justHeader) {
@@ -882,11 +1063,14 @@ void Ebwt<index_t>::writeFromMemory(bool justHeader,
 		// written to the disk next and then discarded from memory.
 		writeIndex<index_t>(out1, this->_nPat,      be);
 		for(index_t i = 0; i < this->_nPat; i++)
-			writeIndex<index_t>(out1, this->plen()[i], be);
+			writeIndexStore<index_t>(out1, this->plen()[i], be, _off40);
 		assert_geq(this->_nFrag, this->_nPat);
 		writeIndex<index_t>(out1, this->_nFrag, be);
 		for(size_t i = 0; i < this->_nFrag*3; i++)
-			writeIndex<index_t>(out1, this->rstarts()[i], be);
+			writeIndexStore<index_t>(out1, this->rstarts()[i], be, _off40);
+		if(_packedOcc) {
+			while((size_t)out1.tellp() % ebwt_block_align != 0) out1.put(0);
+		}
 		
 		// These Ebwt parameters are discovered only as the Ebwt is being
 		// built (in buildToDisk()).  Of these, only 'offs' and 'ebwt' are
@@ -896,8 +1080,12 @@ void Ebwt<index_t>::writeFromMemory(bool justHeader,
 		out1.write((const char *)this->ebwt(), eh._ebwtTotLen);
 		writeIndex<index_t>(out1, this->zOff(), be);
 		index_t offsLen = eh._offsLen;
-		for(index_t i = 0; i < offsLen; i++)
-			writeIndex<index_t>(out2, this->offs()[i], be);
+		if(_packedSa) {
+			out2.write((const char *)_offs.get(), saPackBytes(offsLen, _saBits));
+		} else {
+			for(index_t i = 0; i < offsLen; i++)
+				writeIndexStore<index_t>(out2, this->offs()[i], be, _off40);
+		}
 		
 		// 'fchr', 'ftab' and 'eftab' are not fully determined until the
 		// loop is finished, so they are written to the primary file after
@@ -906,9 +1094,9 @@ void Ebwt<index_t>::writeFromMemory(bool justHeader,
 		for(int i = 0; i < 5; i++)
 			writeIndex<index_t>(out1, this->fchr()[i], be);
 		for(index_t i = 0; i < eh._ftabLen; i++)
-			writeIndex<index_t>(out1, this->ftab()[i], be);
+			writeIndexStore<index_t>(out1, this->ftab()[i], be, _off40);
 		for(index_t i = 0; i < eh._eftabLen; i++)
-			writeIndex<index_t>(out1, this->eftab()[i], be);
+			writeIndexStore<index_t>(out1, this->eftab()[i], be, _off40);
 	}
 }
 
@@ -967,7 +1155,7 @@ void Ebwt<index_t>::writeFromMemory(bool justHeader,
 		for(size_t i = 0; i < eh._eftabLen; i++)
 			assert_eq(this->eftab()[i], copy.eftab()[i]);
 		for(index_t i = 0; i < eh._offsLen; i++)
-			assert_eq(this->_offs[i], copy.offs()[i]);
+			assert_eq(this->offAt(i), copy.offAt(i));
 		for(index_t i = 0; i < eh._ebwtTotLen; i++)
 			assert_eq(this->ebwt()[i], copy.ebwt()[i]);
 		copy.sanityCheckAll();
@@ -1006,9 +1194,9 @@ void Ebwt<index_t>::szsToDisk(const EList<RefRecord>& szs, ostream& os, int reve
 			assert_leq(off + szs[i].len, plen()[seqm1]);
 			fwoff = plen()[seqm1] - (off + szs[i].len);
 		}
-		writeIndex<index_t>(os, totlen, this->toBe()); // offset from beginning of joined string
-		writeIndex<index_t>(os, (index_t)seqm1,  this->toBe()); // sequence id
-		writeIndex<index_t>(os, (index_t)fwoff,  this->toBe()); // offset into sequence
+		writeIndexStore<index_t>(os, totlen, this->toBe(), _off40); // offset from beginning of joined string
+		writeIndexStore<index_t>(os, (index_t)seqm1,  this->toBe(), _off40); // sequence id
+		writeIndexStore<index_t>(os, (index_t)fwoff,  this->toBe(), _off40); // offset into sequence
         
 #ifdef HISAT_CLASS
         this->rstarts()[i*3]   = totlen;
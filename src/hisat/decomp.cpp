@@ -0,0 +1,457 @@
+/*
+ * Copyright 2015, Daehwan Kim <infphilo@gmail.com>
+ *
+ * This file is part of HISAT.
+ *
+ * HISAT is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * HISAT is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with HISAT.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <iostream>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#ifndef _WIN32
+#include <poll.h>
+#endif
+#include <zlib.h>
+#include <bzlib.h>
+#ifdef WITH_ZSTD
+#include <zstd.h>
+#endif
+#include "decomp.h"
+#include "assert_helpers.h"
+
+using namespace std;
+
+int sniffCompression(const char *magic, size_t len) {
+	const unsigned char *m = (const unsigned char *)magic;
+	if(len >= 2 && m[0] == 0x1f && m[1] == 0x8b) {
+		return COMPRESS_GZIP;
+	}
+	if(len >= 3 && m[0] == 'B' && m[1] == 'Z' && m[2] == 'h') {
+		return COMPRESS_BZIP2;
+	}
+	if(len >= 4 && m[0] == 0x28 && m[1] == 0xb5 && m[2] == 0x2f && m[3] == 0xfd) {
+		return COMPRESS_ZSTD;
+	}
+	return COMPRESS_NONE;
+}
+
+const char *compressionName(int fmt) {
+	switch(fmt) {
+		case COMPRESS_GZIP:  return "gzip";
+		case COMPRESS_BZIP2: return "bzip2";
+		case COMPRESS_ZSTD:  return "zstd";
+		default:             return "uncompressed";
+	}
+}
+
+size_t readMagic(FILE *in, char *magic) {
+	int fd = fileno(in);
+	size_t n = 0;
+	while(n < COMPRESS_MAGIC_LEN) {
+		ssize_t r = ::read(fd, magic + n, COMPRESS_MAGIC_LEN - n);
+		if(r < 0 && errno == EINTR) continue;
+		if(r <= 0) break;
+		n += (size_t)r;
+	}
+	return n;
+}
+
+Decompressor::Decompressor(
+	FILE *in,
+	int fmt,
+	const char *prefix,
+	size_t len,
+	const string& name) :
+	in_(in),
+	fmt_(fmt),
+	name_(name),
+	prefix_(magic_),
+	prefixLen_(len),
+	head_(0),
+	tail_(0),
+	nfull_(0),
+	headOff_(0),
+	finished_(false),
+	stop_(false),
+	err_(NULL)
+{
+	assert(in_ != NULL);
+	assert_leq(len, COMPRESS_MAGIC_LEN);
+	memcpy(magic_, prefix, len);
+	inbuf_ = new char[IN_SZ];
+	for(size_t i = 0; i < NSLOTS; i++) {
+		slots_[i] = new char[SLOT_SZ];
+		slotLen_[i] = 0;
+	}
+#ifndef _WIN32
+	if(pipe(wake_) != 0) {
+		cerr << "Error: could not create a pipe for decompressing \"" << name_ << "\"" << endl;
+		throw 1;
+	}
+#endif
+	thread_ = new tthread::thread(decodeWorker, (void *)this);
+}
+
+Decompressor::~Decompressor() {
+	mutex_.lock();
+	stop_ = true;
+	notFull_.notify_all();
+	mutex_.unlock();
+#ifndef _WIN32
+	// The decoder may be waiting for input that never comes, e.g. on
+	// a pipe that stays open until we exit
+	char c = 0;
+	while(write(wake_[1], &c, 1) < 0 && errno == EINTR) { }
+#endif
+	thread_->join();
+	delete thread_;
+#ifndef _WIN32
+	close(wake_[0]);
+	close(wake_[1]);
+#endif
+	if(in_ != stdin) fclose(in_);
+	delete[] inbuf_;
+	for(size_t i = 0; i < NSLOTS; i++) {
+		delete[] slots_[i];
+	}
+}
+
+size_t Decompressor::read(void *buf, size_t len) {
+	char *dst = (char *)buf;
+	size_t done = 0;
+	mutex_.lock();
+	while(done < len) {
+		while(nfull_ == 0 && !finished_) {
+			notEmpty_.wait(mutex_);
+		}
+		if(nfull_ == 0) {
+			// Decoder is finished and everything has been handed out
+			if(err_ != NULL) {
+				mutex_.unlock();
+				cerr << "Error: could not decompress " << compressionName(fmt_)
+				     << " file \"" << name_ << "\": " << err_ << endl;
+				throw 1;
+			}
+			break;
+		}
+		// The decoder doesn't touch slots counted in nfull_, so we
+		// can copy out of this one without holding the lock
+		size_t cur = head_;
+		size_t n = min(slotLen_[cur] - headOff_, len - done);
+		mutex_.unlock();
+		memcpy(dst + done, slots_[cur] + headOff_, n);
+		done += n;
+		mutex_.lock();
+		headOff_ += n;
+		if(headOff_ == slotLen_[cur]) {
+			head_ = (head_ + 1) % NSLOTS;
+			headOff_ = 0;
+			nfull_--;
+			notFull_.notify_one();
+		}
+	}
+	mutex_.unlock();
+	return done;
+}
+
+void Decompressor::decodeWorker(void *vp) {
+	((Decompressor *)vp)->decode();
+}
+
+void Decompressor::decode() {
+	const char *err = NULL;
+	switch(fmt_) {
+		case COMPRESS_GZIP:  err = decodeGzip();  break;
+		case COMPRESS_BZIP2: err = decodeBzip2(); break;
+		case COMPRESS_ZSTD:  err = decodeZstd();  break;
+		default: assert(false); err = "unknown compression format";
+	}
+	mutex_.lock();
+	err_ = err;
+	finished_ = true;
+	notEmpty_.notify_all();
+	mutex_.unlock();
+}
+
+size_t Decompressor::fillIn(size_t off) {
+	assert_lt(off, IN_SZ);
+	if(prefixLen_ > 0) {
+		assert_eq(0, off);
+		memcpy(inbuf_, prefix_, prefixLen_);
+		size_t n = prefixLen_;
+		prefixLen_ = 0;
+		return n;
+	}
+#ifdef _WIN32
+	// Windows has no poll() for files and pipes, so the decoder can't
+	// be woken early; it reads until the input ends
+	while(true) {
+		int r = ::read(fileno(in_), inbuf_ + off, (unsigned int)(IN_SZ - off));
+		if(r < 0 && errno == EINTR) continue;
+		return r < 0 ? 0 : (size_t)r;
+	}
+#else
+	struct pollfd fds[2];
+	fds[0].fd = fileno(in_);
+	fds[1].fd = wake_[0];
+	while(true) {
+		fds[0].events = fds[1].events = POLLIN;
+		fds[0].revents = fds[1].revents = 0;
+		if(poll(fds, 2, -1) < 0) {
+			if(errno == EINTR) continue;
+			return 0;
+		}
+		if(fds[1].revents != 0) return 0; // destructor wants us to stop
+		ssize_t r = ::read(fds[0].fd, inbuf_ + off, IN_SZ - off);
+		if(r < 0 && errno == EINTR) continue;
+		return r < 0 ? 0 : (size_t)r;
+	}
+#endif
+}
+
+bool Decompressor::streamFollows(
+	char *&next,
+	size_t& avail,
+	const char *magic,
+	size_t mlen)
+{
+	if(avail < mlen) {
+		if(avail > 0) memmove(inbuf_, next, avail);
+		next = inbuf_;
+		size_t n;
+		while(avail < mlen && (n = fillIn(avail)) > 0) {
+			avail += n;
+		}
+	}
+	if(avail == 0) return false;
+	if(avail >= mlen && memcmp(next, magic, mlen) == 0) return true;
+	// Like gzip -d and bzip2 -d: zeros are padding, anything else is
+	// garbage, but neither spoils the streams before it
+	while(avail > 0) {
+		for(size_t i = 0; i < avail; i++) {
+			if(next[i] != 0) {
+				cerr << "Warning: ignoring trailing garbage after the "
+				     << compressionName(fmt_) << " data in \"" << name_ << "\"" << endl;
+				return false;
+			}
+		}
+		next = inbuf_;
+		avail = fillIn();
+	}
+	return false;
+}
+
+char *Decompressor::acquireFree() {
+	mutex_.lock();
+	while(nfull_ == NSLOTS && !stop_) {
+		notFull_.wait(mutex_);
+	}
+	char *slot = stop_ ? NULL : slots_[tail_];
+	mutex_.unlock();
+	return slot;
+}
+
+void Decompressor::publish(size_t len) {
+	mutex_.lock();
+	slotLen_[tail_] = len;
+	tail_ = (tail_ + 1) % NSLOTS;
+	nfull_++;
+	notEmpty_.notify_one();
+	mutex_.unlock();
+}
+
+/**
+ * The decoders below share a shape: keep one ring slot as the output
+ * buffer, refill the compressed input whenever it runs dry, and
+ * publish the slot each time it fills.  After a full slot, the decoder
+ * is called again before reading more input, since it may still be
+ * holding decoded bytes.  At the end of each stream the decoder is
+ * reset so that concatenated streams are decoded as one, provided
+ * streamFollows() finds another stream there.
+ */
+
+const char *Decompressor::decodeGzip() {
+	z_stream zs;
+	memset(&zs, 0, sizeof(zs));
+	// 15 + 32: maximum window size, and expect a gzip (or zlib) header
+	if(inflateInit2(&zs, 15 + 32) != Z_OK) {
+		return "could not initialize zlib";
+	}
+	char *out = acquireFree();
+	if(out == NULL) { inflateEnd(&zs); return NULL; }
+	zs.next_out = (Bytef *)out;
+	zs.avail_out = SLOT_SZ;
+	bool midStream = false, outFull = false, between = false;
+	const char *err = NULL;
+	while(true) {
+		if(between) {
+			// A finished stream leaves no output pending
+			char *next = (char *)zs.next_in;
+			size_t avail = zs.avail_in;
+			if(!streamFollows(next, avail, "\x1f\x8b", 2)) break;
+			zs.next_in = (Bytef *)next;
+			zs.avail_in = (uInt)avail;
+			between = false;
+		}
+		if(zs.avail_in == 0 && !outFull) {
+			size_t n = fillIn();
+			if(n == 0) break;
+			zs.next_in = (Bytef *)inbuf_;
+			zs.avail_in = (uInt)n;
+		}
+		int ret = inflate(&zs, Z_NO_FLUSH);
+		if(ret == Z_STREAM_END) {
+			inflateReset(&zs);
+			midStream = false;
+			between = true;
+		} else if(ret == Z_OK) {
+			midStream = true;
+		} else if(ret != Z_BUF_ERROR) {
+			err = (ret == Z_MEM_ERROR) ? "out of memory" : "invalid or corrupt data";
+			break;
+		}
+		outFull = (zs.avail_out == 0);
+		if(outFull) {
+			publish(SLOT_SZ);
+			if((out = acquireFree()) == NULL) break;
+			zs.next_out = (Bytef *)out;
+			zs.avail_out = SLOT_SZ;
+		}
+	}
+	if(err == NULL && out != NULL) {
+		if(zs.avail_out < SLOT_SZ) publish(SLOT_SZ - zs.avail_out);
+		if(midStream) err = "unexpected end of file";
+	}
+	inflateEnd(&zs);
+	return err;
+}
+
+const char *Decompressor::decodeBzip2() {
+	bz_stream bs;
+	memset(&bs, 0, sizeof(bs));
+	if(BZ2_bzDecompressInit(&bs, 0, 0) != BZ_OK) {
+		return "could not initialize bzip2";
+	}
+	char *out = acquireFree();
+	if(out == NULL) { BZ2_bzDecompressEnd(&bs); return NULL; }
+	bs.next_out = out;
+	bs.avail_out = SLOT_SZ;
+	bool midStream = false, outFull = false, between = false;
+	const char *err = NULL;
+	while(true) {
+		if(between) {
+			size_t avail = bs.avail_in;
+			if(!streamFollows(bs.next_in, avail, "BZh", 3)) break;
+			bs.avail_in = (unsigned int)avail;
+			between = false;
+		}
+		if(bs.avail_in == 0 && !outFull) {
+			size_t n = fillIn();
+			if(n == 0) break;
+			bs.next_in = inbuf_;
+			bs.avail_in = (unsigned int)n;
+		}
+		unsigned int avail_in_before = bs.avail_in;
+		unsigned int avail_out_before = bs.avail_out;
+		int ret = BZ2_bzDecompress(&bs);
+		if(ret == BZ_STREAM_END) {
+			// Start over on the next stream, keeping unconsumed input
+			char *next_in = bs.next_in;
+			unsigned int avail_in = bs.avail_in;
+			char *next_out = bs.next_out;
+			unsigned int avail_out = bs.avail_out;
+			BZ2_bzDecompressEnd(&bs);
+			memset(&bs, 0, sizeof(bs));
+			if(BZ2_bzDecompressInit(&bs, 0, 0) != BZ_OK) {
+				err = "could not initialize bzip2";
+				break;
+			}
+			bs.next_in = next_in;
+			bs.avail_in = avail_in;
+			bs.next_out = next_out;
+			bs.avail_out = avail_out;
+			midStream = false;
+			between = true;
+		} else if(ret == BZ_OK) {
+			if(bs.avail_in != avail_in_before || bs.avail_out != avail_out_before) {
+				midStream = true;
+			}
+		} else {
+			err = (ret == BZ_MEM_ERROR) ? "out of memory" : "invalid or corrupt data";
+			break;
+		}
+		outFull = (bs.avail_out == 0);
+		if(outFull) {
+			publish(SLOT_SZ);
+			if((out = acquireFree()) == NULL) break;
+			bs.next_out = out;
+			bs.avail_out = SLOT_SZ;
+		}
+	}
+	if(err == NULL && out != NULL) {
+		if(bs.avail_out < SLOT_SZ) publish(SLOT_SZ - bs.avail_out);
+		if(midStream) err = "unexpected end of file";
+	}
+	BZ2_bzDecompressEnd(&bs);
+	return err;
+}
+
+const char *Decompressor::decodeZstd() {
+#ifdef WITH_ZSTD
+	ZSTD_DStream *zds = ZSTD_createDStream();
+	if(zds == NULL || ZSTD_isError(ZSTD_initDStream(zds))) {
+		if(zds != NULL) ZSTD_freeDStream(zds);
+		return "could not initialize zstd";
+	}
+	char *out = acquireFree();
+	if(out == NULL) { ZSTD_freeDStream(zds); return NULL; }
+	ZSTD_inBuffer zin = { inbuf_, 0, 0 };
+	ZSTD_outBuffer zout = { out, SLOT_SZ, 0 };
+	size_t hint = 0;
+	bool outFull = false;
+	const char *err = NULL;
+	while(true) {
+		if(zin.pos == zin.size && !outFull) {
+			size_t n = fillIn();
+			if(n == 0) break;
+			zin.size = n;
+			zin.pos = 0;
+		}
+		hint = ZSTD_decompressStream(zds, &zout, &zin);
+		if(ZSTD_isError(hint)) {
+			err = "invalid or corrupt data";
+			break;
+		}
+		outFull = (zout.pos == zout.size);
+		if(outFull) {
+			publish(SLOT_SZ);
+			if((out = acquireFree()) == NULL) break;
+			zout.dst = out;
+			zout.pos = 0;
+		}
+	}
+	if(err == NULL && out != NULL) {
+		if(zout.pos > 0) publish(zout.pos);
+		// A non-zero hint means the last frame wasn't finished
+		if(hint != 0) err = "unexpected end of file";
+	}
+	ZSTD_freeDStream(zds);
+	return err;
+#else
+	return "this binary was built without zstd support (rebuild with USE_ZSTD=1)";
+#endif
+}
@@ -0,0 +1,184 @@
+/*
+ * Copyright 2015, Daehwan Kim <infphilo@gmail.com>
+ *
+ * This file is part of HISAT.
+ *
+ * HISAT is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * HISAT is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with HISAT.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef DECOMP_H_
+#define DECOMP_H_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string>
+#include "filebuf.h"
+#include "tinythread.h"
+
+/**
+ * Compression formats recognized by their magic numbers.
+ */
+enum {
+	COMPRESS_NONE = 0,
+	COMPRESS_GZIP,
+	COMPRESS_BZIP2,
+	COMPRESS_ZSTD
+};
+
+/**
+ * Number of leading bytes needed by sniffCompression().
+ */
+static const size_t COMPRESS_MAGIC_LEN = 4;
+
+/**
+ * Given the first 'len' bytes of a file, return the compression format
+ * they announce, or COMPRESS_NONE.
+ */
+extern int sniffCompression(const char *magic, size_t len);
+
+/**
+ * Return a printable name for a compression format.
+ */
+extern const char *compressionName(int fmt);
+
+/**
+ * Read up to COMPRESS_MAGIC_LEN leading bytes of 'in' into 'magic'
+ * straight from its file descriptor, so nothing is left in the FILE's
+ * own buffer and a Decompressor can take the descriptor over.  Returns
+ * the number of bytes read.
+ */
+extern size_t readMagic(FILE *in, char *magic);
+
+/**
+ * A ByteSource that decodes a gzip, bzip2 or zstd file on a dedicated
+ * thread.  The decoding thread fills a small ring of buffers, and
+ * read() hands out their contents in order, so the threads consuming
+ * the input only block when they get ahead of decompression.
+ * Concatenated streams (e.g. from "cat a.gz b.gz" or BGZF) are decoded
+ * back to back.  As with gzip -d, zeros after the last stream are
+ * ignored, and anything else there is ignored with a warning.  A
+ * corrupt or truncated input makes read() print an error and throw 1.
+ */
+class Decompressor : public ByteSource {
+
+public:
+
+	/**
+	 * Start decoding 'in', which is in format 'fmt'.  The first 'len'
+	 * bytes of the file were already read into 'prefix' with
+	 * readMagic().  The Decompressor takes ownership of 'in' (unless it
+	 * is stdin).
+	 */
+	Decompressor(
+		FILE *in,
+		int fmt,
+		const char *prefix,
+		size_t len,
+		const std::string& name);
+
+	/**
+	 * Stop the decoding thread, waking it if it is waiting for input
+	 * (not on Windows), and close the input.
+	 */
+	virtual ~Decompressor();
+
+	/**
+	 * Copy up to 'len' decompressed bytes into 'buf'.  Blocks until
+	 * that many are available or the input is exhausted.
+	 */
+	virtual size_t read(void *buf, size_t len);
+
+	static const size_t NSLOTS  = 4;            // buffers in the ring
+	static const size_t SLOT_SZ = 1024 * 1024;  // bytes per buffer
+	static const size_t IN_SZ   = 256 * 1024;   // compressed read size
+
+protected:
+
+	/**
+	 * Entry point for the decoding thread.
+	 */
+	static void decodeWorker(void *vp);
+
+	/**
+	 * Decode the whole input into the ring, then mark it finished.
+	 */
+	void decode();
+
+	/**
+	 * Decoders for each format.  They return an error message, or
+	 * NULL on success.
+	 */
+	const char *decodeGzip();
+	const char *decodeBzip2();
+	const char *decodeZstd();
+
+	/**
+	 * Read the next chunk of compressed input into inbuf_, after the
+	 * first 'off' bytes; returns the number of bytes read, 0 at end of
+	 * file or once the destructor has asked the decoder to stop.
+	 */
+	size_t fillIn(size_t off = 0);
+
+	/**
+	 * Called at the end of each stream with the 'avail' unconsumed
+	 * input bytes at 'next'.  Returns true iff another stream, starting
+	 * with the 'mlen' bytes of 'magic', follows; 'next' and 'avail' are
+	 * then updated to point at it.  Otherwise the rest of the input is
+	 * skipped as described above.
+	 */
+	bool streamFollows(
+		char *&next,
+		size_t& avail,
+		const char *magic,
+		size_t mlen);
+
+	/**
+	 * Return a pointer to the ring slot the decoder should fill next,
+	 * blocking while the ring is full.  Returns NULL if the consumer
+	 * went away.
+	 */
+	char *acquireFree();
+
+	/**
+	 * Publish 'len' decoded bytes in the slot returned by the last
+	 * acquireFree().
+	 */
+	void publish(size_t len);
+
+	FILE       *in_;
+	int         fmt_;
+	std::string name_;
+	const char *prefix_;      // bytes already read from in_, not yet decoded
+	size_t      prefixLen_;
+	char        magic_[COMPRESS_MAGIC_LEN];
+	char       *inbuf_;       // compressed input
+	char       *slots_[NSLOTS];
+	size_t      slotLen_[NSLOTS];
+	size_t      head_;        // next slot for read() to drain
+	size_t      tail_;        // next slot for the decoder to fill
+	size_t      nfull_;       // slots published but not yet drained
+	size_t      headOff_;     // bytes of slot head_ already handed out
+	bool        finished_;    // decoder published its last slot
+	bool        stop_;        // consumer is going away
+	const char *err_;         // error from the decoder, if any
+#ifndef _WIN32
+	int         wake_[2];     // pipe the destructor writes to when stopping
+#endif
+	tthread::mutex              mutex_;
+	tthread::condition_variable notFull_;
+	tthread::condition_variable notEmpty_;
+	tthread::thread            *thread_;
+};
+
+#endif /*DECOMP_H_*/
@@ -489,6 +489,19 @@ public:
 		return sPrimeSz * 4; // sPrime array
 	}
 
+	/**
+	 * Return the approximate number of bytes a DifferenceCoverSample
+	 * with period v takes for a text of 'len' characters: sPrime,
+	 * sPrimeOrder and _isaPrime while it's being built ('building'),
+	 * or just _isaPrime afterwards.  v == 0 means no cover.
+	 */
+	static uint64_t peakBytes(uint64_t len, uint32_t v, bool building) {
+		if(v == 0) return 0;
+		EList<uint32_t> ds(getDiffCover(v, false /*verbose*/, false /*sanity*/));
+		uint64_t sPrimeSz = (len / v + 1) * ds.size();
+		return sPrimeSz * OFF_SIZE * (building ? 3 : 1) + (uint64_t)v * 4 * 2;
+	}
+
 	uint32_t v() const                   { return _v; }
 	uint32_t log2v() const               { return _log2v; }
 	uint32_t vmask() const               { return _vmask; }
@@ -28,6 +28,7 @@
 #include <stdint.h>
 #include <stdexcept>
 #include "assert_helpers.h"
+#include "sse_scan.h"
 
 /**
  * Simple, fast helper for determining if a character is a newline.
@@ -44,6 +45,21 @@ static inline bool isspace_notnl(int c) {
 	return isspace(c) && !isnewline(c);
 }
 
+/**
+ * Abstract source of bytes for a FileBuf.  Used for inputs that aren't
+ * plain streams, e.g. compressed files decoded on another thread.
+ */
+class ByteSource {
+public:
+	virtual ~ByteSource() { }
+
+	/**
+	 * Copy up to 'len' bytes into 'buf' and return the number copied.
+	 * Fewer than 'len' bytes are returned only at the end of input.
+	 */
+	virtual size_t read(void *buf, size_t len) = 0;
+};
+
 /**
  * Simple wrapper for a FILE*, istream or ifstream that reads it in chunks
  * using fread and keeps those chunks in a buffer.  It also services calls to
@@ -78,18 +94,28 @@ public:
 		assert(_ins != NULL);
 	}
 
+	FileBuf(ByteSource *src) {
+		init();
+		_src = src;
+		assert(_src != NULL);
+	}
+
 	/**
 	 * Return true iff there is a stream ready to read.
 	 */
 	bool isOpen() {
-		return _in != NULL || _inf != NULL || _ins != NULL;
+		return _in != NULL || _inf != NULL || _ins != NULL || _src != NULL;
 	}
 
 	/**
-	 * Close the input stream (if that's possible)
+	 * Close the input stream (if that's possible).  A ByteSource is
+	 * owned by the FileBuf, so it is deleted here.
 	 */
 	void close() {
-		if(_in != NULL && _in != stdin) {
+		if(_src != NULL) {
+			delete _src;
+			_src = NULL;
+		} else if(_in != NULL && _in != stdin) {
 			fclose(_in);
 		} else if(_inf != NULL) {
 			_inf->close();
@@ -102,7 +128,7 @@ public:
 	 * Get the next character of input and advance.
 	 */
 	int get() {
-		assert(_in != NULL || _inf != NULL || _ins != NULL);
+		assert(_in != NULL || _inf != NULL || _ins != NULL || _src != NULL || _data != _buf);
 		int c = peek();
 		if(c != -1) {
 			_cur++;
@@ -125,6 +151,37 @@ public:
 		_in = in;
 		_inf = NULL;
 		_ins = NULL;
+		_src = NULL;
+		_data = _buf;
+		_cur = BUF_SZ;
+		_buf_sz = BUF_SZ;
+		_done = false;
+	}
+
+	/**
+	 * Initialize the buffer with a new C-style file from which the
+	 * first 'len' bytes, stored at 'prefix', have already been read
+	 * (e.g. to check for a magic number).  Those bytes are dispensed
+	 * before the rest of the file.
+	 */
+	void newFile(FILE *in, const char *prefix, size_t len) {
+		assert_leq(len, BUF_SZ);
+		newFile(in);
+		memcpy(_buf, prefix, len);
+		_cur = 0;
+		_buf_sz = len;
+	}
+
+	/**
+	 * Initialize the buffer with a new ByteSource, which the FileBuf
+	 * takes ownership of.
+	 */
+	void newFile(ByteSource *src) {
+		_in = NULL;
+		_inf = NULL;
+		_ins = NULL;
+		_src = src;
+		_data = _buf;
 		_cur = BUF_SZ;
 		_buf_sz = BUF_SZ;
 		_done = false;
@@ -137,6 +194,8 @@ public:
 		_in = NULL;
 		_inf = __inf;
 		_ins = NULL;
+		_src = NULL;
+		_data = _buf;
 		_cur = BUF_SZ;
 		_buf_sz = BUF_SZ;
 		_done = false;
@@ -149,16 +208,37 @@ public:
 		_in = NULL;
 		_inf = NULL;
 		_ins = __ins;
+		_src = NULL;
+		_data = _buf;
 		_cur = BUF_SZ;
 		_buf_sz = BUF_SZ;
 		_done = false;
 	}
 
+	/**
+	 * Dispense the 'len' characters at 'buf' as though they were the
+	 * entire contents of an input stream.  The characters are not
+	 * copied, so 'buf' must outlive any subsequent calls to get() and
+	 * peek().  The last-N-chars buffer is reset.
+	 */
+	void newBuf(const char *buf, size_t len) {
+		_in = NULL;
+		_inf = NULL;
+		_ins = NULL;
+		_src = NULL;
+		_data = (const uint8_t *)buf;
+		_cur = 0;
+		_buf_sz = len;
+		_done = true;
+		_lastn_cur = 0;
+	}
+
 	/**
 	 * Restore state as though we just started reading the input
 	 * stream.
 	 */
 	void reset() {
+		assert(_src == NULL);
 		if(_inf != NULL) {
 			_inf->clear();
 			_inf->seekg(0, std::ios::beg);
@@ -179,7 +259,7 @@ public:
 	 * Occasionally we'll need to read in a new buffer's worth of data.
 	 */
 	int peek() {
-		assert(_in != NULL || _inf != NULL || _ins != NULL);
+		assert(_in != NULL || _inf != NULL || _ins != NULL || _src != NULL || _data != _buf);
 		assert_leq(_cur, _buf_sz);
 		if(_cur == _buf_sz) {
 			if(_done) {
@@ -195,10 +275,13 @@ public:
 				} else if(_ins != NULL) {
 					_ins->read((char*)_buf, BUF_SZ);
 					_buf_sz = _ins->gcount();
+				} else if(_src != NULL) {
+					_buf_sz = _src->read(_buf, BUF_SZ);
 				} else {
 					assert(_in != NULL);
 					_buf_sz = fread(_buf, 1, BUF_SZ, _in);
 				}
+				_data = _buf;
 				_cur = 0;
 				if(_buf_sz == 0) {
 					// Exhausted, and we have nothing to return to the
@@ -211,7 +294,7 @@ public:
 				}
 			}
 		}
-		return (int)_buf[_cur];
+		return (int)_data[_cur];
 	}
 
 	/**
@@ -259,6 +342,44 @@ public:
 		return len;
 	}
 
+	/**
+	 * Copy the next 'len' characters of input into 'buf' in bulk and
+	 * return the number copied, which is less than 'len' only if the
+	 * input ran out.  Unlike get(), this does not add to the
+	 * last-N-chars buffer.
+	 */
+	size_t read(char *buf, size_t len) {
+		size_t stored = 0;
+		while(stored < len && peek() != -1) {
+			size_t n = _buf_sz - _cur;
+			if(n > len - stored) n = len - stored;
+			memcpy(buf + stored, _data + _cur, n);
+			_cur += n;
+			stored += n;
+		}
+		return stored;
+	}
+
+	/**
+	 * Append characters to 'dst' up to, but not including, the next
+	 * occurrence of 'c1' or 'c2', scanning the buffer in bulk rather than
+	 * a character at a time.  Returns that character, which the next
+	 * get() will dispense, or -1 if the input ran out first.  Unlike
+	 * get(), this does not add to the last-N-chars buffer.
+	 */
+	template<typename TDst>
+	int copyUpTo(TDst& dst, char c1, char c2) {
+		while(peek() != -1) {
+			const char *s = (const char *)_data + _cur;
+			const char *e = (const char *)_data + _buf_sz;
+			const char *hit = scanForEither(s, e, c1, c2);
+			dst.append(s, hit - s);
+			_cur += hit - s;
+			if(hit < e) return (int)(uint8_t)*hit;
+		}
+		return -1;
+	}
+
 	static const size_t LASTN_BUF_SZ = 8 * 1024;
 
 	/**
@@ -432,6 +553,8 @@ private:
 		_in = NULL;
 		_inf = NULL;
 		_ins = NULL;
+		_src = NULL;
+		_data = _buf;
 		_cur = _buf_sz = BUF_SZ;
 		_done = false;
 		_lastn_cur = 0;
@@ -442,9 +565,11 @@ private:
 	FILE     *_in;
 	std::ifstream *_inf;
 	std::istream  *_ins;
+	ByteSource    *_src;   // owned; deleted by close()
 	size_t    _cur;
 	size_t    _buf_sz;
 	bool      _done;
+	const uint8_t *_data;   // _buf, or caller's memory after newBuf()
 	uint8_t   _buf[BUF_SZ]; // (large) input buffer
 	size_t    _lastn_cur;
 	char      _lastn_buf[LASTN_BUF_SZ]; // buffer of the last N chars dispensed
@@ -525,11 +650,16 @@ class OutFileBuf {
 
 public:
 
+	/**
+	 * Callback that takes the place of the output file; see below.
+	 */
+	typedef void (*Sink)(void *arg, const char *buf, size_t len);
+
 	/**
 	 * Open a new output stream to a file with given name.
 	 */
 	OutFileBuf(const std::string& out, bool binary = false) :
-		name_(out.c_str()), cur_(0), closed_(false)
+		name_(out.c_str()), cur_(0), closed_(false), sink_(NULL), sinkArg_(NULL)
 	{
 		out_ = fopen(out.c_str(), binary ? "wb" : "w");
 		if(out_ == NULL) {
@@ -544,7 +674,7 @@ public:
 	 * Open a new output stream to a file with given name.
 	 */
 	OutFileBuf(const char *out, bool binary = false) :
-		name_(out), cur_(0), closed_(false)
+		name_(out), cur_(0), closed_(false), sink_(NULL), sinkArg_(NULL)
 	{
 		assert(out != NULL);
 		out_ = fopen(out, binary ? "wb" : "w");
@@ -557,9 +687,21 @@ public:
 	/**
 	 * Open a new output stream to standard out.
 	 */
-	OutFileBuf() : name_("cout"), cur_(0), closed_(false) {
+	OutFileBuf() : name_("cout"), cur_(0), closed_(false), sink_(NULL), sinkArg_(NULL) {
 		out_ = stdout;
 	}
+
+	/**
+	 * Open a new output stream that hands each buffer it would have
+	 * written to 'sink', along with 'arg'.  Buffers only ever end where a
+	 * writeString() or writeChars() call ended, so a caller that writes
+	 * whole SAM records gets whole records.
+	 */
+	OutFileBuf(Sink sink, void *arg) :
+		name_("sink"), out_(NULL), cur_(0), closed_(false), sink_(sink), sinkArg_(arg)
+	{
+		assert(sink != NULL);
+	}
 	
 	/**
 	 * Close buffer when object is destroyed.
@@ -598,7 +740,7 @@ public:
 		if(cur_ + slen > BUF_SZ) {
 			if(cur_ > 0) flush();
 			if(slen >= BUF_SZ) {
-				fwrite(s.c_str(), slen, 1, out_);
+				emit(s.c_str(), slen);
 			} else {
 				memcpy(&buf_[cur_], s.data(), slen);
 				assert_eq(0, cur_);
@@ -621,7 +763,7 @@ public:
 		if(cur_ + slen > BUF_SZ) {
 			if(cur_ > 0) flush();
 			if(slen >= BUF_SZ) {
-				fwrite(s.toZBuf(), slen, 1, out_);
+				emit(s.toZBuf(), slen);
 			} else {
 				memcpy(&buf_[cur_], s.toZBuf(), slen);
 				assert_eq(0, cur_);
@@ -642,7 +784,7 @@ public:
 		if(cur_ + len > BUF_SZ) {
 			if(cur_ > 0) flush();
 			if(len >= BUF_SZ) {
-				fwrite(s, len, 1, out_);
+				emit(s, len);
 			} else {
 				memcpy(&buf_[cur_], s, len);
 				assert_eq(0, cur_);
@@ -669,7 +811,7 @@ public:
 		if(closed_) return;
 		if(cur_ > 0) flush();
 		closed_ = true;
-		if(out_ != stdout) {
+		if(out_ != stdout && out_ != NULL) {
 			fclose(out_);
 		}
 	}
@@ -683,10 +825,7 @@ public:
 	}
 
 	void flush() {
-		if(!fwrite((const void *)buf_, cur_, 1, out_)) {
-			std::cerr << "Error while flushing and closing output" << std::endl;
-			throw 1;
-		}
+		if(cur_ > 0) emit(buf_, cur_);
 		cur_ = 0;
 	}
 
@@ -706,6 +845,18 @@ public:
 
 private:
 
+	/**
+	 * Write 'len' bytes at 'p' to the file or hand them to the sink.
+	 */
+	void emit(const char *p, size_t len) {
+		if(sink_ != NULL) {
+			sink_(sinkArg_, p, len);
+		} else if(!fwrite((const void *)p, len, 1, out_)) {
+			std::cerr << "Error while flushing and closing output" << std::endl;
+			throw 1;
+		}
+	}
+
 	static const size_t BUF_SZ = 16 * 1024;
 
 	const char *name_;
@@ -713,6 +864,8 @@ private:
 	size_t      cur_;
 	char        buf_[BUF_SZ]; // (large) input buffer
 	bool        closed_;
+	Sink        sink_;    // if set, takes buffers instead of out_
+	void       *sinkArg_;
 };
 
 #endif /*ndef FILEBUF_H_*/
@@ -41,6 +41,7 @@
 #include "aligner_driver.h"
 #include "aligner_sw_driver.h"
 #include "group_walk.h"
+#include "kmer_table.h"
 
 // Maximum insertion length
 static const uint32_t maxInsLen = 3;
@@ -376,6 +377,42 @@ struct ReadBWTHit {
 };
 
 
+/**
+ * State of one exact-match partial search, which HI_Aligner advances
+ * one character at a time, so that the first searches of several reads
+ * can be run in lock-step
+ */
+template <typename index_t>
+struct PartialSearchState {
+    const BTDnaString*  seq;             // sequence being searched
+    bool                fw;
+    index_t             len;             // length of seq
+    index_t             offset;          // where the search began
+    index_t             dep;             // # chars matched so far, plus offset
+    index_t             top;             // current range
+    index_t             bot;
+    SideLocus<index_t>  tloc;            // loci for the next LF step
+    SideLocus<index_t>  bloc;
+    index_t             same_range;
+    index_t             similar_range;
+    bool                pseudogeneStop_; // heuristics still in force
+    bool                anchorStop_;
+    bool                pseudogeneStop;  // outcome
+    bool                anchorStop;
+    bool                running;         // whether another step is needed
+};
+
+/**
+ * First partial searches of one read or pair, run ahead of the rest of
+ * its alignment by HI_Aligner::runSearchAhead
+ */
+template <typename index_t>
+struct PartialSearchAhead {
+    PartialSearchState<index_t> st[2][2];    // [mate][fw, rc]
+    bool                        ready[2][2]; // not yet picked up
+};
+
+
 /**
  * this is per-thread data, which are shared by GenomeHit classes
  * the main purpose of this struct is to avoid extensive use of memory related functions
@@ -2320,7 +2357,12 @@ public:
     _gwstate(GW_CAT),
     _gwstate_local(GW_CAT),
     _thread_rids_mindist(threads_rids_mindist),
-    _no_spliced_alignment(no_spliced_alignment)
+    _no_spliced_alignment(no_spliced_alignment),
+    _kmerTable(NULL),
+    _mate1fw(true),
+    _mate2fw(false),
+    _aheadUsed(0),
+    _aheadSlot((index_t)OFF_MASK)
     {
         index_t genomeLen = ebwt.eh().len();
         _minK = 0;
@@ -2331,7 +2373,64 @@ public:
         _minK_local = 8;
     }
     
-    HI_Aligner() {
+    HI_Aligner() : _kmerTable(NULL), _mate1fw(true), _mate2fw(false), _aheadUsed(0), _aheadSlot((index_t)OFF_MASK) {
+    }
+    
+    /**
+     * Start partial searches from the k-mers in 'kmerTable' rather than
+     * from the ftab alone.  A table followed for another minK is ignored.
+     */
+    void setKmerTable(const KmerTable<index_t>* kmerTable) {
+        _kmerTable = (kmerTable != NULL && kmerTable->minK() == _minK) ? kmerTable : NULL;
+    }
+    
+    /**
+     * Set the orientations of the mates on the forward strand, as given
+     * by --fr (the default), --rf or --ff.
+     */
+    void setMateOrientations(bool mate1fw, bool mate2fw) {
+        _mate1fw = mate1fw;
+        _mate2fw = mate2fw;
+    }
+    
+    /**
+     * Drop the searches run ahead for the last set of reads
+     */
+    void clearSearchAhead() {
+        for(index_t slot = 0; slot < _aheadUsed; slot++) {
+            for(index_t rdi = 0; rdi < 2; rdi++) {
+                _ahead[slot].ready[rdi][0] = _ahead[slot].ready[rdi][1] = false;
+            }
+        }
+        _aheadUsed = 0;
+        _aheadSlot = (index_t)OFF_MASK;
+    }
+    
+    /**
+     * Set up, in 'slot', the first partial searches that go() is sure to
+     * ask for when given the read rds[0] (rds[1] == NULL) or the pair
+     * rds[0], rds[1].  runSearchAhead then runs every slot's searches
+     * together.  The reads must stay put until go() is done with them.
+     */
+    void addSearchAhead(
+                        const Ebwt<index_t>& ebwt,
+                        index_t              slot,
+                        const Read*          rds[2],
+                        const bool           nofw[2],
+                        const bool           norc[2]);
+    
+    /**
+     * Run the searches set up by addSearchAhead in lock-step
+     */
+    void runSearchAhead(const Ebwt<index_t>& ebwt);
+    
+    /**
+     * Have go() pick up the searches run ahead in 'slot' for the read
+     * or pair just passed to initRead or initReads
+     */
+    void useSearchAhead(index_t slot) {
+        assert_lt(slot, _aheadUsed);
+        _aheadSlot = slot;
     }
     
     /**
@@ -2357,6 +2456,7 @@ public:
         _genomeHits.clear();
         _concordantPairs.clear();
         _hits_searched[0].clear();
+        _aheadSlot = (index_t)OFF_MASK;
         assert(!_paired);
     }
     
@@ -2380,6 +2480,7 @@ public:
         }
         _genomeHits.clear();
         _concordantPairs.clear();
+        _aheadSlot = (index_t)OFF_MASK;
         assert(_paired);
         assert(!_rightendonly);
     }
@@ -2715,7 +2816,56 @@ public:
                          RandomSource&           rnd,
                          bool&                   pseudogeneStop,  // stop if mapped to multiple locations due to processed pseudogenes
                          bool&                   anchorStop);
+
+    /**
+     * Set up a partial search of seq beginning at offset, using the ftab
+     * for the first characters
+     */
+    void partialSearchBegin(
+                            const Ebwt<index_t>&        ebwt,
+                            const BTDnaString&          seq,
+                            bool                        fw,
+                            index_t                     offset,
+                            bool                        pseudogeneStop,
+                            bool                        anchorStop,
+                            PartialSearchState<index_t>& st);
+
+    /**
+     * Extend a partial search by one character
+     */
+    void partialSearchStep(
+                           const Ebwt<index_t>&         ebwt,
+                           PartialSearchState<index_t>& st);
+
+    /**
+     * Record the outcome of a finished partial search in hit
+     */
+    size_t partialSearchEnd(
+                            PartialSearchState<index_t>& st,
+                            ReadBWTHit<index_t>&         hit,
+                            bool&                        pseudogeneStop,
+                            bool&                        anchorStop);
     
+    /**
+     * Prefetch the BWT sides the next step of a partial search will count
+     */
+    void partialSearchPrefetch(
+                               const Ebwt<index_t>&               ebwt,
+                               const PartialSearchState<index_t>& st)
+    {
+        if(!st.running) return;
+        const uint8_t* side = st.tloc.side(ebwt.ebwt());
+        for(index_t i = 0; i < ebwt.eh().sideSz(); i += 64) {
+            __builtin_prefetch(side + i);
+        }
+        if(st.bloc.valid() && st.bloc._sideByteOff != st.tloc._sideByteOff) {
+            side = st.bloc.side(ebwt.ebwt());
+            for(index_t i = 0; i < ebwt.eh().sideSz(); i += 64) {
+                __builtin_prefetch(side + i);
+            }
+        }
+    }
+
     /**
      * Global FM index search
 	 */
@@ -3042,6 +3192,16 @@ protected:
     
     uint64_t   _thread_rids_mindist;
     bool _no_spliced_alignment;
+    
+    const KmerTable<index_t>* _kmerTable; // k-mer table for partial searches, or NULL
+    bool _mate1fw; // mate 1 aligns to the forward strand
+    bool _mate2fw; // mate 2 aligns to the forward strand
+    
+    // first partial searches run ahead for a set of reads
+    EList<PartialSearchAhead<index_t> >   _ahead;
+    index_t                               _aheadUsed;    // # slots set up
+    index_t                               _aheadSlot;    // current read's slot, or OFF_MASK
+    EList<PartialSearchState<index_t>* >  _aheadRunning; // scratch for runSearchAhead
 
     // For AlnRes::matchesRef
 	ASSERT_ONLY(EList<bool> raw_matches_);
@@ -3183,7 +3343,7 @@ bool HI_Aligner<index_t, local_index_t>::alignMate(
 {
     assert_lt(rdi, 2);
     index_t ordi = 1 - rdi;
-    bool ofw = (fw == gMate2fw ? gMate1fw : gMate2fw);
+    bool ofw = (fw == _mate2fw ? _mate1fw : _mate2fw);
     assert(_rds[ordi] != NULL);
     const Read& ord = *_rds[ordi];
     index_t rdlen = ord.length();
@@ -3511,10 +3671,10 @@ bool HI_Aligner<index_t, local_index_t>::pairReads(
             if(left.ref() != left2.ref()) continue;
             assert_eq(left.orient(), right.orient());
             assert_eq(left2.orient(), right2.orient());
-            if(left.orient() == gMate1fw) {
-                if(left2.orient() != gMate2fw) continue;
+            if(left.orient() == _mate1fw) {
+                if(left2.orient() != _mate2fw) continue;
             } else {
-                if(left2.orient() == gMate2fw) continue;
+                if(left2.orient() == _mate2fw) continue;
                 Coord temp = left; left = left2; left2 = temp;
                 temp = right; right = right2; right2 = temp;
             }
@@ -3817,171 +3977,358 @@ size_t HI_Aligner<index_t, local_index_t>::partialSearch(
                                                          bool&                     pseudogeneStop,
                                                          bool&                     anchorStop)
 {
-    bool pseudogeneStop_ = pseudogeneStop, anchorStop_ = anchorStop;
-    pseudogeneStop = anchorStop = false;
-	const index_t ftabLen = ebwt.eh().ftabChars();
-	SideLocus<index_t> tloc, bloc;
-	const index_t len = (index_t)read.length();
     const BTDnaString& seq = fw ? read.patFw : read.patRc;
     assert(!seq.empty());
+    assert_lt(hit._cur, hit._len);
     
-    size_t nelt = 0;
-    EList<BWTHit<index_t> >& partialHits = hit._partialHits;
-    index_t& cur = hit._cur;
-    assert_lt(cur, hit._len);
-    
-    hit._numPartialSearch++;
+    // Has runSearchAhead already run this search?
+    if(_aheadSlot < _aheadUsed && pseudogeneStop && anchorStop &&
+       hit._cur == 0 && hit._numPartialSearch == 0) {
+        PartialSearchAhead<index_t>& ahead = _ahead[_aheadSlot];
+        for(index_t rdi = 0; rdi < 2; rdi++) {
+            for(index_t fwi = 0; fwi < 2; fwi++) {
+                if(&_hits[rdi][fwi] != &hit || !ahead.ready[rdi][fwi]) continue;
+                ahead.ready[rdi][fwi] = false;
+                PartialSearchState<index_t>& st = ahead.st[rdi][fwi];
+                if(st.fw == fw && st.len == (index_t)seq.length()) {
+                    // It ran on the read-ahead copy of this read
+                    assert(*st.seq == seq);
+                    st.seq = &seq;
+                    return partialSearchEnd(st, hit, pseudogeneStop, anchorStop);
+                }
+            }
+        }
+    }
     
-    index_t offset = cur;
-    index_t dep = offset;
-    index_t top = 0, bot = 0;
-    index_t topTemp = 0, botTemp = 0;
-    index_t left = len - dep;
+    PartialSearchState<index_t> st;
+    partialSearchBegin(ebwt, seq, fw, hit._cur, pseudogeneStop, anchorStop, st);
+    while(st.running) {
+        partialSearchStep(ebwt, st);
+    }
+    return partialSearchEnd(st, hit, pseudogeneStop, anchorStop);
+}
+
+/**
+ * Set up a partial search of seq beginning at offset.  If the ftab
+ * cannot be used (too few characters left, or an N among them) or the
+ * ftab range is empty, the search is finished right away with an empty
+ * range and dep set to where the next search should begin.
+ */
+template <typename index_t, typename local_index_t>
+void HI_Aligner<index_t, local_index_t>::partialSearchBegin(
+                                                            const Ebwt<index_t>&         ebwt,
+                                                            const BTDnaString&           seq,
+                                                            bool                         fw,
+                                                            index_t                      offset,
+                                                            bool                         pseudogeneStop,
+                                                            bool                         anchorStop,
+                                                            PartialSearchState<index_t>& st)
+{
+	const index_t ftabLen = ebwt.eh().ftabChars();
+    const index_t len = (index_t)seq.length();
+    st.seq = &seq;
+    st.fw = fw;
+    st.len = len;
+    st.offset = offset;
+    st.dep = offset;
+    st.top = st.bot = 0;
+    st.tloc.invalidate();
+    st.bloc.invalidate();
+    st.same_range = st.similar_range = 0;
+    st.pseudogeneStop_ = pseudogeneStop;
+    st.anchorStop_ = anchorStop;
+    st.pseudogeneStop = st.anchorStop = false;
+    st.running = false;
+    
+    index_t left = len - st.dep;
     assert_gt(left, 0);
     if(left < ftabLen) {
-        cur = hit._len;
-        partialHits.expand();
-        partialHits.back().init((index_t)OFF_MASK,
-                                (index_t)OFF_MASK,
-                                fw,
-                                (index_t)offset,
-                                (index_t)(cur - offset));
-        hit.done(true);
-		return 0;
+        st.dep = len;
+        return;
     }
     // Does N interfere with use of Ftab?
     for(index_t i = 0; i < ftabLen; i++) {
-        int c = seq[len-dep-1-i];
+        int c = seq[len-st.dep-1-i];
         if(c > 3) {
-            cur += (i+1);
-            partialHits.expand();
-            partialHits.back().init((index_t)OFF_MASK,
-                                    (index_t)OFF_MASK,
-                                    fw,
-                                    (index_t)offset,
-                                    (index_t)(cur - offset));
-            if(cur >= hit._len) {
-                hit.done(true);
-            }
-			return 0;
+            st.dep += (i+1);
+			return;
         }
     }
     
     // Use ftab
-    ebwt.ftabLoHi(seq, len - dep - ftabLen, false, top, bot);
-    dep += ftabLen;
-    if(bot <= top) {
-        cur = dep;
-        partialHits.expand();
-        partialHits.back().init((index_t)OFF_MASK,
-                                (index_t)OFF_MASK,
-                                fw,
-                                (index_t)offset,
-                                (index_t)(cur - offset));
-        if(cur >= hit._len) {
-            hit.done(true);
-        }
-        return 0;
+    ebwt.ftabLoHi(seq, len - st.dep - ftabLen, false, st.top, st.bot);
+    st.dep += ftabLen;
+    if(st.bot <= st.top) {
+        st.top = st.bot = 0;
+        return;
     }
-    index_t same_range = 0, similar_range = 0;
-    HIER_INIT_LOCS(top, bot, tloc, bloc, ebwt);
-    // Keep going
-    while(dep < len) {
-        int c = seq[len-dep-1];
-        if(c > 3) {
-            topTemp = botTemp = 0;
-        } else {
-            if(bloc.valid()) {
-                bwops_ += 2;
-                topTemp = ebwt.mapLF(tloc, c);
-                botTemp = ebwt.mapLF(bloc, c);
-            } else {
-                bwops_++;
-                topTemp = ebwt.mapLF1(top, tloc, c);
-                if(topTemp == (index_t)OFF_MASK) {
-                    topTemp = botTemp = 0;
+    
+    // Go further with the k-mer table if it has the next characters;
+    // otherwise they are matched one at a time as usual
+    if(_kmerTable != NULL && len - st.dep >= (index_t)_kmerTable->extra()) {
+        const index_t extra = (index_t)_kmerTable->extra();
+        uint32_t code = 0;
+        index_t i = 0;
+        for(; i < extra; i++) {
+            int c = seq[len-st.dep-1-i];
+            if(c > 3) break;
+            code = (code << 2) | (uint32_t)c;
+        }
+        index_t top = 0, bot = 0;
+        uint8_t state = 0;
+        if(i == extra &&
+           _kmerTable->find(ebwt.ftabSeqToInt(seq, len - st.dep, false), code, top, bot, state))
+        {
+            st.top = top;
+            st.bot = bot;
+            st.dep += extra;
+            if(st.pseudogeneStop_) {
+                index_t similar_range = state & 0x0f;
+                if(similar_range == KmerTable<index_t>::PSEUDOGENE_OFF) {
+                    st.pseudogeneStop_ = false;
                 } else {
-                    botTemp = topTemp + 1;
+                    st.similar_range = similar_range;
                 }
             }
-        }
-        if(botTemp <= topTemp) {
-            break;
-        }
-
-        if(pseudogeneStop_) {
-            if(botTemp - topTemp < bot - top && bot - top <= 5) {
-                static const index_t minLenForPseudogene = _minK + 6;
-                if(dep - offset >= minLenForPseudogene && similar_range >= 5) {
-                    hit._numUniqueSearch++;
-                    pseudogeneStop = true;
-                    break;
+            if(st.anchorStop_) {
+                index_t same_range = state >> 4;
+                if(same_range == KmerTable<index_t>::ANCHOR_OFF) {
+                    st.anchorStop_ = false;
+                } else {
+                    st.same_range = same_range;
                 }
             }
-            if(botTemp - topTemp != 1) {
-                if(botTemp - topTemp + 2 >= bot - top) similar_range++;
-                else if(botTemp - topTemp + 4 < bot - top) similar_range = 0;
-            } else {
-                pseudogeneStop_ = false;
-            }
         }
-        
-        if(anchorStop_) {
-            if(botTemp - topTemp != 1 && bot - top == botTemp - topTemp) {
-                same_range++;
-                if(same_range >= 5) {
-                    anchorStop_ = false;
-                }
+    }
+    HIER_INIT_LOCS(st.top, st.bot, st.tloc, st.bloc, ebwt);
+    st.running = (st.dep < len);
+}
+
+/**
+ * Extend the range of a partial search by one character, stopping when
+ * the range would become empty or when the pseudogene or anchor
+ * heuristics say so.
+ */
+template <typename index_t, typename local_index_t>
+void HI_Aligner<index_t, local_index_t>::partialSearchStep(
+                                                           const Ebwt<index_t>&         ebwt,
+                                                           PartialSearchState<index_t>& st)
+{
+    assert(st.running);
+    assert_lt(st.dep, st.len);
+    const BTDnaString& seq = *st.seq;
+    const index_t len = st.len;
+    const index_t offset = st.offset;
+    index_t& dep = st.dep;
+    index_t& top = st.top;
+    index_t& bot = st.bot;
+    index_t topTemp = 0, botTemp = 0;
+    st.running = false;
+    
+    int c = seq[len-dep-1];
+    if(c > 3) {
+        topTemp = botTemp = 0;
+    } else {
+        if(st.bloc.valid()) {
+            bwops_ += 2;
+            topTemp = ebwt.mapLF(st.tloc, c);
+            botTemp = ebwt.mapLF(st.bloc, c);
+        } else {
+            bwops_++;
+            topTemp = ebwt.mapLF1(top, st.tloc, c);
+            if(topTemp == (index_t)OFF_MASK) {
+                topTemp = botTemp = 0;
             } else {
-                same_range = 0;
+                botTemp = topTemp + 1;
             }
-        
-            if(dep - offset >= _minK + 8 && botTemp - topTemp >= 4) {
-                anchorStop_ = false;
+        }
+    }
+    if(botTemp <= topTemp) {
+        return;
+    }
+    
+    if(st.pseudogeneStop_) {
+        if(botTemp - topTemp < bot - top && bot - top <= 5) {
+            static const index_t minLenForPseudogene = _minK + 6;
+            if(dep - offset >= minLenForPseudogene && st.similar_range >= 5) {
+                st.pseudogeneStop = true;
+                return;
             }
         }
-        
-        top = topTemp;
-        bot = botTemp;
-        dep++;
-
-        if(anchorStop_) {
-            if(dep - offset >= _minK + 12 && bot - top == 1) {
-                hit._numUniqueSearch++;
-                anchorStop = true;
-                break;
+        if(botTemp - topTemp != 1) {
+            if(botTemp - topTemp + 2 >= bot - top) st.similar_range++;
+            else if(botTemp - topTemp + 4 < bot - top) st.similar_range = 0;
+        } else {
+            st.pseudogeneStop_ = false;
+        }
+    }
+    
+    if(st.anchorStop_) {
+        if(botTemp - topTemp != 1 && bot - top == botTemp - topTemp) {
+            st.same_range++;
+            if(st.same_range >= 5) {
+                st.anchorStop_ = false;
             }
+        } else {
+            st.same_range = 0;
         }
         
-        HIER_INIT_LOCS(top, bot, tloc, bloc, ebwt);
+        if(dep - offset >= _minK + 8 && botTemp - topTemp >= 4) {
+            st.anchorStop_ = false;
+        }
     }
     
-    // Done
-    if(bot > top) {
-        // This is an exact hit
-        assert_gt(dep, offset);
-        assert_leq(dep, len);
+    top = topTemp;
+    bot = botTemp;
+    dep++;
+    
+    if(st.anchorStop_) {
+        if(dep - offset >= _minK + 12 && bot - top == 1) {
+            st.anchorStop = true;
+            return;
+        }
+    }
+    
+    HIER_INIT_LOCS(top, bot, st.tloc, st.bloc, ebwt);
+    st.running = (dep < len);
+}
+
+/**
+ * Add the range a finished partial search ended with (or an empty range
+ * if it never got past the ftab) to hit and advance hit's cursor.
+ */
+template <typename index_t, typename local_index_t>
+size_t HI_Aligner<index_t, local_index_t>::partialSearchEnd(
+                                                            PartialSearchState<index_t>& st,
+                                                            ReadBWTHit<index_t>&         hit,
+                                                            bool&                        pseudogeneStop,
+                                                            bool&                        anchorStop)
+{
+    assert(!st.running);
+    assert_eq(st.len, hit._len);
+    assert_eq(st.offset, hit._cur);
+    size_t nelt = 0;
+    EList<BWTHit<index_t> >& partialHits = hit._partialHits;
+    index_t& cur = hit._cur;
+    const index_t offset = st.offset;
+    
+    hit._numPartialSearch++;
+    pseudogeneStop = st.pseudogeneStop;
+    anchorStop = st.anchorStop;
+    if(pseudogeneStop || anchorStop) {
+        hit._numUniqueSearch++;
+    }
+    
+    if(st.bot <= st.top) {
+        cur = st.dep;
         partialHits.expand();
-        index_t hit_type = CANDIDATE_HIT;
-        if(anchorStop) hit_type = ANCHOR_HIT;
-        else if(pseudogeneStop) hit_type = PSEUDOGENE_HIT;
-        partialHits.back().init(top,
-                                bot,
-                                fw,
+        partialHits.back().init((index_t)OFF_MASK,
+                                (index_t)OFF_MASK,
+                                st.fw,
                                 (index_t)offset,
-                                (index_t)(dep - offset),
-                                hit_type);
-        
-        nelt += (bot - top);
-        cur = dep;
+                                (index_t)(cur - offset));
         if(cur >= hit._len) {
-            if(hit_type == CANDIDATE_HIT) hit._numUniqueSearch++;
             hit.done(true);
         }
+        return 0;
+    }
+    
+    // This is an exact hit
+    assert_gt(st.dep, offset);
+    assert_leq(st.dep, st.len);
+    partialHits.expand();
+    index_t hit_type = CANDIDATE_HIT;
+    if(anchorStop) hit_type = ANCHOR_HIT;
+    else if(pseudogeneStop) hit_type = PSEUDOGENE_HIT;
+    partialHits.back().init(st.top,
+                            st.bot,
+                            st.fw,
+                            (index_t)offset,
+                            (index_t)(st.dep - offset),
+                            hit_type);
+    
+    nelt += (st.bot - st.top);
+    cur = st.dep;
+    if(cur >= hit._len) {
+        if(hit_type == CANDIDATE_HIT) hit._numUniqueSearch++;
+        hit.done(true);
     }
     return nelt;
 }
 
+/**
+ * Set up the first partial searches that go() is sure to ask for.
+ * pickNextReadToSearch takes every first search before any later one,
+ * in order (1st mate forward, reverse complement, 2nd mate forward,
+ * reverse complement).  An unpaired read may stop after its first
+ * search, but go() can't stop before the 2nd mate of a pair has been
+ * aligned, so those are the 1st mate's first searches and the first of
+ * the 2nd mate's.
+ */
+template <typename index_t, typename local_index_t>
+void HI_Aligner<index_t, local_index_t>::addSearchAhead(
+                                                        const Ebwt<index_t>& ebwt,
+                                                        index_t              slot,
+                                                        const Read*          rds[2],
+                                                        const bool           nofw[2],
+                                                        const bool           norc[2])
+{
+    assert(rds[0] != NULL);
+    while(_ahead.size() <= slot) _ahead.expand();
+    if(_aheadUsed <= slot) _aheadUsed = slot + 1;
+    PartialSearchAhead<index_t>& ahead = _ahead[slot];
+    bool last = false; // have we taken the last search sure to be asked for?
+    for(index_t rdi = 0; rdi < 2; rdi++) {
+        for(index_t fwi = 0; fwi < 2; fwi++) {
+            ahead.ready[rdi][fwi] = false;
+            if(rds[rdi] == NULL || last) continue;
+            if     (fwi == 0 && nofw[rdi]) continue;
+            else if(fwi == 1 && norc[rdi]) continue;
+            bool fw = (fwi == 0);
+            const BTDnaString& seq = fw ? rds[rdi]->patFw : rds[rdi]->patRc;
+            if(seq.empty()) continue;
+            partialSearchBegin(ebwt, seq, fw, 0, true, true, ahead.st[rdi][fwi]);
+            ahead.ready[rdi][fwi] = true;
+            last = (rdi == 1 || rds[1] == NULL);
+        }
+    }
+}
+
+/**
+ * Run the searches of every slot set up by addSearchAhead in lock-step,
+ * one character at a time.  Before any search's next LF step is
+ * counted, the BWT sides that every search's step will touch are
+ * prefetched, so that their cache misses overlap instead of being taken
+ * one after another.  partialSearch hands the results back as go() asks
+ * for them, so the alignments are the same as searching one at a time.
+ */
+template <typename index_t, typename local_index_t>
+void HI_Aligner<index_t, local_index_t>::runSearchAhead(const Ebwt<index_t>& ebwt)
+{
+    _aheadRunning.clear();
+    for(index_t slot = 0; slot < _aheadUsed; slot++) {
+        for(index_t rdi = 0; rdi < 2; rdi++) {
+            for(index_t fwi = 0; fwi < 2; fwi++) {
+                PartialSearchState<index_t>& st = _ahead[slot].st[rdi][fwi];
+                if(_ahead[slot].ready[rdi][fwi] && st.running) {
+                    _aheadRunning.push_back(&st);
+                }
+            }
+        }
+    }
+    size_t nrunning = _aheadRunning.size();
+    while(nrunning > 0) {
+        for(size_t i = 0; i < nrunning; i++) {
+            partialSearchPrefetch(ebwt, *_aheadRunning[i]);
+        }
+        size_t j = 0;
+        for(size_t i = 0; i < nrunning; i++) {
+            partialSearchStep(ebwt, *_aheadRunning[i]);
+            if(_aheadRunning[i]->running) _aheadRunning[j++] = _aheadRunning[i];
+        }
+        nrunning = j;
+    }
+}
 
 /**
  */
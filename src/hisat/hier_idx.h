@@ -20,11 +20,21 @@
 #ifndef HIEREBWT_H_
 #define HIEREBWT_H_
 
+#include <sstream>
 #include "hier_idx_common.h"
+#include "threading.h"
 #include "bt2_idx.h"
 #include "bt2_io.h"
 #include "bt2_util.h"
 
+/**
+ * Return the number of padding bytes between file offset 'off' and
+ * the next multiple of local_index_align.
+ */
+static inline size_t localIndexPad(size_t off) {
+	return (local_index_align - off % local_index_align) % local_index_align;
+}
+
 /**
  * Extended Burrows-Wheeler transform data.
  * LocalEbwt is a specialized Ebwt index that represents ~64K bps
@@ -47,6 +57,8 @@ public:
 			  full_index_t& localOffset,
 			  bool switchEndian,
 			  size_t& bytesRead,
+			  size_t& bytesRead6,
+			  bool aligned,
 			  int color,
 			  int needEntireReverse,
 			  bool fw,
@@ -96,6 +108,8 @@ public:
 					   localOffset,
 					   switchEndian,
 					   bytesRead,
+					   bytesRead6,
+					   aligned,
 					   color,
 					   needEntireReverse,
 					   loadSASamp,
@@ -153,7 +167,10 @@ public:
 			  int32_t overrideOffRate = -1,
 			  bool verbose = false,
 			  bool passMemExc = false,
-			  bool sanityCheck = false) :
+			  bool sanityCheck = false,
+			  size_t* padAt = NULL,
+			  EList<TIndexOffU>* bktBuf = NULL,
+			  bool sais = false) :
 	Ebwt<index_t>(packed,
 				  color,
 				  needEntireReverse,
@@ -226,11 +243,20 @@ public:
 			}
 			
 			VMSG_NL("Constructing suffix-array element generator");
-			KarkkainenBlockwiseSA<TStr> bsa(s, s.length()+1, dcv, seed, this->_sanity, this->_passMemExc, this->_verbose);
-			assert(bsa.suffixItrIsReset());
-			assert_eq(bsa.size(), s.length()+1);
-			VMSG_NL("Converting suffix-array elements to index image");
-			buildToDisk(bsa, s, out5, out6);
+			if(sais) {
+				SaisBlockwiseSA<TStr> bsa(s, this->_sanity, this->_passMemExc, this->_verbose);
+				assert(bsa.suffixItrIsReset());
+				assert_eq(bsa.size(), s.length()+1);
+				VMSG_NL("Converting suffix-array elements to index image");
+				buildToDisk(bsa, s, out5, out6, padAt);
+			} else {
+				KarkkainenBlockwiseSA<TStr> bsa(s, s.length()+1, dcv, seed, this->_sanity, this->_passMemExc, this->_verbose);
+				bsa.setBucketScratch(bktBuf);
+				assert(bsa.suffixItrIsReset());
+				assert_eq(bsa.size(), s.length()+1);
+				VMSG_NL("Converting suffix-array elements to index image");
+				buildToDisk(bsa, s, out5, out6, padAt);
+			}
 		}
 		
 		out5.flush(); out6.flush();
@@ -244,7 +270,8 @@ public:
 											  InorderBlockwiseSA<TStr>& sa,
 											  const TStr& s,
 											  ostream& out1, 
-											  ostream& out2);
+											  ostream& out2,
+											  size_t* padAt = NULL);
 	
 	// I/O
 	void readIntoMemory(
@@ -255,7 +282,9 @@ public:
 						full_index_t& tidx,
 						full_index_t& localOffset,
 						bool switchEndian,
-						size_t bytesRead,
+						size_t& bytesRead,
+						size_t& bytesRead6,
+						bool aligned,
 						int color,
 						int needEntireRev, 
 						bool loadSASamp, 
@@ -306,6 +335,8 @@ public:
  * @param sa            the suffix array to convert to a Ebwt
  * @param s             the original string
  * @param out
+ * @param padAt         if not NULL, leave out the alignment padding and
+ *                      store where it belongs in out5 and out6 here
  */
 template <typename index_t, typename full_index_t>
 template <typename TStr>
@@ -313,7 +344,8 @@ void LocalEbwt<index_t, full_index_t>::buildToDisk(
 									 InorderBlockwiseSA<TStr>& sa,
 									 const TStr& s,
 									 ostream& out5,
-									 ostream& out6)
+									 ostream& out6,
+									 size_t* padAt)
 {
 	assert_leq(s.length(), std::numeric_limits<index_t>::max());
 	const EbwtParams<index_t>& eh = this->_eh;
@@ -391,6 +423,17 @@ void LocalEbwt<index_t, full_index_t>::buildToDisk(
 	ASSERT_ONLY(bool inSA = true); // true iff saI still points inside suffix
 	// array (as opposed to the padding at the
 	// end)
+	// Start ebwt and offs on local_index_align boundaries, so that
+	// readers can use them in place from memory-mapped files.  When
+	// building into a LocalEbwtBuf, just note where the padding goes.
+	if(padAt != NULL) {
+		padAt[0] = (size_t)out5.tellp();
+		padAt[1] = (size_t)out6.tellp();
+	} else {
+		for(size_t pad = localIndexPad((size_t)out5.tellp()); pad > 0; pad--) out5.put(0);
+		for(size_t pad = localIndexPad((size_t)out6.tellp()); pad > 0; pad--) out6.put(0);
+	}
+
 	// Iterate over packed bwt bytes
 	VMSG_NL("Entering Ebwt loop");
 	ASSERT_ONLY(uint32_t beforeEbwtOff = (uint32_t)out5.tellp());
@@ -639,7 +682,9 @@ void LocalEbwt<index_t, full_index_t>::readIntoMemory(
 										full_index_t& tidx,
 										full_index_t& localOffset,
 										bool switchEndian,
-										size_t bytesRead,
+										size_t& bytesRead,
+										size_t& bytesRead6,
+										bool aligned,
 										int color,
 										int entireRev,
 										bool loadSASamp,
@@ -777,6 +822,16 @@ void LocalEbwt<index_t, full_index_t>::readIntoMemory(
 		fseek(in5, this->_nFrag*sizeof(index_t)*3, SEEK_CUR);
 	}
 	
+	if(aligned) {
+		// Skip the padding that puts ebwt on a local_index_align boundary
+		size_t pad = localIndexPad((size_t)ftello(in5));
+		if(this->_useMm) {
+			assert_eq(bytesRead, (size_t)ftello(in5));
+			bytesRead += pad;
+		}
+		fseek(in5, pad, SEEK_CUR);
+	}
+	
 	this->_ebwt.reset();
 	if(this->_useMm) {
 #ifdef BOWTIE_MM
@@ -955,7 +1010,15 @@ void LocalEbwt<index_t, full_index_t>::readIntoMemory(
 	
 	this->_offs.reset();
 	if(loadSASamp) {
-		bytesRead = 4; // reset for secondary index file (already read 1-sentinel)		
+		if(aligned) {
+			// Skip the padding that puts offs on a local_index_align boundary
+			size_t pad = localIndexPad((size_t)ftello(in6));
+			if(this->_useMm) {
+				assert_eq(bytesRead6, (size_t)ftello(in6));
+				bytesRead6 += pad;
+			}
+			fseek(in6, pad, SEEK_CUR);
+		}
 		shmemLeader = true;
 		if(this->_verbose || startVerbose) {
 			cerr << "Reading offs (" << offsLenSampled << " " << std::setw(2) << sizeof(index_t)*8 << "-bit words): ";
@@ -1016,8 +1079,8 @@ void LocalEbwt<index_t, full_index_t>::readIntoMemory(
 				} else {
 					if(this->_useMm) {
 #ifdef BOWTIE_MM
-						this->_offs.init((index_t*)(mmFile[1] + bytesRead), offsLen, false);
-						bytesRead += (offsLen * sizeof(index_t));
+						this->_offs.init((index_t*)(mmFile[1] + bytesRead6), offsLen, false);
+						bytesRead6 += (offsLen * sizeof(index_t));
 						fseek(in6, (offsLen * sizeof(index_t)), SEEK_CUR);
 #endif
 					} else {
@@ -1064,6 +1127,380 @@ void LocalEbwt<index_t, full_index_t>::readIntoMemory(
 	if(this->_verbose || startVerbose) this->print(cerr, this->_eh);
 }
 
+/**
+ * One local index of a HierEbwt: the stretch of reference 'tidx' it
+ * covers and where its unambiguous characters sit in the joined
+ * string.  Its reference records are szs[szsOff, szsOff+szsLen) of the
+ * LocalEbwtBuilder that owns it.
+ */
+template <typename index_t>
+struct LocalEbwtJob {
+	index_t tidx;
+	index_t localOffset;
+	index_t indexSize;
+	index_t sOff;
+	index_t sztot;
+	size_t  szsOff;
+	size_t  szsLen;
+};
+
+/**
+ * The .5 and .6 bytes of one local index, built in memory so that local
+ * indexes built on different threads can be written out in order.  The
+ * padding that aligns ebwt and offs depends on where the index lands in
+ * the files, so LocalEbwt::buildToDisk() leaves it out and notes where
+ * it goes in padAt[]; write() puts it back.
+ */
+struct LocalEbwtBuf {
+
+	LocalEbwtBuf() { clear(); }
+
+	void clear() {
+		out5.str("");
+		out6.str("");
+		out5.clear();
+		out6.clear();
+		padAt[0] = padAt[1] = std::numeric_limits<size_t>::max();
+	}
+
+	/**
+	 * Append the index to the .5 and .6 files, with the padding if
+	 * 'aligned' (EBWT_LOCAL_ALIGNED).
+	 */
+	void write(ostream& fout5, ostream& fout6, bool aligned) const {
+		writePadded(out5.str(), aligned ? padAt[0] : std::numeric_limits<size_t>::max(), fout5);
+		writePadded(out6.str(), aligned ? padAt[1] : std::numeric_limits<size_t>::max(), fout6);
+	}
+
+	stringstream out5;
+	stringstream out6;
+	size_t       padAt[2]; // max() if the index is empty and has no padding
+
+private:
+
+	static void writePadded(const string& b, size_t off, ostream& fout) {
+		if(off > b.size()) {
+			fout.write(b.data(), b.size());
+			return;
+		}
+		fout.write(b.data(), off);
+		for(size_t pad = localIndexPad((size_t)fout.tellp()); pad > 0; pad--) fout.put(0);
+		fout.write(b.data() + off, b.size() - off);
+	}
+};
+
+/**
+ * Copy characters [off, off+len) of the joined string 's' into 'dst'.
+ */
+static inline void installLocal(SString<char>& dst, const SString<char>& s, size_t off, size_t len) {
+	assert_gt(len, 0);
+	dst.install(s.buf() + off, len);
+}
+
+/**
+ * Packed strings can't be copied from the middle of a word, so copy
+ * them a character at a time.
+ */
+static inline void installLocal(S2bDnaString& dst, const S2bDnaString& s, size_t off, size_t len) {
+	dst.resize(len);
+	for(size_t i = 0; i < len; i++) {
+		dst.set(s[off + i], i);
+	}
+}
+
+/**
+ * Builds the local indexes of a HierEbwt and writes them to the .5 and
+ * .6 files.  With more than one thread, workers claim the jobs in order
+ * and build each into a LocalEbwtBuf; job j uses buffer j % nbufs and
+ * isn't started until job j - nbufs has been written, so at most nbufs
+ * indexes are held in memory.  The calling thread writes the buffers out
+ * in job order, so the files are the same whatever the thread count.
+ */
+template <typename index_t, typename local_index_t, typename TStr>
+class LocalEbwtBuilder {
+
+	typedef LocalEbwt<local_index_t, index_t> TLocalEbwt;
+
+public:
+
+	LocalEbwtBuilder(
+		TStr& s,
+		bool packed,
+		int color,
+		int needEntireReverse,
+		int32_t localOffRate,
+		int32_t localFtabChars,
+		const string& file,
+		bool fw,
+		int dcv,
+		const RefReadInParams& refparams,
+		uint32_t seed,
+		bool passMemExc,
+		bool sanityCheck,
+		bool sais = false,
+		bool aligned = false) :
+		_s(s),
+		_packed(packed),
+		_color(color),
+		_needEntireReverse(needEntireReverse),
+		_localOffRate(localOffRate),
+		_localFtabChars(localFtabChars),
+		_file(file),
+		_fw(fw),
+		_dcv(dcv),
+		_refparams(refparams),
+		_seed(seed),
+		_passMemExc(passMemExc),
+		_sanityCheck(sanityCheck),
+		_sais(sais),
+		_aligned(aligned),
+		_jobs(EBWT_CAT),
+		_szs(EBWT_CAT),
+		_threads(EBWT_CAT),
+		_bufs(NULL),
+		_built(NULL),
+		_nbufs(0),
+		_claim(0),
+		_taken(0),
+		_err(0)
+	{ }
+
+	/**
+	 * Add a local index covering the given records to the end of the
+	 * list.
+	 */
+	void addJob(
+		index_t tidx,
+		index_t localOffset,
+		index_t indexSize,
+		index_t sOff,
+		index_t sztot,
+		const EList<RefRecord>& szs)
+	{
+		_jobs.expand();
+		LocalEbwtJob<index_t>& job = _jobs.back();
+		job.tidx = tidx;
+		job.localOffset = localOffset;
+		job.indexSize = indexSize;
+		job.sOff = sOff;
+		job.sztot = sztot;
+		job.szsOff = _szs.size();
+		job.szsLen = szs.size();
+		for(size_t i = 0; i < szs.size(); i++) {
+			_szs.push_back(szs[i]);
+		}
+	}
+
+	/**
+	 * Build every local index on 'nthreads' threads, writing them to
+	 * 'fout5' and 'fout6' and appending them to 'localEbwts' in the
+	 * order they were added.
+	 */
+	void run(
+		ostream& fout5,
+		ostream& fout6,
+		EList<EList<TLocalEbwt*> >& localEbwts,
+		int nthreads);
+
+private:
+
+	TLocalEbwt* build(
+		size_t j,
+		ostream& out5,
+		ostream& out6,
+		size_t* padAt,
+		EList<TIndexOffU>* bktBuf);
+
+	void buildJobs();
+
+	static void buildJobsWorker(void *vp) {
+		((LocalEbwtBuilder<index_t, local_index_t, TStr>*)vp)->buildJobs();
+	}
+
+	TStr&                  _s;
+	bool                   _packed;
+	int                    _color;
+	int                    _needEntireReverse;
+	int32_t                _localOffRate;
+	int32_t                _localFtabChars;
+	const string&          _file;
+	bool                   _fw;
+	int                    _dcv;
+	const RefReadInParams& _refparams;
+	uint32_t               _seed;
+	bool                   _passMemExc;
+	bool                   _sanityCheck;
+	bool                   _sais;
+	bool                   _aligned; // pad for EBWT_LOCAL_ALIGNED
+
+	EList<LocalEbwtJob<index_t> > _jobs;
+	EList<RefRecord>       _szs;   // records of all jobs, concatenated
+
+	// Used by run() with more than one thread; everything below _nbufs
+	// is guarded by _mutex
+	EList<tthread::thread*> _threads;
+	LocalEbwtBuf*          _bufs;  // per-job output, indexed by job % _nbufs
+	TLocalEbwt**           _built; // finished index in each buffer, or NULL
+	size_t                 _nbufs;
+	size_t                 _claim; // next job for a worker to build
+	size_t                 _taken; // # jobs written out
+	int                    _err;   // 1 = bad_alloc, 2 = fatal error
+	tthread::mutex         _mutex;
+	tthread::condition_variable _cond;
+};
+
+template <typename index_t, typename local_index_t, typename TStr>
+LocalEbwt<local_index_t, index_t>* LocalEbwtBuilder<index_t, local_index_t, TStr>::build(
+	size_t j,
+	ostream& out5,
+	ostream& out6,
+	size_t* padAt,
+	EList<TIndexOffU>* bktBuf)
+{
+	const LocalEbwtJob<index_t>& job = _jobs[j];
+	EList<RefRecord> conv_local_szs;
+	for(size_t i = 0; i < job.szsLen; i++) {
+		conv_local_szs.push_back(_szs[job.szsOff + i]);
+	}
+	TStr local_s;
+	installLocal(local_s, _s, job.sOff, job.sztot);
+	return new TLocalEbwt(
+		local_s,
+		job.tidx,
+		job.localOffset,
+		job.indexSize,
+		_packed,
+		_color,
+		_needEntireReverse,
+		local_lineRate,
+		_localOffRate,      // suffix-array sampling rate
+		_localFtabChars,    // number of chars in initial arrow-pair calc
+		_file,              // basename for .?.ebwt files
+		_fw,                // fw
+		_dcv,               // difference-cover period
+		conv_local_szs,     // list of reference sizes
+		job.sztot,          // total size of all unambiguous ref chars
+		_refparams,         // reference read-in parameters
+		_seed,              // pseudo-random number generator seed
+		out5,
+		out6,
+		-1,                 // override offRate
+		false,              // be silent
+		_passMemExc,        // pass exceptions up to the toplevel so that we can adjust memory settings automatically
+		_sanityCheck,       // verify results and internal consistency
+		padAt,
+		bktBuf,
+		_sais);
+}
+
+template <typename index_t, typename local_index_t, typename TStr>
+void LocalEbwtBuilder<index_t, local_index_t, TStr>::run(
+	ostream& fout5,
+	ostream& fout6,
+	EList<EList<TLocalEbwt*> >& localEbwts,
+	int nthreads)
+{
+	if(nthreads <= 1 || _jobs.size() <= 1) {
+		// Without padding, where it would go is simply not used
+		size_t noPad[2];
+		for(size_t j = 0; j < _jobs.size(); j++) {
+			localEbwts[_jobs[j].tidx].push_back(build(j, fout5, fout6, _aligned ? NULL : noPad, NULL));
+		}
+		return;
+	}
+	nthreads = (int)min<size_t>((size_t)nthreads, _jobs.size());
+	_nbufs = min<size_t>((size_t)(nthreads << 1), _jobs.size());
+	_bufs = new LocalEbwtBuf[_nbufs];
+	_built = new TLocalEbwt*[_nbufs];
+	for(size_t i = 0; i < _nbufs; i++) {
+		_built[i] = NULL;
+	}
+	_claim = _taken = 0;
+	_err = 0;
+	for(int i = 0; i < nthreads; i++) {
+		_threads.push_back(new tthread::thread(buildJobsWorker, (void*)this));
+	}
+	for(size_t j = 0; j < _jobs.size(); j++) {
+		size_t b = j % _nbufs;
+		_mutex.lock();
+		while(_built[b] == NULL && _err == 0) {
+			_cond.wait(_mutex);
+		}
+		TLocalEbwt* localEbwt = _built[b];
+		_mutex.unlock();
+		if(localEbwt == NULL) break; // a worker failed
+		// No worker touches buffer b again until _taken passes j
+		_bufs[b].write(fout5, fout6, _aligned);
+		localEbwts[_jobs[j].tidx].push_back(localEbwt);
+		_mutex.lock();
+		_built[b] = NULL;
+		_taken = j + 1;
+		_cond.notify_all();
+		_mutex.unlock();
+	}
+	for(size_t i = 0; i < _threads.size(); i++) {
+		_threads[i]->join();
+		delete _threads[i];
+	}
+	_threads.clear();
+	for(size_t i = 0; i < _nbufs; i++) {
+		delete _built[i];
+	}
+	delete[] _built;
+	delete[] _bufs;
+	_built = NULL;
+	_bufs = NULL;
+	if(_err == 1) {
+		throw bad_alloc();
+	} else if(_err != 0) {
+		throw 1;
+	}
+}
+
+/**
+ * Worker loop: claim the next job once its buffer is free, build it
+ * outside the lock, and hand it over.  An error stops all workers; run()
+ * rethrows it on the calling thread.
+ */
+template <typename index_t, typename local_index_t, typename TStr>
+void LocalEbwtBuilder<index_t, local_index_t, TStr>::buildJobs() {
+	EList<TIndexOffU> bktBuf(EBWT_CAT);
+	while(true) {
+		size_t j;
+		_mutex.lock();
+		while(_err == 0 && _claim < _jobs.size() && _claim >= _taken + _nbufs) {
+			_cond.wait(_mutex);
+		}
+		if(_err != 0 || _claim >= _jobs.size()) {
+			_mutex.unlock();
+			return;
+		}
+		j = _claim++;
+		_mutex.unlock();
+		LocalEbwtBuf& buf = _bufs[j % _nbufs];
+		buf.clear();
+		TLocalEbwt* localEbwt = NULL;
+		int err = 0;
+		try {
+			localEbwt = build(j, buf.out5, buf.out6, buf.padAt, &bktBuf);
+		} catch(bad_alloc& e) {
+			err = 1;
+		} catch(int e) {
+			err = 2;
+		} catch(...) {
+			err = 2;
+		}
+		_mutex.lock();
+		if(err != 0) {
+			if(_err == 0) _err = err;
+		} else {
+			_built[j % _nbufs] = localEbwt;
+		}
+		_cond.notify_all();
+		_mutex.unlock();
+	}
+}
+
 /**
  * Extended Burrows-Wheeler transform data.
  * HierEbwt is a specialized Ebwt index that represents one global index and a large set of local indexes.
@@ -1111,7 +1548,9 @@ public:
 						   sanityCheck,
 						   skipLoading),
 	         _in5(NULL),
-	         _in6(NULL)
+	         _in6(NULL),
+	         mmFile5_(NULL),
+	         mmFile6_(NULL)
 	{
 		_in5Str = in + ".5." + gEbwt_ext;
 		_in6Str = in + ".6." + gEbwt_ext;
@@ -1163,7 +1602,7 @@ public:
 			 TIndexOffU bmaxSqrtMult,
 			 TIndexOffU bmaxDivN,
 			 int dcv,
-			 EList<FileBuf*>& is,
+			 const PackedRef& ref,
 			 EList<RefRecord>& szs,
 			 index_t sztot,
 			 const RefReadInParams& refparams,
@@ -1171,11 +1610,46 @@ public:
 			 int32_t overrideOffRate = -1,
 			 bool verbose = false,
 			 bool passMemExc = false,
-			 bool sanityCheck = false);
+			 bool sanityCheck = false,
+			 bool packedOcc = false,
+			 bool packedSa = false,
+			 int nthreads = 1,
+			 uint64_t maxMem = 0,
+			 bool alignedLocal = false,
+			 bool off40 = false);
 	        	
 	~HierEbwt() {
 		clearLocalEbwts();
 	}
+
+	/**
+	 * Return the approximate number of bytes the local index builds
+	 * take on 'nthreads' threads, not counting the joined string: each
+	 * thread's copy of its local string and suffix-array builder, and
+	 * the finished local indexes (about a byte per character) waiting
+	 * to be written out.
+	 */
+	template <typename TStr>
+	static uint64_t localMemEstimate(int nthreads, int dcv, bool sais) {
+		uint64_t len = local_index_size;
+		uint64_t sa;
+		if(sais) {
+			sa = SaisBlockwiseSA<TStr>::peakBytes(len);
+		} else {
+			sa = DifferenceCoverSample<TStr>::peakBytes(len, dcv, true) +
+			     KarkkainenBlockwiseSA<TStr>::peakBytes(len, len + 1, 1);
+		}
+		return (uint64_t)nthreads * (len + sa) + (uint64_t)nthreads * 2 * len;
+	}
+
+	/**
+	 * Return true iff the local indexes should be built with SA-IS,
+	 * i.e. iff 'nthreads' of them fit in the memory budget 'maxMem'.
+	 */
+	template <typename TStr>
+	static bool localSais(int nthreads, uint64_t maxMem) {
+		return maxMem > 0 && localMemEstimate<TStr>(nthreads, 0, true) <= maxMem;
+	}
     
     /**
 	 * Load this Ebwt into memory by reading it in from the _in1 and
@@ -1225,6 +1699,21 @@ public:
 		PARENT_CLASS::evictFromMemory();		
 	}
 	
+	/**
+	 * Print which of the big index arrays, including the local
+	 * indexes, got huge pages.
+	 */
+	void printHugePages(ostream& out) const {
+		PARENT_CLASS::printHugePages(out);
+		out << "Huge pages for " << _in5Str << ", " << _in6Str << ": ";
+		if(huge5_.get() != NULL) {
+			out << "local indexes " << huge5_.kindName() << endl;
+		} else {
+			out << "none; local indexes are "
+			    << (mmFile5_ != NULL ? "memory-mapped" : "read into memory") << endl;
+		}
+	}
+	
 	/**
 	 * Sanity-check various pieces of the Ebwt
 	 */
@@ -1278,6 +1767,15 @@ public:
 		}
 		
 		_localEbwts.clear();
+		
+#ifdef BOWTIE_MM
+		// Nothing points into the mapped local index files anymore
+		unmapIndexFile(map5_);
+		unmapIndexFile(map6_);
+#endif
+		huge5_.free();
+		huge6_.free();
+		mmFile5_ = mmFile6_ = NULL;
 	}
 	
 
@@ -1293,8 +1791,12 @@ public:
 	string                                   _in5Str;
 	string                                   _in6Str;
 	
-	char                                     *mmFile5_;
-	char                                     *mmFile6_;
+	char                                     *mmFile5_; // .5 file contents, if mapped or on huge pages
+	char                                     *mmFile6_; // .6 file contents, likewise
+	IndexFileMap                             map5_;    // .5 file, if memory-mapped
+	IndexFileMap                             map6_;    // .6 file, if memory-mapped
+	HugePageBuf                              huge5_;   // .5 file contents, with huge pages
+	HugePageBuf                              huge6_;   // .6 file contents, with huge pages
 };
     
 /// Construct an Ebwt from the given header parameters and string
@@ -1320,7 +1822,7 @@ HierEbwt<index_t, local_index_t>::HierEbwt(
                                            TIndexOffU bmaxSqrtMult,
                                            TIndexOffU bmaxDivN,
                                            int dcv,
-                                           EList<FileBuf*>& is,
+                                           const PackedRef& ref,
                                            EList<RefRecord>& szs,
                                            index_t sztot,
                                            const RefReadInParams& refparams,
@@ -1328,7 +1830,13 @@ HierEbwt<index_t, local_index_t>::HierEbwt(
                                            int32_t overrideOffRate,
                                            bool verbose,
                                            bool passMemExc,
-                                           bool sanityCheck) :
+                                           bool sanityCheck,
+                                           bool packedOcc,
+                                           bool packedSa,
+                                           int nthreads,
+                                           uint64_t maxMem,
+                                           bool alignedLocal,
+                                           bool off40) :
     Ebwt<index_t>(s,
                   packed,
                   color,
@@ -1343,7 +1851,7 @@ HierEbwt<index_t, local_index_t>::HierEbwt(
                   bmaxSqrtMult,
                   bmaxDivN,
                   dcv,
-                  is,
+                  ref,
                   szs,
                   sztot,
                   refparams,
@@ -1351,9 +1859,16 @@ HierEbwt<index_t, local_index_t>::HierEbwt(
                   overrideOffRate,
                   verbose,
                   passMemExc,
-                  sanityCheck),
+                  sanityCheck,
+                  packedOcc,
+                  packedSa,
+                  nthreads,
+                  maxMem,
+                  off40),
     _in5(NULL),
-    _in6(NULL)
+    _in6(NULL),
+    mmFile5_(NULL),
+    mmFile6_(NULL)
 {
     _in5Str = file + ".5." + gEbwt_ext;
     _in6Str = file + ".6." + gEbwt_ext;
@@ -1540,11 +2055,28 @@ HierEbwt<index_t, local_index_t>::HierEbwt(
     int32_t flags = 1;
     if(this->_eh._color) flags |= EBWT_COLOR;
     if(this->_eh._entireReverse) flags |= EBWT_ENTIRE_REV;
+    if(alignedLocal) flags |= EBWT_LOCAL_ALIGNED;
     writeI32(fout5, -flags, be); // BTL: chunkRate is now deprecated
     
-    // build local FM indexes
+    // build local FM indexes, with SA-IS if every thread's local
+    // suffix array fits in the memory budget
+    LocalEbwtBuilder<index_t, local_index_t, TStr> builder(
+                                                           s,
+                                                           packed,
+                                                           color,
+                                                           needEntireReverse,
+                                                           localOffRate,
+                                                           localFtabChars,
+                                                           file,
+                                                           fw,
+                                                           dcv,
+                                                           refparams,
+                                                           seed,
+                                                           passMemExc,
+                                                           sanityCheck,
+                                                           localSais<TStr>(nthreads, maxMem),
+                                                           alignedLocal);
     index_t curr_sztot = 0;
-    ASSERT_ONLY(bool firstIndex = true);
     for(size_t tidx = 0; tidx < _refLens.size(); tidx++) {
         index_t refLen = _refLens[tidx];
         index_t local_offset = 0;
@@ -1573,44 +2105,17 @@ HierEbwt<index_t, local_index_t>::HierEbwt(
                 local_sztot += local_szs[i].len;
                 local_len += local_szs[i].len;
             }
-            TStr local_s;
-            local_s.resize(local_sztot);
+            index_t sOff = curr_sztot;
             if(refparams.reverse == REF_READ_REVERSE) {
-                local_s.install(s.buf() + s.length() - curr_sztot - local_sztot, local_sztot);
-            } else {
-                local_s.install(s.buf() + curr_sztot, local_sztot);
+                sOff = s.length() - curr_sztot - local_sztot;
             }
-            LocalEbwt<local_index_t, index_t>* localEbwt = new LocalEbwt<local_index_t, index_t>(
-                                                                                                 local_s,
-                                                                                                 tidx,
-                                                                                                 local_offset,
-                                                                                                 index_size,
-                                                                                                 packed,
-                                                                                                 color,
-                                                                                                 needEntireReverse,
-                                                                                                 local_lineRate,
-                                                                                                 localOffRate,      // suffix-array sampling rate
-                                                                                                 localFtabChars,    // number of chars in initial arrow-pair calc
-                                                                                                 file,               // basename for .?.ebwt files
-                                                                                                 fw,                 // fw
-                                                                                                 dcv,                // difference-cover period
-                                                                                                 conv_local_szs,     // list of reference sizes
-                                                                                                 local_sztot,        // total size of all unambiguous ref chars
-                                                                                                 refparams,          // reference read-in parameters
-                                                                                                 seed,               // pseudo-random number generator seed
-                                                                                                 fout5,
-                                                                                                 fout6,
-                                                                                                 -1,                 // override offRate
-                                                                                                 false,              // be silent
-                                                                                                 passMemExc,         // pass exceptions up to the toplevel so that we can adjust memory settings automatically
-                                                                                                 sanityCheck);       // verify results and internal consistency
-            ASSERT_ONLY(firstIndex = false);
-            _localEbwts[tidx].push_back(localEbwt);
+            builder.addJob(tidx, local_offset, index_size, sOff, local_sztot, conv_local_szs);
             curr_sztot += local_sztot_interval;
             local_offset += local_index_interval;
         }
     }
     assert_eq(curr_sztot, sztot);
+    builder.run(fout5, fout6, _localEbwts, nthreads);
     
     
     fout5 << '\0';
@@ -1697,9 +2202,6 @@ void HierEbwt<index_t, local_index_t>::readIntoMemory(
                                  startVerbose);
 
 	bool switchEndian; // dummy; caller doesn't care
-#ifdef BOWTIE_MM
-	char *mmFile[] = { NULL, NULL };
-#endif
 	if(_in5Str.length() > 0) {
 		if(this->_verbose || startVerbose) {
 			cerr << "  About to open input files: ";
@@ -1722,55 +2224,7 @@ void HierEbwt<index_t, local_index_t>::readIntoMemory(
 			cerr << "  Finished opening input files: ";
 			logTime(cerr);
 		}
-		
-#ifdef BOWTIE_MM
-		if(this->_useMm /*&& !justHeader*/) {
-			const char *names[] = {_in5Str.c_str(), _in6Str.c_str()};
-            int fds[] = { fileno(_in5), fileno(_in6) };
-			for(int i = 0; i < (loadSASamp ? 2 : 1); i++) {
-				if(this->_verbose || startVerbose) {
-					cerr << "  ¯ " << (i+1) << ": ";
-					logTime(cerr);
-				}
-				struct stat sbuf;
-				if (stat(names[i], &sbuf) == -1) {
-					perror("stat");
-					cerr << "Error: Could not stat index file " << names[i] << " prior to memory-mapping" << endl;
-					throw 1;
-				}
-                mmFile[i] = (char*)mmap((void *)0, (size_t)sbuf.st_size,
-										PROT_READ, MAP_SHARED, fds[(size_t)i], 0);
-				if(mmFile[i] == (void *)(-1)) {
-					perror("mmap");
-					cerr << "Error: Could not memory-map the index file " << names[i] << endl;
-					throw 1;
-				}
-				if(mmSweep) {
-					int sum = 0;
-					for(off_t j = 0; j < sbuf.st_size; j += 1024) {
-						sum += (int) mmFile[i][j];
-					}
-					if(startVerbose) {
-						cerr << "  Swept the memory-mapped ebwt index file 1; checksum: " << sum << ": ";
-						logTime(cerr);
-					}
-				}
-			}
-			mmFile5_ = mmFile[0];
-			mmFile6_ = loadSASamp ? mmFile[1] : NULL;
-		}
-#endif
-	}
-#ifdef BOWTIE_MM
-	else if(this->_useMm && !justHeader) {
-		mmFile[0] = mmFile5_;
-		mmFile[1] = mmFile6_;
-	}
-	if(this->_useMm && !justHeader) {
-		assert(mmFile[0] == mmFile5_);
-		assert(mmFile[1] == mmFile6_);
 	}
-#endif
 	
 	if(this->_verbose || startVerbose) {
 		cerr << "  Reading header: ";
@@ -1812,7 +2266,8 @@ void HierEbwt<index_t, local_index_t>::readIntoMemory(
 	// user has to tell us whether there's an ISA sample and what the
 	// sampling rate is.
 	int32_t ftabChars = readI32(_in5, switchEndian); bytesRead += 4;
-	/*int32_t flag  =*/ readI32(_in5, switchEndian); bytesRead += 4;
+	int32_t flags     = readI32(_in5, switchEndian); bytesRead += 4;
+	bool aligned = (flags < 0 && (((-flags) & EBWT_LOCAL_ALIGNED) != 0));
     
     if(this->_verbose || startVerbose) {
         cerr << "    number of local indexes: " << _nlocalEbwts << endl
@@ -1824,7 +2279,83 @@ void HierEbwt<index_t, local_index_t>::readIntoMemory(
 	
 	clearLocalEbwts();
 	
+	// The local indexes point straight into memory-mapped .5/.6 files
+	// if --mm was given, or if the index was built with the local
+	// sections aligned for it, so that processes sharing an index share
+	// its pages and don't pay to copy the local indexes in.  With huge
+	// pages (and no --mm), each file is instead read whole into one
+	// huge-page-backed block, and the local indexes point into that.
+	// Otherwise they are read into memory one array at a time.
+	bool localMm = false, localHuge = false;
+#ifdef BOWTIE_MM
+	localHuge = this->_hugePages && !this->_useMm && !switchEndian && !this->useShmem_;
+	localMm = !localHuge && (this->_useMm || aligned) && !switchEndian && !this->useShmem_;
+	if(localHuge) {
+		const char *names[] = {_in5Str.c_str(), _in6Str.c_str()};
+		FILE *files[] = { _in5, _in6 };
+		HugePageBuf *bufs[] = { &huge5_, &huge6_ };
+		char *data[] = { NULL, NULL };
+		for(int i = 0; i < (loadSASamp ? 2 : 1); i++) {
+			if(this->_verbose || startVerbose) {
+				cerr << "  Reading " << names[i] << " onto huge pages: ";
+				logTime(cerr);
+			}
+			struct stat sbuf;
+			if(fstat(fileno(files[i]), &sbuf) == -1) {
+				perror("stat");
+				cerr << "Error: Could not stat index file " << names[i] << endl;
+				throw 1;
+			}
+			size_t sz = (size_t)sbuf.st_size;
+			data[i] = (char*)bufs[i]->alloc(sz);
+			if(data[i] == NULL) {
+				cerr << "Out of memory allocating the local indexes in " << names[i] << "." << endl
+				     << "Please try again on a computer with more memory." << endl;
+				throw 1;
+			}
+			off_t pos = ftello(files[i]);
+			fseeko(files[i], 0, SEEK_SET);
+			if(fread(data[i], 1, sz, files[i]) != sz) {
+				cerr << "Error reading index file " << names[i] << endl;
+				throw 1;
+			}
+			fseeko(files[i], pos, SEEK_SET);
+		}
+		mmFile5_ = data[0];
+		mmFile6_ = data[1];
+	} else if(localMm) {
+		const char *names[] = {_in5Str.c_str(), _in6Str.c_str()};
+		FILE *files[] = { _in5, _in6 };
+		IndexFileMap *maps[] = { &map5_, &map6_ };
+		char *mmFile[] = { NULL, NULL };
+		for(int i = 0; i < (loadSASamp ? 2 : 1); i++) {
+			if(this->_verbose || startVerbose) {
+				cerr << "  Memory-mapping " << names[i] << ": ";
+				logTime(cerr);
+			}
+			mmFile[i] = mapIndexFile(names[i], fileno(files[i]), *maps[i], this->_shmIndex, this->_verbose || startVerbose);
+			if(mmSweep) {
+				int sum = 0;
+				for(size_t j = 0; j < maps[i]->len; j += 1024) {
+					sum += (int) mmFile[i][j];
+				}
+				if(startVerbose) {
+					cerr << "  Swept the memory-mapped local index file " << (i+5) << "; checksum: " << sum << ": ";
+					logTime(cerr);
+				}
+			}
+		}
+		mmFile5_ = mmFile[0];
+		mmFile6_ = mmFile[1];
+	}
+#endif
+	if(this->_verbose || startVerbose) {
+		cerr << "    local indexes: " << (aligned ? "aligned" : "unaligned") << ", "
+		     << (localHuge ? "on huge pages" : (localMm ? "memory-mapped" : "read into memory")) << endl;
+	}
+	
 	index_t tidx = 0, localOffset = 0;
+	size_t bytesRead6 = 4; // already read the 1-sentinel
 	string base = "";
 	for(size_t i = 0; i < _nlocalEbwts; i++) {
 		LocalEbwt<local_index_t, index_t> *localEbwt = new LocalEbwt<local_index_t, index_t>(base,
@@ -1836,6 +2367,8 @@ void HierEbwt<index_t, local_index_t>::readIntoMemory(
                                                                                              localOffset,
                                                                                              switchEndian,
                                                                                              bytesRead,
+                                                                                             bytesRead6,
+                                                                                             aligned,
                                                                                              color,
                                                                                              needEntireRev,
                                                                                              this->fw_,
@@ -1844,7 +2377,7 @@ void HierEbwt<index_t, local_index_t>::readIntoMemory(
                                                                                              (uint32_t)lineRate,
                                                                                              (uint32_t)offRate,
                                                                                              (uint32_t)ftabChars,
-                                                                                             this->_useMm,
+                                                                                             localMm || localHuge,
                                                                                              this->useShmem_,
                                                                                              mmSweep,
                                                                                              loadNames,
@@ -38,4 +38,9 @@ static const int32_t  local_offRate        = 3;
 // the look table in a local index 4^<int> entries
 static const int32_t  local_ftabChars      = 6;
 
+// in indexes built with EBWT_LOCAL_ALIGNED, each local index's ebwt (.5 file)
+// and offs (.6 file) begin on a multiple of this many bytes, so that they can be
+// used in place from a memory-mapped file
+static const uint32_t local_index_align    = 4096;
+
 #endif /*HIEREBWT_COMMON_H_*/
@@ -27,6 +27,10 @@
 #include <math.h>
 #include <utility>
 #include <limits>
+#include <sstream>
+#include <signal.h>
+#include <unistd.h>
+#include <limits.h>
 #include "alphabet.h"
 #include "assert_helpers.h"
 #include "endian_swap.h"
@@ -34,6 +38,7 @@
 #include "bt2_io.h"
 #include "bt2_util.h"
 #include "hier_idx.h"
+#include "kmer_table.h"
 #include "formats.h"
 #include "sequence_io.h"
 #include "tokenize.h"
@@ -57,6 +62,8 @@
 #include "presets.h"
 #include "opts.h"
 #include "outq.h"
+#include "align_daemon.h"
+#include "hisat_api.h"
 #include "aligner_seed2.h"
 
 #if __cplusplus <= 199711L
@@ -65,220 +72,254 @@
 
 using namespace std;
 
-static EList<string> mates1;  // mated reads (first mate)
-static EList<string> mates2;  // mated reads (second mate)
-static EList<string> mates12; // mated reads (1st/2nd interleaved in 1 file)
-static string adjIdxBase;
-bool gColor;              // colorspace (not supported)
-int gVerbose;             // be talkative
-static bool startVerbose; // be talkative at startup
-int gQuiet;               // print nothing but the alignments
-static int sanityCheck;   // enable expensive sanity checks
-static int format;        // default read format is FASTQ
-static string origString; // reference text, or filename(s)
-static int seed;          // srandom() seed
-static int timing;        // whether to report basic timing data
-static int metricsIval;   // interval between alignment metrics messages (0 = no messages)
-static string metricsFile;// output file to put alignment metrics in
-static bool metricsStderr;// output file to put alignment metrics in
-static bool metricsPerRead; // report a metrics tuple for every read
-static bool allHits;      // for multihits, report just one
-static bool showVersion;  // just print version and quit?
-static int ipause;        // pause before maching?
-static uint32_t qUpto;    // max # of queries to read
-int gTrim5;               // amount to trim from 5' end
-int gTrim3;               // amount to trim from 3' end
-static int offRate;       // keep default offRate
-static bool solexaQuals;  // quality strings are solexa quals, not phred, and subtract 64 (not 33)
-static bool phred64Quals; // quality chars are phred, but must subtract 64 (not 33)
-static bool integerQuals; // quality strings are space-separated strings of integers, not ASCII
-static int nthreads;      // number of pthreads operating concurrently
-static int outType;       // style of output
-static bool noRefNames;   // true -> print reference indexes; not names
-static uint32_t khits;    // number of hits per read; >1 is much slower
-static uint32_t mhits;    // don't report any hits if there are > mhits
-static int partitionSz;   // output a partitioning key in first field
-static bool useSpinlock;  // false -> don't use of spinlocks even if they're #defines
-static bool fileParallel; // separate threads read separate input files in parallel
-static bool useShmem;     // use shared memory to hold the index
-static bool useMm;        // use memory-mapped files to hold the index
-static bool mmSweep;      // sweep through memory-mapped files immediately after mapping
-int gMinInsert;           // minimum insert size
-int gMaxInsert;           // maximum insert size
-bool gMate1fw;            // -1 mate aligns in fw orientation on fw strand
-bool gMate2fw;            // -2 mate aligns in rc orientation on fw strand
-bool gFlippedMatesOK;     // allow mates to be in wrong order
-bool gDovetailMatesOK;    // allow one mate to extend off the end of the other
-bool gContainMatesOK;     // allow one mate to contain the other in PE alignment
-bool gOlapMatesOK;        // allow mates to overlap in PE alignment
-bool gExpandToFrag;       // incr max frag length to =larger mate len if necessary
-bool gReportDiscordant;   // find and report discordant paired-end alignments
-bool gReportMixed;        // find and report unpaired alignments for paired reads
-static uint32_t cacheLimit;      // ranges w/ size > limit will be cached
-static uint32_t cacheSize;       // # words per range cache
-static uint32_t skipReads;       // # reads/read pairs to skip
-bool gNofw; // don't align fw orientation of read
-bool gNorc; // don't align rc orientation of read
-static uint32_t fastaContLen;
-static uint32_t fastaContFreq;
-static bool hadoopOut; // print Hadoop status and summary messages
-static bool fuzzy;
-static bool fullRef;
-static bool samTruncQname; // whether to truncate QNAME to 255 chars
-static bool samOmitSecSeqQual; // omit SEQ/QUAL for 2ndary alignments?
-static bool samNoUnal; // don't print records for unaligned reads
-static bool samNoHead; // don't print any header lines in SAM output
-static bool samNoSQ;   // don't print @SQ header lines
-static bool sam_print_as;
-static bool sam_print_xs;  // XS:i
-static bool sam_print_xss; // Xs:i and Ys:i
-static bool sam_print_yn;  // YN:i and Yn:i
-static bool sam_print_xn;
-static bool sam_print_cs;
-static bool sam_print_cq;
-static bool sam_print_x0;
-static bool sam_print_x1;
-static bool sam_print_xm;
-static bool sam_print_xo;
-static bool sam_print_xg;
-static bool sam_print_nm;
-static bool sam_print_md;
-static bool sam_print_yf;
-static bool sam_print_yi;
-static bool sam_print_ym;
-static bool sam_print_yp;
-static bool sam_print_yt;
-static bool sam_print_ys;
-static bool sam_print_zs;
-static bool sam_print_xr;
-static bool sam_print_xt;
-static bool sam_print_xd;
-static bool sam_print_xu;
-static bool sam_print_yl;
-static bool sam_print_ye;
-static bool sam_print_yu;
-static bool sam_print_xp;
-static bool sam_print_yr;
-static bool sam_print_zb;
-static bool sam_print_zr;
-static bool sam_print_zf;
-static bool sam_print_zm;
-static bool sam_print_zi;
-static bool sam_print_zp;
-static bool sam_print_zu;
-static bool sam_print_xs_a;
-static bool sam_print_nh;
-static bool bwaSwLike;
-static float bwaSwLikeC;
-static float bwaSwLikeT;
-static bool qcFilter;
-static bool sortByScore;      // prioritize alignments to report by score?
-bool gReportOverhangs;        // false -> filter out alignments that fall off the end of a reference sequence
-static string rgid;           // ID: setting for @RG header line
-static string rgs;            // SAM outputs for @RG header line
-static string rgs_optflag;    // SAM optional flag to add corresponding to @RG ID
-static bool msample;          // whether to report a random alignment when maxed-out via -m/-M
-int      gGapBarrier;         // # diags on top/bot only to be entered diagonally
-static EList<string> qualities;
-static EList<string> qualities1;
-static EList<string> qualities2;
-static string polstr;         // temporary holder for policy string
-static bool  msNoCache;       // true -> disable local cache
-static int   bonusMatchType;  // how to reward matches
-static int   bonusMatch;      // constant reward if bonusMatchType=constant
-static int   penMmcType;      // how to penalize mismatches
-static int   penMmcMax;       // max mm penalty
-static int   penMmcMin;       // min mm penalty
-static int   penNType;        // how to penalize Ns in the read
-static int   penN;            // constant if N pelanty is a constant
-static bool  penNCatPair;     // concatenate mates before N filtering?
-static bool  localAlign;      // do local alignment in DP steps
-static bool  noisyHpolymer;   // set to true if gap penalties should be reduced to be consistent with a sequencer that under- and overcalls homopolymers
-static int   penRdGapConst;   // constant cost of extending a gap in the read
-static int   penRfGapConst;   // constant cost of extending a gap in the reference
-static int   penRdGapLinear;  // coeff of linear term for cost of gap extension in read
-static int   penRfGapLinear;  // coeff of linear term for cost of gap extension in ref
-static SimpleFunc scoreMin;   // minimum valid score as function of read len
-static SimpleFunc nCeil;      // max # Ns allowed as function of read len
-static SimpleFunc msIval;     // interval between seeds as function of read len
-static double descConsExp;    // how to adjust score minimum as we descent further into index-assisted alignment
-static size_t descentLanding; // don't place a search root if it's within this many positions of end
-static SimpleFunc descentTotSz;    // maximum space a DescentDriver can use in bytes
-static SimpleFunc descentTotFmops; // maximum # FM ops a DescentDriver can perform
-static int    multiseedMms;   // mismatches permitted in a multiseed seed
-static int    multiseedLen;   // length of multiseed seeds
-static size_t multiseedOff;   // offset to begin extracting seeds
-static uint32_t seedCacheLocalMB;   // # MB to use for non-shared seed alignment cacheing
-static uint32_t seedCacheCurrentMB; // # MB to use for current-read seed hit cacheing
-static uint32_t exactCacheCurrentMB; // # MB to use for current-read seed hit cacheing
-static size_t maxhalf;        // max width on one side of DP table
-static bool seedSumm;         // print summary information about seed hits, not alignments
-static bool doUngapped;       // do ungapped alignment
-static size_t maxIters;       // stop after this many extend loop iterations
-static size_t maxUg;          // stop after this many ungap extends
-static size_t maxDp;          // stop after this many DPs
-static size_t maxItersIncr;   // amt to add to maxIters for each -k > 1
-static size_t maxEeStreak;    // stop after this many end-to-end fails in a row
-static size_t maxUgStreak;    // stop after this many ungap fails in a row
-static size_t maxDpStreak;    // stop after this many dp fails in a row
-static size_t maxStreakIncr;  // amt to add to streak for each -k > 1
-static size_t maxMateStreak;  // stop seed range after this many mate-find fails
-static bool doExtend;         // extend seed hits
-static bool enable8;          // use 8-bit SSE where possible?
-static size_t cminlen;        // longer reads use checkpointing
-static size_t cpow2;          // checkpoint interval log2
-static bool doTri;            // do triangular mini-fills?
-static string defaultPreset;  // default preset; applied immediately
-static bool ignoreQuals;      // all mms incur same penalty, regardless of qual
-static string wrapper;        // type of wrapper script, so we can print correct usage
-static EList<string> queries; // list of query files
-static string outfile;        // write SAM output to this file
-static int mapqv;             // MAPQ calculation version
-static int tighten;           // -M tighten mode (0=none, 1=best, 2=secbest+1)
-static bool doExactUpFront;   // do exact search up front if seeds seem good enough
-static bool do1mmUpFront;     // do 1mm search up front if seeds seem good enough
-static size_t do1mmMinLen;    // length below which we disable 1mm e2e search
-static int seedBoostThresh;   // if average non-zero position has more than this many elements
-static size_t nSeedRounds;    // # seed rounds
-static bool reorder;          // true -> reorder SAM recs in -p mode
-static float sampleFrac;      // only align random fraction of input reads
-static bool arbitraryRandom;  // pseudo-randoms no longer a function of read properties
-static bool bowtie2p5;
-static bool useTempSpliceSite;
-static int penCanSplice;
-static int penNoncanSplice;
-static int penConflictSplice;
-static SimpleFunc penIntronLen;
-static size_t minIntronLen;
-static size_t maxIntronLen;
-static string knownSpliceSiteInfile;  //
-static string novelSpliceSiteInfile;  //
-static string novelSpliceSiteOutfile; //
-static bool secondary;
-static bool no_spliced_alignment;
-static int rna_strandness; //
-static bool splicesite_db_only; //
+bool gColor; // colorspace (not supported); read by the pattern sources
+
+/**
+ * hisat-align's options, as parsed from one command line, and the
+ * functions that parse them.  Each AlignSession has its own, so
+ * sessions never see each other's options.
+ */
+struct AlignOptions {
+
+	AlignOptions() { resetOptions(); }
+
+	void resetOptions();
+	void printUsage(ostream& out);
+	int parseInt(int lower, int upper, const char *errmsg, const char *arg);
+	int parseInt(int lower, const char *errmsg, const char *arg);
+	string applyPreset(const string& sorig, Presets& presets);
+	void parseOption(int next_option, const char *arg);
+	void parseOptions(int argc, const char **argv);
+
+	EList<string> mates1;         // mated reads (first mate)
+	EList<string> mates2;         // mated reads (second mate)
+	EList<string> mates12;        // mated reads (1st/2nd interleaved in 1 file)
+	string adjIdxBase;
+	int gVerbose;             // be talkative
+	bool startVerbose;        // be talkative at startup
+	int gQuiet;               // print nothing but the alignments
+	int sanityCheck;          // enable expensive sanity checks
+	int format;               // default read format is FASTQ
+	string origString;        // reference text, or filename(s)
+	int seed;                 // srandom() seed
+	int timing;               // whether to report basic timing data
+	int metricsIval;          // interval between alignment metrics messages (0 = no messages)
+	string metricsFile;       // output file to put alignment metrics in
+	bool metricsStderr;       // output file to put alignment metrics in
+	bool metricsPerRead;        // report a metrics tuple for every read
+	bool allHits;             // for multihits, report just one
+	bool showVersion;         // just print version and quit?
+	int ipause;               // pause before maching?
+	uint32_t qUpto;           // max # of queries to read
+	int gTrim5;               // amount to trim from 5' end
+	int gTrim3;               // amount to trim from 3' end
+	int offRate;              // keep default offRate
+	bool solexaQuals;         // quality strings are solexa quals, not phred, and subtract 64 (not 33)
+	bool phred64Quals;        // quality chars are phred, but must subtract 64 (not 33)
+	bool integerQuals;        // quality strings are space-separated strings of integers, not ASCII
+	int nthreads;             // number of pthreads operating concurrently
+	int outType;              // style of output
+	bool noRefNames;          // true -> print reference indexes; not names
+	uint32_t khits;           // number of hits per read; >1 is much slower
+	uint32_t mhits;           // don't report any hits if there are > mhits
+	int partitionSz;          // output a partitioning key in first field
+	bool useSpinlock;         // false -> don't use of spinlocks even if they're #defines
+	bool fileParallel;        // separate threads read separate input files in parallel
+	bool useShmem;            // use shared memory to hold the index
+	bool useMm;               // use memory-mapped files to hold the index
+	bool mmSweep;             // sweep through memory-mapped files immediately after mapping
+	bool useHugePages;        // back the big index arrays with huge pages
+	bool noKmerTable;         // don't load the index's k-mer table
+	bool shmIndex;            // share the index through POSIX shared memory
+	bool shmRemove;           // remove the index's POSIX shared-memory copies and quit
+	string daemonSocket;         // keep the index loaded and serve jobs on this UNIX socket
+	string daemonConnect;        // hand this job to the daemon on this UNIX socket
+	string batchFile;            // align the samples listed in this manifest
+	int gMinInsert;           // minimum insert size
+	int gMaxInsert;           // maximum insert size
+	bool gMate1fw;            // -1 mate aligns in fw orientation on fw strand
+	bool gMate2fw;            // -2 mate aligns in rc orientation on fw strand
+	bool gFlippedMatesOK;     // allow mates to be in wrong order
+	bool gDovetailMatesOK;    // allow one mate to extend off the end of the other
+	bool gContainMatesOK;     // allow one mate to contain the other in PE alignment
+	bool gOlapMatesOK;        // allow mates to overlap in PE alignment
+	bool gExpandToFrag;       // incr max frag length to =larger mate len if necessary
+	bool gReportDiscordant;   // find and report discordant paired-end alignments
+	bool gReportMixed;        // find and report unpaired alignments for paired reads
+	uint32_t cacheLimit;             // ranges w/ size > limit will be cached
+	uint32_t cacheSize;              // # words per range cache
+	uint32_t skipReads;              // # reads/read pairs to skip
+	bool gNofw; // don't align fw orientation of read
+	bool gNorc; // don't align rc orientation of read
+	uint32_t fastaContLen;
+	uint32_t fastaContFreq;
+	bool hadoopOut;        // print Hadoop status and summary messages
+	bool fuzzy;
+	bool fullRef;
+	bool samTruncQname;        // whether to truncate QNAME to 255 chars
+	bool samOmitSecSeqQual;        // omit SEQ/QUAL for 2ndary alignments?
+	bool samNoUnal;        // don't print records for unaligned reads
+	bool samNoHead;        // don't print any header lines in SAM output
+	bool samNoSQ;          // don't print @SQ header lines
+	bool samBam;           // write BAM instead of SAM
+	bool samSortedBam;        // write coordinate-sorted, indexed BAM
+	int sortMem;           // MB of BAM records to hold in memory when sorting
+	bool sam_print_as;
+	bool sam_print_xs;         // XS:i
+	bool sam_print_xss;        // Xs:i and Ys:i
+	bool sam_print_yn;         // YN:i and Yn:i
+	bool sam_print_xn;
+	bool sam_print_cs;
+	bool sam_print_cq;
+	bool sam_print_x0;
+	bool sam_print_x1;
+	bool sam_print_xm;
+	bool sam_print_xo;
+	bool sam_print_xg;
+	bool sam_print_nm;
+	bool sam_print_md;
+	bool sam_print_yf;
+	bool sam_print_yi;
+	bool sam_print_ym;
+	bool sam_print_yp;
+	bool sam_print_yt;
+	bool sam_print_ys;
+	bool sam_print_zs;
+	bool sam_print_xr;
+	bool sam_print_xt;
+	bool sam_print_xd;
+	bool sam_print_xu;
+	bool sam_print_yl;
+	bool sam_print_ye;
+	bool sam_print_yu;
+	bool sam_print_xp;
+	bool sam_print_yr;
+	bool sam_print_zb;
+	bool sam_print_zr;
+	bool sam_print_zf;
+	bool sam_print_zm;
+	bool sam_print_zi;
+	bool sam_print_zp;
+	bool sam_print_zu;
+	bool sam_print_xs_a;
+	bool sam_print_nh;
+	bool bwaSwLike;
+	float bwaSwLikeC;
+	float bwaSwLikeT;
+	bool qcFilter;
+	bool sortByScore;             // prioritize alignments to report by score?
+	bool gReportOverhangs;        // false -> filter out alignments that fall off the end of a reference sequence
+	string rgid;                  // ID: setting for @RG header line
+	string rgs;                   // SAM outputs for @RG header line
+	string rgs_optflag;           // SAM optional flag to add corresponding to @RG ID
+	bool msample;                 // whether to report a random alignment when maxed-out via -m/-M
+	int      gGapBarrier;         // # diags on top/bot only to be entered diagonally
+	EList<string> qualities;
+	EList<string> qualities1;
+	EList<string> qualities2;
+	string polstr;                // temporary holder for policy string
+	bool  msNoCache;              // true -> disable local cache
+	int   bonusMatchType;         // how to reward matches
+	int   bonusMatch;             // constant reward if bonusMatchType=constant
+	int   penMmcType;             // how to penalize mismatches
+	int   penMmcMax;              // max mm penalty
+	int   penMmcMin;              // min mm penalty
+	int   penNType;               // how to penalize Ns in the read
+	int   penN;                   // constant if N pelanty is a constant
+	bool  penNCatPair;            // concatenate mates before N filtering?
+	bool  localAlign;             // do local alignment in DP steps
+	bool  noisyHpolymer;          // set to true if gap penalties should be reduced to be consistent with a sequencer that under- and overcalls homopolymers
+	int   penRdGapConst;          // constant cost of extending a gap in the read
+	int   penRfGapConst;          // constant cost of extending a gap in the reference
+	int   penRdGapLinear;         // coeff of linear term for cost of gap extension in read
+	int   penRfGapLinear;         // coeff of linear term for cost of gap extension in ref
+	SimpleFunc scoreMin;          // minimum valid score as function of read len
+	SimpleFunc nCeil;             // max # Ns allowed as function of read len
+	SimpleFunc msIval;            // interval between seeds as function of read len
+	double descConsExp;           // how to adjust score minimum as we descent further into index-assisted alignment
+	size_t descentLanding;        // don't place a search root if it's within this many positions of end
+	SimpleFunc descentTotSz;           // maximum space a DescentDriver can use in bytes
+	SimpleFunc descentTotFmops;        // maximum # FM ops a DescentDriver can perform
+	int    multiseedMms;          // mismatches permitted in a multiseed seed
+	int    multiseedLen;          // length of multiseed seeds
+	size_t multiseedOff;          // offset to begin extracting seeds
+	uint32_t seedCacheLocalMB;          // # MB to use for non-shared seed alignment cacheing
+	uint32_t seedCacheCurrentMB;        // # MB to use for current-read seed hit cacheing
+	uint32_t exactCacheCurrentMB;        // # MB to use for current-read seed hit cacheing
+	size_t maxhalf;               // max width on one side of DP table
+	bool seedSumm;                // print summary information about seed hits, not alignments
+	bool doUngapped;              // do ungapped alignment
+	size_t maxIters;              // stop after this many extend loop iterations
+	size_t maxUg;                 // stop after this many ungap extends
+	size_t maxDp;                 // stop after this many DPs
+	size_t maxItersIncr;          // amt to add to maxIters for each -k > 1
+	size_t maxEeStreak;           // stop after this many end-to-end fails in a row
+	size_t maxUgStreak;           // stop after this many ungap fails in a row
+	size_t maxDpStreak;           // stop after this many dp fails in a row
+	size_t maxStreakIncr;         // amt to add to streak for each -k > 1
+	size_t maxMateStreak;         // stop seed range after this many mate-find fails
+	bool doExtend;                // extend seed hits
+	bool enable8;                 // use 8-bit SSE where possible?
+	size_t cminlen;               // longer reads use checkpointing
+	size_t cpow2;                 // checkpoint interval log2
+	bool doTri;                   // do triangular mini-fills?
+	string defaultPreset;         // default preset; applied immediately
+	bool ignoreQuals;             // all mms incur same penalty, regardless of qual
+	string wrapper;               // type of wrapper script, so we can print correct usage
+	EList<string> queries;        // list of query files
+	string outfile;               // write SAM output to this file
+	int mapqv;                    // MAPQ calculation version
+	int tighten;                  // -M tighten mode (0=none, 1=best, 2=secbest+1)
+	bool doExactUpFront;          // do exact search up front if seeds seem good enough
+	bool do1mmUpFront;            // do 1mm search up front if seeds seem good enough
+	size_t do1mmMinLen;           // length below which we disable 1mm e2e search
+	int seedBoostThresh;          // if average non-zero position has more than this many elements
+	size_t nSeedRounds;           // # seed rounds
+	bool reorder;                 // true -> reorder SAM recs in -p mode
+	int reorderMem;               // MB of finished records --reorder may buffer; 0 = no cap
+	int readsPerBatch;            // # reads each thread claims from the input at a time
+	int searchAhead;              // # reads each thread starts searching together
+	float sampleFrac;             // only align random fraction of input reads
+	bool arbitraryRandom;         // pseudo-randoms no longer a function of read properties
+	bool bowtie2p5;
+	bool useTempSpliceSite;
+	int penCanSplice;
+	int penNoncanSplice;
+	int penConflictSplice;
+	SimpleFunc penIntronLen;
+	size_t minIntronLen;
+	size_t maxIntronLen;
+	string knownSpliceSiteInfile;         //
+	string novelSpliceSiteInfile;         //
+	string novelSpliceSiteOutfile;        //
+	bool secondary;
+	bool no_spliced_alignment;
+	int rna_strandness;        //
+	bool splicesite_db_only;        //
 
 #ifdef USE_SRA
-static EList<string> sra_accs;
+	EList<string> sra_accs;
 #endif
 
-static string bt2index;      // read Bowtie 2 index from files with this prefix
-static EList<pair<int, string> > extra_opts;
-static size_t extra_opts_cur;
+	string bt2index;             // read Bowtie 2 index from files with this prefix
+	EList<pair<int, string> > extra_opts;
+	size_t extra_opts_cur;
 
-static EList<uint64_t> thread_rids;
-static MUTEX_T         thread_rids_mutex;
-static uint64_t        thread_rids_mindist;
+	// Parsing state
+	bool saw_M;
+	bool saw_a;
+	bool saw_k;
+	EList<string> presetList;
+	int nextArg;                  // first argv element parseOptions() left unparsed
+};
 
 #define DMAX std::numeric_limits<double>::max()
 
-static void resetOptions() {
+void AlignOptions::resetOptions() {
 	mates1.clear();
 	mates2.clear();
 	mates12.clear();
 	adjIdxBase	            = "";
-	gColor                  = false;
 	gVerbose                = 0;
 	startVerbose			= 0;
 	gQuiet					= false;
@@ -312,6 +353,13 @@ static void resetOptions() {
 	useShmem				= false; // use shared memory to hold the index
 	useMm					= false; // use memory-mapped files to hold the index
 	mmSweep					= false; // sweep through memory-mapped files immediately after mapping
+	useHugePages			= false; // back the big index arrays with huge pages
+	noKmerTable				= false; // don't load the index's k-mer table
+	shmIndex				= false; // share the index through POSIX shared memory
+	shmRemove				= false; // remove the index's POSIX shared-memory copies and quit
+	daemonSocket.clear();            // keep the index loaded and serve jobs on this UNIX socket
+	daemonConnect.clear();           // hand this job to the daemon on this UNIX socket
+	batchFile.clear();               // align the samples listed in this manifest
 	gMinInsert				= 0;     // minimum insert size
 	gMaxInsert				= 500;   // maximum insert size
 	gMate1fw				= true;  // -1 mate aligns in fw orientation on fw strand
@@ -339,6 +387,9 @@ static void resetOptions() {
 	samNoUnal               = false; // omit SAM records for unaligned reads
 	samNoHead				= false; // don't print any header lines in SAM output
 	samNoSQ					= false; // don't print @SQ header lines
+	samBam					= false; // write BAM instead of SAM
+	samSortedBam			= false; // write coordinate-sorted, indexed BAM
+	sortMem					= 768;   // MB of BAM records per sorted run
 	sam_print_as            = true;
 	sam_print_xs            = true;
 	sam_print_xss           = false; // Xs:i and Ys:i
@@ -441,6 +492,7 @@ static void resetOptions() {
 	defaultPreset      = "sensitive%LOCAL%"; // default preset; applied immediately
 	extra_opts.clear();
 	extra_opts_cur = 0;
+	nextArg = 1;
 	bt2index.clear();        // read Bowtie 2 index from files with this prefix
 	ignoreQuals = false;     // all mms incur same penalty, regardless of qual
 	wrapper.clear();         // type of wrapper script, so we can print correct usage
@@ -454,6 +506,9 @@ static void resetOptions() {
 	nSeedRounds = 2;         // # rounds of seed searches to do for repetitive reads
 	do1mmMinLen = 60;        // length below which we disable 1mm search
 	reorder = false;         // reorder SAM records with -p > 1
+	reorderMem = 256;        // MB of finished records --reorder may buffer
+	readsPerBatch = 16;      // # reads each thread claims from the input at a time
+	searchAhead = 16;        // # reads each thread starts searching together
 	sampleFrac = 1.1f;       // align all reads
 	arbitraryRandom = false; // let pseudo-random seeds be a function of read properties
 	bowtie2p5 = false;
@@ -484,7 +539,7 @@ static struct option long_options[] = {
 	{(char*)"startverbose", no_argument,       0,            ARG_STARTVERBOSE},
 	{(char*)"quiet",        no_argument,       0,            ARG_QUIET},
 	{(char*)"sanity",       no_argument,       0,            ARG_SANITY},
-	{(char*)"pause",        no_argument,       &ipause,      1},
+	{(char*)"pause",        no_argument,       0,            ARG_PAUSE},
 	{(char*)"orig",         required_argument, 0,            ARG_ORIG},
 	{(char*)"all",          no_argument,       0,            'a'},
 	{(char*)"solexa-quals", no_argument,       0,            ARG_SOLEXA_QUALS},
@@ -535,6 +590,13 @@ static struct option long_options[] = {
 	{(char*)"mm",           no_argument,       0,            ARG_MM},
 	{(char*)"shmem",        no_argument,       0,            ARG_SHMEM},
 	{(char*)"mmsweep",      no_argument,       0,            ARG_MMSWEEP},
+	{(char*)"huge-pages",   no_argument,       0,            ARG_HUGE_PAGES},
+	{(char*)"no-kmer-table", no_argument,      0,            ARG_NO_KMER_TABLE},
+	{(char*)"shm-index",    no_argument,       0,            ARG_SHM_INDEX},
+	{(char*)"shm-remove",   no_argument,       0,            ARG_SHM_REMOVE},
+	{(char*)"daemon",       required_argument, 0,            ARG_DAEMON},
+	{(char*)"connect",      required_argument, 0,            ARG_CONNECT},
+	{(char*)"batch",        required_argument, 0,            ARG_BATCH},
 	{(char*)"hadoopout",    no_argument,       0,            ARG_HADOOPOUT},
 	{(char*)"fuzzy",        no_argument,       0,            ARG_FUZZY},
 	{(char*)"fullref",      no_argument,       0,            ARG_FULLREF},
@@ -555,6 +617,9 @@ static struct option long_options[] = {
 	{(char*)"no-HD",        no_argument,       0,            ARG_SAM_NOHEAD},
 	{(char*)"no-SQ",        no_argument,       0,            ARG_SAM_NOSQ},
 	{(char*)"no-unal",      no_argument,       0,            ARG_SAM_NO_UNAL},
+	{(char*)"bam",          no_argument,       0,            ARG_SAM_BAM},
+	{(char*)"sorted-bam",   no_argument,       0,            ARG_SAM_SORTED_BAM},
+	{(char*)"sort-mem",     required_argument, 0,            ARG_SORT_MEM},
 	{(char*)"color",        no_argument,       0,            'C'},
 	{(char*)"sam-RG",       required_argument, 0,            ARG_SAM_RG},
 	{(char*)"sam-rg",       required_argument, 0,            ARG_SAM_RG},
@@ -643,6 +708,9 @@ static struct option long_options[] = {
 	{(char*)"mapq-extra",       no_argument,       0,        ARG_MAPQ_EX},
 	{(char*)"seed-rounds",      required_argument, 0,        'R'},
 	{(char*)"reorder",          no_argument,       0,        ARG_REORDER},
+	{(char*)"reorder-mem",      required_argument, 0,        ARG_REORDER_MEM},
+	{(char*)"reads-per-batch",  required_argument, 0,        ARG_READS_PER_BATCH},
+	{(char*)"search-ahead",     required_argument, 0,        ARG_SEARCH_AHEAD},
 	{(char*)"passthrough",      no_argument,       0,        ARG_READ_PASSTHRU},
 	{(char*)"sample",           required_argument, 0,        ARG_SAMPLE},
 	{(char*)"cp-min",           required_argument, 0,        ARG_CP_MIN},
@@ -719,7 +787,7 @@ static void printArgDesc(ostream& out) {
 /**
  * Print a summary usage message to the provided output stream.
  */
-static void printUsage(ostream& out) {
+void AlignOptions::printUsage(ostream& out) {
 	out << "HISAT version " << string(HISAT_VERSION).c_str() << " by Daehwan Kim (infphilo@gmail.com, www.ccb.jhu.edu/people/infphilo)" << endl;
 	string tool_name = "hisat-align";
 	if(wrapper == "basic-0") {
@@ -734,17 +802,18 @@ static void printUsage(ostream& out) {
 	    << endl
 		<<     "  <bt2-idx>  Index filename prefix (minus trailing .X." << gEbwt_ext << ")." << endl
 	    <<     "  <m1>       Files with #1 mates, paired with files in <m2>." << endl;
-	if(wrapper == "basic-0") {
-		out << "             Could be gzip'ed (extension: .gz) or bzip2'ed (extension: .bz2)." << endl;
-	}
+	// Compressed read files are recognized by content, not extension
+	const char *compressed =
+#ifdef WITH_ZSTD
+		"gzip'ed, bzip2'ed or zstd-compressed";
+#else
+		"gzip'ed or bzip2'ed";
+#endif
+	out <<     "             Could be " << compressed << "." << endl;
 	out <<     "  <m2>       Files with #2 mates, paired with files in <m1>." << endl;
-	if(wrapper == "basic-0") {
-		out << "             Could be gzip'ed (extension: .gz) or bzip2'ed (extension: .bz2)." << endl;
-	}
+	out <<     "             Could be " << compressed << "." << endl;
 	out <<     "  <r>        Files with unpaired reads." << endl;
-	if(wrapper == "basic-0") {
-		out << "             Could be gzip'ed (extension: .gz) or bzip2'ed (extension: .bz2)." << endl;
-	}
+	out <<     "             Could be " << compressed << "." << endl;
 #ifdef USE_SRA
     out <<     "  <SRA accession number>        Comma-separated list of SRA accession numbers, e.g. --sra-acc SRR353653,SRR353654." << endl;
 #endif
@@ -762,6 +831,7 @@ static void printUsage(ostream& out) {
 	    << "  -f                 query input files are (multi-)FASTA .fa/.mfa" << endl
 	    << "  -r                 query input files are raw one-sequence-per-line" << endl
 	    << "  -c                 <m1>, <m2>, <r> are sequences themselves, not files" << endl
+	    << "  --batch <tsv>      align each sample listed in <tsv>, loading index once" << endl
 	    << "  -s/--skip <int>    skip the first <int> reads/pairs in the input (none)" << endl
 	    << "  -u/--upto <int>    stop after first <int> reads/pairs (no limit)" << endl
 	    << "  -5/--trim5 <int>   trim <int> bases from 5'/left end of reads (0)" << endl
@@ -867,14 +937,28 @@ static void printUsage(ostream& out) {
 	    << "  --rg <text>        add <text> (\"lab:value\") to @RG line of SAM header." << endl
 	    << "                     Note: @RG line only printed when --rg-id is set." << endl
 	    << "  --omit-sec-seq     put '*' in SEQ and QUAL fields for secondary alignments." << endl
+	    << "  --bam              write BAM instead of SAM; compressed using -p threads" << endl
+	    << "  --sorted-bam       write coordinate-sorted BAM and a .bai index next to it" << endl
+	    << "  --sort-mem <int>   MB of memory for sorting records before spilling (768)" << endl
 		<< endl
 	    << " Performance:" << endl
 	    << "  -o/--offrate <int> override offrate of index; must be >= index's offrate" << endl
 	    << "  -p/--threads <int> number of alignment threads to launch (1)" << endl
 	    << "  --reorder          force SAM output order to match order of input reads" << endl
+	    << "  --reorder-mem <int> MB of out-of-order records --reorder may buffer (256)" << endl
+	    << "  --reads-per-batch <int> # of reads each thread claims from input at once (16)" << endl
+	    << "  --search-ahead <int> # of reads each thread starts searching together (16)" << endl
 #ifdef BOWTIE_MM
 	    << "  --mm               use memory-mapped I/O for index; many 'bowtie's can share" << endl
 #endif
+	    << "  --huge-pages       back the index with huge pages to cut TLB misses" << endl
+	    << "  --no-kmer-table    don't load the index's k-mer table (.7." << gEbwt_ext << ")" << endl
+#ifdef BOWTIE_MM
+	    << "  --shm-index        publish index in POSIX shared memory for other hisats" << endl
+	    << "  --shm-remove       remove the index's shared-memory copy and quit" << endl
+#endif
+	    << "  --daemon <path>    keep index loaded; run jobs sent to UNIX socket <path>" << endl
+	    << "  --connect <path>   run this job on the daemon listening on <path>" << endl
 #ifdef BOWTIE_SHARED_MEM
 		//<< "  --shmem            use shared mem for index; many 'bowtie's can share" << endl
 #endif
@@ -900,7 +984,7 @@ static void printUsage(ostream& out) {
  * if it is less than 'lower', than output the given error message and
  * exit with an error and a usage message.
  */
-static int parseInt(int lower, int upper, const char *errmsg, const char *arg) {
+int AlignOptions::parseInt(int lower, int upper, const char *errmsg, const char *arg) {
 	long l;
 	char *endPtr= NULL;
 	l = strtol(arg, &endPtr, 10);
@@ -921,7 +1005,7 @@ static int parseInt(int lower, int upper, const char *errmsg, const char *arg) {
 /**
  * Upper is maximum int by default.
  */
-static int parseInt(int lower, const char *errmsg, const char *arg) {
+int AlignOptions::parseInt(int lower, const char *errmsg, const char *arg) {
 	return parseInt(lower, std::numeric_limits<int>::max(), errmsg, arg);
 }
 
@@ -963,7 +1047,7 @@ void parseTuple(const char *str, char delim, EList<T>& ret) {
 	}
 }
 
-static string applyPreset(const string& sorig, Presets& presets) {
+string AlignOptions::applyPreset(const string& sorig, Presets& presets) {
 	string s = sorig;
 	size_t found = s.find("%LOCAL%");
 	if(found != string::npos) {
@@ -978,11 +1062,6 @@ static string applyPreset(const string& sorig, Presets& presets) {
 	return pol;
 }
 
-static bool saw_M;
-static bool saw_a;
-static bool saw_k;
-static EList<string> presetList;
-
 /**
  * TODO: Argument parsing is very, very flawed.  The biggest problem is that
  * there are two separate worlds of arguments, the ones set via polstr, and
@@ -990,7 +1069,7 @@ static EList<string> presetList;
  * e.g., with the -M option being resolved at an awkward time relative to
  * the -k and -a options.
  */
-static void parseOption(int next_option, const char *arg) {
+void AlignOptions::parseOption(int next_option, const char *arg) {
 	switch (next_option) {
 		case ARG_TEST_25: bowtie2p5 = true; break;
 		case ARG_DESC_KB: descentTotSz = SimpleFunc::parse(arg, 0.0, 1024.0, 1024.0, DMAX); break;
@@ -1068,6 +1147,23 @@ static void parseOption(int next_option, const char *arg) {
 #endif
 		}
 		case ARG_MMSWEEP: mmSweep = true; break;
+		case ARG_HUGE_PAGES: useHugePages = true; break;
+		case ARG_NO_KMER_TABLE: noKmerTable = true; break;
+		case ARG_SHM_INDEX: {
+#ifdef BOWTIE_MM
+			// Published copies are used in place, like mapped files
+			shmIndex = true;
+			useMm = true;
+			break;
+#else
+			cerr << "--shm-index is disabled because hisat was not compiled with BOWTIE_MM defined." << endl;
+			throw 1;
+#endif
+		}
+		case ARG_SHM_REMOVE: shmRemove = true; break;
+		case ARG_DAEMON: daemonSocket = arg; break;
+		case ARG_CONNECT: daemonConnect = arg; break;
+		case ARG_BATCH: batchFile = arg; break;
 		case ARG_HADOOPOUT: hadoopOut = true; break;
 		case ARG_SOLEXA_QUALS: solexaQuals = true; break;
 		case ARG_INTEGER_QUALS: integerQuals = true; break;
@@ -1209,6 +1305,7 @@ static void parseOption(int next_option, const char *arg) {
 		case ARG_STARTVERBOSE: startVerbose = true; break;
 		case ARG_QUIET: gQuiet = true; break;
 		case ARG_SANITY: sanityCheck = true; break;
+		case ARG_PAUSE: ipause = 1; break;
 		case 't': timing = true; break;
 		case ARG_METRIC_IVAL: {
 			metricsIval = parseInt(1, "--metrics arg must be at least 1", arg);
@@ -1224,8 +1321,26 @@ static void parseOption(int next_option, const char *arg) {
 		case ARG_SAM_NO_UNAL: samNoUnal = true; break;
 		case ARG_SAM_NOHEAD: samNoHead = true; break;
 		case ARG_SAM_NOSQ: samNoSQ = true; break;
+		case ARG_SAM_BAM: samBam = true; break;
+		case ARG_SAM_SORTED_BAM: samBam = samSortedBam = true; break;
+		case ARG_SORT_MEM: {
+			sortMem = parseInt(1, "--sort-mem arg must be at least 1", arg);
+			break;
+		}
 		case ARG_SAM_PRINT_YI: sam_print_yi = true; break;
 		case ARG_REORDER: reorder = true; break;
+		case ARG_REORDER_MEM: {
+			reorderMem = parseInt(0, "--reorder-mem arg must be at least 0", arg);
+			break;
+		}
+		case ARG_READS_PER_BATCH: {
+			readsPerBatch = parseInt(1, "--reads-per-batch arg must be at least 1", arg);
+			break;
+		}
+		case ARG_SEARCH_AHEAD: {
+			searchAhead = parseInt(1, "--search-ahead arg must be at least 1", arg);
+			break;
+		}
 		case ARG_MAPQ_EX: {
 			sam_print_zp = true;
 			sam_print_zu = true;
@@ -1554,10 +1669,13 @@ static void parseOption(int next_option, const char *arg) {
 	}
 }
 
+static MUTEX_T getoptMutex; // getopt_long() keeps its state in globals
+
 /**
- * Read command-line arguments
+ * Read command-line arguments.  Afterwards, argv[nextArg] is the first
+ * argument that isn't an option (getopt_long() moves them to the end).
  */
-static void parseOptions(int argc, const char **argv) {
+void AlignOptions::parseOptions(int argc, const char **argv) {
 	int option_index = 0;
 	int next_option;
 	saw_M = false;
@@ -1565,21 +1683,27 @@ static void parseOptions(int argc, const char **argv) {
 	saw_k = true;
 	presetList.clear();
 	if(startVerbose) { cerr << "Parsing options: "; logTime(cerr, true); }
-	while(true) {
-		next_option = getopt_long(
-			argc, const_cast<char**>(argv),
-			short_options, long_options, &option_index);
-		const char * arg = optarg;
-		if(next_option == EOF) {
-			if(extra_opts_cur < extra_opts.size()) {
-				next_option = extra_opts[extra_opts_cur].first;
-				arg = extra_opts[extra_opts_cur].second.c_str();
-				extra_opts_cur++;
-			} else {
-				break;
+	{
+		// One command line at a time, from the top
+		ThreadSafe ts(&getoptMutex);
+		opterr = optind = 1;
+		while(true) {
+			next_option = getopt_long(
+				argc, const_cast<char**>(argv),
+				short_options, long_options, &option_index);
+			const char * arg = optarg;
+			if(next_option == EOF) {
+				if(extra_opts_cur < extra_opts.size()) {
+					next_option = extra_opts[extra_opts_cur].first;
+					arg = extra_opts[extra_opts_cur].second.c_str();
+					extra_opts_cur++;
+				} else {
+					break;
+				}
 			}
+			parseOption(next_option, arg);
 		}
-		parseOption(next_option, arg);
+		nextArg = optind;
 	}
 	// Now parse all the presets.  Might want to pick which presets version to
 	// use according to other parameters.
@@ -1675,6 +1799,11 @@ static void parseOptions(int argc, const char **argv) {
 		     << "files must sequences must be specified with -2 and --Q2." << endl;
 		throw 1;
 	}
+	if(samBam && seedSumm) {
+		cerr << "Error: --bam cannot be combined with --seed-summ, which "
+		     << "doesn't print SAM records" << endl;
+		throw 1;
+	}
 	if(!rgs.empty() && rgid.empty()) {
 		cerr << "Warning: --rg was specified without --rg-id also "
 		     << "being specified.  @RG line is not printed unless --rg-id "
@@ -1700,6 +1829,10 @@ static void parseOptions(int argc, const char **argv) {
 		cerr << "Warning: --shmem overrides --mm..." << endl;
 		useMm = false;
 	}
+	if(useShmem && shmIndex) {
+		cerr << "Warning: --shmem overrides --shm-index..." << endl;
+		shmIndex = false;
+	}
 	if(gGapBarrier < 1) {
 		cerr << "Warning: --gbar was set less than 1 (=" << gGapBarrier
 		     << "); setting to 1 instead" << endl;
@@ -1723,8 +1856,6 @@ static void parseOptions(int argc, const char **argv) {
 #endif
 }
 
-static const char *argv0 = NULL;
-
 /// Create a PatternSourcePerThread for the current thread according
 /// to the global params and return a pointer to it
 static PatternSourcePerThreadFactory*
@@ -1739,15 +1870,6 @@ createPatsrcFactory(PairedPatternSource& _patsrc, int tid) {
 
 typedef TIndexOffU index_t;
 typedef uint16_t local_index_t;
-static PairedPatternSource*              multiseed_patsrc;
-static HierEbwt<index_t>*                multiseed_ebwtFw;
-static HierEbwt<index_t>*                multiseed_ebwtBw;
-static Scoring*                          multiseed_sc;
-static BitPairReference*                 multiseed_refs;
-static AlignmentCache<index_t>*          multiseed_ca; // seed cache
-static AlnSink<index_t>*                 multiseed_msink;
-static OutFileBuf*                       multiseed_metricsOfb;
-static SpliceSiteDB*                     ssdb;
 
 /**
  * Metrics for measuring the work done by the outer read alignment
@@ -1804,7 +1926,7 @@ struct OuterLoopMetrics {
  */
 struct PerfMetrics {
 
-	PerfMetrics() : first(true) { reset(); }
+	PerfMetrics() : first(true), outq(NULL) { reset(); }
 
 	/**
 	 * Set all counters to 0.
@@ -1823,6 +1945,8 @@ struct PerfMetrics {
 		nbtfiltst = 0;
 		nbtfiltsc = 0;
 		nbtfiltdo = 0;
+		ridWaits = 0;
+		ridWaitUs = 0;
 		
 		olmu.reset();
 		sdmu.reset();
@@ -1837,6 +1961,8 @@ struct PerfMetrics {
 		nbtfiltst_u = 0;
 		nbtfiltsc_u = 0;
 		nbtfiltdo_u = 0;
+		ridWaits_u = 0;
+		ridWaitUs_u = 0;
         
         him.reset();
 	}
@@ -1858,6 +1984,8 @@ struct PerfMetrics {
 		uint64_t nbtfiltst_,
 		uint64_t nbtfiltsc_,
 		uint64_t nbtfiltdo_,
+		uint64_t ridWaits_,
+		uint64_t ridWaitUs_,
         const HIMetrics *hi,
 		bool getLock)
 	{
@@ -1895,6 +2023,8 @@ struct PerfMetrics {
 		nbtfiltst_u += nbtfiltst_;
 		nbtfiltsc_u += nbtfiltsc_;
 		nbtfiltdo_u += nbtfiltdo_;
+		ridWaits_u += ridWaits_;
+		ridWaitUs_u += ridWaitUs_;
         if(hi != NULL) {
             him.merge(*hi, false);
         }
@@ -2067,6 +2197,10 @@ struct PerfMetrics {
                 /* 134 */ "LocalSearchRecur"    "\t"
                 /* 135 */ "GlobalGenomeCoords"  "\t"
                 /* 136 */ "LocalGenomeCoords"   "\t"
+
+				/* 137 */ "ReorderBufPeak" "\t" // bytes
+				/* 138 */ "RidWaits"       "\t" // waits for the slowest thread
+				/* 139 */ "RidWaitMs"            // time spent in those waits
             
             
 				"\n";
@@ -2662,7 +2796,20 @@ struct PerfMetrics {
 		if(o != NULL) { o->writeChars(buf); o->write('\t'); }
         // 136
         itoa10<size_t>(him.localgenomecoords, buf);
-        if(metricsStderr) stderrSs << buf;
+        if(metricsStderr) stderrSs << buf << '\t';
+		if(o != NULL) { o->writeChars(buf); o->write('\t'); }
+
+		// 137. Most bytes of output buffered by --reorder at once
+		itoa10<size_t>(outq != NULL ? outq->peakBytes() : 0, buf);
+		if(metricsStderr) stderrSs << buf << '\t';
+		if(o != NULL) { o->writeChars(buf); o->write('\t'); }
+		// 138. # times a thread slept waiting for the slowest thread
+		itoa10<uint64_t>(total ? ridWaits : ridWaits_u, buf);
+		if(metricsStderr) stderrSs << buf << '\t';
+		if(o != NULL) { o->writeChars(buf); o->write('\t'); }
+		// 139. Milliseconds spent in those waits
+		itoa10<uint64_t>((total ? ridWaitUs : ridWaitUs_u) / 1000, buf);
+		if(metricsStderr) stderrSs << buf;
 		if(o != NULL) { o->writeChars(buf); }
 
 		if(o != NULL) { o->write('\n'); }
@@ -2683,6 +2830,8 @@ struct PerfMetrics {
 		nbtfiltst_u += nbtfiltst;
 		nbtfiltsc_u += nbtfiltsc;
 		nbtfiltdo_u += nbtfiltdo;
+		ridWaits += ridWaits_u;
+		ridWaitUs += ridWaitUs_u;
 
 		olmu.reset();
 		sdmu.reset();
@@ -2697,6 +2846,8 @@ struct PerfMetrics {
 		nbtfiltst_u = 0;
 		nbtfiltsc_u = 0;
 		nbtfiltdo_u = 0;
+		ridWaits_u = 0;
+		ridWaitUs_u = 0;
 	}
 
 	// Total over the whole job
@@ -2713,6 +2864,8 @@ struct PerfMetrics {
 	uint64_t          nbtfiltst;
 	uint64_t          nbtfiltsc;
 	uint64_t          nbtfiltdo;
+	uint64_t          ridWaits;  // # times a thread waited for the slowest one
+	uint64_t          ridWaitUs; // microseconds spent in those waits
 
 	// Just since the last update
 	OuterLoopMetrics  olmu;  // overall metrics
@@ -2728,6 +2881,8 @@ struct PerfMetrics {
 	uint64_t          nbtfiltst_u;
 	uint64_t          nbtfiltsc_u;
 	uint64_t          nbtfiltdo_u;
+	uint64_t          ridWaits_u;
+	uint64_t          ridWaitUs_u;
     
     //
     HIMetrics         him;
@@ -2735,9 +2890,120 @@ struct PerfMetrics {
 	MUTEX_T           mutex_m;  // lock for when one ob
 	bool              first; // yet to print first line?
 	time_t            lastElapsed; // used in reportInterval to measure time since last call
+	const OutputQueue *outq;   // the job's output queue, for its --reorder peak
 };
 
-static PerfMetrics metrics;
+struct AlignIndex;
+struct BatchSample;
+
+/**
+ * One hisat-align run, or the series of jobs that --daemon, --batch or
+ * hisat_align() run against one resident index: the options, and the
+ * state that the search threads of the job in progress share.  None of
+ * it is global, so a process can run any number of sessions at once,
+ * e.g. one per hisat_align() call, all against the same loaded index.
+ */
+class AlignSession : public AlignOptions {
+
+public:
+
+	AlignSession();
+
+	/**
+	 * Parse the command line 'argv' and do what it says.  Returns the
+	 * exit status.
+	 */
+	int run(int argc, const char **argv);
+
+	void loadAlignIndex(AlignIndex& idx, const string& bt2indexBase);
+
+	int runJob(
+		AlignIndex& idx,
+		const string& index,
+		const EList<string>& args,
+		OutFileBuf *out = NULL);
+
+	const char *argv0; // program name; indexes are also looked for next to it
+
+private:
+
+	/**
+	 * What multiseedSearch() hands each of its threads.
+	 */
+	struct SearchThread {
+		AlignSession *session;
+		int tid; // thread IDs start at 1
+	};
+
+	static void multiseedSearchThread(void *vp);
+
+	void multiseedSearchWorker_hisat(int tid);
+
+	void multiseedSearch(
+		Scoring& sc,
+		PairedPatternSource& patsrc,
+		AlnSink<index_t>& msink,
+		HierEbwt<index_t>& ebwtFw,
+		HierEbwt<index_t>& ebwtBw,
+		const KmerTable<index_t>* kmers,
+		BitPairReference* refs,
+		OutFileBuf *metricsOfb);
+
+	void strandsToSearch(bool paired, bool nofw[2], bool norc[2]) const;
+
+	void alignJob(AlignIndex& idx, const string& outfile, OutFileBuf *out = NULL);
+
+	int parseReadArgs(int argc, const char **argv);
+
+	void serveJobs(
+		AlignIndex& idx,
+		const string& path_,
+		const string& index_,
+		const EList<string>& baseArgs);
+
+	void runBatch(
+		AlignIndex& idx,
+		const string& index_,
+		const EList<string>& baseArgs,
+		const EList<BatchSample>& samples);
+
+	template<typename TStr>
+	void driver(
+		const char * type,
+		const string& bt2indexBase,
+		const string& outfile,
+		const EList<string>& jobArgs);
+
+	PairedPatternSource*              multiseed_patsrc;
+	HierEbwt<index_t>*                multiseed_ebwtFw;
+	HierEbwt<index_t>*                multiseed_ebwtBw;
+	const KmerTable<index_t>*         multiseed_kmers;
+	Scoring*                          multiseed_sc;
+	BitPairReference*                 multiseed_refs;
+	AlignmentCache<index_t>*          multiseed_ca; // seed cache
+	AlnSink<index_t>*                 multiseed_msink;
+	OutFileBuf*                       multiseed_metricsOfb;
+	SpliceSiteDB*                     ssdb;
+	PerfMetrics                       metrics;
+	ReadIdWatermark                   thread_rids; // how far each thread has got through the reads
+	uint64_t                          thread_rids_mindist;
+	string                            argstr;      // command line, for the @PG header line
+};
+
+AlignSession::AlignSession() :
+	argv0(NULL),
+	multiseed_patsrc(NULL),
+	multiseed_ebwtFw(NULL),
+	multiseed_ebwtBw(NULL),
+	multiseed_kmers(NULL),
+	multiseed_sc(NULL),
+	multiseed_refs(NULL),
+	multiseed_ca(NULL),
+	multiseed_msink(NULL),
+	multiseed_metricsOfb(NULL),
+	ssdb(NULL),
+	thread_rids_mindist(0)
+{ }
 
 // Cyclic rotations
 #define ROTL(n, x) (((x) << (n)) | ((x) >> (32-n)))
@@ -2835,6 +3101,8 @@ static inline void printEEScoreMsg(
 		nbtfiltst, \
 		nbtfiltsc, \
 		nbtfiltdo, \
+		ridWaits, \
+		ridWaitUs, \
         &him, \
 		sync); \
 	olm.reset(); \
@@ -2847,6 +3115,8 @@ static inline void printEEScoreMsg(
 	sseU8MateMet.reset(); \
 	sseI16ExtendMet.reset(); \
 	sseI16MateMet.reset(); \
+	ridWaits = 0; \
+	ridWaitUs = 0; \
     him.reset(); \
 }
 
@@ -2862,6 +3132,17 @@ static inline void printEEScoreMsg(
 	x.resetCounters(); \
 }
 
+/**
+ * Set nofw/norc for each mate of a read or pair according to --nofw,
+ * --norc and the mate orientations.
+ */
+inline void AlignSession::strandsToSearch(bool paired, bool nofw[2], bool norc[2]) const {
+	nofw[0] = paired ? (gMate1fw ? gNofw : gNorc) : gNofw;
+	norc[0] = paired ? (gMate1fw ? gNorc : gNofw) : gNorc;
+	nofw[1] = paired ? (gMate2fw ? gNofw : gNorc) : gNofw;
+	norc[1] = paired ? (gMate2fw ? gNorc : gNofw) : gNorc;
+}
+
 /**
  * Called once per thread.  Sets up per-thread pointers to the shared global
  * data structures, creates per-thread structures, then enters the alignment
@@ -2877,8 +3158,7 @@ static inline void printEEScoreMsg(
  *   + If not identical, continue
  * -
  */
-static void multiseedSearchWorker_hisat(void *vp) {
-	int tid = *((int*)vp);
+void AlignSession::multiseedSearchWorker_hisat(int tid) {
 	assert(multiseed_ebwtFw != NULL);
 	assert(multiseedMms == 0 || multiseed_ebwtBw != NULL);
 	PairedPatternSource&             patsrc   = *multiseed_patsrc;
@@ -2897,7 +3177,16 @@ static void multiseedSearchWorker_hisat(void *vp) {
 	
 	//const BitPairReference& refs   = *multiseed_refs;
 	unique_ptr<PatternSourcePerThreadFactory> patsrcFact(createPatsrcFactory(patsrc, tid));
-	unique_ptr<PatternSourcePerThread> ps(patsrcFact->create());
+	unique_ptr<PatternSourcePerThread> ps;
+	// Read ahead so that the first searches of several reads can be run
+	// together; see HI_Aligner::runSearchAhead
+	LookaheadPatternSourcePerThread* lookahead = NULL;
+	if(searchAhead > 1) {
+		lookahead = new LookaheadPatternSourcePerThread(patsrcFact->create(), searchAhead);
+		ps.reset(lookahead);
+	} else {
+		ps.reset(patsrcFact->create());
+	}
 	
 	// Thread-local cache for seed alignments
 	PtrWrap<AlignmentCache<index_t> > scLocal;
@@ -2941,6 +3230,8 @@ static void multiseedSearchWorker_hisat(void *vp) {
                                                           localAlign,
                                                           thread_rids_mindist,
                                                           no_spliced_alignment);
+    splicedAligner.setKmerTable(multiseed_kmers);
+    splicedAligner.setMateOrientations(gMate1fw, gMate2fw);
 	SwAligner sw;
 	OuterLoopMetrics olm;
 	SeedSearchMetrics sdm;
@@ -2956,6 +3247,8 @@ static void multiseedSearchWorker_hisat(void *vp) {
 	uint64_t nbtfiltst = 0; // TODO: find a new home for these
 	uint64_t nbtfiltsc = 0; // TODO: find a new home for these
 	uint64_t nbtfiltdo = 0; // TODO: find a new home for these
+	uint64_t ridWaits = 0;  // # times we waited for the slowest thread
+	uint64_t ridWaitUs = 0; // microseconds spent waiting for it
     HIMetrics him;
     
 	ASSERT_ONLY(BTDnaString tmp);
@@ -3018,28 +3311,36 @@ static void multiseedSearchWorker_hisat(void *vp) {
 			continue;
 		}
 		TReadId rdid = ps->rdid();
+		
+		if(lookahead != NULL && lookahead->refilled()) {
+			// Start the first searches of all the reads just read ahead
+			splicedAligner.clearSearchAhead();
+			for(size_t i = 0; i < lookahead->numAhead(); i++) {
+				TReadId id = lookahead->aheadRdid(i);
+				if(id < skipReads || id >= qUpto) continue;
+				bool p = lookahead->aheadPaired(i);
+				const Read* rds[2] = { &lookahead->aheada(i), p ? &lookahead->aheadb(i) : NULL };
+				bool nofw[2], norc[2];
+				strandsToSearch(p, nofw, norc);
+				splicedAligner.addSearchAhead(ebwtFw, (index_t)i, rds, nofw, norc);
+			}
+			splicedAligner.runSearchAhead(ebwtFw);
+		}
         
         if(nthreads > 1 && useTempSpliceSite) {
-            while(true) {
-                uint64_t min_rdid = 0;
-                {
-                    // ThreadSafe t(&thread_rids_mutex, nthreads > 1);
-                    assert_gt(thread_rids.size(), 0);
-                    min_rdid = thread_rids[0];
-                    for(size_t i = 1; i < thread_rids.size(); i++) {
-                        if(thread_rids[i] < min_rdid) {
-                            min_rdid = thread_rids[i];
-                        }
-                    }
+            // Reads are claimed in batches, so this thread may have
+            // skipped over reads being aligned by others; it no longer
+            // holds anything before rdid, so it must not wait on itself
+            if(rdid > 0) {
+                thread_rids.advance(tid - 1, rdid - 1);
+            }
+            // Sleep until the slowest thread is within mindist of us
+            if(rdid > thread_rids_mindist) {
+                uint64_t us = thread_rids.waitFor(rdid - thread_rids_mindist);
+                if(us > 0) {
+                    ridWaits++;
+                    ridWaitUs += us;
                 }
-                
-                if(min_rdid + thread_rids_mindist < rdid) {
-#if defined(_TTHREAD_WIN32_)
-                    Sleep(0);
-#elif defined(_TTHREAD_POSIX_)
-                    sched_yield();
-#endif
-                } else break;
             }
         }
         
@@ -3184,10 +3485,7 @@ static void multiseedSearchWorker_hisat(void *vp) {
 				// Calcualte nofw / no rc
 				bool nofw[2] = { false, false };
 				bool norc[2] = { false, false };
-				nofw[0] = paired ? (gMate1fw ? gNofw : gNorc) : gNofw;
-				norc[0] = paired ? (gMate1fw ? gNorc : gNofw) : gNorc;
-				nofw[1] = paired ? (gMate2fw ? gNofw : gNorc) : gNofw;
-				norc[1] = paired ? (gMate2fw ? gNorc : gNofw) : gNorc;
+				strandsToSearch(paired, nofw, norc);
 				// Calculate nceil
 				int nceil[2] = { 0, 0 };
 				nceil[0] = nCeil.f<int>((double)rdlens[0]);
@@ -3273,6 +3571,9 @@ static void multiseedSearchWorker_hisat(void *vp) {
                     splicedAligner.initRead(rds[0], nofw[0], norc[0], minsc[0], maxpen[0], filt[1]);
                 }
                 if(filt[0] || filt[1]) {
+                    if(lookahead != NULL) {
+                        splicedAligner.useSearchAhead((index_t)lookahead->slot());
+                    }
                     int ret = splicedAligner.go(sc, ebwtFw, ebwtBw, ref, sw, *ssdb, wlm, prm, swmSeed, him, rnd, msinkwrap);
                     MERGE_SW(sw);
                     // daehwan
@@ -3347,16 +3648,18 @@ static void multiseedSearchWorker_hisat(void *vp) {
 				assert(!retry || msinkwrap.empty());
                 
                 if(nthreads > 1 && useTempSpliceSite) {
-                    // ThreadSafe t(&thread_rids_mutex, nthreads > 1);
                     assert_gt(tid, 0);
-                    assert_leq(tid, thread_rids.size());
-                    assert(thread_rids[tid - 1] == 0 || rdid > thread_rids[tid - 1]);
-                    thread_rids[tid - 1] = rdid;
+                    thread_rids.advance(tid - 1, rdid);
                 }
 			} // while(retry)
 		} // if(rdid >= skipReads && rdid < qUpto)
 		else if(rdid >= qUpto) {
 			break;
+		} else if(rdid >= skipReads) {
+			// Not sampled; report nothing, but let the output queue
+			// know so that --reorder doesn't wait for it
+			BTString emptyRec;
+			OutputQueueMark qqm(msink.outq(), emptyRec, rdid, (size_t)tid);
 		}
 		if(metricsPerRead) {
 			MERGE_METRICS(metricsPt, nthreads > 1);
@@ -3367,77 +3670,66 @@ static void multiseedSearchWorker_hisat(void *vp) {
 		}
 	} // while(true)
 	
+	if(nthreads > 1 && useTempSpliceSite) {
+		// Don't hold back threads still working on their last reads
+		thread_rids.finish(tid - 1);
+	}
+	
 	// One last metrics merge
 	MERGE_METRICS(metrics, nthreads > 1);
     
 	return;
 }
 
+/**
+ * Thread body for multiseedSearch(): run the worker of the session in
+ * 'vp', a SearchThread.
+ */
+void AlignSession::multiseedSearchThread(void *vp) {
+	SearchThread *t = (SearchThread*)vp;
+	t->session->multiseedSearchWorker_hisat(t->tid);
+}
+
 /**
  * Called once per alignment job.  Sets up global pointers to the
  * shared global data structures, creates per-thread structures, then
- * enters the search loop.
+ * enters the search loop.  The index must already be in memory.
  */
-static void multiseedSearch(
+void AlignSession::multiseedSearch(
 	Scoring& sc,
 	PairedPatternSource& patsrc,  // pattern source
 	AlnSink<index_t>& msink,             // hit sink
 	HierEbwt<index_t>& ebwtFw,                 // index of original text
 	HierEbwt<index_t>& ebwtBw,                 // index of mirror text
+	const KmerTable<index_t>* kmers,           // k-mer table, or NULL
     BitPairReference* refs,
 	OutFileBuf *metricsOfb)
 {
     multiseed_patsrc = &patsrc;
 	multiseed_msink  = &msink;
+	metrics.outq     = &msink.outq();
 	multiseed_ebwtFw = &ebwtFw;
 	multiseed_ebwtBw = &ebwtBw;
+	multiseed_kmers  = kmers;
 	multiseed_sc     = &sc;
 	multiseed_metricsOfb      = metricsOfb;
 	multiseed_refs = refs;
 	AutoArray<tthread::thread*> threads(nthreads);
-	AutoArray<int> tids(nthreads);
-	{
-		// Load the other half of the index into memory
-		assert(!ebwtFw.isInMemory());
-		Timer _t(cerr, "Time loading forward index: ", timing);
-		ebwtFw.loadIntoMemory(
-			0,  // colorspace?
-			-1, // not the reverse index
-			true,         // load SA samp? (yes, need forward index's SA samp)
-			true,         // load ftab (in forward index)
-			true,         // load rstarts (in forward index)
-			!noRefNames,  // load names?
-			startVerbose);
-	}
-#if 0
-	if(multiseedMms > 0 || do1mmUpFront) {
-		// Load the other half of the index into memory
-		assert(!ebwtBw.isInMemory());
-		Timer _t(cerr, "Time loading mirror index: ", timing);
-		ebwtBw.loadIntoMemory(
-			0, // colorspace?
-			// It's bidirectional search, so we need the reverse to be
-			// constructed as the reverse of the concatenated strings.
-			1,
-			true,        // load SA samp in reverse index
-			true,         // yes, need ftab in reverse index
-			true,        // load rstarts in reverse index
-			!noRefNames,  // load names?
-			startVerbose);
-	}
-#endif
+	AutoArray<SearchThread> tids(nthreads);
+	// loadAlignIndex() has already brought the index into memory
+	assert(ebwtFw.isInMemory());
 	// Start the metrics thread
 	{
 		Timer _t(cerr, "Multiseed full-index search: ", timing);
         
-        thread_rids.resize(nthreads);
-        thread_rids.fill(0);
+        thread_rids.init(nthreads);
         thread_rids_mindist = (nthreads == 1 || !useTempSpliceSite ? 0 : 1000 * nthreads);
 
 		for(int i = 0; i < nthreads; i++) {
 			// Thread IDs start at 1
-			tids[i] = i+1;
-            threads[i] = new tthread::thread(multiseedSearchWorker_hisat, (void*)&tids[i]);
+			tids[i].session = this;
+			tids[i].tid = i+1;
+            threads[i] = new tthread::thread(multiseedSearchThread, (void*)&tids[i]);
 		}
 
         for (int i = 0; i < nthreads; i++)
@@ -3449,21 +3741,49 @@ static void multiseedSearch(
 	}
 }
 
-static string argstr;
-
 extern void initializeCntLut();
 
-template<typename TStr>
-static void driver(
-	const char * type,
-	const string& bt2indexBase,
-	const string& outfile)
-{
-	if(gVerbose || startVerbose)  {
-		cerr << "Entered driver(): "; logTime(cerr, true);
+static MUTEX_T tablesMutex;
+static bool tablesReady = false;
+
+/**
+ * Fill in the process-wide lookup tables, once: every session shares
+ * them, and init_junction_prob() must not run twice.
+ */
+static void initTables() {
+	ThreadSafe ts(&tablesMutex);
+	if(!tablesReady) {
+		initializeCntLut();
+		init_junction_prob();
+		tablesReady = true;
 	}
-    
-    initializeCntLut();   
+}
+
+/**
+ * The parts of an alignment run that depend only on the index: the
+ * index itself, resident in memory, the reference sequences and the
+ * reference names and lengths.  driver() loads these once and hands
+ * them to every job it runs.
+ */
+struct AlignIndex {
+	AlignIndex() : ebwt(NULL), ebwtBw(NULL), kmers(NULL), refs(NULL) { }
+
+	HierEbwt<index_t, local_index_t> *ebwt;   // index of original text
+	HierEbwt<index_t, local_index_t> *ebwtBw; // index of mirror text
+	KmerTable<index_t> *kmers; // k-mer table (.7.bt2), if there is one
+	BitPairReference *refs;  // reference sequences
+	EList<size_t> reflens;   // reference sequence lengths
+	EList<string> refnames;  // reference sequence names
+	string knownSsFile;      // --known-splicesite-infile read at load time
+	string knownSs;          // ... and its contents
+};
+
+/**
+ * Load the index named by 'bt2indexBase', the reference sequences, and
+ * the known splice sites into 'idx'.
+ */
+void AlignSession::loadAlignIndex(AlignIndex& idx, const string& bt2indexBase) {
+    initTables();
     
 	// Vector of the reference sequences; used for sanity-checking
 	EList<SString<char> > names, os;
@@ -3475,52 +3795,12 @@ static void driver(
 		tokenize(origString, ",", origFiles);
 		parseFastas(origFiles, names, nameLens, os, seqLens);
 	}
-	PatternParams pp(
-		format,        // file format
-		fileParallel,  // true -> wrap files with separate PairedPatternSources
-		seed,          // pseudo-random seed
-		useSpinlock,   // use spin locks instead of pthreads
-		solexaQuals,   // true -> qualities are on solexa64 scale
-		phred64Quals,  // true -> qualities are on phred64 scale
-		integerQuals,  // true -> qualities are space-separated numbers
-		fuzzy,         // true -> try to parse fuzzy fastq
-		fastaContLen,  // length of sampled reads for FastaContinuous...
-		fastaContFreq, // frequency of sampled reads for FastaContinuous...
-		skipReads      // skip the first 'skip' patterns
-	);
-	if(gVerbose || startVerbose) {
-		cerr << "Creating PatternSource: "; logTime(cerr, true);
-	}
-	PairedPatternSource *patsrc = PairedPatternSource::setupPatternSources(
-		queries,     // singles, from argv
-		mates1,      // mate1's, from -1 arg
-		mates2,      // mate2's, from -2 arg
-		mates12,     // both mates on each line, from --12 arg
-#ifdef USE_SRA
-        sra_accs,    // SRA accessions
-#endif
-		qualities,   // qualities associated with singles
-		qualities1,  // qualities associated with m1
-		qualities2,  // qualities associated with m2
-		pp,          // read read-in parameters
-        nthreads,
-		gVerbose || startVerbose); // be talkative
-	// Open hit output file
-	if(gVerbose || startVerbose) {
-		cerr << "Opening hit output file: "; logTime(cerr, true);
-	}
-	OutFileBuf *fout;
-	if(!outfile.empty()) {
-		fout = new OutFileBuf(outfile.c_str(), false);
-	} else {
-		fout = new OutFileBuf();
-	}
 	// Initialize Ebwt object and read in header
 	if(gVerbose || startVerbose) {
 		cerr << "About to initialize fw Ebwt: "; logTime(cerr, true);
 	}
 	adjIdxBase = adjustEbwtBase(argv0, bt2indexBase, gVerbose);
-	HierEbwt<index_t, local_index_t> ebwt(
+	idx.ebwt = new HierEbwt<index_t, local_index_t>(
 		adjIdxBase,
 	    0,        // index is colorspace
 		-1,       // fw index
@@ -3538,14 +3818,16 @@ static void driver(
 	    startVerbose, // talkative during initialization
 	    false /*passMemExc*/,
 	    sanityCheck);
-	HierEbwt<index_t, local_index_t>* ebwtBw = NULL;
+	HierEbwt<index_t, local_index_t>& ebwt = *idx.ebwt;
+	ebwt.setHugePages(useHugePages);
+	ebwt.setShmIndex(shmIndex);
 #if 0
 	// We need the mirror index if mismatches are allowed
 	if(multiseedMms > 0 || do1mmUpFront) {
 		if(gVerbose || startVerbose) {
 			cerr << "About to initialize rev Ebwt: "; logTime(cerr, true);
 		}
-		ebwtBw = new HierEbwt<index_t, local_index_t>(
+		idx.ebwtBw = new HierEbwt<index_t, local_index_t>(
 			adjIdxBase + ".rev",
 			0,       // index is colorspace
 			1,       // TODO: maybe not
@@ -3586,12 +3868,164 @@ static void driver(
 		ebwt.checkOrigs(os, false, false);
 		ebwt.evictFromMemory();
 	}
+	{
+		// Load the other half of the index into memory
+		Timer _t(cerr, "Time loading forward index: ", timing);
+		ebwt.loadIntoMemory(
+			0,  // colorspace?
+			-1, // not the reverse index
+			true,         // load SA samp? (yes, need forward index's SA samp)
+			true,         // load ftab (in forward index)
+			true,         // load rstarts (in forward index)
+			!noRefNames,  // load names?
+			startVerbose);
+		if(useHugePages && !gQuiet) {
+			ebwt.printHugePages(cerr);
+		}
+	}
+#if 0
+	if(idx.ebwtBw != NULL) {
+		// Load the other half of the index into memory
+		Timer _t(cerr, "Time loading mirror index: ", timing);
+		idx.ebwtBw->loadIntoMemory(
+			0, // colorspace?
+			// It's bidirectional search, so we need the reverse to be
+			// constructed as the reverse of the concatenated strings.
+			1,
+			true,        // load SA samp in reverse index
+			true,         // yes, need ftab in reverse index
+			true,        // load rstarts in reverse index
+			!noRefNames,  // load names?
+			startVerbose);
+	}
+#endif
+	if(!noKmerTable) {
+		Timer _t(cerr, "Time loading k-mer table: ", timing);
+		idx.kmers = new KmerTable<index_t>();
+		if(idx.kmers->read(adjIdxBase + ".7." + gEbwt_ext, ebwt)) {
+			if(gVerbose || startVerbose) {
+				cerr << "Loaded k-mer table: k=" << idx.kmers->k() << ", "
+				     << idx.kmers->size() << " k-mers, "
+				     << (idx.kmers->bytes() >> 20) << " MB" << endl;
+			}
+		} else {
+			delete idx.kmers;
+			idx.kmers = NULL;
+		}
+	}
+	for(size_t i = 0; i < ebwt.nPat(); i++) {
+		idx.reflens.push_back(ebwt.plen()[i]);
+	}
+	readEbwtRefnames<index_t>(adjIdxBase, idx.refnames);
+	{
+		Timer _t(cerr, "Time loading reference: ", timing);
+		idx.refs = new BitPairReference(
+			adjIdxBase,
+			false,
+			sanityCheck,
+			NULL,
+			NULL,
+			false,
+			useMm,
+			useShmem,
+			mmSweep,
+			gVerbose,
+			startVerbose,
+			shmIndex);
+	}
+	if(!idx.refs->loaded()) throw 1;
+	if(knownSpliceSiteInfile != "") {
+		// Jobs build their own SpliceSiteDB from this text, so that
+		// novel sites found by one job don't leak into the next
+		ifstream ssdb_file(knownSpliceSiteInfile.c_str(), ios::in);
+		if(ssdb_file.is_open()) {
+			ostringstream ss;
+			ss << ssdb_file.rdbuf();
+			idx.knownSs = ss.str();
+			idx.knownSsFile = knownSpliceSiteInfile;
+			ssdb_file.close();
+		}
+	}
+}
+
+/**
+ * Free everything loadAlignIndex() loaded into 'idx'.
+ */
+static void unloadAlignIndex(AlignIndex& idx) {
+	// Evict any loaded indexes from memory
+	if(idx.ebwt != NULL && idx.ebwt->isInMemory()) {
+		idx.ebwt->evictFromMemory();
+	}
+	delete idx.ebwt;
+	delete idx.ebwtBw;
+	delete idx.kmers;
+	delete idx.refs;
+	idx.ebwt = idx.ebwtBw = NULL;
+	idx.kmers = NULL;
+	idx.refs = NULL;
+}
+
+/**
+ * Align the reads named by the current options against the resident
+ * index 'idx', writing alignments to 'out' if it's given, else to
+ * 'outfile' (standard out if empty), and the alignment summary to
+ * standard error.
+ */
+void AlignSession::alignJob(AlignIndex& idx, const string& outfile, OutFileBuf *out) {
+	PatternParams pp(
+		format,        // file format
+		fileParallel,  // true -> wrap files with separate PairedPatternSources
+		seed,          // pseudo-random seed
+		useSpinlock,   // use spin locks instead of pthreads
+		solexaQuals,   // true -> qualities are on solexa64 scale
+		phred64Quals,  // true -> qualities are on phred64 scale
+		integerQuals,  // true -> qualities are space-separated numbers
+		fuzzy,         // true -> try to parse fuzzy fastq
+		fastaContLen,  // length of sampled reads for FastaContinuous...
+		fastaContFreq, // frequency of sampled reads for FastaContinuous...
+		skipReads,     // skip the first 'skip' patterns
+		readsPerBatch, // # reads a thread claims at a time
+		gTrim5,        // amount to trim from 5' end
+		gTrim3         // amount to trim from 3' end
+	);
+	if(gVerbose || startVerbose) {
+		cerr << "Creating PatternSource: "; logTime(cerr, true);
+	}
+	PairedPatternSource *patsrc = PairedPatternSource::setupPatternSources(
+		queries,     // singles, from argv
+		mates1,      // mate1's, from -1 arg
+		mates2,      // mate2's, from -2 arg
+		mates12,     // both mates on each line, from --12 arg
+#ifdef USE_SRA
+        sra_accs,    // SRA accessions
+#endif
+		qualities,   // qualities associated with singles
+		qualities1,  // qualities associated with m1
+		qualities2,  // qualities associated with m2
+		pp,          // read read-in parameters
+        nthreads,
+		gVerbose || startVerbose); // be talkative
+	// Open hit output file
+	if(gVerbose || startVerbose) {
+		cerr << "Opening hit output file: "; logTime(cerr, true);
+	}
+	OutFileBuf *fout = out;
+	if(out != NULL) {
+		// Caller's stream; they close it
+	} else if(!outfile.empty()) {
+		fout = new OutFileBuf(outfile.c_str(), samBam);
+	} else {
+		fout = new OutFileBuf();
+	}
+	HierEbwt<index_t, local_index_t>& ebwt = *idx.ebwt;
 	OutputQueue oq(
 		*fout,                   // out file buffer
 		reorder && nthreads > 1, // whether to reorder when there's >1 thread
 		nthreads,                // # threads
 		nthreads > 1,            // whether to be thread-safe
-		skipReads);              // first read will have this rdid
+		skipReads,               // first read will have this rdid
+		readsPerBatch,           // # reads a thread claims at a time
+		(size_t)reorderMem << 20); // cap on buffered out-of-order output
 	{
 		Timer _t(cerr, "Time searching: ", timing);
 		// Set up penalities
@@ -3618,12 +4052,8 @@ static void driver(
             penNoncanSplice,// non-canonical splicing penalty
             penConflictSplice, // conflicting splice site penalty
             &penIntronLen);  // penalty as to intron length
-		EList<size_t> reflens;
-		for(size_t i = 0; i < ebwt.nPat(); i++) {
-			reflens.push_back(ebwt.plen()[i]);
-		}
-		EList<string> refnames;
-		readEbwtRefnames<index_t>(adjIdxBase, refnames);
+		EList<size_t>& reflens = idx.reflens;
+		EList<string>& refnames = idx.refnames;
 		SamConfig samc(
 			refnames,               // reference sequence names
 			reflens,                // reference sequence lengths
@@ -3679,35 +4109,20 @@ static void driver(
 		// then instruct the sink to "retain" hits in a vector in
 		// memory so that we can easily sanity check them later on
 		AlnSink<index_t> *mssink = NULL;
-        Timer *_tRef = new Timer(cerr, "Time loading reference: ", timing);
-        unique_ptr<BitPairReference> refs(
-                                        new BitPairReference(
-                                                             adjIdxBase,
-                                                             false,
-                                                             sanityCheck,
-                                                             NULL,
-                                                             NULL,
-                                                             false,
-                                                             useMm,
-                                                             useShmem,
-                                                             mmSweep,
-                                                             gVerbose,
-                                                             startVerbose)
-                                        );
-        delete _tRef;
-        if(!refs->loaded()) throw 1;
-        
-        init_junction_prob();
         bool write = novelSpliceSiteOutfile != "" || useTempSpliceSite;
         bool read = knownSpliceSiteInfile != "" || novelSpliceSiteInfile != "" || useTempSpliceSite;
         ssdb = new SpliceSiteDB(
-                                *(refs.get()),
+                                *idx.refs,
                                 refnames,
                                 nthreads > 1, // thread-safe
                                 write, // write?
                                 read);  // read?
         if(ssdb != NULL) {
-            if(knownSpliceSiteInfile != "") {
+            if(knownSpliceSiteInfile != "" && knownSpliceSiteInfile == idx.knownSsFile) {
+                istringstream ssdb_text(idx.knownSs);
+                ssdb->read(ssdb_text,
+                           true); // known splice sites
+            } else if(knownSpliceSiteInfile != "") {
                 ifstream ssdb_file(knownSpliceSiteInfile.c_str(), ios::in);
                 if(ssdb_file.is_open()) {
                     ssdb->read(ssdb_file,
@@ -3724,18 +4139,55 @@ static void driver(
                 }
             }
         }
+		BamEncoder *bamenc = NULL;
+		BgzfWriter *bgzf = NULL;
+		BamSorter *bamsort = NULL;
+		BamIndexer *bamidx = NULL;
 		switch(outType) {
 			case OUTPUT_SAM: {
-				mssink = new AlnSinkSam<index_t>(
+				AlnSinkSam<index_t> *samsink = new AlnSinkSam<index_t>(
 					oq,           // output queue
 					samc,         // settings & routines for SAM output
 					refnames,     // reference names
 					gQuiet,       // don't print alignment summary at end
                     ssdb);
+				mssink = samsink;
+				BTString buf;
 				if(!samNoHead) {
 					bool printHd = true, printSq = true;
-					BTString buf;
-					samc.printHeader(buf, rgid, rgs, printHd, !samNoSQ, printSq);
+					samc.printHeader(buf, rgid, rgs, printHd, !samNoSQ, printSq, samSortedBam);
+				}
+				if(samBam) {
+					// BAM always has a header, even if its text is empty
+					bamenc = new BamEncoder(samc);
+					bgzf = new BgzfWriter(*fout, nthreads);
+					BTString bambuf;
+					bamenc->encodeHeader(buf, bambuf);
+					bgzf->writeString(bambuf);
+					bgzf->flush();
+					if(samSortedBam) {
+						// Spill runs next to the output file, or to
+						// $TMPDIR when writing to standard out
+						string tmpPrefix = outfile;
+						if(tmpPrefix.empty()) {
+							const char *tmpdir = getenv("TMPDIR");
+							ostringstream os;
+							// One prefix per session; a process may run several
+							os << ((tmpdir != NULL && *tmpdir != '\0') ? tmpdir : "/tmp")
+							   << "/hisat." << getpid() << "." << (size_t)this;
+							tmpPrefix = os.str();
+						}
+						bamsort = new BamSorter(tmpPrefix, (size_t)sortMem * 1024 * 1024);
+						if(!outfile.empty()) {
+							bamidx = new BamIndexer(samc);
+						} else {
+							cerr << "Warning: --sorted-bam output to standard out "
+							     << "is not indexed" << endl;
+						}
+					}
+					samsink->setBam(bamenc, nthreads);
+					oq.setBam(bgzf, bamsort);
+				} else {
 					fout->writeString(buf);
 				}
 				break;
@@ -3755,20 +4207,20 @@ static void driver(
 		// Do the search for all input reads
 		assert(patsrc != NULL);
 		assert(mssink != NULL);
-		multiseedSearch(
-			sc,      // scoring scheme
-			*patsrc, // pattern source
-			*mssink, // hit sink
-			ebwt,    // BWT
-			*ebwtBw, // BWT'
-            refs.get(),
-			metricsOfb);
-		// Evict any loaded indexes from memory
-		if(ebwt.isInMemory()) {
-			ebwt.evictFromMemory();
-		}
-		if(ebwtBw != NULL) {
-			delete ebwtBw;
+		try {
+			multiseedSearch(
+				sc,      // scoring scheme
+				*patsrc, // pattern source
+				*mssink, // hit sink
+				ebwt,    // BWT
+				*idx.ebwtBw, // BWT'
+				idx.kmers, // k-mer table
+				idx.refs,
+				metricsOfb);
+		} catch(...) {
+			// Don't leave spilled runs behind
+			delete bamsort;
+			throw;
 		}
 		if(!gQuiet && !seedSumm) {
 			size_t repThresh = mhits;
@@ -3793,30 +4245,405 @@ static void driver(
 		oq.flush(true);
 		assert_eq(oq.numStarted(), oq.numFinished());
 		assert_eq(oq.numStarted(), oq.numFlushed());
+		if(bamsort != NULL) {
+			try {
+				bamsort->finish(*bgzf, bamidx);
+			} catch(...) {
+				delete bamsort;
+				throw;
+			}
+			delete bamsort;
+		}
+		if(bgzf != NULL) {
+			bgzf->close();
+			if(bamidx != NULL) {
+				bamidx->write(outfile + bamidx->extension(), *bgzf);
+				delete bamidx;
+			}
+			delete bgzf;
+			delete bamenc;
+		}
 		delete patsrc;
 		delete mssink;
         delete ssdb;
+        ssdb = NULL;
 		delete metricsOfb;
-		if(fout != NULL) {
+		if(fout != out) {
 			delete fout;
 		}
 	}
 }
 
-// C++ name mangling is disabled for the bowtie() function to make it
-// easier to use Bowtie as a library.
-extern "C" {
+/**
+ * Take the query and output file names left on the command line after
+ * option parsing, and check that there are reads to align.  Returns 0
+ * on success or the exit status to fail with.
+ */
+int AlignSession::parseReadArgs(int argc, const char **argv) {
+	// Get query filename
+	bool got_reads = !queries.empty() || !mates1.empty() || !mates12.empty();
+#ifdef USE_SRA
+	got_reads = got_reads || !sra_accs.empty();
+#endif
+	if(minIntronLen > maxIntronLen) {
+		cerr << "--min-intronlen(" << minIntronLen << ") should not be greater than --max-intronlen("
+		     << maxIntronLen << ")" << endl;
+		printUsage(cerr);
+		return 1;
+	}
+	if(nextArg >= argc) {
+		if(!got_reads) {
+			printUsage(cerr);
+			cerr << "***" << endl
+#ifdef USE_SRA
+			     << "Error: Must specify at least one read input with -U/-1/-2/--sra-acc" << endl;
+#else
+			     << "Error: Must specify at least one read input with -U/-1/-2" << endl;
+#endif
+			return 1;
+		}
+	} else if(!got_reads) {
+		// Tokenize the list of query files
+		tokenize(argv[nextArg++], ",", queries);
+		if(queries.empty()) {
+			cerr << "Tokenized query file list was empty!" << endl;
+			printUsage(cerr);
+			return 1;
+		}
+	}
+
+	// Get output filename
+	if(nextArg < argc && outfile.empty()) {
+		outfile = argv[nextArg++];
+		cerr << "Warning: Output file '" << outfile.c_str()
+		     << "' was specified without -S.  This will not work in "
+			 << "future HISAT 2 versions.  Please use -S instead."
+			 << endl;
+	}
+
+	// Extra parametesr?
+	if(nextArg < argc) {
+		cerr << "Extra parameter(s) specified: ";
+		for(int i = nextArg; i < argc; i++) {
+			cerr << "\"" << argv[i] << "\"";
+			if(i < argc-1) cerr << ", ";
+		}
+		cerr << endl;
+		if(mates1.size() > 0) {
+			cerr << "Note that if <mates> files are specified using -1/-2, a <singles> file cannot" << endl
+				 << "also be specified.  Please run bowtie separately for mates and singles." << endl;
+		}
+		throw 1;
+	}
+	return 0;
+}
 
 /**
- * Main bowtie entry function.  Parses argc/argv style command-line
- * options, sets global configuration variables, and calls the driver()
- * function.
+ * Copy argv[1] through argv[argc-1] onto the end of 'args', leaving out
+ * option --<name> and its argument.
  */
-int hisat(int argc, const char **argv) {
+static void argsWithout(
+	int argc,
+	const char **argv,
+	const string& name,
+	EList<string>& args)
+{
+	const string opt = "--" + name;
+	for(int i = 1; i < argc; i++) {
+		string arg = argv[i];
+		if(arg == opt) {
+			i++;
+		} else if(arg.compare(0, opt.length() + 1, opt + "=") != 0) {
+			args.push_back(arg);
+		}
+	}
+}
+
+static char daemonSockName[256]; // socket for the signal handler to remove
+
+/**
+ * Remove the daemon's socket, then die of signal 'sig'.
+ */
+static void daemonSignal(int sig) {
+	unlink(daemonSockName);
+	signal(sig, SIG_DFL);
+	raise(sig);
+}
+
+/**
+ * Run one job against the resident index 'idx', for --daemon, --batch
+ * or hisat_align().  All the options are reset and parsed again from
+ * 'args', which must name 'idx' as the index, and the alignments go to
+ * 'out', if given, or where the options say.  Returns the job's exit
+ * status.
+ */
+int AlignSession::runJob(
+	AlignIndex& idx,
+	const string& index,
+	const EList<string>& args,
+	OutFileBuf *out)
+{
+	EList<const char*> argv;
+	argstr.clear();
+	for(size_t i = 0; i < args.size(); i++) {
+		argv.push_back(args[i].c_str());
+		argstr += args[i];
+		if(i < args.size()-1) argstr += " ";
+	}
+	int argc = (int)argv.size();
 	try {
-		// Reset all global state, including getopt state
-		opterr = optind = 1;
 		resetOptions();
+		parseOptions(argc, argv.ptr());
+		if(bt2index.empty() && nextArg < argc) {
+			bt2index = argv[nextArg++];
+		}
+		if(!daemonSocket.empty() || !daemonConnect.empty() || !batchFile.empty()) {
+			cerr << "Error: --daemon, --connect and --batch can only be given on the command line" << endl;
+			return 1;
+		}
+		if(bt2index != index) {
+			cerr << "Error: The loaded index is \"" << index << "\", not \""
+			     << bt2index << "\"" << endl;
+			return 1;
+		}
+		int ret = parseReadArgs(argc, argv.ptr());
+		if(ret != 0) {
+			return ret;
+		}
+		metrics.reset();
+		metrics.first = true;
+		Timer _t(cerr, "Overall time: ", timing);
+		alignJob(idx, outfile, out);
+		return 0;
+	} catch(std::exception& e) {
+		cerr << "Error: Encountered exception: '" << e.what() << "'" << endl;
+		return 1;
+	} catch(int e) {
+		if(e != 0) {
+			cerr << "Error: Encountered internal HISAT exception (#" << e << ")" << endl;
+		}
+		return e;
+	}
+}
+
+/**
+ * Serve the jobs that "hisat-align --connect" sends to the UNIX socket
+ * 'path', one at a time, each using all the threads it asks for, until
+ * the daemon is killed.  A job runs in the client's working directory,
+ * writes to the client's standard output and error, and is parsed as
+ * 'baseArgs' (the daemon's own command line, minus --daemon) followed
+ * by the client's arguments.
+ */
+void AlignSession::serveJobs(
+	AlignIndex& idx,
+	const string& path_,
+	const string& index_,
+	const EList<string>& baseArgs)
+{
+	// Copy these; they may be options that every job resets
+	const string path = path_, index = index_;
+	int lfd = daemonListen(path);
+	strncpy(daemonSockName, path.c_str(), sizeof(daemonSockName) - 1);
+	signal(SIGINT, daemonSignal);
+	signal(SIGTERM, daemonSignal);
+#ifdef SIGPIPE
+	// A client that goes away mid-job mustn't take the daemon with it
+	signal(SIGPIPE, SIG_IGN);
+#endif
+	char cwd[PATH_MAX];
+	if(getcwd(cwd, sizeof(cwd)) == NULL) {
+		perror("getcwd");
+		daemonClose(lfd, path);
+		throw 1;
+	}
+	int stdfds[3];
+	for(int i = 0; i < 3; i++) {
+		stdfds[i] = dup(i);
+	}
+	if(!gQuiet) {
+		cerr << "Serving index " << index << " on " << path << endl;
+	}
+	while(true) {
+		DaemonJob job;
+		if(!daemonAccept(lfd, job)) {
+			continue;
+		}
+		EList<string> args(baseArgs);
+		for(size_t i = 0; i < job.args.size(); i++) {
+			args.push_back(job.args[i]);
+		}
+		fflush(stdout);
+		fflush(stderr);
+		for(int i = 0; i < 3; i++) {
+			dup2(job.fds[i], i);
+		}
+		int status = 1;
+		if(chdir(job.cwd.c_str()) == -1) {
+			cerr << "Error: Could not change to directory " << job.cwd << ": "
+			     << strerror(errno) << endl;
+		} else {
+			status = runJob(idx, index, args);
+		}
+		cout.flush();
+		cerr.flush();
+		fflush(stdout);
+		fflush(stderr);
+		clearerr(stdin);
+		for(int i = 0; i < 3; i++) {
+			dup2(stdfds[i], i);
+		}
+		if(chdir(cwd) == -1) {
+			perror("chdir");
+		}
+		daemonReply(job, status);
+	}
+}
+
+/**
+ * One sample from a --batch manifest.
+ */
+struct BatchSample {
+	string id;         // read group ID; also labels the sample
+	string reads1;     // unpaired reads, or #1 mates if there are #2 mates
+	string reads2;     // #2 mates, or empty
+	string output;     // SAM/BAM output file
+	EList<string> rg;  // other @RG fields
+};
+
+/**
+ * Read the --batch manifest 'fname' into 'samples'.  Each line holds
+ * tab-separated fields: read group ID, reads (or #1 mates), #2 mates
+ * (empty or "-" for unpaired reads), output file, then any number of
+ * extra @RG fields.  Blank lines and lines starting with '#' are
+ * skipped.  Prints an error and throws 1 on a malformed line.
+ */
+static void readManifest(const string& fname, EList<BatchSample>& samples) {
+	ifstream in(fname.c_str());
+	if(!in.is_open()) {
+		cerr << "Error: Could not open batch manifest " << fname << endl;
+		throw 1;
+	}
+	string line;
+	size_t lineno = 0;
+	while(getline(in, line)) {
+		lineno++;
+		if(!line.empty() && line[line.length()-1] == '\r') {
+			line.erase(line.length()-1);
+		}
+		if(line.empty() || line[0] == '#') continue;
+		EList<string> fields;
+		tokenize(line, '\t', fields);
+		if(fields.size() < 4 || fields[0].empty() || fields[1].empty() || fields[3].empty()) {
+			cerr << "Error: Line " << lineno << " of batch manifest " << fname
+			     << " needs a read group ID, reads, #2 mates (or -) and an output file, "
+			     << "separated by tabs" << endl;
+			throw 1;
+		}
+		samples.expand();
+		BatchSample& s = samples.back();
+		s.id = fields[0];
+		s.reads1 = fields[1];
+		s.reads2 = (fields[2] == "-") ? "" : fields[2];
+		s.output = fields[3];
+		s.rg.clear();
+		for(size_t i = 4; i < fields.size(); i++) {
+			if(!fields[i].empty()) s.rg.push_back(fields[i]);
+		}
+	}
+	if(samples.empty()) {
+		cerr << "Error: Batch manifest " << fname << " lists no samples" << endl;
+		throw 1;
+	}
+}
+
+/**
+ * Align each of 'samples' in turn against the resident index 'idx',
+ * with the options in 'baseArgs' (the command line, minus --batch)
+ * followed by the sample's reads, output file and read group.  Each
+ * sample gets its own output and alignment summary, and all of -p's
+ * threads.  Throws 1 after the last sample if any of them failed.
+ */
+void AlignSession::runBatch(
+	AlignIndex& idx,
+	const string& index_,
+	const EList<string>& baseArgs,
+	const EList<BatchSample>& samples)
+{
+	// Copy these; every sample resets the options they came from
+	const string index = index_;
+	const bool quiet = gQuiet;
+	size_t nfailed = 0;
+	for(size_t i = 0; i < samples.size(); i++) {
+		const BatchSample& s = samples[i];
+		EList<string> args(baseArgs);
+		if(s.reads2.empty()) {
+			args.push_back("-U");
+			args.push_back(s.reads1);
+		} else {
+			args.push_back("-1");
+			args.push_back(s.reads1);
+			args.push_back("-2");
+			args.push_back(s.reads2);
+		}
+		args.push_back("-S");
+		args.push_back(s.output);
+		args.push_back("--rg-id");
+		args.push_back(s.id);
+		for(size_t j = 0; j < s.rg.size(); j++) {
+			args.push_back("--rg");
+			args.push_back(s.rg[j]);
+		}
+		if(!quiet) {
+			cerr << "Sample " << s.id << " (" << (i+1) << " of " << samples.size()
+			     << "), writing " << s.output << ":" << endl;
+		}
+		if(runJob(idx, index, args) != 0) {
+			cerr << "Error: Sample " << s.id << " failed" << endl;
+			nfailed++;
+		}
+	}
+	if(nfailed > 0) {
+		cerr << "Error: " << nfailed << " of " << samples.size() << " samples failed" << endl;
+		throw 1;
+	}
+}
+
+template<typename TStr>
+void AlignSession::driver(
+	const char * type,
+	const string& bt2indexBase,
+	const string& outfile,
+	const EList<string>& jobArgs)
+{
+	if(gVerbose || startVerbose)  {
+		cerr << "Entered driver(): "; logTime(cerr, true);
+	}
+	EList<BatchSample> samples;
+	if(!batchFile.empty()) {
+		// Check the manifest before spending time on the index
+		readManifest(batchFile, samples);
+	}
+	AlignIndex idx;
+	loadAlignIndex(idx, bt2indexBase);
+	if(!daemonSocket.empty()) {
+		serveJobs(idx, daemonSocket, bt2indexBase, jobArgs);
+	} else if(!batchFile.empty()) {
+		runBatch(idx, bt2indexBase, jobArgs, samples);
+	} else {
+		alignJob(idx, outfile);
+	}
+	unloadAlignIndex(idx);
+}
+
+/**
+ * Parses argc/argv style command-line options into this session's
+ * options and calls the driver() function.
+ */
+int AlignSession::run(int argc, const char **argv) {
+	try {
+		// In case this session has run before
+		resetOptions();
+		argstr.clear();
 		for(int i = 0; i < argc; i++) {
 			argstr += argv[i];
 			if(i < argc-1) argstr += " ";
@@ -3844,6 +4671,12 @@ int hisat(int argc, const char **argv) {
 				 << ", " << sizeof(off_t) << "}" << endl;
 			return 0;
 		}
+		if(!daemonConnect.empty()) {
+			// The daemon parses the job's arguments itself
+			EList<string> args;
+			argsWithout(argc, argv, "connect", args);
+			return daemonSubmit(daemonConnect, args);
+		}
 		{
 			Timer _t(cerr, "Overall time: ", timing);
 			if(startVerbose) {
@@ -3852,69 +4685,49 @@ int hisat(int argc, const char **argv) {
 
 			// Get index basename (but only if it wasn't specified via --index)
 			if(bt2index.empty()) {
-				if(optind >= argc) {
+				if(nextArg >= argc) {
 					cerr << "No index, query, or output file specified!" << endl;
 					printUsage(cerr);
 					return 1;
 				}
-				bt2index = argv[optind++];
+				bt2index = argv[nextArg++];
 			}
-
-			// Get query filename
-			bool got_reads = !queries.empty() || !mates1.empty() || !mates12.empty();
-#ifdef USE_SRA
-            got_reads = got_reads || !sra_accs.empty();
-#endif
-            if(minIntronLen > maxIntronLen) {
-                cerr << "--min-intronlen(" << minIntronLen << ") should not be greater than --max-intronlen("
-                     << maxIntronLen << ")" << endl;
-                printUsage(cerr);
-                return 1;
-            }
-			if(optind >= argc) {
-				if(!got_reads) {
-					printUsage(cerr);
-					cerr << "***" << endl
-#ifdef USE_SRA
-					     << "Error: Must specify at least one read input with -U/-1/-2/--sra-acc" << endl;
-#else
-                    << "Error: Must specify at least one read input with -U/-1/-2" << endl;
-
-#endif
-					return 1;
-				}
-			} else if(!got_reads) {
-				// Tokenize the list of query files
-				tokenize(argv[optind++], ",", queries);
-				if(queries.empty()) {
-					cerr << "Tokenized query file list was empty!" << endl;
-					printUsage(cerr);
-					return 1;
+			if(shmRemove) {
+				// Drop the copies --shm-index published for this index
+				string base = adjustEbwtBase(argv0, bt2index, gVerbose);
+				const char *exts[] = { ".1.", ".2.", ".4.", ".5.", ".6." };
+				for(size_t i = 0; i < sizeof(exts) / sizeof(exts[0]); i++) {
+					string fn = base + exts[i] + gEbwt_ext;
+					if(shmIndexRemove(fn) && !gQuiet) {
+						cerr << "Removed shared-memory copy of " << fn << endl;
+					}
 				}
+				return 0;
 			}
 
-			// Get output filename
-			if(optind < argc && outfile.empty()) {
-				outfile = argv[optind++];
-				cerr << "Warning: Output file '" << outfile.c_str()
-				     << "' was specified without -S.  This will not work in "
-					 << "future HISAT 2 versions.  Please use -S instead."
-					 << endl;
-			}
-
-			// Extra parametesr?
-			if(optind < argc) {
-				cerr << "Extra parameter(s) specified: ";
-				for(int i = optind; i < argc; i++) {
-					cerr << "\"" << argv[i] << "\"";
-					if(i < argc-1) cerr << ", ";
+			EList<string> jobArgs;
+			if(!daemonSocket.empty() || !batchFile.empty()) {
+				// Jobs bring their own reads and output files
+				const char *opt = daemonSocket.empty() ? "batch" : "daemon";
+				if(!queries.empty() || !mates1.empty() || !mates12.empty() ||
+				   !outfile.empty() || nextArg < argc)
+				{
+					cerr << "Error: --" << opt << " takes reads and output files from "
+					     << (daemonSocket.empty() ? "the manifest" : "the jobs sent to it")
+					     << ", not from the command line" << endl;
+					throw 1;
 				}
-				cerr << endl;
-				if(mates1.size() > 0) {
-					cerr << "Note that if <mates> files are specified using -1/-2, a <singles> file cannot" << endl
-						 << "also be specified.  Please run bowtie separately for mates and singles." << endl;
+				if(!daemonSocket.empty() && !batchFile.empty()) {
+					cerr << "Error: --daemon and --batch can't be combined" << endl;
+					throw 1;
+				}
+				jobArgs.push_back(argv0);
+				argsWithout(argc, argv, opt, jobArgs);
+			} else {
+				int ret = parseReadArgs(argc, argv);
+				if(ret != 0) {
+					return ret;
 				}
-				throw 1;
 			}
 
 			// Optionally summarize
@@ -3941,7 +4754,7 @@ int hisat(int argc, const char **argv) {
 				cout << "Press key to continue..." << endl;
 				getchar();
 			}
-			driver<SString<char> >("DNA", bt2index, outfile);
+			driver<SString<char> >("DNA", bt2index, outfile, jobArgs);
 		}
 		return 0;
 	} catch(std::exception& e) {
@@ -3959,5 +4772,248 @@ int hisat(int argc, const char **argv) {
 		}
 		return e;
 	}
+}
+
+// C++ name mangling is disabled for the bowtie() function to make it
+// easier to use Bowtie as a library.
+extern "C" {
+
+/**
+ * Main bowtie entry function.  Runs the command line in a session of
+ * its own.
+ */
+int hisat(int argc, const char **argv) {
+	AlignSession session;
+	return session.run(argc, argv);
 } // bowtie()
 } // extern "C"
+
+/**
+ * An index loaded by hisat_load().
+ */
+struct HisatIndex {
+	AlignIndex idx;
+	string index; // basename it was loaded under
+};
+
+/**
+ * Carries the output of a hisat_align() job from the aligner's threads,
+ * which write it, to the thread that called hisat_align(), which hands
+ * it to the caller's sink.  Writers block while more than 'cap' bytes
+ * are waiting, so a slow sink slows the job rather than filling memory.
+ */
+class SinkRelay {
+
+public:
+
+	SinkRelay(size_t cap) : cap_(cap), queued_(0), done_(false) { }
+
+	/**
+	 * OutFileBuf::Sink: queue a copy of a buffer.
+	 */
+	static void put(void *vp, const char *buf, size_t len) {
+		SinkRelay *r = (SinkRelay*)vp;
+		tthread::lock_guard<tthread::mutex> lock(r->mutex_);
+		while(r->queued_ > 0 && r->queued_ + len > r->cap_) {
+			r->cv_.wait(r->mutex_);
+		}
+		r->bufs_.expand();
+		r->bufs_.back().assign(buf, len);
+		r->queued_ += len;
+		r->cv_.notify_all();
+	}
+
+	/**
+	 * The job is over; let drain() return once the queue is empty.
+	 */
+	void finish() {
+		tthread::lock_guard<tthread::mutex> lock(mutex_);
+		done_ = true;
+		cv_.notify_all();
+	}
+
+	/**
+	 * Pass queued buffers to 'sink' until finish() is called.
+	 */
+	void drain(HisatSink sink, void *arg) {
+		EList<string> bufs;
+		mutex_.lock();
+		while(true) {
+			while(bufs_.empty() && !done_) {
+				cv_.wait(mutex_);
+			}
+			if(bufs_.empty()) break;
+			bufs.xfer(bufs_);
+			queued_ = 0;
+			cv_.notify_all();
+			mutex_.unlock();
+			for(size_t i = 0; i < bufs.size(); i++) {
+				sink(arg, bufs[i].data(), bufs[i].length());
+			}
+			bufs.clear();
+			mutex_.lock();
+		}
+		mutex_.unlock();
+	}
+
+private:
+
+	size_t         cap_;
+	size_t         queued_; // bytes in bufs_
+	bool           done_;
+	EList<string>  bufs_;
+	tthread::mutex mutex_;
+	tthread::condition_variable cv_;
+};
+
+/**
+ * A hisat_align() job running on its own thread, so that the caller's
+ * thread is free to feed the sink.
+ */
+struct ApiJob {
+	AlignSession *session;
+	HisatIndex *idx;
+	EList<string> args;
+	OutFileBuf *out;
+	SinkRelay *relay;
+	int status;
+};
+
+static void apiJobThread(void *vp) {
+	ApiJob *job = (ApiJob*)vp;
+	job->status = job->session->runJob(job->idx->idx, job->idx->index, job->args, job->out);
+	delete job->out; // flushes the last records to the relay
+	job->out = NULL;
+	job->relay->finish();
+}
+
+/**
+ * Turn 'opts' into a hisat-align command line, using 'index' if
+ * opts->index is NULL.
+ */
+static void apiArgs(
+	const HisatOptions *opts,
+	const char *index,
+	EList<string>& args)
+{
+	args.push_back("hisat-align");
+	if(opts->index != NULL) index = opts->index;
+	if(index != NULL) {
+		args.push_back("-x");
+		args.push_back(index);
+	}
+	const char **lists[] = { opts->unpaired, opts->mates1, opts->mates2 };
+	const char *flags[] = { "-U", "-1", "-2" };
+	for(size_t i = 0; i < 3; i++) {
+		string files;
+		for(const char **f = lists[i]; f != NULL && *f != NULL; f++) {
+			if(!files.empty()) files += ",";
+			files += *f;
+		}
+		if(!files.empty()) {
+			args.push_back(flags[i]);
+			args.push_back(files);
+		}
+	}
+	if(opts->output != NULL) {
+		args.push_back("-S");
+		args.push_back(opts->output);
+	}
+	if(opts->threads > 0) {
+		ostringstream ss;
+		ss << opts->threads;
+		args.push_back("-p");
+		args.push_back(ss.str());
+	}
+	if(opts->quiet) {
+		args.push_back("--quiet");
+	}
+	for(const char **a = opts->args; a != NULL && *a != NULL; a++) {
+		args.push_back(*a);
+	}
+}
+
+extern "C" {
+
+void hisat_options_init(HisatOptions *opts) {
+	memset(opts, 0, sizeof(HisatOptions));
+}
+
+HisatIndex *hisat_load(const HisatOptions *opts) {
+	if(opts == NULL) {
+		cerr << "Error: hisat_load() was given no options" << endl;
+		return NULL;
+	}
+	EList<string> args;
+	apiArgs(opts, NULL, args);
+	EList<const char*> argv;
+	for(size_t i = 0; i < args.size(); i++) {
+		argv.push_back(args[i].c_str());
+	}
+	HisatIndex *idx = new HisatIndex;
+	AlignSession *session = new AlignSession;
+	try {
+		session->parseOptions((int)argv.size(), argv.ptr());
+		session->argv0 = argv[0];
+		if(session->bt2index.empty()) {
+			cerr << "Error: No index specified" << endl;
+			throw 1;
+		}
+		idx->index = session->bt2index;
+		session->loadAlignIndex(idx->idx, idx->index);
+		delete session;
+		return idx;
+	} catch(std::exception& e) {
+		cerr << "Error: Encountered exception: '" << e.what() << "'" << endl;
+	} catch(int e) {
+		if(e != 0) {
+			cerr << "Error: Encountered internal HISAT exception (#" << e << ")" << endl;
+		}
+	}
+	delete session;
+	unloadAlignIndex(idx->idx);
+	delete idx;
+	return NULL;
+}
+
+int hisat_align(
+	HisatIndex *idx,
+	const HisatOptions *opts,
+	HisatSink sink,
+	void *arg)
+{
+	if(idx == NULL || opts == NULL) {
+		cerr << "Error: hisat_align() was given no "
+		     << (idx == NULL ? "index" : "options") << endl;
+		return 1;
+	}
+	// A session of its own, so that this job's options and search
+	// state are nobody else's
+	AlignSession *session = new AlignSession;
+	session->argv0 = "hisat-align";
+	ApiJob job;
+	job.session = session;
+	job.idx = idx;
+	apiArgs(opts, idx->index.c_str(), job.args);
+	if(opts->output != NULL || sink == NULL) {
+		job.status = session->runJob(idx->idx, idx->index, job.args);
+	} else {
+		SinkRelay relay(4 << 20);
+		job.out = new OutFileBuf(SinkRelay::put, &relay);
+		job.relay = &relay;
+		job.status = 1;
+		tthread::thread t(apiJobThread, &job);
+		relay.drain(sink, arg);
+		t.join();
+	}
+	delete session;
+	return job.status;
+}
+
+void hisat_free(HisatIndex *idx) {
+	if(idx == NULL) return;
+	unloadAlignIndex(idx->idx);
+	delete idx;
+}
+
+} // extern "C"
@@ -0,0 +1,111 @@
+/*
+ * Copyright 2015, Daehwan Kim <infphilo@gmail.com>
+ *
+ * This file is part of HISAT.
+ *
+ * HISAT is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * HISAT is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with HISAT.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef HISAT_API_H_
+#define HISAT_API_H_
+
+#include <stddef.h>
+
+/**
+ * In-process interface to hisat-align, for C and C++ programs that
+ * align many samples against one index and want to skip starting a
+ * process, re-loading the index and parsing SAM back out of a pipe for
+ * each one.  Build libhisat-align-s.a with "make libhisat-align-s.a"
+ * and link against it (and zlib, libbz2 and pthreads); the R package
+ * links it into Rhisat.so and calls it through .Call.
+ *
+ * hisat_load() loads an index into memory; hisat_align() aligns a set
+ * of reads against it, as many times as needed; hisat_free() releases
+ * it.  Each call parses hisat-align options from its HisatOptions into
+ * a session of its own, so the calls are reentrant: any number may run
+ * at once, from any threads, against the same index or different ones.
+ * A loaded index is only read, never changed, until hisat_free(), which
+ * must not overlap a hisat_align() using it.  Errors are printed on
+ * standard error, as is the alignment summary unless quiet is set.
+ * Small (.bt2) indexes only.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * An index loaded by hisat_load().
+ */
+typedef struct HisatIndex HisatIndex;
+
+/**
+ * Receives the output of a hisat_align() call that has no output file:
+ * the SAM header, then batches of whole SAM records (or, with --bam,
+ * BAM data), in output order.  Always called on the thread that called
+ * hisat_align(), so it may call back into R or any other runtime that
+ * isn't thread-safe.
+ */
+typedef void (*HisatSink)(void *arg, const char *buf, size_t len);
+
+/**
+ * Options for hisat_load() and hisat_align().  Lists are NULL-terminated
+ * arrays of strings, or NULL for none.  Start from hisat_options_init().
+ */
+typedef struct HisatOptions {
+	const char *index;     /* index basename, as for -x */
+	const char **unpaired; /* files with unpaired reads, as for -U */
+	const char **mates1;   /* files with #1 mates, as for -1 */
+	const char **mates2;   /* files with #2 mates, as for -2 */
+	const char *output;    /* SAM output file, as for -S; NULL for the sink */
+	int threads;           /* alignment threads, as for -p; 0 for 1 */
+	int quiet;             /* nonzero to suppress the alignment summary */
+	const char **args;     /* any other hisat-align options, as typed */
+} HisatOptions;
+
+/**
+ * Clear every field of 'opts'.
+ */
+void hisat_options_init(HisatOptions *opts);
+
+/**
+ * Load the index named by opts->index into memory, honoring any index
+ * options (such as --mm) in opts->args.  Returns NULL on failure,
+ * including when 'opts' is NULL.
+ */
+HisatIndex *hisat_load(const HisatOptions *opts);
+
+/**
+ * Align the reads named by 'opts' against 'idx', which opts->index must
+ * name too (or leave NULL).  Alignments go to opts->output if it's set,
+ * else to 'sink' (with 'arg') if it's set, else to standard out.
+ * Returns 0 on success, or hisat-align's exit status on failure; 1 if
+ * 'idx' or 'opts' is NULL.
+ */
+int hisat_align(
+	HisatIndex *idx,
+	const HisatOptions *opts,
+	HisatSink sink,
+	void *arg);
+
+/**
+ * Release an index loaded by hisat_load().
+ */
+void hisat_free(HisatIndex *idx);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /*HISAT_API_H_*/
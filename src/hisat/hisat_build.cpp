@@ -22,10 +22,14 @@
 #include <string>
 #include <cassert>
 #include <getopt.h>
+#ifndef _WIN32
+#include <sys/resource.h>
+#endif
 #include "assert_helpers.h"
 #include "endian_swap.h"
 #include "bt2_idx.h"
 #include "hier_idx.h"
+#include "kmer_table.h"
 #include "formats.h"
 #include "sequence_io.h"
 #include "tokenize.h"
@@ -33,6 +37,7 @@
 #include "ref_read.h"
 #include "filebuf.h"
 #include "reference.h"
+#include "decomp.h"
 #include "ds.h"
 
 /**
@@ -65,6 +70,16 @@ static bool packed;
 static bool writeRef;
 static bool justRef;
 static bool reverseEach;
+static bool packedOcc;
+static int kmerTableLen;
+static bool packedSa;
+static bool alignedLocal;
+static bool off40;
+static int nthreads;
+static uint64_t maxMem;
+static bool bmaxSet;
+static bool dcvSet;
+static uint64_t memBase; // peak memory before the first index is built
 static string wrapper;
 
 static void resetOptions() {
@@ -93,6 +108,15 @@ static void resetOptions() {
 	writeRef       = true;  // write compact reference to .3.bt2/.4.bt2
 	justRef        = false; // *just* write compact reference, don't index
 	reverseEach    = false;
+	packedOcc      = false; // lay the BWT out in cache-line blocks
+	kmerTableLen   = 0;     // k of the k-mer table; 0 = no table
+	packedSa       = false; // store SA samples in ceil(log2(n)) bits
+	alignedLocal   = false; // page-align the local indexes in .5/.6
+	off40          = false; // write a large index's offsets in 40 bits
+	nthreads       = 1;     // # threads building the index
+	maxMem         = 0;     // memory budget in bytes; 0 = none
+	bmaxSet        = false; // --bmax/--bmaxmultsqrt/--bmaxdivn given
+	dcvSet         = false; // --dcv given
     wrapper.clear();
 }
 
@@ -111,7 +135,14 @@ enum {
     ARG_SA,
 	ARG_WRAPPER,
     ARG_LOCAL_OFFRATE,
-    ARG_LOCAL_FTABCHARS
+    ARG_LOCAL_FTABCHARS,
+    ARG_PACKED_OCC,
+    ARG_KMER_TABLE,
+    ARG_PACKED_SA,
+    ARG_ALIGNED_LOCAL,
+    ARG_OFF40,
+    ARG_THREADS,
+    ARG_MAX_MEMORY
 };
 
 /**
@@ -131,6 +162,7 @@ static void printUsage(ostream& out) {
     
 	out << "Usage: hisat2-build [options]* <reference_in> <bt2_index_base>" << endl
 	    << "    reference_in            comma-separated list of files with ref sequences" << endl
+	    << "                            (may be gzip, bzip2 or zstd compressed)" << endl
 	    << "    hisat_index_base          write " << gEbwt_ext << " data to files with this dir/basename" << endl
         << "Options:" << endl
         << "    -c                      reference sequences given on cmd line (as" << endl
@@ -144,6 +176,8 @@ static void printUsage(ostream& out) {
 	    << "    --bmax <int>            max bucket sz for blockwise suffix-array builder" << endl
 	    << "    --bmaxdivn <int>        max bucket sz as divisor of ref len (default: 4)" << endl
 	    << "    --dcv <int>             diff-cover period for blockwise (default: 1024)" << endl
+	    << "    --threads <int>         # of threads building the index (default: 1)" << endl
+	    << "    --max-memory <int>[KMG] pick the fastest settings that fit in this much memory" << endl
 	    << "    --nodc                  disable diff-cover (algorithm becomes quadratic)" << endl
 	    << "    -r/--noref              don't build .3/.4.bt2 (packed reference) portion" << endl
 	    << "    -3/--justref            just build .3/.4.bt2 (packed reference) portion" << endl
@@ -151,6 +185,11 @@ static void printUsage(ostream& out) {
 	    << "    -t/--ftabchars <int>    # of chars consumed in initial lookup (default: 10)" << endl
         << "    --localoffrate <int>    SA (local) is sampled every 2^offRate BWT chars (default: 3)" << endl
         << "    --localftabchars <int>  # of chars consumed in initial lookup in a local index (default: 6)" << endl
+	    << "    --packed-occ            cache-line-aligned BWT blocks (needs new hisat)" << endl
+	    << "    --kmer-table <int>      also write SA ranges of all <int>-mers (.7." << gEbwt_ext << ")" << endl
+	    << "    --packed-sa             store SA samples in ceil(log2(n)) bits (needs new hisat)" << endl
+	    << "    --aligned-local         page-align local indexes to map them in place (needs new hisat)" << endl
+	    << "    --off40                 store a large index's offsets in 40 bits (needs new hisat)" << endl
 	    << "    --seed <int>            seed for random number generator" << endl
 	    << "    -q/--quiet              verbose output (for debugging)" << endl
 	    << "    -h/--help               print detailed description of tool and its options" << endl
@@ -191,6 +230,13 @@ static struct option long_options[] = {
 	{(char*)"ftabchars",      required_argument, 0,            't'},
     {(char*)"localoffrate",   required_argument, 0,            ARG_LOCAL_OFFRATE},
 	{(char*)"localftabchars", required_argument, 0,            ARG_LOCAL_FTABCHARS},
+	{(char*)"packed-occ",     no_argument,       0,            ARG_PACKED_OCC},
+	{(char*)"kmer-table",     required_argument, 0,            ARG_KMER_TABLE},
+	{(char*)"packed-sa",      no_argument,       0,            ARG_PACKED_SA},
+	{(char*)"aligned-local",  no_argument,       0,            ARG_ALIGNED_LOCAL},
+	{(char*)"off40",          no_argument,       0,            ARG_OFF40},
+	{(char*)"threads",        required_argument, 0,            ARG_THREADS},
+	{(char*)"max-memory",     required_argument, 0,            ARG_MAX_MEMORY},
 	{(char*)"help",           no_argument,       0,            'h'},
 	{(char*)"ntoa",           no_argument,       0,            ARG_NTOA},
 	{(char*)"justref",        no_argument,       0,            '3'},
@@ -226,6 +272,30 @@ static int parseNumber(T lower, const char *errmsg) {
 	return -1;
 }
 
+/**
+ * Parse a number of bytes out of optarg, optionally followed by K, M or
+ * G (powers of 1024).
+ */
+static uint64_t parseMemSize(const char *errmsg) {
+	char *endPtr = NULL;
+	uint64_t t = (uint64_t)strtoull(optarg, &endPtr, 10);
+	if(endPtr != optarg && t > 0) {
+		switch(toupper(*endPtr)) {
+			case 'G': t <<= 10; /* fall through */
+			case 'M': t <<= 10; /* fall through */
+			case 'K': t <<= 10; endPtr++; break;
+			default: break;
+		}
+		if(*endPtr == '\0') {
+			return t;
+		}
+	}
+	cerr << errmsg << endl;
+	printUsage(cerr);
+	throw 1;
+	return 0;
+}
+
 /**
  * Read command-line arguments
  */
@@ -271,6 +341,7 @@ static void parseOptions(int argc, const char **argv) {
 			case 'n':
 				// all f-s is used to mean "not set", so put 'e' on end
 				bmax = 0xfffffffe;
+				bmaxSet = true;
 				break;
 			case 'h':
 			case ARG_USAGE:
@@ -281,19 +352,23 @@ static void parseOptions(int argc, const char **argv) {
 				bmax = parseNumber<TIndexOffU>(1, "--bmax arg must be at least 1");
 				bmaxMultSqrt = OFF_MASK; // don't use multSqrt
 				bmaxDivN = 0xffffffff;     // don't use multSqrt
+				bmaxSet = true;
 				break;
 			case ARG_BMAX_MULT:
 				bmaxMultSqrt = parseNumber<TIndexOffU>(1, "--bmaxmultsqrt arg must be at least 1");
 				bmax = OFF_MASK;     // don't use bmax
 				bmaxDivN = 0xffffffff; // don't use multSqrt
+				bmaxSet = true;
 				break;
 			case ARG_BMAX_DIV:
 				bmaxDivN = parseNumber<uint32_t>(1, "--bmaxdivn arg must be at least 1");
 				bmax = OFF_MASK;         // don't use bmax
 				bmaxMultSqrt = OFF_MASK; // don't use multSqrt
+				bmaxSet = true;
 				break;
 			case ARG_DCV:
 				dcv = parseNumber<int>(3, "--dcv arg must be at least 3");
+				dcvSet = true;
 				break;
 			case ARG_SEED:
 				seed = parseNumber<int>(0, "--seed arg must be at least 0");
@@ -301,6 +376,27 @@ static void parseOptions(int argc, const char **argv) {
 			case ARG_REVERSE_EACH:
 				reverseEach = true;
 				break;
+			case ARG_PACKED_OCC:
+				packedOcc = true;
+				break;
+			case ARG_KMER_TABLE:
+				kmerTableLen = parseNumber<int>(1, "--kmer-table arg must be at least 1");
+				break;
+			case ARG_PACKED_SA:
+				packedSa = true;
+				break;
+			case ARG_ALIGNED_LOCAL:
+				alignedLocal = true;
+				break;
+			case ARG_OFF40:
+				off40 = true;
+				break;
+			case ARG_THREADS:
+				nthreads = parseNumber<int>(1, "--threads arg must be at least 1");
+				break;
+			case ARG_MAX_MEMORY:
+				maxMem = parseMemSize("--max-memory arg must be a positive number of bytes, optionally followed by K, M or G");
+				break;
 			case ARG_NTOA: nsToAs = true; break;
 			case 'a': autoMem = false; break;
 			case 'q': verbose = false; break;
@@ -317,6 +413,22 @@ static void parseOptions(int argc, const char **argv) {
 				throw 1;
 		}
 	} while(next_option != -1);
+	if(packedOcc && ((1 << lineRate) != (int)ebwt_block_align || sizeof(TIndexOffU) != 4)) {
+		cerr << "Error: --packed-occ needs 64-byte sides (-l/--linerate 6, the default) and" << endl
+		     << "isn't supported for large indexes." << endl;
+		throw 1;
+	}
+	if(kmerTableLen > 0 && (kmerTableLen <= ftabChars || kmerTableLen > ftabChars + 8)) {
+		cerr << "Error: --kmer-table must be longer than -t/--ftabchars (" << ftabChars << ")" << endl
+		     << "by 1 to 8 characters." << endl;
+		throw 1;
+	}
+	if(nthreads > 1 && !bmaxSet) {
+		// Cut the text into smaller blocks so that every thread gets
+		// a few; the blocks in flight then take about as much memory
+		// as the default blocks do on one thread
+		bmaxDivN *= nthreads;
+	}
 	if(bmax < 40) {
 		cerr << "Warning: specified bmax is very small (" << bmax << ").  This can lead to" << endl
 		     << "extremely slow performance and memory exhaustion.  Perhaps you meant to specify" << endl
@@ -346,80 +458,249 @@ static void deleteIdxFiles(
 extern void initializeCntLut();
 
 /**
- * Drive the index construction process and optionally sanity-check the
- * result.
+ * Return the peak resident memory of this process so far in bytes, or 0
+ * where that isn't available.
+ */
+static uint64_t observedPeakBytes() {
+#ifdef _WIN32
+	return 0;
+#else
+	struct rusage ru;
+	if(getrusage(RUSAGE_SELF, &ru) != 0) return 0;
+#ifdef __APPLE__
+	return (uint64_t)ru.ru_maxrss;
+#else
+	return (uint64_t)ru.ru_maxrss << 10;
+#endif
+#endif
+}
+
+/**
+ * Suffix-sorting parameters chosen by fitToMemory().
+ */
+struct MemFit {
+	bool     sais;     // build the suffix array with SA-IS
+	uint32_t bmaxDivN; // otherwise, cut it into blocks of len/bmaxDivN
+	int      dcv;      // ... using this difference-cover period
+	uint64_t peak;     // predicted peak, not counting memory already in use
+	bool     fits;     // true iff peak <= the budget
+};
+
+/**
+ * Pick the fastest suffix-sorting parameters whose estimated peak
+ * memory fits in 'budget' bytes for a joined reference of 'len'
+ * characters.  SA-IS comes first.  Otherwise the blockwise algorithm is
+ * fastest with the fewest blocks, and the default difference-cover
+ * period is tried before the larger (smaller) covers.  Parameters given
+ * on the command line are left alone.  If nothing fits, returns the
+ * parameters with the smallest estimate and 'fits' false.  The
+ * offset rates don't figure in: the SA samples are streamed to disk,
+ * not held in memory.
  */
 template<typename TStr>
-static void driver(
-	const string& infile,
+static MemFit fitToMemory(TIndexOffU len, bool packed, uint64_t budget) {
+	typedef Ebwt<TIndexOffU> TEbwt;
+	typedef HierEbwt<TIndexOffU> THierEbwt;
+	EbwtParams<TIndexOffU> eh(len, lineRate, offRate, ftabChars, false, false);
+	uint64_t joined = TEbwt::joinedMemEstimate(eh, packed);
+	bool localSais = THierEbwt::template localSais<TStr>(nthreads, budget);
+	MemFit fit;
+	fit.sais = true;
+	fit.bmaxDivN = bmaxDivN;
+	fit.dcv = noDc ? 0 : dcv;
+	fit.peak = max(TEbwt::template saisMemEstimate<TStr>(eh, packed),
+	               joined + THierEbwt::template localMemEstimate<TStr>(nthreads, fit.dcv, localSais));
+	fit.fits = fit.peak <= budget;
+	if(fit.fits) return fit;
+	fit.sais = false;
+	fit.peak = std::numeric_limits<uint64_t>::max();
+	int dcvs[] = { 1024, 2048, 4096 };
+	size_t ndcvs = 3;
+	if(noDc || dcvSet) {
+		dcvs[0] = noDc ? 0 : dcv;
+		ndcvs = 1;
+	}
+	for(size_t i = 0; i < ndcvs; i++) {
+		int v = dcvs[i];
+		uint64_t local = joined + THierEbwt::template localMemEstimate<TStr>(nthreads, v, localSais);
+		// Blocks are handed to the threads in turn, so start with one each
+		for(uint32_t d = (uint32_t)nthreads; ; d = (d < 16 ? d + 1 : d + (d >> 2))) {
+			TIndexOffU b;
+			if(!bmaxSet) {
+				b = max<TIndexOffU>(len / d, 1);
+			} else if(bmax != (TIndexOffU)OFF_MASK) {
+				b = bmax;
+			} else if(bmaxMultSqrt != (TIndexOffU)OFF_MASK) {
+				b = (TIndexOffU)(bmaxMultSqrt * sqrt((double)len));
+			} else {
+				b = max<TIndexOffU>(len / bmaxDivN, 1);
+			}
+			b -= (b >> 2); // initFromVector's first try is 25% smaller
+			if(b < 40 && d > (uint32_t)nthreads) break;
+			uint64_t peak = max(TEbwt::template blockwiseMemEstimate<TStr>(eh, packed, b, v, nthreads), local);
+			if(peak < fit.peak) {
+				fit.peak = peak;
+				fit.bmaxDivN = bmaxSet ? bmaxDivN : d;
+				fit.dcv = v;
+			}
+			if(peak <= budget) {
+				fit.fits = true;
+				return fit;
+			}
+			if(bmaxSet) break;
+		}
+	}
+	return fit;
+}
+
+/**
+ * Open the reference files, decoding compressed ones on threads of
+ * their own, and read them into 'ref' in one pass, parsing on the
+ * --threads threads.  Writes the .3 and .4 files too if they're wanted.
+ */
+static void readReference(
 	EList<string>& infiles,
 	const string& outfile,
-	bool packed,
-	int reverse)
+	const RefReadInParams& refparams,
+	PackedRef& ref)
 {
-    initializeCntLut();
 	EList<FileBuf*> is(MISC_CAT);
-	bool bisulfite = false;
-	RefReadInParams refparams(false, reverse, nsToAs, bisulfite);
-	assert_gt(infiles.size(), 0);
+	uint64_t sizeHint = 0;
 	if(format == CMDLINE) {
 		// Adapt sequence strings to stringstreams open for input
 		stringstream *ss = new stringstream();
 		for(size_t i = 0; i < infiles.size(); i++) {
 			(*ss) << ">" << i << endl << infiles[i].c_str() << endl;
+			sizeHint += infiles[i].length();
 		}
 		FileBuf *fb = new FileBuf(ss);
 		assert(fb != NULL);
 		assert(!fb->eof());
-		assert(fb->get() == '>');
-		ASSERT_ONLY(fb->reset());
-		assert(!fb->eof());
 		is.push_back(fb);
 	} else {
-		// Adapt sequence files to ifstreams
+		bool compressed = false;
 		for(size_t i = 0; i < infiles.size(); i++) {
-			FILE *f = fopen(infiles[i].c_str(), "r");
+			FILE *f = fopen(infiles[i].c_str(), "rb");
 			if (f == NULL) {
 				cerr << "Error: could not open "<< infiles[i].c_str() << endl;
 				throw 1;
 			}
-			FileBuf *fb = new FileBuf(f);
-			assert(fb != NULL);
-			if(fb->peek() == -1 || fb->eof()) {
-				cerr << "Warning: Empty fasta file: '" << infile.c_str() << "'" << endl;
+			char magic[COMPRESS_MAGIC_LEN];
+			size_t nmagic = readMagic(f, magic);
+			if(nmagic == 0) {
+				cerr << "Warning: Empty fasta file: '" << infiles[i].c_str() << "'" << endl;
+				fclose(f);
 				continue;
 			}
-			assert(!fb->eof());
-			assert(fb->get() == '>');
-			ASSERT_ONLY(fb->reset());
-			assert(!fb->eof());
+			// Compressed files are recognized by their magic number
+			FileBuf *fb = new FileBuf();
+			int fmt = sniffCompression(magic, nmagic);
+			if(fmt != COMPRESS_NONE) {
+				fb->newFile(new Decompressor(f, fmt, magic, nmagic, infiles[i]));
+				compressed = true;
+			} else {
+				fb->newFile(f, magic, nmagic);
+				struct stat st;
+				if(fstat(fileno(f), &st) == 0) sizeHint += (uint64_t)st.st_size;
+			}
 			is.push_back(fb);
 		}
+		// Can't tell how long compressed inputs are
+		if(compressed) sizeHint = 0;
 	}
 	if(is.empty()) {
 		cerr << "Warning: All fasta inputs were empty" << endl;
 		throw 1;
 	}
-	// Vector for the ordered list of "records" comprising the input
-	// sequences.  A record represents a stretch of unambiguous
-	// characters in one of the input sequences.
-	EList<RefRecord> szs(MISC_CAT);
-	std::pair<size_t, size_t> sztot;
 	{
-		if(verbose) cout << "Reading reference sizes" << endl;
-		Timer _t(cout, "  Time reading reference sizes: ", verbose);
-		if(!reverse && (writeRef || justRef)) {
+		if(verbose) cout << "Reading reference" << endl;
+		Timer _t(cout, "  Time reading reference: ", verbose);
+		string file;
+		if(writeRef || justRef) {
 			filesWritten.push_back(outfile + ".3." + gEbwt_ext);
 			filesWritten.push_back(outfile + ".4." + gEbwt_ext);
-			sztot = BitPairReference::szsFromFasta(is, outfile, bigEndian, refparams, szs, sanityCheck);
-		} else {
-			sztot = BitPairReference::szsFromFasta(is, string(), bigEndian, refparams, szs, sanityCheck);
+			file = outfile;
 		}
+		BitPairReference::szsFromFasta(is, file, bigEndian, refparams, ref, nthreads, sizeHint);
+	}
+	for(size_t i = 0; i < is.size(); i++) {
+		is[i]->close();
+		delete is[i];
+	}
+}
+
+/**
+ * Drive the index construction process and optionally sanity-check the
+ * result.  The forward index reads the reference into 'ref', and the
+ * mirror index is built from the same 'ref'.
+ */
+template<typename TStr>
+static void driver(
+	EList<string>& infiles,
+	const string& outfile,
+	bool packed,
+	int reverse,
+	PackedRef& ref)
+{
+    initializeCntLut();
+	bool bisulfite = false;
+	RefReadInParams refparams(false, reverse, nsToAs, bisulfite);
+	assert_gt(infiles.size(), 0);
+	if(ref.recs.empty()) {
+		assert_eq(0, reverse);
+		readReference(infiles, outfile, refparams, ref);
 	}
+	// Vector for the ordered list of "records" comprising the input
+	// sequences.  A record represents a stretch of unambiguous
+	// characters in one of the input sequences.
+	EList<RefRecord>& szs = ref.recs;
+	std::pair<size_t, size_t> sztot = ref.sztot;
 	if(justRef) return;
 	assert_gt(sztot.first, 0);
 	assert_gt(sztot.second, 0);
 	assert_gt(szs.size(), 0);
+	uint64_t budget = 0, predicted = 0;
+	if(maxMem > 0) {
+		// Keep an eighth in reserve; the heap left fragmented by the
+		// forward index takes some of it while the mirror is built
+		uint64_t base = memBase + ref.bytes();
+		budget = maxMem > base ? maxMem - base : 1;
+		budget -= (budget >> 3);
+		TIndexOffU jlen = 0;
+		for(size_t i = 0; i < szs.size(); i++) {
+			jlen += (TIndexOffU)szs[i].len;
+		}
+		MemFit fit = fitToMemory<TStr>(jlen, packed, budget);
+		if(!fit.fits && !packed && autoMem &&
+		   fitToMemory<S2bDnaString>(jlen, true, budget).fits)
+		{
+			// The packed string is a quarter of the size
+			if(verbose) cout << "Only a packed string representation fits in the memory budget" << endl;
+			throw bad_alloc();
+		}
+		if(!fit.fits) {
+			cerr << "Warning: building this index takes about " << (base + fit.peak) << " bytes of memory" << endl
+			     << "even with the most economical parameters, more than --max-memory " << maxMem << endl;
+		}
+		if(!fit.sais) {
+			if(!bmaxSet) {
+				bmax = OFF_MASK;
+				bmaxMultSqrt = OFF_MASK;
+				bmaxDivN = fit.bmaxDivN;
+			}
+			dcv = fit.dcv;
+		}
+		predicted = base + fit.peak;
+		if(verbose) {
+			cout << "Fitted to --max-memory " << maxMem << ": ";
+			if(fit.sais) {
+				cout << "SA-IS";
+			} else {
+				cout << "--bmaxdivn " << bmaxDivN << " --dcv " << fit.dcv;
+			}
+			cout << "; predicted peak: " << predicted << " bytes" << endl;
+		}
+	}
 	// Construct index from input strings and parameters
 	filesWritten.push_back(outfile + ".1." + gEbwt_ext);
 	filesWritten.push_back(outfile + ".2." + gEbwt_ext);
@@ -441,7 +722,7 @@ static void driver(
                                   bmaxMultSqrt, // block size as multiplier of sqrt(len)
                                   bmaxDivN,     // block size as divisor of len
                                   noDc? 0 : dcv,// difference-cover period
-                                  is,           // list of input streams
+                                  ref,          // reference sequences
                                   szs,          // list of reference sizes
                                   (TIndexOffU)sztot.first,  // total size of all unambiguous ref chars
                                   refparams,    // reference read-in parameters
@@ -449,13 +730,51 @@ static void driver(
                                   -1,           // override offRate
                                   verbose,      // be talkative
                                   autoMem,      // pass exceptions up to the toplevel so that we can adjust memory settings automatically
-                                  sanityCheck); // verify results and internal consistency
+                                  sanityCheck,  // verify results and internal consistency
+                                  packedOcc,    // cache-line-aligned BWT blocks
+                                  packedSa,     // bit-packed SA samples
+                                  nthreads,     // # threads for SA blocks, local indexes
+                                  budget,       // memory budget for choosing SA-IS
+                                  alignedLocal, // page-aligned local indexes
+                                  off40);       // 40-bit offsets in the .1/.2 files
 	// Note that the Ebwt is *not* resident in memory at this time.  To
 	// load it into memory, call ebwt.loadIntoMemory()
 	if(verbose) {
 		// Print Ebwt's vital stats
 		hierEbwt.eh().print(cout);
 	}
+	if(maxMem > 0) {
+		uint64_t observed = observedPeakBytes();
+		if(verbose) {
+			cout << "Peak memory: predicted " << predicted << " bytes, observed " << observed << " bytes" << endl;
+		}
+		if(observed > maxMem) {
+			cerr << "Warning: peak memory of " << observed << " bytes exceeded --max-memory " << maxMem << endl;
+		}
+	}
+	if(kmerTableLen > 0 && reverse == 0) {
+		// Only the forward index's partial searches use the table, and
+		// they only need the BWT and ftab
+		Timer _t(cout, "  Time building k-mer table: ", verbose);
+		string kmerFile = outfile + ".7." + gEbwt_ext;
+		filesWritten.push_back(kmerFile);
+		hierEbwt.Ebwt<TIndexOffU>::loadIntoMemory(
+			0,
+			0,
+			false, // load SA sample?
+			true,  // load ftab?
+			false, // load rstarts?
+			false,
+			false);
+		KmerTable<TIndexOffU> kmers;
+		kmers.build(hierEbwt, (size_t)kmerTableLen);
+		kmers.write(kmerFile, bigEndian != 0);
+		hierEbwt.evictFromMemory();
+		if(verbose) {
+			cout << "K-mer table: " << kmers.size() << " " << kmerTableLen << "-mers, "
+			     << kmers.bytes() << " bytes" << endl;
+		}
+	}
 	if(sanityCheck) {
 		// Try restoring the original string (if there were
 		// multiple texts, what we'll get back is the joined,
@@ -473,7 +792,7 @@ static void driver(
 		hierEbwt.evictFromMemory();
 		{
 			SString<char> joinedss = Ebwt<>::join<SString<char> >(
-				is,          // list of input streams
+				ref,         // reference sequences
 				szs,         // list of reference sizes
 				(TIndexOffU)sztot.first, // total size of all unambiguous ref chars
 				refparams,   // reference read-in parameters
@@ -562,7 +881,12 @@ int hisat_build(int argc, const char **argv) {
 				 << "  Output files: \"" << outfile.c_str() << ".*." << gEbwt_ext << "\"" << endl
 				 << "  Line rate: " << lineRate << " (line is " << (1<<lineRate) << " bytes)" << endl
 				 << "  Lines per side: " << linesPerSide << " (side is " << ((1<<lineRate)*linesPerSide) << " bytes)" << endl
+				 << "  Occurrence blocks: " << (packedOcc ? "packed, cache-line aligned" : "unaligned") << endl
+				 << "  K-mer table k: " << kmerTableLen << (kmerTableLen > 0 ? "" : " (none)") << endl
 				 << "  Offset rate: " << offRate << " (one in " << (1<<offRate) << ")" << endl
+				 << "  SA samples: " << (packedSa ? "bit-packed" : "full words") << endl
+				 << "  Local indexes: " << (alignedLocal ? "page-aligned" : "unaligned") << endl
+				 << "  Large index offsets: " << (off40 ? "40-bit" : "64-bit") << endl
 				 << "  FTable chars: " << ftabChars << endl
 				 << "  Strings: " << (packed? "packed" : "unpacked") << endl
                  << "  Local offset rate: " << localOffRate << " (one in " << (1<<localOffRate) << ")" << endl
@@ -586,6 +910,12 @@ int hisat_build(int argc, const char **argv) {
 				cout << "  Max bucket size, len divisor: " << bmaxDivN << endl;
 			}
 			cout << "  Difference-cover sample period: " << dcv << endl;
+			cout << "  Threads: " << nthreads << endl;
+			if(maxMem == 0) {
+				cout << "  Memory budget: none" << endl;
+			} else {
+				cout << "  Memory budget: " << maxMem << " bytes" << endl;
+			}
 			cout << "  Endianness: " << (bigEndian? "big":"little") << endl
 				 << "  Actual local endianness: " << (currentlyBigEndian()? "big":"little") << endl
 				 << "  Sanity checking: " << (sanityCheck? "enabled":"disabled") << endl;
@@ -603,11 +933,13 @@ int hisat_build(int argc, const char **argv) {
 		}
 		// Seed random number generator
 		srand(seed);
+		memBase = observedPeakBytes();
+		PackedRef ref;
 		{
 			Timer timer(cout, "Total time for call to driver() for forward index: ", verbose);
 			if(!packed) {
 				try {
-					driver<SString<char> >(infile, infiles, outfile, false, REF_READ_FORWARD);
+					driver<SString<char> >(infiles, outfile, false, REF_READ_FORWARD, ref);
 				} catch(bad_alloc& e) {
 					if(autoMem) {
 						cerr << "Switching to a packed string representation." << endl;
@@ -618,7 +950,7 @@ int hisat_build(int argc, const char **argv) {
 				}
 			}
 			if(packed) {
-				driver<S2bDnaString>(infile, infiles, outfile, true, REF_READ_FORWARD);
+				driver<S2bDnaString>(infiles, outfile, true, REF_READ_FORWARD, ref);
 			}
 		}
 		int reverseType = reverseEach ? REF_READ_REVERSE_EACH : REF_READ_REVERSE;
@@ -626,7 +958,7 @@ int hisat_build(int argc, const char **argv) {
 		Timer timer(cout, "Total time for backward call to driver() for mirror index: ", verbose);
 		if(!packed) {
 			try {
-				driver<SString<char> >(infile, infiles, outfile + ".rev", false, reverseType);
+				driver<SString<char> >(infiles, outfile + ".rev", false, reverseType, ref);
 			} catch(bad_alloc& e) {
 				if(autoMem) {
 					cerr << "Switching to a packed string representation." << endl;
@@ -637,7 +969,7 @@ int hisat_build(int argc, const char **argv) {
 			}
 		}
 		if(packed) {
-			driver<S2bDnaString>(infile, infiles, outfile + ".rev", true, reverseType);
+			driver<S2bDnaString>(infiles, outfile + ".rev", true, reverseType, ref);
 		}
 		return 0;
 	} catch(std::exception& e) {
@@ -22,6 +22,7 @@
 #include <string>
 #include <iostream>
 #include <getopt.h>
+#include <sys/time.h>
 #include <stdexcept>
 
 #include "assert_helpers.h"
@@ -38,6 +39,7 @@ static int names_only   = 0;  // just print the sequence names in the index
 static int summarize_only = 0; // just print summary of index and quit
 static int across       = 60; // number of characters across in FASTA output
 static bool refFromEbwt = false; // true -> when printing reference, decode it from Ebwt instead of reading it from BitPairReference
+static uint64_t lfBench = 0;  // # LF steps to time; 0 = don't
 static string wrapper;
 static const char *short_options = "vhnsea:";
 
@@ -45,6 +47,7 @@ enum {
 	ARG_VERSION = 256,
     ARG_WRAPPER,
 	ARG_USAGE,
+	ARG_LF_BENCH,
 };
 
 static struct option long_options[] = {
@@ -56,6 +59,7 @@ static struct option long_options[] = {
 	{(char*)"help",     no_argument,        0, 'h'},
 	{(char*)"across",   required_argument,  0, 'a'},
 	{(char*)"ebwt-ref", no_argument,        0, 'e'},
+	{(char*)"lf-bench", required_argument,  0, ARG_LF_BENCH},
     {(char*)"wrapper",  required_argument,  0, ARG_WRAPPER},
 	{(char*)0, 0, 0, 0} // terminator
 };
@@ -82,6 +86,7 @@ static void printUsage(ostream& out) {
 	<< "  -n/--names         Print reference sequence names only" << endl
 	<< "  -s/--summary       Print summary incl. ref names, lengths, index properties" << endl
 	<< "  -e/--bt2-ref      Reconstruct reference from ." << gEbwt_ext << " (slow, preserves colors)" << endl
+	<< "  --lf-bench <int>   Time <int> LF steps on the BWT and print LF steps/second" << endl
 	<< "  -v/--verbose       Verbose output (for debugging)" << endl
 	<< "  -h/--help          print detailed description of tool and its options" << endl
 	<< "  --help             print this usage message" << endl
@@ -141,6 +146,7 @@ static void parseOptions(int argc, char **argv) {
 			case 'n': names_only = true; break;
 			case 's': summarize_only = true; break;
 			case 'a': across = parseInt(-1, "-a/--across arg must be at least 1"); break;
+			case ARG_LF_BENCH: lfBench = (uint64_t)parseInt(1, "--lf-bench arg must be at least 1"); break;
 			case -1: break; /* Done with options. */
 			case 0:
 				if (long_options[option_index].flag != 0)
@@ -216,7 +222,7 @@ static void print_ref_sequences(
 	ostream& fout,
 	bool color,
 	const EList<string>& refnames,
-	const TIndexOffU* plen,
+	Ebwt<TIndexOffU>::index_store_cptr plen,
 	const string& adjustedEbwtFileBase)
 {
 	BitPairReference ref(
@@ -357,6 +363,7 @@ static void print_index_summary(
 	cout << "Colorspace" << '\t' << (color ? "1" : "0") << endl;
 	cout << "2.0-compatible" << '\t' << (entireReverse ? "1" : "0") << endl;
 	cout << "SA-Sample" << "\t1 in " << (1 << ebwt.eh().offRate()) << endl;
+	cout << "SA-Sample-Bits" << '\t' << ebwt.saBits() << endl;
 	cout << "FTab-Chars" << '\t' << ebwt.eh().ftabChars() << endl;
 	assert_eq(ebwt.nPat(), p_refnames.size());
 	for(size_t i = 0; i < p_refnames.size(); i++) {
@@ -367,6 +374,103 @@ static void print_index_summary(
 	}
 }
 
+/**
+ * Time 'steps' LF-mapping steps on the index's BWT and print the rate.
+ * The steps are taken in walks of up to 100 steps from pseudo-random
+ * rows, each step depending on the last, so on a large genome nearly
+ * every step waits on a cache miss as in a backward search.  Running
+ * this on indexes built with and without hisat-build --packed-occ
+ * compares the two occurrence layouts.  The walks are then repeated
+ * with mapLFEx(), which counts through the occurrence kernel that
+ * HISAT_OCC_KERNEL selects, and the two walks must end on the same row.
+ */
+template <typename index_t>
+static void print_lf_benchmark(
+	const string& fname,
+	uint64_t steps,
+	ostream& fout)
+{
+	bool color = readEbwtColor(fname);
+	Ebwt<index_t> ebwt(
+					   fname,
+					   color,                // index is colorspace
+					   -1,                   // don't require entire reverse
+					   true,                 // index is for the forward direction
+					   -1,                   // offrate (-1 = index default)
+					   0,                    // offrate-plus (0 = index default)
+					   false,                // use memory-mapped IO
+					   false,                // use shared memory
+					   false,                // sweep memory-mapped memory
+					   false,                // load names?
+					   false,                // load SA sample?
+					   false,                // load ftab?
+					   false,                // load rstarts?
+					   verbose,              // be talkative?
+					   verbose,              // be talkative at startup?
+					   false,                // pass up memory exceptions?
+					   false);               // sanity check?
+	ebwt.loadIntoMemory(
+						-1,      // color
+						-1,      // need entire reverse
+						false,   // load SA sample
+						false,   // load ftab
+						false,   // load rstarts
+						false,   // load names
+						verbose);
+	int32_t flags = Ebwt<index_t>::readFlags(fname);
+	bool packedOcc = (flags < 0 && (((-flags) & EBWT_OCC_PACKED) != 0));
+	const index_t bwtLen = ebwt.eh()._bwtLen;
+	RandomSource rnd(1);
+	index_t row = 0;
+	struct timeval tv_beg, tv_end;
+	gettimeofday(&tv_beg, NULL);
+	for(uint64_t i = 0; i < steps; i++) {
+		if(i % 100 == 0 || row == ebwt.zOff() || row + 1 == bwtLen) {
+			do {
+				row = (index_t)(rnd.nextU32() % bwtLen);
+			} while(row == ebwt.zOff() || row + 1 == bwtLen);
+		}
+		SideLocus<index_t> l(row, ebwt.eh(), ebwt.ebwt());
+		row = ebwt.mapLF(l);
+	}
+	gettimeofday(&tv_end, NULL);
+	double secs = (tv_end.tv_sec - tv_beg.tv_sec) + (tv_end.tv_usec - tv_beg.tv_usec) / 1000000.0;
+	// The same walks again, but counting all four characters at once
+	// as the aligner does; this is the path the SIMD kernels speed up.
+	// Both walks avoid the last row so that [row, row+1) stays in range
+	RandomSource rndEx(1);
+	index_t rowEx = 0;
+	gettimeofday(&tv_beg, NULL);
+	for(uint64_t i = 0; i < steps; i++) {
+		if(i % 100 == 0 || rowEx == ebwt.zOff() || rowEx + 1 == bwtLen) {
+			do {
+				rowEx = (index_t)(rndEx.nextU32() % bwtLen);
+			} while(rowEx == ebwt.zOff() || rowEx + 1 == bwtLen);
+		}
+		index_t tops[4] = {0, 0, 0, 0}, bots[4] = {0, 0, 0, 0};
+		ebwt.mapLFEx(rowEx, rowEx + 1, tops, bots);
+		for(int c = 0; c < 4; c++) {
+			if(bots[c] > tops[c]) {
+				rowEx = tops[c];
+				break;
+			}
+		}
+	}
+	gettimeofday(&tv_end, NULL);
+	double secsEx = (tv_end.tv_sec - tv_beg.tv_sec) + (tv_end.tv_usec - tv_beg.tv_usec) / 1000000.0;
+	if(row != rowEx) {
+		cerr << "Error: the occurrence kernel disagrees with mapLF()" << endl;
+		throw 1;
+	}
+	fout << "Occ-Blocks" << '\t' << (packedOcc ? "packed" : "unaligned") << endl;
+	fout << "Occ-Kernel" << '\t' << occKernelName(ebwt.occKernel()) << endl;
+	fout << "LF-Steps" << '\t' << steps << endl;
+	fout << "Seconds" << '\t' << secs << endl;
+	fout << "LF-Per-Second" << '\t' << (uint64_t)(secs > 0 ? steps / secs : 0) << endl;
+	fout << "LFEx-Seconds" << '\t' << secsEx << endl;
+	fout << "LFEx-Per-Second" << '\t' << (uint64_t)(secsEx > 0 ? steps / secsEx : 0) << endl;
+}
+
 extern void initializeCntLut();
 
 static void driver(
@@ -382,6 +486,8 @@ static void driver(
 		print_index_sequence_names<TIndexOffU>(adjustedEbwtFileBase, cout);
 	} else if(summarize_only) {
 		print_index_summary<TIndexOffU>(adjustedEbwtFileBase, cout);
+	} else if(lfBench > 0) {
+		print_lf_benchmark<TIndexOffU>(adjustedEbwtFileBase, lfBench, cout);
 	} else {
         // Initialize Ebwt object
 		bool color = readEbwtColor(adjustedEbwtFileBase);
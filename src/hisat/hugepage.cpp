@@ -0,0 +1,130 @@
+/*
+ * Copyright 2015, Daehwan Kim <infphilo@gmail.com>
+ *
+ * This file is part of HISAT.
+ *
+ * HISAT is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * HISAT is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with HISAT.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#ifdef BOWTIE_MM
+#include <sys/mman.h>
+#endif
+#include "hugepage.h"
+
+#ifndef MAP_HUGE_SHIFT
+#define MAP_HUGE_SHIFT 26
+#endif
+
+#ifdef BOWTIE_MM
+static const size_t HUGE_2MB = (size_t)1 << 21;
+static const size_t HUGE_1GB = (size_t)1 << 30;
+
+#ifdef MADV_HUGEPAGE
+/**
+ * Return true iff transparent huge pages are turned off system-wide,
+ * in which case madvise(MADV_HUGEPAGE) won't get us any.
+ */
+static bool thpDisabled() {
+	FILE *f = fopen("/sys/kernel/mm/transparent_hugepage/enabled", "r");
+	if(f == NULL) return true;
+	char buf[128];
+	bool never = (fgets(buf, sizeof(buf), f) == NULL || strstr(buf, "[never]") != NULL);
+	fclose(f);
+	return never;
+}
+#endif
+
+/**
+ * Try to map 'sz' bytes, a multiple of the page size implied by
+ * 'flags', from the hugetlbfs pool.
+ */
+static void *mapHuge(size_t sz, int flags) {
+#ifdef MAP_HUGETLB
+	void *p = mmap(NULL, sz, PROT_READ | PROT_WRITE,
+	               MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | flags, -1, 0);
+	return p == MAP_FAILED ? NULL : p;
+#else
+	return NULL;
+#endif
+}
+#endif
+
+void *HugePageBuf::alloc(size_t sz, bool huge) {
+	free();
+	if(sz == 0) sz = 1;
+#ifdef BOWTIE_MM
+	if(!huge) {
+		sz_ = sz;
+		p_ = mmap(NULL, sz_, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if(p_ == MAP_FAILED) {
+			p_ = NULL;
+			sz_ = 0;
+		}
+		kind_ = HUGE_PAGE_NONE;
+		return p_;
+	}
+	if(sz >= HUGE_1GB) {
+		sz_ = (sz + HUGE_1GB - 1) & ~(HUGE_1GB - 1);
+		p_ = mapHuge(sz_, 30 << MAP_HUGE_SHIFT);
+		if(p_ != NULL) { kind_ = HUGE_PAGE_1GB; return p_; }
+	}
+	sz_ = (sz + HUGE_2MB - 1) & ~(HUGE_2MB - 1);
+	p_ = mapHuge(sz_, 21 << MAP_HUGE_SHIFT);
+	if(p_ != NULL) { kind_ = HUGE_PAGE_2MB; return p_; }
+	// No reserved huge pages; settle for transparent ones.  Keeping
+	// the length a multiple of 2 MB lets the kernel use a huge page
+	// for the tail, too.
+	p_ = mmap(NULL, sz_, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if(p_ == MAP_FAILED) {
+		p_ = NULL;
+		sz_ = 0;
+		return NULL;
+	}
+	kind_ = HUGE_PAGE_NONE;
+#ifdef MADV_HUGEPAGE
+	if(madvise(p_, sz_, MADV_HUGEPAGE) == 0 && !thpDisabled()) {
+		kind_ = HUGE_PAGE_THP;
+	}
+#endif
+#else
+	p_ = calloc(sz, 1);
+	sz_ = sz;
+	kind_ = HUGE_PAGE_NONE;
+#endif
+	return p_;
+}
+
+void HugePageBuf::free() {
+	if(p_ == NULL) return;
+#ifdef BOWTIE_MM
+	munmap(p_, sz_);
+#else
+	::free(p_);
+#endif
+	p_ = NULL;
+	sz_ = 0;
+	kind_ = HUGE_PAGE_NONE;
+}
+
+const char *HugePageBuf::kindName() const {
+	switch(kind_) {
+		case HUGE_PAGE_1GB: return "1 GB huge pages";
+		case HUGE_PAGE_2MB: return "2 MB huge pages";
+		case HUGE_PAGE_THP: return "transparent huge pages";
+		default:            return "no huge pages";
+	}
+}
@@ -0,0 +1,87 @@
+/*
+ * Copyright 2015, Daehwan Kim <infphilo@gmail.com>
+ *
+ * This file is part of HISAT.
+ *
+ * HISAT is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * HISAT is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with HISAT.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef HUGEPAGE_H_
+#define HUGEPAGE_H_
+
+#include <stddef.h>
+
+/**
+ * How the memory of a HugePageBuf is backed.
+ */
+enum {
+	HUGE_PAGE_NONE = 0, // ordinary pages
+	HUGE_PAGE_THP,      // ordinary mapping, madvise()d for transparent huge pages
+	HUGE_PAGE_2MB,      // 2 MB pages from the hugetlbfs pool
+	HUGE_PAGE_1GB       // 1 GB pages from the hugetlbfs pool
+};
+
+/**
+ * Anonymous memory for one of the big, randomly accessed index arrays
+ * (ebwt, ftab, offs), backed by huge pages where the system allows it
+ * so that lookups take fewer TLB misses.  alloc() first tries
+ * MAP_HUGETLB (1 GB pages for blocks of at least 1 GB, then 2 MB
+ * pages), which only succeeds if the administrator has reserved huge
+ * pages, and then falls back to an ordinary mapping that is madvise()d
+ * so the kernel can back it with transparent huge pages.
+ */
+class HugePageBuf {
+public:
+
+	HugePageBuf() : p_(NULL), sz_(0), kind_(HUGE_PAGE_NONE) { }
+
+	~HugePageBuf() { free(); }
+
+	/**
+	 * Allocate 'sz' zeroed bytes, releasing any earlier allocation.
+	 * Returns NULL if not even an ordinary mapping could be made.  If
+	 * 'huge' is false, huge pages aren't tried and the block is just
+	 * an ordinary, page-aligned mapping.
+	 */
+	void *alloc(size_t sz, bool huge = true);
+
+	/**
+	 * Release the memory, if any.
+	 */
+	void free();
+
+	void *get() const { return p_; }
+
+	/**
+	 * Return one of the HUGE_PAGE_* constants.
+	 */
+	int kind() const { return kind_; }
+
+	/**
+	 * Return a short description of how the memory is backed, for the
+	 * startup log.
+	 */
+	const char *kindName() const;
+
+private:
+
+	HugePageBuf(const HugePageBuf&);
+	HugePageBuf& operator=(const HugePageBuf&);
+
+	void  *p_;
+	size_t sz_;   // # bytes mapped, rounded up to the page size
+	int    kind_;
+};
+
+#endif /*HUGEPAGE_H_*/
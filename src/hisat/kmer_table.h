@@ -0,0 +1,351 @@
+/*
+ * Copyright 2015, Daehwan Kim <infphilo@gmail.com>
+ *
+ * This file is part of HISAT.
+ *
+ * HISAT is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * HISAT is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with HISAT.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef KMER_TABLE_H_
+#define KMER_TABLE_H_
+
+#include <stdint.h>
+#include <iostream>
+#include <fstream>
+#include <string>
+#include "assert_helpers.h"
+#include "ds.h"
+#include "endian_swap.h"
+#include "word_io.h"
+#include "bt2_idx.h"
+
+/**
+ * The SA ranges of all the k-mers of a reference, for a k a few
+ * characters longer than the ftab's, stored next to the index as
+ * <base>.7.<ext> by hisat-build --kmer-table.  HI_Aligner's partial
+ * searches use it to start k characters deep instead of ftabChars deep.
+ *
+ * Entries are grouped by the ftab key of a k-mer's last ftabChars
+ * characters, so a lookup starts from the ftab key the search computes
+ * anyway.  The other k - ftabChars characters (at most 8), packed two
+ * bits each in the order a backward search meets them, sort the
+ * entries of a group and are binary-searched.  Only k-mers that occur
+ * in the reference are stored.
+ *
+ * Each entry also records where the pseudogene and anchor heuristics of
+ * HI_Aligner::partialSearchStep() stand after matching the k-mer one
+ * character at a time, so that jumping ahead leaves a search exactly
+ * where stepping would have.  The heuristics depend on the genome
+ * length through minK; k-mers for which either would end the search
+ * before k characters are left out, and searches step through them as
+ * before.
+ */
+template <typename index_t>
+class KmerTable {
+
+public:
+	// In-state encodings of "heuristic already switched off"
+	enum {
+		PSEUDOGENE_OFF = 0x0f,
+		ANCHOR_OFF     = 0x07
+	};
+
+	KmerTable() :
+		_k(0),
+		_ftabChars(0),
+		_minK(0),
+		_dir(EBWT_CAT),
+		_codes(EBWT_CAT),
+		_states(EBWT_CAT),
+		_tops(EBWT_CAT),
+		_bots(EBWT_CAT)
+	{ }
+
+	/**
+	 * Return the minK HI_Aligner derives from a genome of length 'len'.
+	 */
+	static size_t minKFor(index_t len) {
+		size_t minK = 0;
+		while(len > 0) {
+			len >>= 2;
+			minK++;
+		}
+		return minK;
+	}
+
+	/**
+	 * Fill the table with the k-mers of the index in 'ebwt', which must
+	 * be in memory with its ftab.
+	 */
+	void build(const Ebwt<index_t>& ebwt, size_t k) {
+		_ftabChars = (size_t)ebwt.eh().ftabChars();
+		assert_gt(k, _ftabChars);
+		assert_leq(k, _ftabChars + 8);
+		_k = k;
+		_minK = minKFor(ebwt.eh().len());
+		_dir.clear();
+		_codes.clear();
+		_states.clear();
+		_tops.clear();
+		_bots.clear();
+		const index_t nkeys = (index_t)1 << (_ftabChars << 1);
+		for(index_t fi = 0; fi < nkeys; fi++) {
+			_dir.push_back((index_t)_codes.size());
+			index_t top = ebwt.ftabHi(fi);
+			index_t bot = ebwt.ftabLo(fi+1);
+			if(bot > top) {
+				Walk w;
+				extend(ebwt, top, bot, 0, 0, w);
+			}
+		}
+		_dir.push_back((index_t)_codes.size());
+	}
+
+	/**
+	 * Look up the k-mer whose last ftabChars characters have ftab key
+	 * 'fi' and whose other characters pack into 'code'.  Return false
+	 * if it isn't in the table.
+	 */
+	bool find(index_t fi, uint32_t code, index_t& top, index_t& bot, uint8_t& state) const {
+		assert_lt(fi + 1, _dir.size());
+		size_t lo = _dir[fi], hi = _dir[fi+1];
+		while(lo < hi) {
+			size_t mid = lo + ((hi - lo) >> 1);
+			if(_codes[mid] < code) {
+				lo = mid + 1;
+			} else {
+				hi = mid;
+			}
+		}
+		if(lo == _dir[fi+1] || _codes[lo] != code) return false;
+		top = _tops[lo];
+		bot = _bots[lo];
+		state = _states[lo];
+		return true;
+	}
+
+	/**
+	 * Write the table to 'fn'.
+	 */
+	void write(const std::string& fn, bool toBigEndian) const {
+		std::ofstream out(fn.c_str(), std::ios::binary);
+		if(!out.good()) {
+			cerr << "Could not open k-mer table file " << fn.c_str() << " for writing." << endl;
+			throw 1;
+		}
+		writeU32(out, 1, toBigEndian); // endianness sentinel
+		writeU32(out, (uint32_t)sizeof(index_t), toBigEndian);
+		writeU32(out, (uint32_t)_k, toBigEndian);
+		writeU32(out, (uint32_t)_ftabChars, toBigEndian);
+		writeU32(out, (uint32_t)_minK, toBigEndian);
+		writeIndex<index_t>(out, (index_t)_codes.size(), toBigEndian);
+		for(size_t i = 0; i < _dir.size(); i++) {
+			writeIndex<index_t>(out, _dir[i], toBigEndian);
+		}
+		for(size_t i = 0; i < _codes.size(); i++) {
+			writeU16(out, _codes[i], toBigEndian);
+		}
+		out.write((const char*)_states.ptr(), _states.size());
+		for(size_t i = 0; i < _tops.size(); i++) {
+			writeIndex<index_t>(out, _tops[i], toBigEndian);
+		}
+		for(size_t i = 0; i < _bots.size(); i++) {
+			writeIndex<index_t>(out, _bots[i], toBigEndian);
+		}
+		if(!out.good()) {
+			cerr << "Error writing k-mer table file " << fn.c_str() << endl;
+			throw 1;
+		}
+	}
+
+	/**
+	 * Read the table from 'fn' if there is such a file, checking it
+	 * against the index in 'ebwt'.  Return false if there is no file.
+	 */
+	bool read(const std::string& fn, const Ebwt<index_t>& ebwt) {
+		std::ifstream in(fn.c_str(), std::ios::binary);
+		if(!in.good()) return false;
+		bool swap = false;
+		uint32_t one = readU32(in, false);
+		if(one != 1) {
+			swap = true;
+			if(endianSwapU32(one) != 1) {
+				cerr << "Error: " << fn.c_str() << " is not a k-mer table." << endl;
+				throw 1;
+			}
+		}
+		uint32_t idxWidth = readU32(in, swap);
+		_k = readU32(in, swap);
+		_ftabChars = readU32(in, swap);
+		_minK = readU32(in, swap);
+		if(idxWidth != sizeof(index_t) ||
+		   _ftabChars != (size_t)ebwt.eh().ftabChars() ||
+		   _minK != minKFor(ebwt.eh().len()) ||
+		   _k <= _ftabChars || _k > _ftabChars + 8)
+		{
+			cerr << "Error: k-mer table " << fn.c_str() << " doesn't match its index;" << endl
+			     << "rebuild it with hisat-build --kmer-table." << endl;
+			throw 1;
+		}
+		index_t nent = readIndex<index_t>(in, swap);
+		_dir.resizeExact(((size_t)1 << (_ftabChars << 1)) + 1);
+		_codes.resizeExact(nent);
+		_states.resizeExact(nent);
+		_tops.resizeExact(nent);
+		_bots.resizeExact(nent);
+		in.read((char*)_dir.ptr(), _dir.size() * sizeof(index_t));
+		in.read((char*)_codes.ptr(), _codes.size() * sizeof(uint16_t));
+		in.read((char*)_states.ptr(), _states.size());
+		in.read((char*)_tops.ptr(), _tops.size() * sizeof(index_t));
+		in.read((char*)_bots.ptr(), _bots.size() * sizeof(index_t));
+		if(!in.good()) {
+			cerr << "Error: k-mer table " << fn.c_str() << " is truncated." << endl;
+			throw 1;
+		}
+		if(swap) {
+			for(size_t i = 0; i < _dir.size(); i++) _dir[i] = endianSwapIndex(_dir[i]);
+			for(size_t i = 0; i < nent; i++) {
+				_codes[i] = endianSwapU16(_codes[i]);
+				_tops[i] = endianSwapIndex(_tops[i]);
+				_bots[i] = endianSwapIndex(_bots[i]);
+			}
+		}
+		return true;
+	}
+
+	size_t k() const         { return _k; }
+	size_t ftabChars() const { return _ftabChars; }
+	size_t minK() const      { return _minK; }
+	size_t size() const      { return _codes.size(); }
+
+	/// Characters a lookup skips beyond the ftab's
+	size_t extra() const     { return _k - _ftabChars; }
+
+	/**
+	 * Bytes taken up by the table in memory.
+	 */
+	size_t bytes() const {
+		return _dir.size() * sizeof(index_t) +
+		       _codes.size() * (sizeof(uint16_t) + sizeof(uint8_t) + 2 * sizeof(index_t));
+	}
+
+private:
+
+	/**
+	 * Where the partial-search heuristics stand along one path of the
+	 * walk, starting with both of them on.
+	 */
+	struct Walk {
+		Walk() : similar_range(0), same_range(0), pseudogene(true), anchor(true) { }
+
+		index_t similar_range;
+		index_t same_range;
+		bool    pseudogene;
+		bool    anchor;
+
+		uint8_t encode() const {
+			uint8_t p = pseudogene ? (uint8_t)similar_range : (uint8_t)PSEUDOGENE_OFF;
+			uint8_t a = anchor ? (uint8_t)same_range : (uint8_t)ANCHOR_OFF;
+			return (uint8_t)(p | (a << 4));
+		}
+	};
+
+	/**
+	 * Follow one step of HI_Aligner::partialSearchStep() from a range of
+	 * size 'sz' to one of size 'sz2', 'dep' characters into the search.
+	 * Return false if the step would stop the search.
+	 */
+	bool advance(Walk& w, index_t sz, index_t sz2, index_t dep) const {
+		if(w.pseudogene) {
+			if(sz2 < sz && sz <= 5) {
+				if(dep >= _minK + 6 && w.similar_range >= 5) return false;
+			}
+			if(sz2 != 1) {
+				if(sz2 + 2 >= sz) w.similar_range++;
+				else if(sz2 + 4 < sz) w.similar_range = 0;
+			} else {
+				w.pseudogene = false;
+			}
+		}
+		if(w.anchor) {
+			if(sz2 != 1 && sz == sz2) {
+				w.same_range++;
+				if(w.same_range >= 5) {
+					w.anchor = false;
+				}
+			} else {
+				w.same_range = 0;
+			}
+			if(dep >= _minK + 8 && sz2 >= 4) {
+				w.anchor = false;
+			}
+		}
+		if(w.anchor && dep + 1 >= _minK + 12 && sz2 == 1) return false;
+		return true;
+	}
+
+	/**
+	 * Extend [top, bot), 'depth' characters past the ftab, one character
+	 * at a time in the order the aligner would, adding an entry for
+	 * each k-mer reached.
+	 */
+	void extend(
+		const Ebwt<index_t>& ebwt,
+		index_t top,
+		index_t bot,
+		size_t depth,
+		uint32_t code,
+		const Walk& w)
+	{
+		if(depth == extra()) {
+			_codes.push_back((uint16_t)code);
+			_states.push_back(w.encode());
+			_tops.push_back(top);
+			_bots.push_back(bot);
+			return;
+		}
+		SideLocus<index_t> tloc, bloc;
+		if(bot - top == 1) {
+			tloc.initFromRow(top, ebwt.eh(), ebwt.ebwt());
+		} else {
+			SideLocus<index_t>::initFromTopBot(top, bot, ebwt.eh(), ebwt.ebwt(), tloc, bloc);
+		}
+		for(int c = 0; c < 4; c++) {
+			index_t top2, bot2;
+			if(bot - top == 1) {
+				top2 = ebwt.mapLF1(top, tloc, c);
+				if(top2 == (index_t)OFF_MASK) continue;
+				bot2 = top2 + 1;
+			} else {
+				top2 = ebwt.mapLF(tloc, c);
+				bot2 = ebwt.mapLF(bloc, c);
+			}
+			if(bot2 <= top2) continue;
+			Walk w2 = w;
+			if(!advance(w2, bot - top, bot2 - top2, (index_t)(_ftabChars + depth))) continue;
+			extend(ebwt, top2, bot2, depth + 1, (code << 2) | (uint32_t)c, w2);
+		}
+	}
+
+	size_t            _k;         // k-mer length
+	size_t            _ftabChars; // ftabChars of the index
+	size_t            _minK;      // minK the heuristics were followed with
+	EList<index_t>    _dir;       // first entry for each ftab key, plus end
+	EList<uint16_t>   _codes;     // characters beyond the ftab's
+	EList<uint8_t>    _states;    // Walk::encode() at the end of the k-mer
+	EList<index_t>    _tops;      // SA range of each k-mer
+	EList<index_t>    _bots;
+};
+
+#endif /*KMER_TABLE_H_*/
@@ -702,8 +702,18 @@ void qsortSufDc(
 	if(end > begin+cur+1) qsortSufDc(host, hlen, s, slen, dc, begin+cur+1, end);
 }
 
+#define BUCKET_SORT_CUTOFF (4 * 1024 * 1024)
+#define SELECTION_SORT_CUTOFF 6
+
+// 5 64-element buckets for bucket-sorting A, C, G, T, $
+extern TIndexOffU bkts[4][4 * 1024 * 1024];
+
 /**
- * Toplevel function for multikey quicksort over suffixes.
+ * Toplevel function for multikey quicksort over suffixes.  Bucket
+ * sorting scatters suffixes into 'bkts', four arrays of at least
+ * min(slen, BUCKET_SORT_CUTOFF) elements each; if it's NULL, the
+ * global bkts[][] is used, so threads sorting at the same time must
+ * each pass their own.
  */
 template<typename T1, typename T2>
 void mkeyQSortSufDcU8(
@@ -715,10 +725,13 @@ void mkeyQSortSufDcU8(
 	const DifferenceCoverSample<T1>& dc,
 	int hi,
 	bool verbose = false,
-	bool sanityCheck = false)
+	bool sanityCheck = false,
+	TIndexOffU** bkts = NULL)
 {
+	TIndexOffU* gbkts[4] = { ::bkts[0], ::bkts[1], ::bkts[2], ::bkts[3] };
+	if(bkts == NULL) bkts = gbkts;
 	if(sanityCheck) sanityCheckInputSufs(s, slen);
-	mkeyQSortSufDcU8(host1, host, hlen, s, slen, dc, hi, 0, slen, 0, sanityCheck);
+	mkeyQSortSufDcU8(host1, host, hlen, s, slen, dc, hi, bkts, 0, slen, 0, sanityCheck);
 	if(sanityCheck) sanityCheckOrderedSufs(host1, hlen, s, slen, OFF_MASK);
 }
 
@@ -802,12 +815,6 @@ void qsortSufDcU8(
 	if(end > begin+cur+1) qsortSufDcU8(host1, host, hlen, s, slen, dc, begin+cur+1, end);
 }
 
-#define BUCKET_SORT_CUTOFF (4 * 1024 * 1024)
-#define SELECTION_SORT_CUTOFF 6
-
-// 5 64-element buckets for bucket-sorting A, C, G, T, $
-extern TIndexOffU bkts[4][4 * 1024 * 1024];
-
 /**
  * Straightforwardly obtain a uint8_t-ized version of t[off].  This
  * works fine as long as TStr is not packed.
@@ -978,6 +985,7 @@ static void bucketSortSufDcU8(
         size_t slen,
         const DifferenceCoverSample<T1>& dc,
         uint8_t hi,
+        TIndexOffU** bkts,
         size_t begin,
         size_t end,
         size_t depth,
@@ -985,7 +993,7 @@ static void bucketSortSufDcU8(
 {
 	size_t cnts[] = { 0, 0, 0, 0, 0 };
 	#define BKT_RECURSE_SUF_DC_U8(nbegin, nend) { \
-		bucketSortSufDcU8<T1,T2>(host1, host, hlen, s, slen, dc, hi, \
+		bucketSortSufDcU8<T1,T2>(host1, host, hlen, s, slen, dc, hi, bkts, \
 		                         (nbegin), (nend), depth+1, sanityCheck); \
 	}
 	assert_gt(end, begin);
@@ -1072,6 +1080,7 @@ void mkeyQSortSufDcU8(
 	size_t slen,
 	const DifferenceCoverSample<T1>& dc,
 	int hi,
+	TIndexOffU** bkts,
 	size_t begin,
 	size_t end,
 	size_t depth,
@@ -1081,7 +1090,7 @@ void mkeyQSortSufDcU8(
 	// make sure that the problem actually got smaller.
 	#define MQS_RECURSE_SUF_DC_U8(nbegin, nend, ndepth) { \
 		assert(nbegin > begin || nend < end || ndepth > depth); \
-		mkeyQSortSufDcU8(host1, host, hlen, s, slen, dc, hi, nbegin, nend, ndepth, sanityCheck); \
+		mkeyQSortSufDcU8(host1, host, hlen, s, slen, dc, hi, bkts, nbegin, nend, ndepth, sanityCheck); \
 	}
 	assert_leq(begin, slen);
 	assert_leq(end, slen);
@@ -1100,7 +1109,7 @@ void mkeyQSortSufDcU8(
 	if(n <= BUCKET_SORT_CUTOFF) {
 		// Bucket sort remaining items
 		bucketSortSufDcU8(host1, host, hlen, s, slen, dc,
-		                  (uint8_t)hi, begin, end, depth, sanityCheck);
+		                  (uint8_t)hi, bkts, begin, end, depth, sanityCheck);
 		if(sanityCheck) {
 			sanityCheckOrderedSufs(host1, hlen, s, slen, OFF_MASK, begin, end);
 		}
@@ -0,0 +1,196 @@
+/*
+ * Copyright 2015, Daehwan Kim <infphilo@gmail.com>
+ *
+ * This file is part of HISAT.
+ *
+ * HISAT is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * HISAT is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with HISAT.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef OCC_SIMD_H_
+#define OCC_SIMD_H_
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <iostream>
+#include "processor_support.h"
+
+using namespace std;
+
+/**
+ * Kernels that count all four nucleotides among the first 'nchars'
+ * characters of an Ebwt side (or EBWT_OCC_PACKED block) in one go,
+ * rather than one 64-bit word at a time as countInU64Ex() does.
+ *
+ * Characters are packed 32 to a little-endian 64-bit word starting
+ * from the low-order bits, so within each word the low bits of the
+ * character pairs give C+T, the high bits give G+T, and their
+ * conjunction gives T.  Three population counts then yield all four
+ * counts, A being whatever is left of 'nchars'.  Words are read with
+ * masked loads, so nothing past the last word holding a counted
+ * character is touched.
+ *
+ * The kernels are compiled with function-level target attributes, so
+ * the binary itself needs no -mavx2 or -mavx512f; occSelectKernel()
+ * picks the widest one the processor running us supports.
+ */
+
+enum {
+	OCC_KERNEL_SCALAR = 0, // countInU64Ex() word by word
+	OCC_KERNEL_AVX2,       // vpshufb nibble lookup + vpsadbw
+	OCC_KERNEL_AVX512      // VPOPCNTQ on 512-bit vectors
+};
+
+#ifdef OCC_SIMD_DISPATCH
+
+#include <immintrin.h>
+
+__attribute__((target("avx2")))
+static inline __m256i occPopcnt256(__m256i v) {
+	const __m256i lut = _mm256_setr_epi8(
+		0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+		0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+	const __m256i nibble = _mm256_set1_epi8(0x0f);
+	__m256i lo = _mm256_shuffle_epi8(lut, _mm256_and_si256(v, nibble));
+	__m256i hi = _mm256_shuffle_epi8(lut, _mm256_and_si256(_mm256_srli_epi16(v, 4), nibble));
+	// Per-byte counts summed into the four 64-bit lanes
+	return _mm256_sad_epu8(_mm256_add_epi8(lo, hi), _mm256_setzero_si256());
+}
+
+__attribute__((target("avx2")))
+static inline uint64_t occHsum256(__m256i v) {
+	__m128i s = _mm_add_epi64(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+	return (uint64_t)_mm_cvtsi128_si64(s) + (uint64_t)_mm_extract_epi64(s, 1);
+}
+
+/**
+ * AVX2 kernel: four words per iteration.  Set cnts[0..3] to the
+ * number of As, Cs, Gs and Ts among the first 'nchars' characters.
+ */
+__attribute__((target("avx2")))
+static inline void occCountAVX2(const uint64_t* words, uint32_t nchars, uint32_t* cnts) {
+	const __m256i lowBits = _mm256_set1_epi64x(0x5555555555555555ll);
+	const __m256i ones = _mm256_set1_epi64x(-1);
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i step = _mm256_set1_epi64x(256);
+	// Number of bits still to be counted in each lane's word
+	__m256i nbits = _mm256_sub_epi64(_mm256_set1_epi64x((long long)nchars << 1),
+	                                 _mm256_setr_epi64x(0, 64, 128, 192));
+	__m256i ct = zero, gt = zero, t = zero;
+	const uint32_t nwords = (nchars + 31) >> 5;
+	for(uint32_t w = 0; w < nwords; w += 4) {
+		__m256i valid = _mm256_cmpgt_epi64(nbits, zero);
+		__m256i x = _mm256_maskload_epi64(reinterpret_cast<const long long*>(words + w), valid);
+		// Shifts of 64 or more give 0, so full words keep every bit
+		__m256i keep = _mm256_andnot_si256(_mm256_sllv_epi64(ones, nbits), valid);
+		__m256i lo = _mm256_and_si256(_mm256_and_si256(x, lowBits), keep);
+		__m256i hi = _mm256_and_si256(_mm256_and_si256(_mm256_srli_epi64(x, 1), lowBits), keep);
+		ct = _mm256_add_epi64(ct, occPopcnt256(lo));
+		gt = _mm256_add_epi64(gt, occPopcnt256(hi));
+		t  = _mm256_add_epi64(t,  occPopcnt256(_mm256_and_si256(lo, hi)));
+		nbits = _mm256_sub_epi64(nbits, step);
+	}
+	uint32_t nt = (uint32_t)occHsum256(t);
+	cnts[1] = (uint32_t)occHsum256(ct) - nt;
+	cnts[2] = (uint32_t)occHsum256(gt) - nt;
+	cnts[3] = nt;
+	cnts[0] = nchars - cnts[1] - cnts[2] - nt;
+}
+
+// Spelled out rather than _mm512_reduce_add_epi64(), whose use of
+// _mm512_undefined_epi32() draws -Wuninitialized from some GCCs
+__attribute__((target("avx512f")))
+static inline uint64_t occHsum512(__m512i v) {
+	uint64_t lanes[8];
+	_mm512_storeu_si512(lanes, v);
+	return lanes[0] + lanes[1] + lanes[2] + lanes[3] + lanes[4] + lanes[5] + lanes[6] + lanes[7];
+}
+
+/**
+ * AVX-512 kernel: eight words (a whole 64-byte side) per iteration,
+ * counted with VPOPCNTQ.  Same contract as occCountAVX2().
+ */
+__attribute__((target("avx512f,avx512vpopcntdq")))
+static inline void occCountAVX512(const uint64_t* words, uint32_t nchars, uint32_t* cnts) {
+	const __m512i lowBits = _mm512_set1_epi64(0x5555555555555555ll);
+	const __m512i ones = _mm512_set1_epi64(-1);
+	const __m512i zero = _mm512_setzero_si512();
+	const __m512i step = _mm512_set1_epi64(512);
+	__m512i nbits = _mm512_sub_epi64(_mm512_set1_epi64((long long)nchars << 1),
+	                                 _mm512_set_epi64(448, 384, 320, 256, 192, 128, 64, 0));
+	__m512i ct = zero, gt = zero, t = zero;
+	const uint32_t nwords = (nchars + 31) >> 5;
+	for(uint32_t w = 0; w < nwords; w += 8) {
+		__mmask8 valid = _mm512_cmpgt_epi64_mask(nbits, zero);
+		__m512i x = _mm512_maskz_loadu_epi64(valid, words + w);
+		__m512i keep = _mm512_maskz_andnot_epi64(valid, _mm512_maskz_sllv_epi64(valid, ones, nbits), ones);
+		__m512i lo = _mm512_and_si512(_mm512_and_si512(x, lowBits), keep);
+		__m512i hi = _mm512_and_si512(_mm512_and_si512(_mm512_maskz_srli_epi64(valid, x, 1), lowBits), keep);
+		ct = _mm512_add_epi64(ct, _mm512_popcnt_epi64(lo));
+		gt = _mm512_add_epi64(gt, _mm512_popcnt_epi64(hi));
+		t  = _mm512_add_epi64(t,  _mm512_popcnt_epi64(_mm512_and_si512(lo, hi)));
+		nbits = _mm512_sub_epi64(nbits, step);
+	}
+	uint32_t nt = (uint32_t)occHsum512(t);
+	cnts[1] = (uint32_t)occHsum512(ct) - nt;
+	cnts[2] = (uint32_t)occHsum512(gt) - nt;
+	cnts[3] = nt;
+	cnts[0] = nchars - cnts[1] - cnts[2] - nt;
+}
+
+#endif // OCC_SIMD_DISPATCH
+
+static inline const char* occKernelName(int kernel) {
+	switch(kernel) {
+		case OCC_KERNEL_AVX2:   return "AVX2";
+		case OCC_KERNEL_AVX512: return "AVX-512 VPOPCNTQ";
+		default:                return "scalar";
+	}
+}
+
+/**
+ * Return the widest counting kernel the processor supports, or the one
+ * named by the HISAT_OCC_KERNEL environment variable ("scalar", "avx2"
+ * or "avx512") if it is set and supported, so that the kernels can be
+ * compared against one another.  Decided once per process.
+ */
+static inline int occSelectKernel() {
+	static int kernel = -1;
+	if(kernel >= 0) {
+		return kernel;
+	}
+	bool avx2 = false, avx512 = false;
+#ifdef OCC_SIMD_DISPATCH
+	ProcessorSupport ps;
+	avx2 = ps.AVX2enabled();
+	avx512 = ps.AVX512POPCNTenabled();
+#endif
+	kernel = avx512 ? OCC_KERNEL_AVX512 : (avx2 ? OCC_KERNEL_AVX2 : OCC_KERNEL_SCALAR);
+	const char* force = getenv("HISAT_OCC_KERNEL");
+	if(force != NULL && *force != '\0') {
+		if(strcmp(force, "scalar") == 0) {
+			kernel = OCC_KERNEL_SCALAR;
+		} else if(strcmp(force, "avx2") == 0 && avx2) {
+			kernel = OCC_KERNEL_AVX2;
+		} else if(strcmp(force, "avx512") == 0 && avx512) {
+			kernel = OCC_KERNEL_AVX512;
+		} else {
+			cerr << "Warning: HISAT_OCC_KERNEL=" << force << " is unknown or not supported "
+			     << "here; using the " << occKernelName(kernel) << " kernel" << endl;
+		}
+	}
+	return kernel;
+}
+
+#endif /*OCC_SIMD_H_*/
@@ -0,0 +1,180 @@
+/*
+ * Copyright 2015, Daehwan Kim <infphilo@gmail.com>
+ *
+ * This file is part of HISAT.
+ *
+ * HISAT is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * HISAT is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with HISAT.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef OFF40_H_
+#define OFF40_H_
+
+#include <stdint.h>
+#include <string.h>
+#include <iostream>
+#include "assert_helpers.h"
+#include "word_io.h"
+
+/**
+ * A 64-bit offset kept in 5 bytes.  Large (.bt2l) indexes hold their
+ * offset arrays (offs, ftab, eftab, rstarts and plen) in memory as
+ * off40_t rather than uint64_t, which saves 3 bytes per element, and
+ * hisat-build --off40 writes them to the index files that way too;
+ * arithmetic is still done on the uint64_t the element converts to.
+ *
+ * The bytes are little-endian regardless of the machine, so arrays of
+ * off40_t can be read and memory-mapped straight from the index files.
+ * Bit 39 is sign-extended on the way out, so besides offsets below
+ * 2^39 (over 500 Gbp) the all-ones OFF_MASK and the
+ * OFF_MASK ^ eftab-index values that ftab uses to point into eftab
+ * also survive the round trip.  For the same reason the first 5 bytes
+ * of a little-endian 64-bit word holding any of these values read as
+ * an off40_t of the same value.
+ */
+struct off40_t {
+
+	off40_t() { }
+
+	off40_t(uint64_t v) { set(v); }
+
+	operator uint64_t() const { return get(); }
+
+	off40_t& operator=(uint64_t v) {
+		set(v);
+		return *this;
+	}
+
+	off40_t& operator+=(uint64_t v) {
+		set(get() + v);
+		return *this;
+	}
+
+	off40_t& operator-=(uint64_t v) {
+		set(get() - v);
+		return *this;
+	}
+
+	off40_t& operator++() {
+		set(get() + 1);
+		return *this;
+	}
+
+	uint64_t operator++(int) {
+		uint64_t v = get();
+		set(v + 1);
+		return v;
+	}
+
+	/**
+	 * Return true iff 'v' survives being stored in an off40_t.
+	 */
+	static bool fits(uint64_t v) {
+		return (uint64_t)((int64_t)(v << 24) >> 24) == v;
+	}
+
+	uint64_t get() const {
+		uint32_t lo;
+		memcpy(&lo, b, 4);
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+		lo = endianSwapU32(lo);
+#endif
+		uint64_t v = ((uint64_t)b[4] << 32) | lo;
+		return (uint64_t)((int64_t)(v << 24) >> 24);
+	}
+
+	void set(uint64_t v) {
+		assert(fits(v));
+		uint32_t lo = (uint32_t)v;
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+		lo = endianSwapU32(lo);
+#endif
+		memcpy(b, &lo, 4);
+		b[4] = (uint8_t)(v >> 32);
+	}
+
+	uint8_t b[5];
+};
+
+/**
+ * Read-only pointer to an array of off40_t whose elements are 'stride'
+ * bytes apart.  The stride is 5 for arrays in memory or in a file
+ * written with --off40, and 8 for the 64-bit words of a large index
+ * file written without it and memory-mapped with --mm.
+ */
+class off40_ptr {
+
+public:
+
+	off40_ptr() : p_(NULL), stride_(sizeof(off40_t)) { }
+
+	off40_ptr(const off40_t *p, size_t stride) :
+		p_((const uint8_t*)p), stride_(stride) { }
+
+	uint64_t operator[](size_t i) const {
+		return ((const off40_t*)(p_ + i * stride_))->get();
+	}
+
+	bool operator==(const void *p) const { return p_ == p; }
+	bool operator!=(const void *p) const { return p_ != p; }
+
+private:
+
+	const uint8_t *p_;
+	size_t stride_;
+};
+
+/**
+ * Element type of the offset arrays of an Ebwt<index_t> in memory, and
+ * the type of pointer its accessors return: off40_t and off40_ptr for
+ * 64-bit indexes, index_t and plain pointers otherwise.
+ */
+template <typename index_t>
+struct IndexStore {
+	typedef index_t type;
+	typedef index_t* ptr;
+	typedef const index_t* const_ptr;
+
+	static ptr wrap(type *p, size_t stride) { return p; }
+	static const_ptr wrap(const type *p, size_t stride) { return p; }
+};
+
+template <>
+struct IndexStore<uint64_t> {
+	typedef off40_t type;
+	typedef off40_ptr ptr;
+	typedef off40_ptr const_ptr;
+
+	static ptr wrap(const type *p, size_t stride) { return off40_ptr(p, stride); }
+};
+
+/**
+ * Write one element of an offset array of an Ebwt<index_t> in the
+ * on-disk form readIntoMemory() expects: a 5-byte off40_t if 'off40'
+ * is set and the index is large, an index_t otherwise.
+ */
+template <typename index_t>
+static inline void writeIndexStore(std::ostream& out, index_t x, bool toBigEndian, bool off40) {
+	if(off40 && sizeof(typename IndexStore<index_t>::type) == sizeof(off40_t)) {
+		if(!off40_t::fits(x)) {
+			std::cerr << "Error: offset " << x << " doesn't fit in 40 bits; please rebuild without --off40" << std::endl;
+			throw 1;
+		}
+		off40_t y(x);
+		out.write((const char*)y.b, sizeof(y.b));
+	} else {
+		writeIndex<index_t>(out, x, toBigEndian);
+	}
+}
+
+#endif /*OFF40_H_*/
@@ -39,6 +39,13 @@ enum {
 	ARG_SHMEM,                  // --shmem
 	ARG_MM,                     // --mm
 	ARG_MMSWEEP,                // --mmsweep
+	ARG_HUGE_PAGES,             // --huge-pages
+	ARG_NO_KMER_TABLE,          // --no-kmer-table
+	ARG_SHM_INDEX,              // --shm-index
+	ARG_SHM_REMOVE,             // --shm-remove
+	ARG_DAEMON,                 // --daemon
+	ARG_CONNECT,                // --connect
+	ARG_BATCH,                  // --batch
 	ARG_FF,                     // --ff
 	ARG_FR,                     // --fr
 	ARG_RF,                     // --rf
@@ -135,6 +142,10 @@ enum {
 	ARG_MAPQ_EX,                // --mapq-extra
 	ARG_NO_EXTEND,              // --no-extend
 	ARG_REORDER,                // --reorder
+	ARG_READS_PER_BATCH,        // --reads-per-batch
+	ARG_SEARCH_AHEAD,           // --search-ahead
+	ARG_PAUSE,                  // --pause
+	ARG_REORDER_MEM,            // --reorder-mem
 	ARG_SHOW_RAND_SEED,         // --show-rand-seed
 	ARG_READ_PASSTHRU,          // --passthrough
 	ARG_SAMPLE,                 // --sample
@@ -144,6 +155,9 @@ enum {
 	ARG_LOCAL_SEED_CACHE_SZ,    // --local-seed-cache-sz
 	ARG_CURRENT_SEED_CACHE_SZ,  // --seed-cache-sz
 	ARG_SAM_NO_UNAL,            // --no-unal
+	ARG_SAM_BAM,                // --bam
+	ARG_SAM_SORTED_BAM,         // --sorted-bam
+	ARG_SORT_MEM,               // --sort-mem
 	ARG_NON_DETERMINISTIC,      // --non-deterministic
 	ARG_TEST_25,                // --test-25
 	ARG_DESC_KB,                // --desc-kb
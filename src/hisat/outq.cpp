@@ -24,80 +24,111 @@
  * the read with the given id.
  */
 void OutputQueue::beginRead(TReadId rdid, size_t threadId) {
-	ThreadSafe t(&mutex_m, threadSafe_);
-	nstarted_++;
-	if(reorder_) {
-		assert_geq(rdid, cur_);
-		assert_eq(lines_.size(), finished_.size());
-		assert_eq(lines_.size(), started_.size());
-		if(rdid - cur_ >= lines_.size()) {
-			// Make sure there's enough room in lines_, started_ and finished_
-			size_t oldsz = lines_.size();
-			lines_.resize(rdid - cur_ + 1);
-			started_.resize(rdid - cur_ + 1);
-			finished_.resize(rdid - cur_ + 1);
-			for(size_t i = oldsz; i < lines_.size(); i++) {
-				started_[i] = finished_[i] = false;
-			}
-		}
-		started_[rdid - cur_] = true;
-		finished_[rdid - cur_] = false;
-	}
+	assert_geq(rdid, atomicLoad(&cur_));
+	atomicAdd(&nstarted_, (TReadId)1);
 }
 
 /**
  * Writer is finished writing to 
  */
 void OutputQueue::finishRead(const BTString& rec, TReadId rdid, size_t threadId) {
-	ThreadSafe t(&mutex_m, threadSafe_);
 	if(reorder_) {
-		assert_geq(rdid, cur_);
-		assert_eq(lines_.size(), finished_.size());
-		assert_eq(lines_.size(), started_.size());
-		assert_lt(rdid - cur_, lines_.size());
-		assert(started_[rdid - cur_]);
-		assert(!finished_[rdid - cur_]);
-		lines_[rdid - cur_] = rec;
-		nfinished_++;
-		finished_[rdid - cur_] = true;
-		flush(false, false); // don't force; already have lock
+		size_t len = rec.length();
+		waitForSlot(rdid, len);
+		// The slot is ours until we publish it; the flusher won't look
+		// at it before then
+		size_t i = (size_t)(rdid & mask_);
+		assert_eq(0, atomicLoad(&done_[i]));
+		slots_[i] = rec;
+		size_t nbytes = atomicAdd(&nbytes_, len);
+		size_t peak = atomicLoad(&peakBytes_);
+		while(nbytes > peak && !atomicCas(&peakBytes_, peak, nbytes)) {
+			peak = atomicLoad(&peakBytes_);
+		}
+		atomicAdd(&nfinished_, (TReadId)1);
+		atomicStore(&done_[i], 1);
+		drain();
 	} else {
+		ThreadSafe t(&mutex_m, threadSafe_);
 		// obuf_ is the OutFileBuf for the output file
-		obuf_.writeString(rec);
+		write(rec);
 		nfinished_++;
 		nflushed_++;
 	}
 }
 
 /**
- * Write already-finished lines starting from cur_.
+ * Block until 'rdid' is less than a ring's length ahead of cur_ and its
+ * record fits in the byte budget.  The thread with the earliest
+ * unfinished read never blocks, so the flusher always makes progress.
  */
-void OutputQueue::flush(bool force, bool getLock) {
-	if(!reorder_) {
+void OutputQueue::waitForSlot(TReadId rdid, size_t len) {
+	assert_geq(rdid, atomicLoad(&cur_));
+	if(!mustWait(rdid, len)) {
 		return;
 	}
-	ThreadSafe t(&mutex_m, getLock && threadSafe_);
-	size_t nflush = 0;
-	while(nflush < finished_.size() && finished_[nflush]) {
-		assert(started_[nflush]);
-		nflush++;
+	waitMutex_.lock();
+	// Announce ourselves before re-checking cur_; drain() publishes
+	// cur_ before checking for waiters, so one of us sees the other
+	atomicAdd(&nwaiting_, 1);
+	atomicFence();
+	while(mustWait(rdid, len)) {
+		slotFree_.wait(waitMutex_);
 	}
-	// Waiting until we have several in a row to flush cuts down on copies
-	// (but requires more buffering)
-	if(force || nflush >= NFLUSH_THRESH) {
-		for(size_t i = 0; i < nflush; i++) {
-			assert(started_[i]);
-			assert(finished_[i]);
-			obuf_.writeString(lines_[i]);
+	atomicAdd(&nwaiting_, -1);
+	waitMutex_.unlock();
+}
+
+/**
+ * Write out the run of finished records starting at cur_, unless another
+ * thread is already doing so.
+ */
+void OutputQueue::drain() {
+	while(atomicCas(&flushing_, 0, 1)) {
+		// We're the only flusher, so cur_ is ours to advance
+		TReadId cur = cur_;
+		TReadId nflush = 0;
+		size_t nbytes = 0;
+		size_t i;
+		while(atomicLoad(&done_[i = (size_t)(cur & mask_)]) != 0) {
+			write(slots_[i]);
+			nbytes += slots_[i].length();
+			if(slots_[i].length() > SLOT_KEEP) {
+				// Don't let one huge record pin memory in the ring
+				slots_[i].reset();
+			}
+			atomicStore(&done_[i], 0);
+			cur++;
+			nflush++;
+		}
+		atomicAdd(&nflushed_, nflush);
+		atomicAdd(&nbytes_, (size_t)0 - nbytes);
+		atomicStore(&cur_, cur);
+		atomicStore(&flushing_, 0);
+		atomicFence();
+		if(nflush > 0 && atomicLoad(&nwaiting_) > 0) {
+			waitMutex_.lock();
+			slotFree_.notify_all();
+			waitMutex_.unlock();
+		}
+		// A thread that published the next slot while we held the flag
+		// left it to us, so look again
+		if(atomicLoad(&done_[(size_t)(cur & mask_)]) == 0) {
+			break;
 		}
-		lines_.erase(0, nflush);
-		started_.erase(0, nflush);
-		finished_.erase(0, nflush);
-		cur_ += nflush;
-		nflushed_ += nflush;
 	}
 }
 
+/**
+ * Write already-finished lines starting from cur_.
+ */
+void OutputQueue::flush(bool force, bool getLock) {
+	if(!reorder_) {
+		return;
+	}
+	drain();
+}
+
 #ifdef OUTQ_MAIN
 
 #include <iostream>
@@ -26,17 +26,25 @@
 #include "read.h"
 #include "threading.h"
 #include "mem_ids.h"
+#include "bam.h"
 
 /**
- * Encapsulates a list of lines of output.  If the earliest as-yet-unreported
- * read has id N and Bowtie 2 wants to write a record for read with id N+1, we
- * resize the lines_ and committed_ lists to have at least 2 elements (1 for N,
- * 1 for N+1) and return the BTString * associated with the 2nd element.  When
- * the user calls commit() for the read with id N, 
+ * Collects output records from the search threads and writes them to the
+ * output file.  Without reordering, records are written as soon as they
+ * are finished.  With reordering, each record is parked in a fixed-size
+ * ring at slot rdid mod the ring size, and whichever thread finds the
+ * slot for cur_ (the earliest read not yet written) filled becomes the
+ * flusher and writes out the run of consecutive finished slots.  Slots
+ * are published with atomic stores, so threads don't serialize on a lock
+ * to hand over records; a thread only blocks when its read is a full
+ * ring ahead of cur_, until the flusher catches up.  If a maximum number
+ * of buffered bytes is given, a thread whose record would take the
+ * buffered total past it also waits, unless its read is the one at cur_.
  */
 class OutputQueue {
 
-	static const size_t NFLUSH_THRESH = 8;
+	static const size_t RING_MIN = 1024;       // minimum # slots in the ring
+	static const size_t SLOT_KEEP = 64 * 1024; // free slot buffers bigger than this
 
 public:
 
@@ -45,20 +53,52 @@ public:
 		bool reorder,
 		size_t nthreads,
 		bool threadSafe,
-		TReadId rdid = 0) :
+		TReadId rdid = 0,
+		size_t batch = 1,
+		size_t maxBytes = 0) :
 		obuf_(obuf),
 		cur_(rdid),
 		nstarted_(0),
 		nfinished_(0),
 		nflushed_(0),
-		lines_(RES_CAT),
-		started_(RES_CAT),
-		finished_(RES_CAT),
+		slots_(RES_CAT),
+		done_(RES_CAT),
+		mask_(0),
+		flushing_(0),
+		nwaiting_(0),
+		maxBytes_(maxBytes),
+		nbytes_(0),
+		peakBytes_(0),
 		reorder_(reorder),
 		threadSafe_(threadSafe),
+		nthreads_(nthreads),
+		bgzf_(NULL),
+		sorter_(NULL),
         mutex_m()
 	{
 		assert(nthreads <= 1 || threadSafe);
+		if(reorder_) {
+			// Room for several batches per thread, so that threads
+			// working on later reads rarely have to wait
+			size_t nslots = RING_MIN;
+			while(nslots < 4 * nthreads * batch) nslots <<= 1;
+			slots_.resize(nslots);
+			done_.resize(nslots);
+			done_.fill(0);
+			mask_ = nslots - 1;
+		}
+	}
+
+	/**
+	 * Switch to BAM output.  Finished records, already encoded as BAM
+	 * by the AlnSink, are written through 'bgzf' instead of directly to
+	 * the OutFileBuf.  If 'sorter' is non-NULL, records go to it
+	 * instead, and the caller writes them out with BamSorter::finish()
+	 * after the last flush.
+	 */
+	void setBam(BgzfWriter *bgzf, BamSorter *sorter = NULL) {
+		bgzf_ = bgzf;
+		sorter_ = sorter;
 	}
 
 	/**
@@ -76,48 +116,103 @@ public:
 	 * Return the number of records currently being buffered.
 	 */
 	size_t size() const {
-		return lines_.size();
+		return (size_t)(atomicLoad(&nfinished_) - atomicLoad(&nflushed_));
 	}
 	
 	/**
 	 * Return the number of records that have been flushed so far.
 	 */
 	TReadId numFlushed() const {
-		return nflushed_;
+		return atomicLoad(&nflushed_);
 	}
 
 	/**
 	 * Return the number of records that have been started so far.
 	 */
 	TReadId numStarted() const {
-		return nstarted_;
+		return atomicLoad(&nstarted_);
 	}
 
 	/**
 	 * Return the number of records that have been finished so far.
 	 */
 	TReadId numFinished() const {
-		return nfinished_;
+		return atomicLoad(&nfinished_);
 	}
 
 	/**
-	 * Write already-committed lines starting from cur_.
+	 * Return the largest number of bytes of finished records that were
+	 * waiting to be written at any one time.
+	 */
+	size_t peakBytes() const {
+		return atomicLoad(&peakBytes_);
+	}
+
+	/**
+	 * Write already-finished records starting from cur_.  The ring is
+	 * drained as records finish, so this only matters if a caller
+	 * stopped short of it; 'force' and 'getLock' are kept for callers.
 	 */
 	void flush(bool force = false, bool getLock = true);
 
 protected:
 
+	/**
+	 * Return true iff the record for 'rdid', 'len' bytes long, must
+	 * wait before it is added to the ring.
+	 */
+	bool mustWait(TReadId rdid, size_t len) const {
+		TReadId cur = atomicLoad(&cur_);
+		if(rdid - cur > mask_) return true;
+		return maxBytes_ > 0 && rdid != cur && atomicLoad(&nbytes_) + len > maxBytes_;
+	}
+
+	/**
+	 * Block until the ring has a slot, and the byte budget has room,
+	 * for the 'len'-byte record of 'rdid'.
+	 */
+	void waitForSlot(TReadId rdid, size_t len);
+
+	/**
+	 * If no other thread is flushing, write out finished records from
+	 * cur_ onward.
+	 */
+	void drain();
+
+	/**
+	 * Write a finished record to the output.
+	 */
+	void write(const BTString& rec) {
+		if(sorter_ != NULL) {
+			sorter_->add(rec);
+		} else if(bgzf_ != NULL) {
+			bgzf_->writeString(rec);
+		} else {
+			obuf_.writeString(rec);
+		}
+	}
+
 	OutFileBuf&     obuf_;
-	TReadId         cur_;
-	TReadId         nstarted_;
-	TReadId         nfinished_;
-	TReadId         nflushed_;
-	EList<BTString> lines_;
-	EList<bool>     started_;
-	EList<bool>     finished_;
+	volatile TReadId cur_;      // earliest read not yet written
+	volatile TReadId nstarted_;
+	volatile TReadId nfinished_;
+	volatile TReadId nflushed_;
+	EList<BTString> slots_;     // ring of records for reordering
+	EList<int>      done_;      // 1 if the record in the slot is finished
+	size_t          mask_;      // ring size - 1
+	volatile int    flushing_;  // 1 while a thread is draining the ring
+	volatile int    nwaiting_;  // threads blocked waiting for a slot
+	size_t          maxBytes_;  // cap on nbytes_, 0 for none
+	volatile size_t nbytes_;    // bytes of finished records not yet written
+	volatile size_t peakBytes_; // high-water mark of nbytes_
+	tthread::mutex  waitMutex_;
+	tthread::condition_variable slotFree_;
 	bool            reorder_;
 	bool            threadSafe_;
-	MUTEX_T         mutex_m;
+	size_t          nthreads_;
+	BgzfWriter     *bgzf_;      // BGZF stream for BAM output
+	BamSorter      *sorter_;    // non-NULL for sorted BAM output
+	MUTEX_T         mutex_m;    // serializes unordered output
 };
 
 class OutputQueueMark {
@@ -145,11 +145,125 @@ bool WrappedPatternSourcePerThread::nextReadPair(
 	ASSERT_ONLY(TReadId lastRdId = rdid_);
 	buf1_.reset();
 	buf2_.reset();
-	patsrc_.nextReadPair(buf1_, buf2_, rdid_, endid_, success, done, paired, fixName);
+	if(batch_) {
+		nextFromBatch(success, done, paired, fixName);
+	} else {
+		patsrc_.nextReadPair(buf1_, buf2_, rdid_, endid_, success, done, paired, fixName);
+	}
 	assert(!success || rdid_ != lastRdId);
 	return success;
 }
 
+bool LookaheadPatternSourcePerThread::nextReadPair(
+	bool& success,
+	bool& done,
+	bool& paired,
+	bool fixName)
+{
+	refilled_ = false;
+	if(cur_ == ahead_.size()) {
+		ahead_.clear();
+		cur_ = 0;
+		while(!done_ && ahead_.size() < n_) {
+			bool s = false, d = false, p = false;
+			src_->nextReadPair(s, d, p, fixName);
+			if(!s) {
+				done_ = d;
+				continue;
+			}
+			ahead_.expand();
+			Ahead& r = ahead_.back();
+			r.a = src_->bufa();
+			r.b = src_->bufb();
+			r.rdid = src_->rdid();
+			r.endid = src_->endid();
+			r.paired = p;
+		}
+		refilled_ = !ahead_.empty();
+	}
+	if(cur_ == ahead_.size()) {
+		success = false;
+		done = true;
+		return false;
+	}
+	const Ahead& r = ahead_[cur_++];
+	buf1_ = r.a;
+	buf2_ = r.b;
+	rdid_ = r.rdid;
+	endid_ = r.endid;
+	success = true;
+	done = false;
+	paired = r.paired;
+	return true;
+}
+
+/**
+ * A record claimed by nextBatch() didn't parse.  readLight() only
+ * claims complete records, so the record itself is malformed; stop
+ * with an error as the unbatched parsers do rather than align the
+ * half-filled Read.  'mate' is 0 for an unpaired read.
+ */
+static void badRecord(TReadId rdid, int mate) {
+	cerr << "Error: could not parse read " << (rdid + 1);
+	if(mate > 0) cerr << " (mate " << mate << ")";
+	cerr << "; the reads file may be malformed" << endl;
+	throw 1;
+}
+
+/**
+ * Dispense the next read or pair from the thread-local batch, parsing
+ * it from its raw text.  Only claiming a new batch requires a lock.
+ */
+bool WrappedPatternSourcePerThread::nextFromBatch(
+	bool& success,
+	bool& done,
+	bool& paired,
+	bool fixName)
+{
+	success = false;
+	done = false;
+	if(batcha_.exhausted()) {
+		if(!patsrc_.nextBatch(batcha_, batchb_, batchPaired_)) {
+			done = true;
+			return false;
+		}
+		assert(!batcha_.exhausted());
+	}
+	paired = batchPaired_;
+	size_t i = batcha_.cur++;
+	rdid_ = endid_ = batcha_.rdid + i;
+	if(!batcha_.src->parse(buf1_, batcha_.record(i), batcha_.recordLen(i), rdid_, recbuf_)) {
+		badRecord(rdid_, paired ? 1 : 0);
+	}
+	buf1_.finalize();
+	buf1_.seed = genRandSeed(buf1_.patFw, buf1_.qual, buf1_.name, batcha_.src->seed());
+	buf1_.rdid = rdid_;
+	buf1_.endid = endid_;
+	if(!paired) {
+		buf1_.mate = 0;
+		success = true;
+		return success;
+	}
+	assert_eq(batcha_.rdid, batchb_.rdid);
+	assert_eq(batcha_.size(), batchb_.size());
+	batchb_.cur++;
+	if(!batchb_.src->parse(buf2_, batchb_.record(i), batchb_.recordLen(i), rdid_, recbuf_)) {
+		badRecord(rdid_, 2);
+	}
+	buf2_.finalize();
+	buf2_.seed = genRandSeed(buf2_.patFw, buf2_.qual, buf2_.name, batchb_.src->seed());
+	if(fixName) {
+		buf1_.fixMateName(1);
+		buf2_.fixMateName(2);
+	}
+	buf2_.rdid = rdid_;
+	buf2_.endid = endid_+1;
+	buf1_.mate = 1;
+	buf2_.mate = 2;
+	success = true;
+	return success;
+}
+
 /**
  * The main member function for dispensing pairs of reads or
  * singleton reads.  Returns true iff ra and rb contain a new
@@ -305,6 +419,65 @@ bool PairedDualPatternSource::nextReadPair(
 	return success;
 }
 
+/**
+ * Claim the next batch of unpaired reads, or the next batch of mate 1s
+ * together with the same number of mate 2s.  The mate files are read
+ * under one lock so that the two batches line up.  Returns false once
+ * all PatternSources are exhausted.
+ */
+bool PairedDualPatternSource::nextBatch(
+	RawReadBatch& a,
+	RawReadBatch& b,
+	bool& paired)
+{
+	// 'cur' indexes the current pair of PatternSources
+	uint32_t cur;
+	{
+		lock();
+		cur = cur_;
+		unlock();
+	}
+	while(cur < srca_->size()) {
+		bool done_a = false, done_b = false;
+		if((*srcb_)[cur] == NULL) {
+			paired = false;
+			// Patterns from srca_ are unpaired
+			b.reset();
+			if((*srca_)[cur]->nextBatch(a, readsPerBatch_, done_a) == 0) {
+				lock();
+				if(cur + 1 > cur_) cur_++;
+				cur = cur_; // Move on to next PatternSource
+				unlock();
+				continue; // on to next pair of PatternSources
+			}
+			return true;
+		} else {
+			paired = true;
+			// Lock to ensure that this thread gets parallel reads
+			// in the two mate files
+			lock();
+			size_t na = (*srca_)[cur]->nextBatch(a, readsPerBatch_, done_a);
+			size_t nb = (*srcb_)[cur]->nextBatch(b, max<size_t>(na, 1), done_b);
+			if(na == 0 && nb > 0) {
+				cerr << "Error, fewer reads in file specified with -1 than in file specified with -2" << endl;
+				throw 1;
+			} else if(na == 0) {
+				if(cur + 1 > cur_) cur_++;
+				cur = cur_; // Move on to next PatternSource
+				unlock();
+				continue; // on to next pair of PatternSources
+			} else if(nb < na) {
+				cerr << "Error, fewer reads in file specified with -2 than in file specified with -1" << endl;
+				throw 1;
+			}
+			assert_eq(a.rdid, b.rdid);
+			unlock();
+			return true;
+		}
+	}
+	return false;
+}
+
 /**
  * Return the number of reads attempted.
  */
@@ -470,7 +643,7 @@ VectorPatternSource::VectorPatternSource(
 		assert_leq(ss.size(), 2);
 		// Initialize s
 		string s = ss[0];
-		int mytrim5 = gTrim5;
+		int mytrim5 = trim5_;
 		if(gColor && s.length() > 1) {
 			// This may be a primer character.  If so, keep it in the
 			// 'primer' field of the read buf and parse the rest of the
@@ -494,7 +667,7 @@ VectorPatternSource::VectorPatternSource(
 				if(s[i] == '.') s[i] = 'N';
 			}
 		}
-		if(s.length() <= (size_t)(gTrim3 + mytrim5)) {
+		if(s.length() <= (size_t)(trim3_ + mytrim5)) {
 			// Entire read is trimmed away
 			s.clear();
 		} else {
@@ -503,8 +676,8 @@ VectorPatternSource::VectorPatternSource(
 				s.erase(0, mytrim5);
 			}
 			// Trim on 3' (low-quality) end
-			if(gTrim3 > 0) {
-				s.erase(s.length()-gTrim3);
+			if(trim3_ > 0) {
+				s.erase(s.length()-trim3_);
 			}
 		}
 		//  Initialize vq
@@ -513,14 +686,14 @@ VectorPatternSource::VectorPatternSource(
 			vq = ss[1];
 		}
 		// Trim qualities
-		if(vq.length() > (size_t)(gTrim3 + mytrim5)) {
+		if(vq.length() > (size_t)(trim3_ + mytrim5)) {
 			// Trim on 5' (high-quality) end
 			if(mytrim5 > 0) {
 				vq.erase(0, mytrim5);
 			}
 			// Trim on 3' (low-quality) end
-			if(gTrim3 > 0) {
-				vq.erase(vq.length()-gTrim3);
+			if(trim3_ > 0) {
+				vq.erase(vq.length()-trim3_);
 			}
 		}
 		// Pad quals with Is if necessary; this shouldn't happen
@@ -536,7 +709,7 @@ VectorPatternSource::VectorPatternSource(
 		v_.expand();
 		v_.back().installChars(s);
 		quals_.push_back(BTString(vq));
-		trimmed3_.push_back(gTrim3);
+		trimmed3_.push_back(trim3_);
 		trimmed5_.push_back(mytrim5);
 		ostringstream os;
 		os << (names_.size());
@@ -799,7 +972,7 @@ bool FastaPatternSource::read(
 	// _in now points just past the first character of a sequence
 	// line, and c holds the first character
 	int begin = 0;
-	int mytrim5 = gTrim5;
+	int mytrim5 = trim5_;
 	if(gColor) {
 		// This is the primer character, keep it in the
 		// 'primer' field of the read buf and keep parsing
@@ -830,9 +1003,9 @@ bool FastaPatternSource::read(
 		if(fb_.peek() == '>') break;
 		c = fb_.get();
 	}
-	r.patFw.trimEnd(gTrim3);
-	r.qual.trimEnd(gTrim3);
-	r.trimmed3 = gTrim3;
+	r.patFw.trimEnd(trim3_);
+	r.qual.trimEnd(trim3_);
+	r.trimmed3 = trim3_;
 	r.trimmed5 = mytrim5;
 	// Set up a default name if one hasn't been set
 	if(r.name.empty()) {
@@ -857,19 +1030,16 @@ bool FastqPatternSource::read(
 	bool& done)
 {
 	int c;
-	int dstLen = 0;
 	success = true;
 	done = false;
 	r.reset();
-	r.color = gColor;
-	r.fuzzy = fuzzy_;
 	// Pick off the first at
 	if(first_) {
 		c = fb_.get();
 		if(c != '@') {
 			c = getOverNewline(fb_);
 			if(c < 0) {
-				bail(r); success = false; done = true; return success;
+				bail(r, fb_); success = false; done = true; return success;
 			}
 		}
 		if(c != '@') {
@@ -879,33 +1049,208 @@ bool FastqPatternSource::read(
 		assert_eq('@', c);
 		first_ = false;
 	}
+	if(!parseRecord(r, fb_, readCnt_, done)) {
+		success = false;
+		return success;
+	}
+	rdid = endid = readCnt_;
+	readCnt_++;
+	return success;
+}
+
+/**
+ * Copy the raw text of the next FASTQ record, from its '@' through the
+ * newline(s) ending its quality line, into 'b'.  Record boundaries are
+ * found the same way parseRecord() finds them, but by scanning the
+ * input buffer in bulk and without any other parsing; that is left to
+ * parse(), outside the critical section.  Returns false if the current
+ * file ended before a full record could be read.
+ */
+bool FastqPatternSource::readLight(RawReadBatch& b) {
+	int c;
+	if(first_) {
+		c = fb_.get();
+		if(c != '@') {
+			c = getOverNewline(fb_);
+			if(c < 0) return false;
+		}
+		if(c != '@') {
+			cerr << "Error: reads file does not look like a FASTQ file" << endl;
+			throw 1;
+		}
+		first_ = false;
+	}
+	b.append('@');
+	// Name line, plus the newline(s) after it
+	c = fb_.copyUpTo(b, '\n', '\r');
+	while(c == '\n' || c == '\r') {
+		b.append((char)fb_.get());
+		c = fb_.peek();
+	}
+	if(c < 0) return false;
+	// Sequence, which ends at the first '+'
+	bool emptySeq = (c == '+');
+	if(fb_.copyUpTo(b, '+', '+') < 0) return false;
+	// The '+' line, plus the newline(s) after it
+	c = fb_.copyUpTo(b, '\n', '\r');
+	while(c == '\n' || c == '\r') {
+		b.append((char)fb_.get());
+		c = fb_.peek();
+	}
+	if(c < 0) return true;
+	if(!emptySeq) {
+		// Quality line, plus the newline(s) after it
+		c = fb_.copyUpTo(b, '\n', '\r');
+		while(c == '\n' || c == '\r') {
+			b.append((char)fb_.get());
+			c = fb_.peek();
+		}
+	}
+	// Consume the '@' that starts the next record
+	c = fb_.get();
+	assert(c == -1 || c == '@');
+	return true;
+}
+
+/**
+ * Parse a FASTQ record claimed with nextBatch().  'rec' holds the
+ * record's raw text, starting with its '@'.  Plain four-line records
+ * are handled by parseSimple(); anything else goes through the general
+ * parser.
+ */
+bool FastqPatternSource::parse(
+	Read& r,
+	const char *rec,
+	size_t len,
+	TReadId rdid,
+	FileBuf& fb) const
+{
+	r.reset();
+	if(parseSimple(r, rec, len, rdid)) {
+		return true;
+	}
+	r.reset();
+	fb.newBuf(rec, len);
+	ASSERT_ONLY(int c =) fb.get();
+	assert_eq('@', c);
+	bool done = false;
+	return parseRecord(r, fb, rdid, done);
+}
+
+/**
+ * Parse a record consisting of a name line, a single sequence line, a
+ * '+' line and a quality line as long as the sequence, locating the
+ * lines and converting the sequence and qualities with SSE2.  Returns
+ * false without reporting anything if the record is not of that form,
+ * uses options this path doesn't handle, or contains characters the
+ * general parser would treat specially or complain about; the caller
+ * then parses it with parseRecord(), which yields the same Read for
+ * every record accepted here.
+ */
+bool FastqPatternSource::parseSimple(
+	Read& r,
+	const char *rec,
+	size_t len,
+	TReadId rdid) const
+{
+	if(gColor || fuzzy_ || intQuals_ || solQuals_) {
+		return false;
+	}
+	assert_gt(len, 0);
+	assert_eq('@', rec[0]);
+	const char *e = rec + len;
+	// Name line
+	const char *name = rec + 1;
+	const char *nameEnd = scanForNewline(name, e);
+	const char *seq = nameEnd;
+	while(seq < e && (*seq == '\n' || *seq == '\r')) seq++;
+	if(seq == e || *seq == '+') return false;
+	// Sequence line, which must be followed directly by the '+' line
+	const char *seqEnd = scanForNewline(seq, e);
+	const char *plus = seqEnd;
+	while(plus < e && (*plus == '\n' || *plus == '\r')) plus++;
+	if(plus == e || *plus != '+') return false;
+	const char *qual = scanForNewline(plus, e);
+	while(qual < e && (*qual == '\n' || *qual == '\r')) qual++;
+	const char *qualEnd = scanForNewline(qual, e);
+	size_t seqLen = seqEnd - seq;
+	if((size_t)(qualEnd - qual) != seqLen) return false;
+	// Apply 5' and then 3' trimming
+	size_t trim5 = min<size_t>((size_t)trim5_, seqLen);
+	size_t keep = seqLen - trim5;
+	keep = (keep > (size_t)trim3_) ? (keep - trim3_) : 0;
+	r.patFw.resize(keep);
+	if(!ascToDna(seq + trim5, keep, r.patFw.wbuf())) return false;
+	// Trimmed-off characters must still be ones the general parser counts
+	for(size_t i = 0; i < seqLen; i++) {
+		if(i == trim5) i += keep;
+		if(i < seqLen && ascToDnaChar(seq[i]) < 0) return false;
+	}
+	r.qual.resize(keep);
+	if(!ascToPhred33(qual + trim5, keep, r.qual.wbuf(), phred64Quals_)) return false;
+	for(size_t i = 0; i < seqLen; i++) {
+		if(i == trim5) i += keep;
+		if(i < seqLen && (signed char)qual[i] <= (phred64Quals_ ? 63 : 32)) return false;
+	}
+	r.color = gColor;
+	r.fuzzy = fuzzy_;
+	if(nameEnd > name) {
+		r.name.install(name, nameEnd - name);
+	} else {
+		char cbuf[20];
+		itoa10<TReadId>(rdid, cbuf);
+		r.name.install(cbuf);
+	}
+	r.readOrigBuf.install(rec, min(len, (size_t)FileBuf::LASTN_BUF_SZ));
+	r.trimmed3 = trim3_;
+	r.trimmed5 = trim5_;
+	return true;
+}
+
+/**
+ * Parse the remainder of a FASTQ record, starting just after its '@',
+ * from 'fb' into 'r'.  'rdid' is used to name reads with empty names.
+ * When returning, 'fb' has consumed the '@' of the following record,
+ * if any.  Returns false and sets 'done' if the input ended before the
+ * record was complete.
+ */
+bool FastqPatternSource::parseRecord(
+	Read& r,
+	FileBuf& fb,
+	TReadId rdid,
+	bool& done) const
+{
+	int c;
+	int dstLen = 0;
+	r.color = gColor;
+	r.fuzzy = fuzzy_;
 
 	// Read to the end of the id line, sticking everything after the '@'
 	// into *name
 	while(true) {
-		c = fb_.get();
+		c = fb.get();
 		if(c < 0) {
-			bail(r); success = false; done = true; return success;
+			bail(r, fb); done = true; return false;
 		}
 		if(c == '\n' || c == '\r') {
 			// Break at end of line, after consuming all \r's, \n's
 			while(c == '\n' || c == '\r') {
-				c = fb_.get();
+				c = fb.get();
 				if(c < 0) {
-					bail(r); success = false; done = true; return success;
+					bail(r, fb); done = true; return false;
 				}
 			}
 			break;
 		}
 		r.name.append(c);
 	}
-	// fb_ now points just past the first character of a
+	// fb now points just past the first character of a
 	// sequence line, and c holds the first character
 	int charsRead = 0;
 	BTDnaString *sbuf = &r.patFw;
 	int dstLens[] = {0, 0, 0, 0};
 	int *dstLenCur = &dstLens[0];
-	int mytrim5 = gTrim5;
+	int mytrim5 = trim5_;
 	int altBufIdx = 0;
 	if(gColor && c != '+') {
 		// This may be a primer character.  If so, keep it in the
@@ -914,7 +1259,7 @@ bool FastqPatternSource::read(
 		c = toupper(c);
 		if(asc2dnacat[c] > 0) {
 			// First char is a DNA char
-			int c2 = toupper(fb_.peek());
+			int c2 = toupper(fb.peek());
 			// Second char is a color char
 			if(asc2colcat[c2] > 0) {
 				r.primer = c;
@@ -923,7 +1268,7 @@ bool FastqPatternSource::read(
 			}
 		}
 		if(c < 0) {
-			bail(r); success = false; done = true; return success;
+			bail(r, fb); done = true; return false;
 		}
 	}
 	int trim5 = 0;
@@ -946,7 +1291,7 @@ bool FastqPatternSource::read(
 			} else if(fuzzy_ && c == ' ') {
 				trim5 = 0; // disable 5' trimming for now
 				if(charsRead == 0) {
-					c = fb_.get();
+					c = fb.get();
 					continue;
 				}
 				charsRead = 0;
@@ -958,23 +1303,23 @@ bool FastqPatternSource::read(
 				sbuf = &r.altPatFw[altBufIdx++];
 				dstLenCur = &dstLens[altBufIdx];
 			}
-			c = fb_.get();
+			c = fb.get();
 			if(c < 0) {
-				bail(r); success = false; done = true; return success;
+				bail(r, fb); done = true; return false;
 			}
 		}
 		dstLen = dstLens[0];
 		charsRead = dstLen + mytrim5;
 	}
 	// Trim from 3' end
-	if(gTrim3 > 0) {
-		if((int)r.patFw.length() > gTrim3) {
-			r.patFw.resize(r.patFw.length() - gTrim3);
-			dstLen -= gTrim3;
+	if(trim3_ > 0) {
+		if((int)r.patFw.length() > trim3_) {
+			r.patFw.resize(r.patFw.length() - trim3_);
+			dstLen -= trim3_;
 			assert_eq((int)r.patFw.length(), dstLen);
 		} else {
 			// Trimmed the whole read; we won't be using this read,
-			// but we proceed anyway so that fb_ is advanced
+			// but we proceed anyway so that fb is advanced
 			// properly
 			r.patFw.clear();
 			dstLen = 0;
@@ -983,14 +1328,12 @@ bool FastqPatternSource::read(
 	assert_eq('+', c);
 
 	// Chew up the optional name on the '+' line
-	ASSERT_ONLY(int pk =) peekToEndOfLine(fb_);
+	ASSERT_ONLY(int pk =) peekToEndOfLine(fb);
 	if(charsRead == 0) {
-		assert_eq('@', pk);
-		fb_.get();
-		fb_.resetLastN();
-		rdid = endid = readCnt_;
-		readCnt_++;
-		return success;
+		assert(pk == '@' || pk == -1);
+		fb.get();
+		fb.resetLastN();
+		return true;
 	}
 
 	// Now read the qualities
@@ -1002,10 +1345,10 @@ bool FastqPatternSource::read(
 			// In case the original quality string is one shorter
 			mytrim5--;
 		}
-		qualToks_.clear();
-		tokenizeQualLine(fb_, buf, 4096, qualToks_);
-		for(unsigned int j = 0; j < qualToks_.size(); ++j) {
-			char c = intToPhred33(atoi(qualToks_[j].c_str()), solQuals_);
+		EList<string> qualToks;
+		tokenizeQualLine(fb, buf, 4096, qualToks);
+		for(unsigned int j = 0; j < qualToks.size(); ++j) {
+			char c = intToPhred33(atoi(qualToks[j].c_str()), solQuals_);
 			assert_geq(c, 33);
 			if (qualsRead >= mytrim5) {
 				r.qual.append(c);
@@ -1013,7 +1356,7 @@ bool FastqPatternSource::read(
 			++qualsRead;
 		} // done reading integer quality lines
 		if(gColor && r.primer != -1) mytrim5++;
-		r.qual.trimEnd(gTrim3);
+		r.qual.trimEnd(trim3_);
 		if(r.qual.length() < r.patFw.length()) {
 			tooFewQualities(r.name);
 		} else if(r.qual.length() > r.patFw.length() + 1) {
@@ -1027,7 +1370,7 @@ bool FastqPatternSource::read(
 			r.qual.resize(r.patFw.length());
 			assert_eq((int)r.qual.length(), dstLen);
 		}
-		peekOverNewline(fb_);
+		peekOverNewline(fb);
 	} else {
 		// Non-integer qualities
 		altBufIdx = 0;
@@ -1040,7 +1383,7 @@ bool FastqPatternSource::read(
 			trim5--;
 		}
 		while(true) {
-			c = fb_.get();
+			c = fb.get();
 			if (!fuzzy_ && c == ' ') {
 				wrongQualityFormat(r.name);
 			} else if(c == ' ') {
@@ -1056,7 +1399,7 @@ bool FastqPatternSource::read(
 			}
 			if(c < 0) {
 				break; // let the file end just at the end of a quality line
-				//bail(r); success = false; done = true; return success;
+				//bail(r, fb); done = true; return false;
 			}
 			if (c != '\r' && c != '\n') {
 				if (*qualsReadCur >= trim5) {
@@ -1069,8 +1412,8 @@ bool FastqPatternSource::read(
 				break;
 			}
 		}
-		qualsRead[0] -= gTrim3;
-		r.qual.trimEnd(gTrim3);
+		qualsRead[0] -= trim3_;
+		r.qual.trimEnd(trim3_);
 		if(r.qual.length() < r.patFw.length()) {
 			tooFewQualities(r.name);
 		} else if(r.qual.length() > r.patFw.length()+1) {
@@ -1082,18 +1425,18 @@ bool FastqPatternSource::read(
 
 		if(fuzzy_) {
 			// Trim from 3' end of alternate basecall and quality strings
-			if(gTrim3 > 0) {
+			if(trim3_ > 0) {
 				for(int i = 0; i < 3; i++) {
 					assert_eq(r.altQual[i].length(), r.altPatFw[i].length());
-					if((int)r.altQual[i].length() > gTrim3) {
-						r.altPatFw[i].resize(gTrim3);
-						r.altQual[i].resize(gTrim3);
+					if((int)r.altQual[i].length() > trim3_) {
+						r.altPatFw[i].resize(trim3_);
+						r.altQual[i].resize(trim3_);
 					} else {
 						r.altPatFw[i].clear();
 						r.altQual[i].clear();
 					}
 					qualsRead[i+1] = dstLens[i+1] =
-						max<int>(0, dstLens[i+1] - gTrim3);
+						max<int>(0, dstLens[i+1] - trim3_);
 				}
 			}
 			// Shift to RHS, and install in Strings
@@ -1130,29 +1473,27 @@ bool FastqPatternSource::read(
 		}
 
 		if(c == '\r' || c == '\n') {
-			c = peekOverNewline(fb_);
+			c = peekOverNewline(fb);
 		} else {
-			c = peekToEndOfLine(fb_);
+			c = peekToEndOfLine(fb);
 		}
 	}
-	r.readOrigBuf.install(fb_.lastN(), fb_.lastNLen());
-	fb_.resetLastN();
+	r.readOrigBuf.install(fb.lastN(), fb.lastNLen());
+	fb.resetLastN();
 
-	c = fb_.get();
-	// Should either be at end of file or at beginning of next record
+	c = fb.get();
+	// Should either be at end of input or at beginning of next record
 	assert(c == -1 || c == '@');
 
 	// Set up a default name if one hasn't been set
 	if(r.name.empty()) {
 		char cbuf[20];
-		itoa10<TReadId>(readCnt_, cbuf);
+		itoa10<TReadId>(rdid, cbuf);
 		r.name.install(cbuf);
 	}
-	r.trimmed3 = gTrim3;
+	r.trimmed3 = trim3_;
 	r.trimmed5 = mytrim5;
-	rdid = endid = readCnt_;
-	readCnt_++;
-	return success;
+	return true;
 }
 
 /// Read another pattern from a FASTA input file
@@ -1181,7 +1522,7 @@ bool TabbedPatternSource::read(
 	// fb_ is about to dish out the first character of the
 	// sequence field
 	int charsRead = 0;
-	int mytrim5 = gTrim5;
+	int mytrim5 = trim5_;
 	int dstLen = parseSeq(r, charsRead, mytrim5, '\t');
 	assert_neq('\t', fb_.peek());
 	if(dstLen < 0) {
@@ -1202,7 +1543,7 @@ bool TabbedPatternSource::read(
 		done = true;
 		return false;
 	}
-	r.trimmed3 = gTrim3;
+	r.trimmed3 = trim3_;
 	r.trimmed5 = mytrim5;
 	assert_eq(ct, '\n');
 	assert_neq('\n', fb_.peek());
@@ -1234,7 +1575,7 @@ bool TabbedPatternSource::readPair(
 	
 	// fb_ is about to dish out the first character of the
 	// name field
-	int mytrim5_1 = gTrim5;
+	int mytrim5_1 = trim5_;
 	if(parseName(ra, &rb, '\t') == -1) {
 		peekOverNewline(fb_); // skip rest of line
 		ra.reset();
@@ -1273,7 +1614,7 @@ bool TabbedPatternSource::readPair(
 		done = true;
 		return false;
 	}
-	ra.trimmed3 = gTrim3;
+	ra.trimmed3 = trim3_;
 	ra.trimmed5 = mytrim5_1;
 	assert(ct == '\t' || ct == '\n' || ct == '\r' || ct == -1);
 	if(ct == '\r' || ct == '\n' || ct == -1) {
@@ -1308,7 +1649,7 @@ bool TabbedPatternSource::readPair(
 
 	// fb_ about to give the first character of the second mate's sequence
 	int charsRead2 = 0;
-	int mytrim5_2 = gTrim5;
+	int mytrim5_2 = trim5_;
 	int dstLen2 = parseSeq(rb, charsRead2, mytrim5_2, '\t');
 	if(dstLen2 < 0) {
 		peekOverNewline(fb_); // skip rest of line
@@ -1334,7 +1675,7 @@ bool TabbedPatternSource::readPair(
 	}
 	ra.readOrigBuf.install(fb_.lastN(), fb_.lastNLen());
 	fb_.resetLastN();
-	rb.trimmed3 = gTrim3;
+	rb.trimmed3 = trim3_;
 	rb.trimmed5 = mytrim5_2;
 	rdid = endid = readCnt_;
 	readCnt_++;
@@ -1431,7 +1772,7 @@ int TabbedPatternSource::parseSeq(
 			return -1;
 		}
 	}
-	r.patFw.trimEnd(gTrim3);
+	r.patFw.trimEnd(trim3_);
 	return (int)r.patFw.length();
 }
 
@@ -1543,6 +1884,8 @@ struct SRA_Data {
     uint64_t write_pos;
     uint64_t buffer_size;
     bool     done;
+    int      trim5;
+    int      trim3;
     EList<pair<SRA_Read, SRA_Read> > paired_reads;
     
     ngs::ReadIterator* sra_it;
@@ -1552,6 +1895,7 @@ struct SRA_Data {
         write_pos = 0;
         buffer_size = buffer_size_per_thread;
         done = false;
+        trim5 = trim3 = 0;
         sra_it = NULL;
     }
     
@@ -1594,6 +1938,7 @@ static void SRA_IO_Worker(void *vp)
     assert(sra_data != NULL);
     ngs::ReadIterator* sra_it = sra_data->sra_it;
     assert(sra_it != NULL);
+    const int trim5 = sra_data->trim5, trim3 = sra_data->trim3;
     
     while(!sra_data->done) {
         while(sra_data->isFull()) {
@@ -1622,12 +1967,12 @@ static void SRA_IO_Worker(void *vp)
             assert(!ra.name.empty());
             
             ngs::StringRef ra_seq = sra_it->getFragmentBases();
-            if(gTrim5 + gTrim3 < (int)ra_seq.size()) {
-                ra.patFw.installChars(ra_seq.data() + gTrim5, ra_seq.size() - gTrim5 - gTrim3);
+            if(trim5 + trim3 < (int)ra_seq.size()) {
+                ra.patFw.installChars(ra_seq.data() + trim5, ra_seq.size() - trim5 - trim3);
             }
             ngs::StringRef ra_qual = sra_it->getFragmentQualities();
-            if(ra_seq.size() == ra_qual.size() && gTrim5 + gTrim3 < (int)ra_qual.size()) {
-                ra.qual.install(ra_qual.data() + gTrim5, ra_qual.size() - gTrim5 - gTrim3);
+            if(ra_seq.size() == ra_qual.size() && trim5 + trim3 < (int)ra_qual.size()) {
+                ra.qual.install(ra_qual.data() + trim5, ra_qual.size() - trim5 - trim3);
             } else {
                 ra.qual.resize(ra.patFw.length());
                 ra.qual.fill('I');
@@ -1639,12 +1984,12 @@ static void SRA_IO_Worker(void *vp)
             } else {
                 // rb.name = ra.name;
                 ngs::StringRef rb_seq = sra_it->getFragmentBases();
-                if(gTrim5 + gTrim3 < (int)rb_seq.size()) {
-                    rb.patFw.installChars(rb_seq.data() + gTrim5, rb_seq.size() - gTrim5 - gTrim3);
+                if(trim5 + trim3 < (int)rb_seq.size()) {
+                    rb.patFw.installChars(rb_seq.data() + trim5, rb_seq.size() - trim5 - trim3);
                 }
                 ngs::StringRef rb_qual = sra_it->getFragmentQualities();
-                if(rb_seq.size() == rb_qual.size() && gTrim5 + gTrim3 < (int)rb_qual.size()) {
-                    rb.qual.install(rb_qual.data() + gTrim5, rb_qual.size() - gTrim5 - gTrim3);
+                if(rb_seq.size() == rb_qual.size() && trim5 + trim3 < (int)rb_qual.size()) {
+                    rb.qual.install(rb_qual.data() + trim5, rb_qual.size() - trim5 - trim3);
                 } else {
                     rb.qual.resize(rb.patFw.length());
                     rb.qual.fill('I');
@@ -1719,14 +2064,14 @@ bool SRAPatternSource::readPair(
     ra.name.install(pair.first.name.buf(), pair.first.name.length());
     ra.patFw.install(pair.first.patFw.buf(), pair.first.patFw.length());
     ra.qual.install(pair.first.qual.buf(), pair.first.qual.length());
-    ra.trimmed3 = gTrim3;
-    ra.trimmed5 = gTrim5;
+    ra.trimmed3 = trim3_;
+    ra.trimmed5 = trim5_;
     if(pair.second.patFw.length() > 0) {
         rb.name.install(pair.first.name.buf(), pair.first.name.length());
         rb.patFw.install(pair.second.patFw.buf(), pair.second.patFw.length());
         rb.qual.install(pair.second.qual.buf(), pair.second.qual.length());
-        rb.trimmed3 = gTrim3;
-        rb.trimmed5 = gTrim5;
+        rb.trimmed3 = trim3_;
+        rb.trimmed5 = trim5_;
         paired = true;
     } else {
         rb.reset();
@@ -1761,6 +2106,8 @@ void SRAPatternSource::open() {
             // create a buffer for SRA data
             sra_data_ = new SRA_Data;
             sra_data_->sra_it = sra_it_;
+            sra_data_->trim5 = trim5_;
+            sra_data_->trim3 = trim3_;
             sra_data_->buffer_size = nthreads_ * buffer_size_per_thread;
             sra_data_->paired_reads.resize(sra_data_->buffer_size);
             
@@ -34,6 +34,7 @@
 #include "random_source.h"
 #include "threading.h"
 #include "filebuf.h"
+#include "decomp.h"
 #include "qual.h"
 #include "search_globals.h"
 #include "sstring.h"
@@ -105,7 +106,10 @@ struct PatternParams {
 		bool fuzzy_,
 		int sampleLen_,
 		int sampleFreq_,
-		uint32_t skip_) :
+		uint32_t skip_,
+		int readsPerBatch_,
+		int trim5_,
+		int trim3_) :
 		format(format_),
 		fileParallel(fileParallel_),
 		seed(seed_),
@@ -116,7 +120,10 @@ struct PatternParams {
 		fuzzy(fuzzy_),
 		sampleLen(sampleLen_),
 		sampleFreq(sampleFreq_),
-		skip(skip_) { }
+		skip(skip_),
+		readsPerBatch(readsPerBatch_),
+		trim5(trim5_),
+		trim3(trim3_) { }
 
 	int format;           // file format
 	bool fileParallel;    // true -> wrap files with separate PairedPatternSources
@@ -129,6 +136,71 @@ struct PatternParams {
 	int sampleLen;        // length of sampled reads for FastaContinuous...
 	int sampleFreq;       // frequency of sampled reads for FastaContinuous...
 	uint32_t skip;        // skip the first 'skip' patterns
+	int readsPerBatch;    // # records a thread claims per critical section
+	int trim5;            // # bases to trim from the 5' end of each read
+	int trim3;            // # bases to trim from the 3' end of each read
+};
+
+class PatternSource;
+
+/**
+ * A run of consecutive, not-yet-parsed records claimed by one thread in
+ * a single critical section.  Record i occupies buf[offs[i]] up to (but
+ * not including) buf[offs[i+1]] and has read id rdid + i.  Parsing the
+ * records is left to the claiming thread so that it can happen outside
+ * of the lock; see PatternSource::parse().
+ */
+struct RawReadBatch {
+
+	RawReadBatch() : src(NULL), rdid(0), cur(0) {
+		offs.push_back(0);
+	}
+
+	/**
+	 * Empty the batch, keeping the memory allocated for it.
+	 */
+	void reset() {
+		src = NULL;
+		rdid = 0;
+		cur = 0;
+		buf.clear();
+		offs.clear();
+		offs.push_back(0);
+	}
+
+	/// Number of complete records in the batch
+	size_t size() const { return offs.size() - 1; }
+
+	/// True iff every record has been dispensed
+	bool exhausted() const { return cur >= size(); }
+
+	/// Append a character to the record currently being read
+	void append(char c) { buf.push_back(c); }
+
+	/// Append 'len' characters to the record currently being read
+	void append(const char *s, size_t len) {
+		size_t off = buf.size();
+		buf.resize(off + len);
+		memcpy(buf.ptr() + off, s, len);
+	}
+
+	/// Mark the end of the record currently being read
+	void endRecord() { offs.push_back(buf.size()); }
+
+	/// Discard the partial record currently being read
+	void dropRecord() { buf.resize(offs.back()); }
+
+	/// Pointer to the first character of record i
+	const char *record(size_t i) const { return buf.ptr() + offs[i]; }
+
+	/// Length of record i
+	size_t recordLen(size_t i) const { return offs[i+1] - offs[i]; }
+
+	PatternSource *src; // source the records came from; parses them
+	TReadId rdid;       // read id of the first record
+	size_t cur;         // next record to dispense
+	EList<char> buf;    // raw text of the records, back to back
+	EList<size_t> offs; // offsets into buf where each record begins
 };
 
 /**
@@ -148,6 +220,8 @@ public:
 		numWrappers_(0),
 		doLocking_(true),
 		useSpinlock_(p.useSpinlock),
+		trim5_(p.trim5),
+		trim3_(p.trim3),
 		mutex()
 	{
 	}
@@ -223,6 +297,42 @@ public:
 	/// Reset state to start over again with the first read
 	virtual void reset() { readCnt_ = 0; }
 
+	/**
+	 * Return true iff this source can hand out raw records in batches
+	 * via nextBatch(), to be turned into Reads later with parse().
+	 */
+	virtual bool batchable() const { return false; }
+
+	/**
+	 * Claim up to 'max' consecutive records in a single critical
+	 * section, storing their raw text in 'b' and assigning them
+	 * consecutive read ids.  Sets 'done' once the input is exhausted.
+	 * Returns the number of records claimed.  Only relevant for
+	 * sources where batchable() is true.
+	 */
+	virtual size_t nextBatch(RawReadBatch& b, size_t max, bool& done) {
+		b.reset();
+		done = true;
+		return 0;
+	}
+
+	/**
+	 * Parse the 'len' characters of raw record 'rec', previously claimed
+	 * with nextBatch(), into 'r'.  'rdid' is the read's id.  'fb' is a
+	 * scratch FileBuf the parser may point at the record with newBuf().
+	 * Must not touch any state shared between threads.  Returns true
+	 * iff a read was parsed.
+	 */
+	virtual bool parse(
+		Read& r,
+		const char *rec,
+		size_t len,
+		TReadId rdid,
+		FileBuf& fb) const
+	{
+		return false;
+	}
+
 	/**
 	 * Concrete subclasses call lock() to enter a critical region.
 	 * What constitutes a critical region depends on the subclass.
@@ -256,6 +366,11 @@ public:
 	 */
 	TReadId readCnt() const { return readCnt_ - 1; }
 
+	/**
+	 * Return the global seed that per-read random seeds are derived from.
+	 */
+	uint32_t seed() const { return seed_; }
+
 protected:
 
 	uint32_t seed_;
@@ -269,6 +384,8 @@ protected:
 	/// spinlocks is enabled and compiled in.  This is sometimes better
 	/// if we expect bad I/O latency on some reads.
 	bool useSpinlock_;
+	int trim5_;            /// # bases to trim from the 5' end of each read
+	int trim3_;            /// # bases to trim from the 3' end of each read
 	MUTEX_T mutex;
 };
 
@@ -278,11 +395,31 @@ protected:
  */
 class PairedPatternSource {
 public:
-	PairedPatternSource(const PatternParams& p) : mutex_m(), seed_(p.seed) {}
+	PairedPatternSource(const PatternParams& p) :
+		mutex_m(), seed_(p.seed), readsPerBatch_(max<int>(p.readsPerBatch, 1)) {}
 	virtual ~PairedPatternSource() { }
 
 	virtual void addWrapper() = 0;
 	virtual void reset() = 0;
+
+	/**
+	 * Return true iff reads can be claimed in batches with nextBatch()
+	 * instead of one at a time with nextReadPair().
+	 */
+	virtual bool batchable() const { return false; }
+
+	/**
+	 * Claim the next batch of raw records (and, if paired, the parallel
+	 * batch of mates) under one lock acquisition.  Returns false iff
+	 * all input is exhausted.
+	 */
+	virtual bool nextBatch(
+		RawReadBatch& a,
+		RawReadBatch& b,
+		bool& paired)
+	{
+		return false;
+	}
 	
 	virtual bool nextReadPair(
 		Read& ra,
@@ -335,6 +472,7 @@ protected:
 
 	MUTEX_T mutex_m; /// mutex for syncing over critical regions
 	uint32_t seed_;
+	size_t readsPerBatch_; /// # records to claim per call to nextBatch()
 };
 
 /**
@@ -488,6 +626,23 @@ public:
 		bool& done,
 		bool& paired,
 		bool fixName);
+
+	/**
+	 * Batching is possible when all of the underlying PatternSources
+	 * support it.
+	 */
+	virtual bool batchable() const {
+		for(size_t i = 0; i < srca_->size(); i++) {
+			if(!(*srca_)[i]->batchable()) return false;
+			if((*srcb_)[i] != NULL && !(*srcb_)[i]->batchable()) return false;
+		}
+		return true;
+	}
+
+	virtual bool nextBatch(
+		RawReadBatch& a,
+		RawReadBatch& b,
+		bool& paired);
 	
 	/**
 	 * Return the number of reads attempted.
@@ -590,7 +745,9 @@ public:
 class WrappedPatternSourcePerThread : public PatternSourcePerThread {
 public:
 	WrappedPatternSourcePerThread(PairedPatternSource& __patsrc) :
-		patsrc_(__patsrc)
+		patsrc_(__patsrc),
+		batch_(__patsrc.batchable()),
+		batchPaired_(false)
 	{
 		patsrc_.addWrapper();
 	}
@@ -607,8 +764,24 @@ public:
 
 private:
 
+	/**
+	 * Parse the next record of the current batch(es) into buf1_ and
+	 * buf2_, claiming a new batch first if the current one is used up.
+	 */
+	bool nextFromBatch(
+		bool& success,
+		bool& done,
+		bool& paired,
+		bool fixName);
+
 	/// Container for obtaining paired reads from PatternSources
 	PairedPatternSource& patsrc_;
+
+	bool         batch_;       // claim reads in batches?
+	bool         batchPaired_; // are the records in the current batch paired?
+	RawReadBatch batcha_;      // raw records for mate 1 / unpaired reads
+	RawReadBatch batchb_;      // raw records for mate 2
+	FileBuf      recbuf_;      // dispenses one raw record at a time to parse()
 };
 
 /**
@@ -644,6 +817,71 @@ private:
 	PairedPatternSource& patsrc_;
 };
 
+/**
+ * A per-thread source that reads up to 'n' reads or pairs ahead of the
+ * one it dispenses, so that the aligner can start the searches for all
+ * of them together.  Reads are dispensed in the order the wrapped
+ * source gives them.
+ */
+class LookaheadPatternSourcePerThread : public PatternSourcePerThread {
+public:
+	LookaheadPatternSourcePerThread(PatternSourcePerThread* src, size_t n) :
+		src_(src),
+		n_(n),
+		cur_(0),
+		done_(false),
+		refilled_(false)
+	{
+		assert(src_ != NULL);
+		assert_gt(n_, 0);
+		ahead_.reserveExact(n_);
+	}
+
+	virtual ~LookaheadPatternSourcePerThread() { delete src_; }
+
+	/**
+	 * Dispense the next read pair, reading the next 'n' ahead first if
+	 * the last ones are used up.
+	 */
+	virtual bool nextReadPair(
+		bool& success,
+		bool& done,
+		bool& paired,
+		bool fixName);
+
+	/// True iff the last call to nextReadPair() read a new set ahead
+	bool refilled() const { return refilled_; }
+
+	/// Number of reads or pairs in the current set
+	size_t numAhead() const { return ahead_.size(); }
+
+	/// Index, within the current set, of the read last dispensed
+	size_t slot() const { assert_gt(cur_, 0); return cur_ - 1; }
+
+	/// Mate 1 (or the unpaired read) and mate 2 of read 'i' of the set
+	const Read& aheada(size_t i) const { return ahead_[i].a; }
+	const Read& aheadb(size_t i) const { return ahead_[i].b; }
+	bool aheadPaired(size_t i) const   { return ahead_[i].paired; }
+	TReadId aheadRdid(size_t i) const  { return ahead_[i].rdid; }
+
+private:
+
+	struct Ahead {
+		Read    a;
+		Read    b;
+		TReadId rdid;
+		TReadId endid;
+		bool    paired;
+	};
+
+	PatternSourcePerThread* src_;      // source being read ahead of
+	size_t                  n_;        // # reads or pairs to read ahead
+	EList<Ahead>            ahead_;    // current set
+	size_t                  cur_;      // next to dispense from ahead_
+	bool                    done_;     // src_ has no more reads
+	bool                    refilled_; // last call read a new set
+};
+
 /// Skip to the end of the current string of newline chars and return
 /// the first character after the newline chars, or -1 for EOF
 static inline int getOverNewline(FileBuf& in) {
@@ -770,7 +1008,7 @@ public:
 		errs_.resize(infiles_.size());
 		errs_.fill(0, infiles_.size(), false);
 		assert(!fb_.isOpen());
-		open(); // open first file in the list
+		open(true); // open first file in the list
 		filecur_++;
 	}
 
@@ -843,6 +1081,39 @@ public:
 		return success;
 	}
 	
+	/**
+	 * Claim up to 'max' raw records with a single lock acquisition,
+	 * moving on to the next input file as needed.  The records get
+	 * consecutive read ids, just as if they had been read one by one.
+	 */
+	virtual size_t nextBatch(RawReadBatch& b, size_t max, bool& done) {
+		b.reset();
+		b.src = this;
+		done = false;
+		// We'll be manipulating our file handle/filecur_ state
+		lock();
+		b.rdid = readCnt_;
+		while(b.size() < max) {
+			if(readLight(b)) {
+				b.endRecord();
+				continue;
+			}
+			b.dropRecord();
+			if(filecur_ < infiles_.size()) {
+				open();
+				resetForNextFile(); // reset state to handle a fresh file
+				filecur_++;
+				continue;
+			}
+			done = true;
+			break;
+		}
+		readCnt_ += b.size();
+		// Leaving critical region
+		unlock();
+		return b.size();
+	}
+
 	/**
 	 * Reset state so that we read start reading again from the
 	 * beginning of the first file.  Should only be called by the
@@ -851,12 +1122,19 @@ public:
 	virtual void reset() {
 		PatternSource::reset();
 		filecur_ = 0,
-		open();
+		open(true);
 		filecur_++;
 	}
 
 protected:
 
+	/// Copy the raw text of the next record into 'b' without parsing
+	/// it; returns false at the end of the current file.  Overridden by
+	/// formats for which batchable() is true.
+	virtual bool readLight(RawReadBatch& b) {
+		return false;
+	}
+
 	/// Read another pattern from the input file; this is overridden
 	/// to deal with specific file formats
 	virtual bool read(
@@ -880,7 +1158,12 @@ protected:
 	/// Reset state to handle a fresh file
 	virtual void resetForNextFile() { }
 	
-	void open() {
+	/**
+	 * Open the next readable file in the list.  If there is none, exit;
+	 * or, when 'master' says we're on the master thread, which can
+	 * unwind, throw 1 so that a --daemon survives a job's bad inputs.
+	 */
+	void open(bool master = false) {
 		if(fb_.isOpen()) fb_.close();
 		while(filecur_ < infiles_.size()) {
 			// Open read
@@ -895,10 +1178,20 @@ protected:
 				filecur_++;
 				continue;
 			}
-			fb_.newFile(in);
+			// Compressed files are recognized by their magic number
+			// and decoded on a separate thread
+			char magic[COMPRESS_MAGIC_LEN];
+			size_t nmagic = readMagic(in, magic);
+			int fmt = sniffCompression(magic, nmagic);
+			if(fmt != COMPRESS_NONE) {
+				fb_.newFile(new Decompressor(in, fmt, magic, nmagic, infiles_[filecur_]));
+			} else {
+				fb_.newFile(in, magic, nmagic);
+			}
 			return;
 		}
 		cerr << "Error: No input read files were valid" << endl;
+		if(master) throw 1;
 		exit(1);
 		return;
 	}
@@ -1375,6 +1668,15 @@ public:
 		fb_.resetLastN();
 		BufferedFilePatternSource::reset();
 	}
+
+	virtual bool batchable() const { return true; }
+
+	virtual bool parse(
+		Read& r,
+		const char *rec,
+		size_t len,
+		TReadId rdid,
+		FileBuf& fb) const;
 	
 protected:
 
@@ -1429,6 +1731,15 @@ protected:
 		TReadId& endid,
 		bool& success,
 		bool& done);
+
+	/// Copy the raw text of the next FASTQ record into 'b'
+	virtual bool readLight(RawReadBatch& b);
+
+	/// Parse everything after the leading '@' of a FASTQ record
+	bool parseRecord(Read& r, FileBuf& fb, TReadId rdid, bool& done) const;
+
+	/// Parse a plain four-line FASTQ record with bulk scans
+	bool parseSimple(Read& r, const char *rec, size_t len, TReadId rdid) const;
 	
 	/// Read another read pair from a FASTQ input file
 	virtual bool readPair(
@@ -1457,9 +1768,9 @@ private:
 	 * read, usually because we reached the end of the input without
 	 * finishing.
 	 */
-	void bail(Read& r) {
+	static void bail(Read& r, FileBuf& fb) {
 		r.patFw.clear();
-		fb_.resetLastN();
+		fb.resetLastN();
 	}
 
 	bool first_;
@@ -1467,7 +1778,6 @@ private:
 	bool phred64Quals_;
 	bool intQuals_;
 	bool fuzzy_;
-	EList<string> qualToks_;
 };
 
 /**
@@ -1507,7 +1817,7 @@ protected:
 		}
 		assert(!isspace(c));
 		r.color = gColor;
-		int mytrim5 = gTrim5;
+		int mytrim5 = trim5_;
 		if(first_) {
 			// Check that the first character is sane for a raw file
 			int cc = c;
@@ -1566,10 +1876,10 @@ protected:
 			c = fb_.get();
 		}
 		// 3' trimming
-		r.patFw.trimEnd(gTrim3);
-		r.qual.trimEnd(gTrim3);
+		r.patFw.trimEnd(trim3_);
+		r.qual.trimEnd(trim3_);
 		c = peekToEndOfLine(fb_);
-		r.trimmed3 = gTrim3;
+		r.trimmed3 = trim3_;
 		r.trimmed5 = mytrim5;
 		r.readOrigBuf.install(fb_.lastN(), fb_.lastNLen());
 		fb_.resetLastN();
@@ -3,7 +3,11 @@
 
 // Utility class ProcessorSupport provides POPCNTenabled() to determine
 // processor support for POPCNT instruction. It uses CPUID to
-// retrieve the processor capabilities.
+// retrieve the processor capabilities.  Where the compiler can build
+// code for an instruction set it was not told to target (GCC and clang
+// on x86-64, see OCC_SIMD_DISPATCH), it also provides AVX2enabled()
+// and AVX512POPCNTenabled() so that the occurrence-counting kernels can
+// be picked at run time rather than at compile time.
 // for Intel ICC compiler __cpuid() is an intrinsic 
 // for Microsoft compiler __cpuid() is provided by #include <intrin.h>
 // for GCC compiler __get_cpuid() is provided by #include <cpuid.h>
@@ -17,7 +21,11 @@
 #   include <cpuid.h>
 #elif defined(_MSC_VER)
 // __MSC_VER defined by Microsoft compiler
-#define USING MSC_COMPILER
+#define USING_MSC_COMPILER
+#endif
+
+#if defined(USING_GCC_COMPILER) && defined(__x86_64__)
+#   define OCC_SIMD_DISPATCH
 #endif
 
 struct regs_t {unsigned int EAX, EBX, ECX, EDX;};
@@ -25,10 +33,65 @@ struct regs_t {unsigned int EAX, EBX, ECX, EDX;};
 
 class ProcessorSupport {
 
+#ifdef OCC_SIMD_DISPATCH
+
+public:
+    ProcessorSupport() { }
+
+    /**
+     * Return true iff the processor supports AVX2 and the operating
+     * system saves the YMM registers across context switches.
+     */
+    bool AVX2enabled() {
+        regs_t regs;
+        if(!osxsave(regs)) return false;
+        if((xgetbv() & 0x6) != 0x6) return false;
+        if(!leaf7(regs)) return false;
+        return (regs.EBX & BIT(5)) != 0;
+    }
+
+    /**
+     * Return true iff the processor supports AVX-512F together with the
+     * AVX512_VPOPCNTDQ extension (VPOPCNTQ) and the operating system
+     * saves the opmask and ZMM registers.
+     */
+    bool AVX512POPCNTenabled() {
+        regs_t regs;
+        if(!osxsave(regs)) return false;
+        if((xgetbv() & 0xe6) != 0xe6) return false;
+        if(!leaf7(regs)) return false;
+        return (regs.EBX & BIT(16)) != 0 && (regs.ECX & BIT(14)) != 0;
+    }
+
+private:
+    // CPUID.01H:ECX.OSXSAVE[bit 27] and CPUID.01H:ECX.AVX[bit 28]
+    bool osxsave(regs_t& regs) {
+        if(!__get_cpuid(0x1, &regs.EAX, &regs.EBX, &regs.ECX, &regs.EDX)) return false;
+        return (regs.ECX & BIT(27)) && (regs.ECX & BIT(28));
+    }
+
+    // Structured extended feature flags, CPUID.(EAX=07H, ECX=0)
+    bool leaf7(regs_t& regs) {
+        if(__get_cpuid_max(0, 0) < 7) return false;
+        __cpuid_count(7, 0, regs.EAX, regs.EBX, regs.ECX, regs.EDX);
+        return true;
+    }
+
+    // XCR0, read with XGETBV; encoded by hand so that no -mxsave is needed
+    unsigned int xgetbv() {
+        unsigned int eax, edx;
+        __asm__ __volatile__ (".byte 0x0f, 0x01, 0xd0" : "=a" (eax), "=d" (edx) : "c" (0));
+        return eax;
+    }
+
+#endif // OCC_SIMD_DISPATCH
+
 #ifdef POPCNT_CAPABILITY 
 
 public: 
+#ifndef OCC_SIMD_DISPATCH
     ProcessorSupport() { } 
+#endif
     bool POPCNTenabled()
     {
     // from: Intel® 64 and IA-32 Architectures Software Developer’s Manual, 325462-036US,March 2013
@@ -49,7 +112,7 @@ public:
 #elif defined(USING_GCC_COMPILER)
         __get_cpuid(0x1, &regs.EAX, &regs.EBX, &regs.ECX, &regs.EDX);
 #else
-        std::cerr << “ERROR: please define __cpuid() for this build.\n”; 
+        std::cerr << "ERROR: please define __cpuid() for this build.\n"; 
         assert(0);
 #endif
         if( !( (regs.ECX & BIT(20)) && (regs.ECX & BIT(23)) ) ) return false;
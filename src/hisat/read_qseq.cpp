@@ -125,7 +125,7 @@ int QseqPatternSource::parseSeq(
 			return -1;
 		}
 	}
-	r.patFw.trimEnd(gTrim3);
+	r.patFw.trimEnd(trim3_);
 	return (int)r.patFw.length();
 }
 
@@ -260,7 +260,7 @@ bool QseqPatternSource::read(
 	} else {
 		assert_neq('\t', fb_.peek());
 		int charsRead = 0;
-		int mytrim5 = gTrim5;
+		int mytrim5 = trim5_;
 		// 9. Sequence
 		int dstLen = parseSeq(r, charsRead, mytrim5, '\t');
 		assert_neq('\t', fb_.peek());
@@ -268,7 +268,7 @@ bool QseqPatternSource::read(
 		char ct = 0;
 		// 10. Qualities
 		if(parseQuals(r, charsRead, dstLen, mytrim5, ct, '\t', -1) < 0) BAIL_UNPAIRED();
-		r.trimmed3 = gTrim3;
+		r.trimmed3 = trim3_;
 		r.trimmed5 = mytrim5;
 		if(ct != '\t') {
 			cerr << "Error: QSEQ with name " << r.name << " did not have tab after qualities" << endl;
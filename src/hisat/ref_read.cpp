@@ -18,6 +18,7 @@
  */
 
 #include "ref_read.h"
+#include "tinythread.h"
 
 /**
  * Reads past the next ambiguous or unambiguous stretch of sequence
@@ -325,3 +326,569 @@ fastaRefReadSizes(
 		unambigTot, // total number of unambiguous DNA characters read
 		bothTot); // total number of DNA characters read, incl. ambiguous ones
 }
+
+/**
+ * What parseFastaChunk() found in a chunk of FASTA input, in order.
+ */
+struct FastaEvent {
+	enum {
+		NAME = 0, // piece of a name line; 'off' and 'len' locate it
+		BASES,    // 'len' unambiguous characters
+		GAPS,     // 'len' ambiguous characters
+		OTHER     // a character that is neither, other than a newline
+	};
+	int    type;
+	bool   start; // NAME: piece begins with the '>'
+	bool   end;   // NAME: piece ends the line
+	size_t off;
+	size_t len;
+};
+
+/**
+ * A chunk of FASTA input, and the events and packed characters
+ * parseFastaChunk() made of it.
+ */
+struct FastaChunk {
+	FastaChunk() :
+		buf(NULL), len(0), inName(false), last(false), parsed(false), nbases(0)
+	{ }
+	~FastaChunk() { delete[] buf; }
+
+	char*             buf;
+	size_t            len;
+	bool              inName; // starts in the middle of a name line
+	bool              last;   // ends its file
+	bool              parsed;
+	EList<FastaEvent> evs;
+	EList<uint8_t>    bits;   // unambiguous characters, 4 per byte
+	size_t            nbases;
+};
+
+// Classes of input characters for parseFastaChunk(); 0-3 are the
+// unambiguous characters themselves
+enum {
+	FASTA_GAP = 4,
+	FASTA_NAME,
+	FASTA_NEWLINE,
+	FASTA_OTHER
+};
+
+static void pushFastaEvent(FastaChunk& ch, int type, size_t len) {
+	ch.evs.expand();
+	FastaEvent& ev = ch.evs.back();
+	ev.type = type;
+	ev.start = ev.end = false;
+	ev.off = 0;
+	ev.len = len;
+}
+
+/**
+ * Break a chunk of FASTA input into events and pack its unambiguous
+ * characters.  'cls' maps each input character to its class.  Runs of
+ * characters become one event, newlines and other characters within
+ * the sequence are skipped, and with rparms.nsToAs an ambiguous
+ * character is packed as an A once the sequence has had an unambiguous
+ * one (which the chunk can only tell after its first name line or
+ * unambiguous character).
+ */
+static void parseFastaChunk(
+	FastaChunk& ch,
+	const uint8_t* cls,
+	const RefReadInParams& rparms)
+{
+	ch.evs.clear();
+	ch.bits.resize((ch.len >> 2) + 1);
+	uint8_t *out = ch.bits.ptr();
+	uint32_t acc = 0;
+	int sh = 0;
+	size_t nb = 0, ng = 0;  // lengths of the current runs
+	bool fresh = true;      // nothing but newlines since a name line
+	bool seenBase = false;  // unambiguous character since a name line
+	ch.nbases = 0;
+	const char *buf = ch.buf;
+	size_t i = 0;
+	bool inName = ch.inName;
+	bool nameStart = false; // name piece starts with its '>'
+	while(i < ch.len) {
+		if(inName) {
+			size_t st = i;
+			while(i < ch.len && !isnewline(buf[i])) i++;
+			ch.evs.expand();
+			FastaEvent& ev = ch.evs.back();
+			ev.type = FastaEvent::NAME;
+			ev.start = nameStart;
+			ev.end = (i < ch.len);
+			ev.off = st;
+			ev.len = i - st;
+			inName = nameStart = false;
+			fresh = true;
+			seenBase = false;
+			continue;
+		}
+		int c = cls[(uint8_t)buf[i]];
+		if(c == FASTA_GAP && rparms.nsToAs && seenBase) {
+			c = 0;
+		}
+		if(c < 4) {
+			if(ng > 0) {
+				pushFastaEvent(ch, FastaEvent::GAPS, ng);
+				ng = 0;
+			}
+			acc |= (uint32_t)c << sh;
+			sh += 2;
+			if(sh == 8) {
+				*out++ = (uint8_t)acc;
+				acc = 0;
+				sh = 0;
+			}
+			nb++;
+			fresh = false;
+			seenBase = true;
+		} else if(c == FASTA_GAP) {
+			if(nb > 0) {
+				pushFastaEvent(ch, FastaEvent::BASES, nb);
+				ch.nbases += nb;
+				nb = 0;
+			}
+			ng++;
+			fresh = false;
+		} else if(c == FASTA_NAME) {
+			if(nb > 0) {
+				pushFastaEvent(ch, FastaEvent::BASES, nb);
+				ch.nbases += nb;
+				nb = 0;
+			}
+			if(ng > 0) {
+				pushFastaEvent(ch, FastaEvent::GAPS, ng);
+				ng = 0;
+			}
+			inName = nameStart = true;
+		} else if(c == FASTA_OTHER && fresh) {
+			pushFastaEvent(ch, FastaEvent::OTHER, 1);
+			fresh = false;
+		}
+		i++;
+	}
+	if(nb > 0) {
+		pushFastaEvent(ch, FastaEvent::BASES, nb);
+		ch.nbases += nb;
+	}
+	if(ng > 0) {
+		pushFastaEvent(ch, FastaEvent::GAPS, ng);
+	}
+	if(sh > 0) *out = (uint8_t)acc;
+}
+
+/**
+ * Reads FASTA input for fastaRefReadPacked().  The calling thread
+ * reads chunks into a ring of twice as many buffers as there are
+ * threads, the threads parse whichever chunk is next, and the calling
+ * thread folds the parsed chunks into the PackedRef in input order,
+ * tracking where each RefRecord starts and ends the way
+ * fastaRefReadSize() does.
+ */
+class FastaPacker {
+
+public:
+
+	FastaPacker(
+		EList<FileBuf*>& in,
+		const RefReadInParams& rparms,
+		PackedRef& ref) :
+		_in(in),
+		_rparms(rparms),
+		_ref(ref),
+		_file(0),
+		_started(false),
+		_inName(false),
+		_state(ST_NONE),
+		_off(0),
+		_len(0),
+		_first(true)
+	{
+		for(int c = 0; c < 256; c++) {
+			int cat = asc2dnacat[c];
+			if(cat == 1) {
+				int b = asc2dna[c];
+				if(rparms.bisulfite && b == 1) b = 3; // C -> T
+				_cls[c] = (uint8_t)b;
+			} else if(cat >= 2) {
+				_cls[c] = FASTA_GAP;
+			} else if(c == '>') {
+				_cls[c] = FASTA_NAME;
+			} else if(isnewline(c)) {
+				_cls[c] = FASTA_NEWLINE;
+			} else {
+				_cls[c] = FASTA_OTHER;
+			}
+		}
+	}
+
+	/**
+	 * Read all the input on 'nthreads' threads.
+	 */
+	void run(int nthreads);
+
+	static const size_t CHUNK_SZ = 1024 * 1024;
+
+private:
+
+	// Where the record being read is, as fastaRefReadSize() sees it
+	enum {
+		ST_NONE = 0, // no name line yet in this file
+		ST_NAME,     // in a name line, or only newlines since one
+		ST_LEAD,     // after a name line, before any unambiguous char
+		ST_BASES,    // in a stretch of unambiguous characters
+		ST_GAPS      // in the gap after a stretch
+	};
+
+	bool readChunk(FastaChunk& ch);
+	void fold(const FastaChunk& ch);
+	void endRecord(bool eof);
+	void appendBits(const uint8_t *bits, size_t n);
+	void parseChunks();
+
+	static void parseChunksWorker(void *vp) {
+		((FastaPacker*)vp)->parseChunks();
+	}
+
+	EList<FileBuf*>&       _in;
+	const RefReadInParams& _rparms;
+	PackedRef&             _ref;
+	uint8_t                _cls[256];
+
+	// Reading
+	size_t                 _file;    // file being read
+	bool                   _started; // read its leading '>'
+	bool                   _inName;  // last chunk ended in a name line
+
+	// Folding
+	int                    _state;
+	TIndexOffU             _off;
+	TIndexOffU             _len;
+	bool                   _first;
+
+	// Used by run() with more than one thread; guarded by _mutex
+	FastaChunk*            _chunks;
+	size_t                 _nbufs;
+	size_t                 _read;    // # chunks read
+	size_t                 _claim;   // next chunk for a thread to parse
+	bool                   _eof;     // no more chunks will be read
+	int                    _err;     // 1 = bad_alloc
+	tthread::mutex         _mutex;
+	tthread::condition_variable _cond;
+};
+
+/**
+ * Read the next chunk of input into 'ch'.  A chunk never spans two
+ * files.  Returns false once all the input is read.
+ */
+bool FastaPacker::readChunk(FastaChunk& ch) {
+	if(ch.buf == NULL) ch.buf = new char[CHUNK_SZ];
+	while(_file < _in.size()) {
+		FileBuf& fb = *_in[_file];
+		size_t n = 0;
+		if(!_started) {
+			int c = fb.getPastWhitespace();
+			if(c == -1) {
+				cerr << "Warning: Empty input file" << endl;
+				_file++;
+				continue;
+			}
+			if(c != '>') {
+				cerr << "Reference file does not seem to be a FASTA file" << endl;
+				throw 1;
+			}
+			ch.buf[n++] = '>';
+			_started = true;
+			_inName = false;
+		}
+		n += fb.read(ch.buf + n, CHUNK_SZ - n);
+		ch.len = n;
+		ch.inName = _inName;
+		ch.last = (n < CHUNK_SZ);
+		ch.parsed = false;
+		// The next chunk starts in a name line iff there's a '>'
+		// after this chunk's last newline
+		size_t nl = n;
+		while(nl > 0 && !isnewline(ch.buf[nl-1])) nl--;
+		if(nl > 0) _inName = false;
+		if(memchr(ch.buf + nl, '>', n - nl) != NULL) _inName = true;
+		if(ch.last) {
+			_file++;
+			_started = false;
+		}
+		return true;
+	}
+	return false;
+}
+
+/**
+ * Append 'n' packed characters to the PackedRef, shifting them into
+ * place if the last byte is partly filled.
+ */
+void FastaPacker::appendBits(const uint8_t *bits, size_t n) {
+	if(n == 0) return;
+	if((TIndexOffU)(_ref.len + n) < _ref.len) {
+		cerr << RefTooLongException().what() << endl;
+		throw 1;
+	}
+	EList<uint8_t>& dst = _ref.bits;
+	size_t nbytes = (n + 3) >> 2;
+	size_t sh = (_ref.len & 3) << 1;
+	size_t cur = dst.size();
+	if(sh == 0) {
+		dst.resize(cur + nbytes);
+		memcpy(dst.ptr() + cur, bits, nbytes);
+	} else {
+		dst.resize(cur + nbytes);
+		uint8_t *d = dst.ptr() + cur - 1;
+		for(size_t i = 0; i < nbytes; i++) {
+			d[0] |= (uint8_t)(bits[i] << sh);
+			d[1] = (uint8_t)(bits[i] >> (8 - sh));
+			d++;
+		}
+	}
+	_ref.len += (TIndexOffU)n;
+	dst.resize(((size_t)_ref.len + 3) >> 2);
+}
+
+/**
+ * Finish the record being read, if there is one, because a name line
+ * or (if 'eof') the end of the file follows, with fastaRefReadSize()'s
+ * warnings.
+ */
+void FastaPacker::endRecord(bool eof) {
+	switch(_state) {
+		case ST_NONE:
+			break;
+		case ST_NAME:
+			if(!eof) {
+				// Two name lines in a row; the second one names the
+				// sequence
+				cerr << "Warning: Encountered empty reference sequence" << endl;
+				_ref.names.pop_back();
+				return;
+			}
+			cerr << "Warning: Encountered empty reference sequence" << endl;
+			_ref.recs.push_back(RefRecord(0, 0, true));
+			break;
+		case ST_LEAD:
+			if(_off > 0) {
+				cerr << "Warning: Encountered reference sequence with only gaps" << endl;
+			} else {
+				cerr << "Warning: Encountered empty reference sequence" << endl;
+			}
+			_ref.recs.push_back(RefRecord(_off, 0, true));
+			break;
+		case ST_BASES:
+			_ref.recs.push_back(RefRecord(_off, _len, _first));
+			break;
+		case ST_GAPS:
+			_ref.recs.push_back(RefRecord(_off, 0, false));
+			break;
+	}
+}
+
+/**
+ * Fold a parsed chunk into the PackedRef.
+ */
+void FastaPacker::fold(const FastaChunk& ch) {
+	size_t bitsOff = 0; // characters of ch.bits already appended
+	for(size_t i = 0; i < ch.evs.size(); i++) {
+		const FastaEvent& ev = ch.evs[i];
+		switch(ev.type) {
+			case FastaEvent::NAME:
+				if(ev.start) {
+					endRecord(false);
+					_ref.names.push_back(string(ch.buf + ev.off, ev.len));
+					_state = ST_NAME;
+					_off = _len = 0;
+					_first = true;
+				} else {
+					assert_eq(ST_NAME, _state);
+					_ref.names.back().append(ch.buf + ev.off, ev.len);
+				}
+				break;
+			case FastaEvent::OTHER:
+				if(_state == ST_NAME) _state = ST_LEAD;
+				break;
+			case FastaEvent::GAPS:
+				assert_neq(ST_NONE, _state);
+				if(_state == ST_NAME || _state == ST_LEAD) {
+					_state = ST_LEAD;
+					_off += (TIndexOffU)ev.len;
+				} else if(_state == ST_BASES && _rparms.nsToAs) {
+					// Leading gaps of a chunk, within a sequence: As
+					assert_eq(0, bitsOff);
+					size_t cur = _ref.bits.size();
+					_ref.bits.resize(((size_t)_ref.len + ev.len + 3) >> 2);
+					for(size_t j = cur; j < _ref.bits.size(); j++) {
+						_ref.bits[j] = 0;
+					}
+					_ref.len += (TIndexOffU)ev.len;
+					_len += (TIndexOffU)ev.len;
+				} else if(_state == ST_BASES) {
+					_ref.recs.push_back(RefRecord(_off, _len, _first));
+					_state = ST_GAPS;
+					_off = (TIndexOffU)ev.len;
+					_len = 0;
+					_first = false;
+				} else {
+					_off += (TIndexOffU)ev.len;
+				}
+				break;
+			case FastaEvent::BASES:
+				assert_neq(ST_NONE, _state);
+				if(_state != ST_BASES) {
+					_state = ST_BASES;
+					_len = 0;
+				}
+				if((TIndexOffU)(_len + ev.len) < _len) {
+					cerr << RefTooLongException().what() << endl;
+					throw 1;
+				}
+				_len += (TIndexOffU)ev.len;
+				bitsOff += ev.len;
+				break;
+		}
+	}
+	assert_eq(bitsOff, ch.nbases);
+	appendBits(ch.bits.ptr(), ch.nbases);
+	if(ch.last) {
+		endRecord(true);
+		_state = ST_NONE;
+	}
+}
+
+/**
+ * Parse chunks as they're read, until there are no more.
+ */
+void FastaPacker::parseChunks() {
+	while(true) {
+		_mutex.lock();
+		while(_claim == _read && !_eof && _err == 0) {
+			_cond.wait(_mutex);
+		}
+		if(_claim == _read || _err != 0) {
+			_mutex.unlock();
+			return;
+		}
+		FastaChunk& ch = _chunks[_claim++ % _nbufs];
+		_mutex.unlock();
+		try {
+			parseFastaChunk(ch, _cls, _rparms);
+		} catch(bad_alloc& e) {
+			_mutex.lock();
+			_err = 1;
+			_cond.notify_all();
+			_mutex.unlock();
+			return;
+		}
+		_mutex.lock();
+		ch.parsed = true;
+		_cond.notify_all();
+		_mutex.unlock();
+	}
+}
+
+void FastaPacker::run(int nthreads) {
+	if(nthreads <= 1) {
+		FastaChunk ch;
+		while(readChunk(ch)) {
+			parseFastaChunk(ch, _cls, _rparms);
+			fold(ch);
+		}
+		return;
+	}
+	_nbufs = (size_t)nthreads << 1;
+	_chunks = new FastaChunk[_nbufs];
+	_read = _claim = 0;
+	_eof = false;
+	_err = 0;
+	EList<tthread::thread*> threads;
+	for(int i = 0; i < nthreads; i++) {
+		threads.push_back(new tthread::thread(parseChunksWorker, (void*)this));
+	}
+	int err = 0;
+	try {
+		for(size_t j = 0; err == 0; j++) {
+			// Read ahead until every buffer but the one being folded
+			// next is taken; no thread touches a buffer before _read
+			// passes it
+			while(!_eof && _read < j + _nbufs) {
+				bool more = readChunk(_chunks[_read % _nbufs]);
+				_mutex.lock();
+				if(more) {
+					_read++;
+				} else {
+					_eof = true;
+				}
+				_cond.notify_all();
+				_mutex.unlock();
+			}
+			if(j == _read) break;
+			FastaChunk& ch = _chunks[j % _nbufs];
+			_mutex.lock();
+			while(!ch.parsed && _err == 0) {
+				_cond.wait(_mutex);
+			}
+			err = _err;
+			_mutex.unlock();
+			if(err == 0) fold(ch);
+		}
+	} catch(bad_alloc& e) {
+		err = 1;
+	} catch(...) {
+		err = 2;
+	}
+	_mutex.lock();
+	_eof = true;
+	if(err != 0) _err = err;
+	_cond.notify_all();
+	_mutex.unlock();
+	for(size_t i = 0; i < threads.size(); i++) {
+		threads[i]->join();
+		delete threads[i];
+	}
+	delete[] _chunks;
+	_chunks = NULL;
+	if(err == 1) {
+		throw bad_alloc();
+	} else if(err != 0) {
+		throw 1;
+	}
+}
+
+/**
+ * Read the FASTA inputs into 'ref' in a single pass: the RefRecords
+ * and totals that fastaRefReadSizes() would return, the sequence
+ * names, and the packed unambiguous characters.
+ */
+void fastaRefReadPacked(
+	EList<FileBuf*>& in,
+	const RefReadInParams& rparms,
+	int nthreads,
+	uint64_t sizeHint,
+	PackedRef& ref)
+{
+	assert(!rparms.color);
+	assert_gt(in.size(), 0);
+	if(sizeHint > 0) {
+		ref.bits.reserveExact((size_t)(sizeHint >> 2) + 1);
+	}
+	FastaPacker packer(in, rparms, ref);
+	packer.run(nthreads);
+	TIndexOffU unambigTot = 0;
+	size_t bothTot = 0;
+	ref.numSeqs = 0;
+	for(size_t i = 0; i < ref.recs.size(); i++) {
+		if(ref.recs[i].first) ref.numSeqs++;
+		unambigTot += ref.recs[i].len;
+		bothTot += ref.recs[i].len;
+		bothTot += ref.recs[i].off;
+	}
+	assert_eq(unambigTot, ref.len);
+	assert_eq((size_t)ref.numSeqs, ref.names.size());
+	ref.sztot = make_pair((size_t)unambigTot, bothTot);
+}
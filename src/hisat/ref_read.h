@@ -139,6 +139,79 @@ fastaRefReadSizes(
 	BitpairOutFileBuf* bpout,
 	TIndexOff& numSeqs);
 
+/**
+ * A reference as read in by fastaRefReadPacked(): the RefRecords
+ * fastaRefReadSizes() would find, the name line of each sequence, and
+ * the unambiguous characters, packed four to a byte with the first in
+ * the low bits, as in the .4 file.  The index builders join their
+ * strings from here rather than parsing the FASTA again.
+ */
+struct PackedRef {
+
+	PackedRef() : len(0), numSeqs(0), sztot(0, 0) { }
+
+	/**
+	 * Return the i-th unambiguous character.
+	 */
+	int get(TIndexOffU i) const {
+		assert_lt(i, len);
+		return (bits[i >> 2] >> ((i & 3) << 1)) & 3;
+	}
+
+	/**
+	 * Set dst[dstoff], dst[dstoff+1], ... to the 'n' unambiguous
+	 * characters starting at 'off', advancing 'dstoff', and reverse
+	 * them in place if 'rev' is set.
+	 */
+	template <typename TStr>
+	void copyTo(
+		TStr& dst,
+		TIndexOffU& dstoff,
+		TIndexOffU off,
+		TIndexOffU n,
+		bool rev) const
+	{
+		assert_leq(off + n, len);
+		TIndexOffU start = dstoff;
+		for(TIndexOffU i = off; i < off + n; i++) {
+			dst.set(get(i), dstoff++);
+		}
+		if(rev) dst.reverseWindow(start, dstoff);
+	}
+
+	/**
+	 * Return the number of bytes of memory this takes.
+	 */
+	uint64_t bytes() const {
+		uint64_t b = bits.capacity() + recs.capacity() * sizeof(RefRecord);
+		for(size_t i = 0; i < names.size(); i++) {
+			b += names[i].capacity();
+		}
+		return b;
+	}
+
+	EList<RefRecord> recs;  // unambiguous stretches, in input order
+	EList<string>    names; // name of each record with 'first' set
+	EList<uint8_t>   bits;  // unambiguous characters, 4 per byte
+	TIndexOffU       len;   // # unambiguous characters
+	TIndexOff        numSeqs;
+	std::pair<size_t, size_t> sztot; // # unambiguous, # all characters
+};
+
+/**
+ * Read the FASTA inputs into 'ref' in a single pass.  Chunks of input
+ * are parsed and packed on 'nthreads' threads while this thread reads
+ * ahead and stitches them together in order.  'sizeHint', if not 0,
+ * bounds the number of characters to expect.
+ */
+extern void
+fastaRefReadPacked(
+	EList<FileBuf*>& in,
+	const RefReadInParams& rparms,
+	int nthreads,
+	uint64_t sizeHint,
+	PackedRef& ref);
+
 extern void
 reverseRefRecords(
 	const EList<RefRecord>& src,
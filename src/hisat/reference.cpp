@@ -21,6 +21,7 @@
 #include <string.h>
 #include "reference.h"
 #include "mem_ids.h"
+#include "shm_index.h"
 
 using namespace std;
 
@@ -38,7 +39,8 @@ BitPairReference::BitPairReference(
 	bool useShmem,
 	bool mmSweep,
 	bool verbose,
-	bool startVerbose) :
+	bool startVerbose,
+	bool shmIndex) :
 	buf_(NULL),
 	sanityBuf_(NULL),
 	loaded_(true),
@@ -71,22 +73,10 @@ BitPairReference::BitPairReference(
 			cerr << "  Memory-mapping reference index file " << s4.c_str() << ": ";
 			logTime(cerr);
 		}
-		struct stat sbuf;
-		if (stat(s4.c_str(), &sbuf) == -1) {
-			perror("stat");
-			cerr << "Error: Could not stat index file " << s4.c_str() << " prior to memory-mapping" << endl;
-			throw 1;
-		}
-		mmFile = (char*)mmap((void *)0, (size_t)sbuf.st_size,
-				     PROT_READ, MAP_SHARED, fileno(f4), 0);
-		if(mmFile == (void *)(-1) || mmFile == NULL) {
-			perror("mmap");
-			cerr << "Error: Could not memory-map the index file " << s4.c_str() << endl;
-			throw 1;
-		}
+		mmFile = mapIndexFile(s4, fileno(f4), mmFile_, shmIndex, verbose_ || startVerbose);
 		if(mmSweep) {
 			TIndexOff sum = 0;
-			for(off_t i = 0; i < sbuf.st_size; i += 1024) {
+			for(size_t i = 0; i < mmFile_.len; i += 1024) {
 				sum += (TIndexOff) mmFile[i];
 			}
 			if(startVerbose) {
@@ -316,6 +306,7 @@ BitPairReference::BitPairReference(
 BitPairReference::~BitPairReference() {
 	if(buf_ != NULL && !useMm_ && !useShmem_) delete[] buf_;
 	if(sanityBuf_ != NULL) delete[] sanityBuf_;
+	unmapIndexFile(mmFile_);
 }
 
 /**
@@ -580,8 +571,8 @@ int BitPairReference::getStretch(
 
 
 /**
- * Parse the input fasta files, populating the szs list and writing the
- * .3.gEbwt_ext and .4.gEbwt_ext portions of the index as we go.
+ * Read the input fasta files into 'ref' and write the .3.gEbwt_ext and
+ * .4.gEbwt_ext portions of the index from it.
  */
 pair<size_t, size_t>
 BitPairReference::szsFromFasta(
@@ -589,11 +580,15 @@ BitPairReference::szsFromFasta(
 	const string& outfile,
 	bool bigEndian,
 	const RefReadInParams& refparams,
-	EList<RefRecord>& szs,
-	bool sanity)
+	PackedRef& ref,
+	int nthreads,
+	uint64_t sizeHint)
 {
-	RefReadInParams parms = refparams;
-	std::pair<size_t, size_t> sztot;
+	fastaRefReadPacked(is, refparams, nthreads, sizeHint, ref);
+	if(ref.sztot.first == 0) {
+		cerr << "Error: No unambiguous stretches of characters in the input.  Aborting..." << endl;
+		throw 1;
+	}
 	if(!outfile.empty()) {
 		string file3 = outfile + ".3." + gEbwt_ext;
 		string file4 = outfile + ".4." + gEbwt_ext;
@@ -606,63 +601,24 @@ BitPairReference::szsFromFasta(
 				 << "Bowtie." << endl;
 			throw 1;
 		}
-		BitpairOutFileBuf bpout(file4.c_str());
-		// Read in the sizes of all the unambiguous stretches of the genome
-		// into a vector of RefRecords.  The input streams are reset once
-		// it's done.
 		writeIndex<int32_t>(fout3, 1, bigEndian); // endianness sentinel
-		bool color = parms.color;
-		if(color) {
-			parms.color = false;
-			// Make sure the .3.gEbwt_ext and .4.gEbwt_ext files contain
-			// nucleotides; not colors
-			TIndexOff numSeqs = 0;
-			ASSERT_ONLY(std::pair<size_t, size_t> sztot2 =)
-			fastaRefReadSizes(is, szs, parms, &bpout, numSeqs);
-			parms.color = true;
-			writeIndex<TIndexOffU>(fout3, (TIndexOffU)szs.size(), bigEndian); // write # records
-			for(size_t i = 0; i < szs.size(); i++) {
-				szs[i].write(fout3, bigEndian);
-			}
-			szs.clear();
-			// Now read in the colorspace size records; these are
-			// the ones that were indexed
-			TIndexOff numSeqs2 = 0;
-			sztot = fastaRefReadSizes(is, szs, parms, NULL, numSeqs2);
-			assert_eq(numSeqs, numSeqs2);
-			assert_eq(sztot2.second, sztot.second + numSeqs);
-		} else {
-			TIndexOff numSeqs = 0;
-			sztot = fastaRefReadSizes(is, szs, parms, &bpout, numSeqs);
-			writeIndex<TIndexOffU>(fout3, (TIndexOffU)szs.size(), bigEndian); // write # records
-			for(size_t i = 0; i < szs.size(); i++) szs[i].write(fout3, bigEndian);
+		writeIndex<TIndexOffU>(fout3, (TIndexOffU)ref.recs.size(), bigEndian); // write # records
+		for(size_t i = 0; i < ref.recs.size(); i++) {
+			ref.recs[i].write(fout3, bigEndian);
 		}
-		if(sztot.first == 0) {
-			cerr << "Error: No unambiguous stretches of characters in the input.  Aborting..." << endl;
+		fout3.close();
+		// The '.4.gEbwt_ext' file is the packed characters as they are
+		FILE *fout4 = fopen(file4.c_str(), "wb");
+		if(fout4 == NULL) {
+			cerr << "Error: Could not open bitpair-output file " << file4.c_str() << endl;
 			throw 1;
 		}
-		assert_gt(sztot.first, 0);
-		assert_gt(sztot.second, 0);
-		bpout.close();
-		fout3.close();
-	} else {
-		// Read in the sizes of all the unambiguous stretches of the
-		// genome into a vector of RefRecords
-		TIndexOff numSeqs = 0;
-		sztot = fastaRefReadSizes(is, szs, parms, NULL, numSeqs);
-#ifndef NDEBUG
-		if(parms.color) {
-			parms.color = false;
-			EList<RefRecord> szs2(EBWTB_CAT);
-			TIndexOff numSeqs2 = 0;
-			ASSERT_ONLY(std::pair<size_t, size_t> sztot2 =)
-			fastaRefReadSizes(is, szs2, parms, NULL, numSeqs2);
-			assert_eq(numSeqs, numSeqs2);
-			// One less color than base
-			assert_geq(sztot2.second, sztot.second + numSeqs);
-			parms.color = true;
+		size_t nbytes = ((size_t)ref.len + 3) >> 2;
+		if(nbytes > 0 && fwrite(ref.bits.ptr(), 1, nbytes, fout4) != nbytes) {
+			cerr << "Error writing to the reference index file (.4.ebwt)" << endl;
+			throw 1;
 		}
-#endif
+		fclose(fout4);
 	}
-	return sztot;
+	return ref.sztot;
 }
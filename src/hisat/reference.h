@@ -33,6 +33,7 @@
 #include "sequence_io.h"
 #include "mm.h"
 #include "shmem.h"
+#include "shm_index.h"
 #include "timer.h"
 #include "sstring.h"
 #include "btypes.h"
@@ -73,7 +74,8 @@ public:
 		bool useShmem = false,
 		bool mmSweep = false,
 		bool verbose = false,
-		bool startVerbose = false);
+		bool startVerbose = false,
+		bool shmIndex = false);
 
 	~BitPairReference();
 
@@ -150,8 +152,9 @@ public:
 	}
 
 	/**
-	 * Parse the input fasta files, populating the szs list and writing the
-	 * .3.ebwt and .4.ebwt portions of the index as we go.
+	 * Read the input fasta files into 'ref' in one pass on 'nthreads'
+	 * threads, then write the .3.ebwt and .4.ebwt portions of the index
+	 * from it unless 'outfile' is empty.
 	 */
 	static std::pair<size_t, size_t>
 	szsFromFasta(
@@ -159,8 +162,9 @@ public:
 		const string& outfile,
 		bool bigEndian,
 		const RefReadInParams& refparams,
-		EList<RefRecord>& szs,
-		bool sanity);
+		PackedRef& ref,
+		int nthreads = 1,
+		uint64_t sizeHint = 0);
 	
 protected:
 
@@ -183,6 +187,7 @@ protected:
 	bool     useMm_;    /// load the reference as a memory-mapped file
 	bool     useShmem_; /// load the reference into shared memory
 	bool     verbose_;
+	IndexFileMap mmFile_; /// .4 file, if memory-mapped
 	ASSERT_ONLY(SStringExpandable<uint32_t> tmp_destU32_);
 };
 
@@ -0,0 +1,139 @@
+/*
+ * Copyright 2015, Daehwan Kim <infphilo@gmail.com>
+ *
+ * This file is part of HISAT.
+ *
+ * HISAT is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * HISAT is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with HISAT.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SA_PACK_H_
+#define SA_PACK_H_
+
+#include <stdint.h>
+#include <string.h>
+#include <iostream>
+#include "assert_helpers.h"
+#include "endian_swap.h"
+
+/**
+ * Bit-packed storage for the suffix-array sample of an EBWT_SA_PACKED
+ * index.  Sample i occupies bits [i*w, (i+1)*w) of a little-endian bit
+ * stream, where w is just wide enough for the largest offset, so the
+ * stream reads the same on any machine.  Eight zero bytes follow the
+ * last value so that every value can be fetched with a single
+ * unaligned 8-byte load.  Widths above 57 bits can't be fetched that
+ * way, but no index gets near them.
+ */
+
+static const int sa_pack_max_bits = 57;
+
+/**
+ * Number of bits per sample for an index whose BWT has 'bwtLen' rows;
+ * offsets run from 0 to bwtLen-1.
+ */
+static inline int saPackBits(uint64_t bwtLen) {
+	int w = 1;
+	while(w < 64 && ((bwtLen - 1) >> w) != 0) w++;
+	return w;
+}
+
+/**
+ * Bytes taken by 'n' packed 'w'-bit samples, padding included.
+ */
+static inline uint64_t saPackBytes(uint64_t n, int w) {
+	return ((n * w + 7) >> 3) + 8;
+}
+
+static inline uint64_t saPackLoad(const uint8_t* buf, uint64_t bit) {
+	uint64_t word;
+	memcpy(&word, buf + (bit >> 3), 8);
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	word = endianSwapU64(word);
+#endif
+	return word;
+}
+
+/**
+ * Return sample 'i' of the packed stream 'buf'.
+ */
+static inline uint64_t saPackGet(const uint8_t* buf, uint64_t i, int w) {
+	assert_leq(w, sa_pack_max_bits);
+	uint64_t bit = i * w;
+	return (saPackLoad(buf, bit) >> (bit & 7)) & ((1ull << w) - 1);
+}
+
+/**
+ * Store 'v' as sample 'i' of the packed stream 'buf', which must have
+ * been zeroed beforehand.
+ */
+static inline void saPackSet(uint8_t* buf, uint64_t i, int w, uint64_t v) {
+	assert_leq(w, sa_pack_max_bits);
+	assert_eq(0, v >> w);
+	uint64_t bit = i * w;
+	uint64_t word = saPackLoad(buf, bit) | (v << (bit & 7));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	word = endianSwapU64(word);
+#endif
+	memcpy(buf + (bit >> 3), &word, 8);
+}
+
+/**
+ * Writes packed samples to a stream one at a time, so that
+ * Ebwt::buildToDisk() can emit them in row order as it goes.
+ */
+class SaPackWriter {
+
+public:
+
+	SaPackWriter(std::ostream& out, int w) :
+		_out(out), _w(w), _acc(0), _nbits(0)
+	{
+		assert_leq(_w, sa_pack_max_bits);
+	}
+
+	/**
+	 * Append the next sample.
+	 */
+	void put(uint64_t v) {
+		assert_eq(0, v >> _w);
+		_acc |= (v << _nbits);
+		_nbits += _w;
+		while(_nbits >= 8) {
+			_out.put((char)(_acc & 0xff));
+			_acc >>= 8;
+			_nbits -= 8;
+		}
+	}
+
+	/**
+	 * Flush the last partial byte and write the padding.
+	 */
+	void finish() {
+		if(_nbits > 0) {
+			_out.put((char)(_acc & 0xff));
+			_acc = 0;
+			_nbits = 0;
+		}
+		for(int i = 0; i < 8; i++) _out.put(0);
+	}
+
+private:
+
+	std::ostream& _out;
+	int           _w;
+	uint64_t      _acc;   // bits not yet written, lowest first
+	int           _nbits; // number of valid bits in _acc (< 8 between puts)
+};
+
+#endif /*SA_PACK_H_*/
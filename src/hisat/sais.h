@@ -0,0 +1,335 @@
+/*
+ * Copyright 2015, Daehwan Kim <infphilo@gmail.com>
+ *
+ * This file is part of HISAT.
+ *
+ * HISAT is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * HISAT is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with HISAT.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SAIS_H_
+#define SAIS_H_
+
+#include <stdint.h>
+#include <string.h>
+#include <iostream>
+#include "assert_helpers.h"
+#include "blockwise_sa.h"
+#include "ds.h"
+#include "mem_ids.h"
+#include "timer.h"
+
+/**
+ * Build the whole suffix array in memory with Nong, Zhang and Chan's
+ * induced-sorting algorithm (SA-IS) and dole it out as a single block.
+ * This runs in linear time, but the array and the algorithm's scratch
+ * space all have to fit in memory at once; see peakBytes().
+ *
+ * The blockwise builders sort a suffix that is a proper prefix of
+ * another *after* it, and the empty suffix ($) last.  SA-IS wants a
+ * sentinel that is smaller than every character, so the text is read
+ * with its alphabet reversed (A=4, C=3, G=2, T=1) and a sentinel of 0.
+ * That flips the outcome of every suffix comparison, so the array SA-IS
+ * produces is exactly the blockwise order read backwards.
+ */
+template<typename TStr>
+class SaisBlockwiseSA : public InorderBlockwiseSA<TStr> {
+public:
+	SaisBlockwiseSA(const TStr& __text,
+	                bool __sanityCheck = false,
+	                bool __passMemExc = false,
+	                bool __verbose = false,
+	                ostream& __logger = cout) :
+	InorderBlockwiseSA<TStr>(__text, (TIndexOffU)__text.length()+1, __sanityCheck, __passMemExc, __verbose, __logger),
+	_done(false)
+	{ }
+
+	/**
+	 * Return the approximate number of bytes SA-IS needs at its peak
+	 * for a text of 'len' characters, not counting the text itself:
+	 * the suffix array, one type bit per character at every level of
+	 * recursion, and the buckets of one reduced string.  A reduced
+	 * string has at most half as many characters as the level above,
+	 * so below the first level its alphabet is at most a quarter of
+	 * the text.  The first reduced string's alphabet is the number of
+	 * distinct LMS substrings of the text; at most n/l of those are
+	 * l or more characters long, and at most 4^(l+1)/3 are shorter,
+	 * which (taking l = 5) keeps it under a quarter of the text too
+	 * once the text is over 128K characters long.
+	 */
+	static uint64_t peakBytes(uint64_t len) {
+		uint64_t n = len + 1;
+		uint64_t bkts = (n < (1 << 17)) ? (n >> 1) : (n >> 2);
+		return (n + bkts) * sizeof(TIndexOffU) + (n >> 2) + 1024;
+	}
+
+	/// Return true iff more blocks are available
+	virtual bool hasMoreBlocks() const {
+		return !_done;
+	}
+
+protected:
+
+	/// Reset back to the first (and only) block
+	virtual void reset() {
+		_done = false;
+	}
+
+	/// Return true iff reset to the first block
+	virtual bool isReset() {
+		return !_done;
+	}
+
+	/**
+	 * Compute the whole suffix array into _itrBucket.
+	 */
+	virtual void nextBlock() {
+		assert(!_done);
+		EList<TIndexOffU>& sa = this->_itrBucket;
+		TIndexOffU n = (TIndexOffU)this->_text.length() + 1;
+		VMSG_NL("Building suffix array of " << n << " suffixes with SA-IS");
+		try {
+			Timer timer(cout, "  SA-IS time: ", this->verbose());
+			sa.resize(n);
+			SaisText txt(this->_text, n);
+			sais(txt, sa.ptr(), n, 4, 0);
+			// Reverse to get the blockwise order, $ last
+			for(TIndexOffU i = 0, j = n - 1; i < j; i++, j--) {
+				TIndexOffU tmp = sa[i]; sa[i] = sa[j]; sa[j] = tmp;
+			}
+		} catch(bad_alloc& e) {
+			if(this->_passMemExc) {
+				throw e; // rethrow immediately
+			} else {
+				cerr << "Out of memory building the suffix array with SA-IS; please try again" << endl
+				     << "with a smaller --max-memory" << endl;
+				throw 1;
+			}
+		}
+		assert_eq(n - 1, sa[n - 1]);
+		if(this->sanityCheck()) {
+			for(TIndexOffU i = 0; i + 1 < n; i++) {
+				assert(sstr_suf_lt(this->_text, sa[i], this->_text, sa[i+1], false));
+			}
+		}
+		_done = true;
+	}
+
+private:
+
+	/**
+	 * The level-0 string: the reference with its alphabet reversed
+	 * and a sentinel of 0 at the end.
+	 */
+	struct SaisText {
+		SaisText(const TStr& t, TIndexOffU n) : t_(t), n_(n) { }
+		TIndexOffU operator[](TIndexOffU i) const {
+			return i + 1 == n_ ? 0 : 4 - (TIndexOffU)t_[i];
+		}
+		const TStr& t_;
+		TIndexOffU  n_;
+	};
+
+	/**
+	 * A reduced string, whose characters are the names of the LMS
+	 * substrings of the level above.
+	 */
+	struct SaisReduced {
+		SaisReduced(const TIndexOffU* s) : s_(s) { }
+		TIndexOffU operator[](TIndexOffU i) const { return s_[i]; }
+		const TIndexOffU* s_;
+	};
+
+	static inline bool tget(const AutoArray<uint8_t>& t, TIndexOffU i) {
+		return (t[i >> 3] >> (i & 7)) & 1;
+	}
+
+	static inline void tset(AutoArray<uint8_t>& t, TIndexOffU i, bool b) {
+		if(b) t[i >> 3] |=  (uint8_t)(1 << (i & 7));
+		else  t[i >> 3] &= ~(uint8_t)(1 << (i & 7));
+	}
+
+	/// Return true iff position i is a leftmost S-type position
+	static inline bool isLMS(const AutoArray<uint8_t>& t, TIndexOffU i) {
+		return i > 0 && i != (TIndexOffU)OFF_MASK && tget(t, i) && !tget(t, i - 1);
+	}
+
+	/**
+	 * Set bkt[c] to the start (or, if 'end', one past the end) of the
+	 * bucket of each character c in [0, K].
+	 */
+	template<typename TText>
+	static void getBuckets(
+		const TText& s,
+		AutoArray<TIndexOffU>& bkt,
+		TIndexOffU n,
+		TIndexOffU K,
+		bool end)
+	{
+		for(TIndexOffU i = 0; i <= K; i++) bkt[i] = 0;
+		for(TIndexOffU i = 0; i < n; i++) bkt[s[i]]++;
+		TIndexOffU sum = 0;
+		for(TIndexOffU i = 0; i <= K; i++) {
+			sum += bkt[i];
+			bkt[i] = end ? sum : sum - bkt[i];
+		}
+	}
+
+	/**
+	 * Induce the order of the L-type suffixes from the suffixes
+	 * already placed in SA, scanning left to right.
+	 */
+	template<typename TText>
+	static void induceL(
+		const AutoArray<uint8_t>& t,
+		TIndexOffU* SA,
+		const TText& s,
+		AutoArray<TIndexOffU>& bkt,
+		TIndexOffU n,
+		TIndexOffU K)
+	{
+		getBuckets(s, bkt, n, K, false);
+		for(TIndexOffU i = 0; i < n; i++) {
+			TIndexOffU j = SA[i];
+			if(j != (TIndexOffU)OFF_MASK && j > 0 && !tget(t, j - 1)) {
+				SA[bkt[s[j - 1]]++] = j - 1;
+			}
+		}
+	}
+
+	/**
+	 * Induce the order of the S-type suffixes from the L-type
+	 * suffixes, scanning right to left.
+	 */
+	template<typename TText>
+	static void induceS(
+		const AutoArray<uint8_t>& t,
+		TIndexOffU* SA,
+		const TText& s,
+		AutoArray<TIndexOffU>& bkt,
+		TIndexOffU n,
+		TIndexOffU K)
+	{
+		getBuckets(s, bkt, n, K, true);
+		for(TIndexOffU i = n; i-- > 0;) {
+			TIndexOffU j = SA[i];
+			if(j != (TIndexOffU)OFF_MASK && j > 0 && tget(t, j - 1)) {
+				SA[--bkt[s[j - 1]]] = j - 1;
+			}
+		}
+	}
+
+	/**
+	 * Fill SA[0..n) with the suffix array of s[0..n), whose characters
+	 * are in [0, K] and whose last character is a unique 0.  The
+	 * reduced string of the next level is kept in the top half of SA,
+	 * and its suffix array in the bottom half.
+	 */
+	template<typename TText>
+	void sais(
+		const TText& s,
+		TIndexOffU* SA,
+		TIndexOffU n,
+		TIndexOffU K,
+		int level)
+	{
+		assert_gt(n, 0);
+		if(n == 1) {
+			SA[0] = 0;
+			return;
+		}
+		// Classify each suffix as S-type (1) or L-type (0)
+		AutoArray<uint8_t> t((n + 7) >> 3, EBWTB_CAT);
+		tset(t, n - 2, false);
+		tset(t, n - 1, true);
+		for(TIndexOffU i = n - 2; i-- > 0;) {
+			TIndexOffU c = s[i], c1 = s[i + 1];
+			tset(t, i, c < c1 || (c == c1 && tget(t, i + 1)));
+		}
+		// Stage 1: sort the LMS substrings by inducing from the LMS
+		// suffixes placed at the ends of their buckets
+		{
+			AutoArray<TIndexOffU> bkt(K + 1, EBWTB_CAT);
+			getBuckets(s, bkt, n, K, true);
+			for(TIndexOffU i = 0; i < n; i++) SA[i] = (TIndexOffU)OFF_MASK;
+			for(TIndexOffU i = 1; i < n; i++) {
+				if(isLMS(t, i)) SA[--bkt[s[i]]] = i;
+			}
+			induceL(t, SA, s, bkt, n, K);
+			induceS(t, SA, s, bkt, n, K);
+		}
+		// Move the sorted LMS substrings to the front of SA
+		TIndexOffU n1 = 0;
+		for(TIndexOffU i = 0; i < n; i++) {
+			if(isLMS(t, SA[i])) SA[n1++] = SA[i];
+		}
+		// Name the LMS substrings; equal substrings get equal names.
+		// Substring i's name goes to SA[n1 + i/2], which can't collide
+		// because LMS positions are at least 2 apart.
+		for(TIndexOffU i = n1; i < n; i++) SA[i] = (TIndexOffU)OFF_MASK;
+		TIndexOffU name = 0, prev = (TIndexOffU)OFF_MASK;
+		for(TIndexOffU i = 0; i < n1; i++) {
+			TIndexOffU pos = SA[i];
+			bool diff = false;
+			for(TIndexOffU d = 0; d < n; d++) {
+				if(prev == (TIndexOffU)OFF_MASK ||
+				   s[pos + d] != s[prev + d] ||
+				   tget(t, pos + d) != tget(t, prev + d))
+				{
+					diff = true;
+					break;
+				} else if(d > 0 && (isLMS(t, pos + d) || isLMS(t, prev + d))) {
+					break;
+				}
+			}
+			if(diff) {
+				name++;
+				prev = pos;
+			}
+			SA[n1 + (pos >> 1)] = name - 1;
+		}
+		for(TIndexOffU i = n, j = n; i-- > n1;) {
+			if(SA[i] != (TIndexOffU)OFF_MASK) SA[--j] = SA[i];
+		}
+		// Stage 2: sort the reduced string, recursing unless every
+		// name is already unique
+		TIndexOffU* s1 = SA + n - n1;
+		TIndexOffU* SA1 = SA;
+		if(name < n1) {
+			VMSG_NL("  SA-IS level " << level << ": recursing on " << n1 << " LMS substrings with " << name << " names");
+			sais(SaisReduced(s1), SA1, n1, name - 1, level + 1);
+		} else {
+			for(TIndexOffU i = 0; i < n1; i++) SA1[s1[i]] = i;
+		}
+		// Stage 3: place the LMS suffixes in sorted order at the ends
+		// of their buckets and induce the rest
+		AutoArray<TIndexOffU> bkt(K + 1, EBWTB_CAT);
+		getBuckets(s, bkt, n, K, true);
+		for(TIndexOffU i = 1, j = 0; i < n; i++) {
+			if(isLMS(t, i)) s1[j++] = i;
+		}
+		for(TIndexOffU i = 0; i < n1; i++) SA1[i] = s1[SA1[i]];
+		for(TIndexOffU i = n1; i < n; i++) SA[i] = (TIndexOffU)OFF_MASK;
+		for(TIndexOffU i = n1; i-- > 0;) {
+			TIndexOffU j = SA[i];
+			SA[i] = (TIndexOffU)OFF_MASK;
+			SA[--bkt[s[j]]] = j;
+		}
+		induceL(t, SA, s, bkt, n, K);
+		induceS(t, SA, s, bkt, n, K);
+	}
+
+	bool _done; /// true -> the suffix array has been handed out
+};
+
+#endif /*SAIS_H_*/
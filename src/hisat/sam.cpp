@@ -57,9 +57,10 @@ void SamConfig::printHeader(
 	const string& rgs,
 	bool printHd,
 	bool printSq,
-	bool printPg) const
+	bool printPg,
+	bool coordSorted) const
 {
-	if(printHd) printHdLine(o, "1.0");
+	if(printHd) printHdLine(o, "1.0", coordSorted);
 	if(printSq) printSqLines(o);
 	if(!rgid.empty()) {
 		o.append("@RG");
@@ -73,10 +74,15 @@ void SamConfig::printHeader(
 /**
  * Print the @HD header line to the given string.
  */
-void SamConfig::printHdLine(BTString& o, const char *samver) const {
+void SamConfig::printHdLine(
+	BTString& o,
+	const char *samver,
+	bool coordSorted)
+	const
+{
 	o.append("@HD\tVN:");
 	o.append(samver);
-	o.append("\tSO:unsorted\n");
+	o.append(coordSorted ? "\tSO:coordinate\n" : "\tSO:unsorted\n");
 }
 
 /**
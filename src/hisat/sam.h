@@ -264,13 +264,19 @@ public:
 		const std::string& rgs,
 		bool printHd,
 		bool printSq,
-		bool printPg)
+		bool printPg,
+		bool coordSorted = false)
 		const;
 
 	/**
-	 * Print the @HD header line to the given string.
+	 * Print the @HD header line to the given string.  'coordSorted'
+	 * selects SO:coordinate instead of SO:unsorted.
 	 */
-	void printHdLine(BTString& o, const char *samver) const;
+	void printHdLine(
+		BTString& o,
+		const char *samver,
+		bool coordSorted = false)
+		const;
 
 	/**
 	 * Print the @SQ header lines to the given string.
@@ -328,6 +334,20 @@ public:
 		return noUnal_;
 	}
 
+	/**
+	 * Return the number of reference sequences.
+	 */
+	size_t numRefs() const {
+		return refnames_.size();
+	}
+
+	/**
+	 * Return the length of the reference sequence with index i.
+	 */
+	size_t refLen(size_t i) const {
+		return reflens_[i];
+	}
+
 protected:
 
 	bool truncQname_;   // truncate QNAME to 255 chars?
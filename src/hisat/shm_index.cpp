@@ -0,0 +1,256 @@
+/*
+ * Copyright 2015, Daehwan Kim <infphilo@gmail.com>
+ *
+ * This file is part of HISAT.
+ *
+ * HISAT is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * HISAT is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with HISAT.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <iostream>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#ifdef BOWTIE_MM
+#include <sys/mman.h>
+#include <sys/file.h>
+#endif
+#include "shm_index.h"
+#include "threading.h"
+
+using namespace std;
+
+#ifdef BOWTIE_MM
+
+static const uint32_t SHM_INDEX_MAGIC   = 0x48534d49; // "HSMI"
+static const uint32_t SHM_INDEX_VERSION = 1;
+static const size_t   SHM_INDEX_HDR     = 4096;       // keeps the file image page-aligned
+
+/**
+ * Header at the start of a published index file.  'ready' is set last,
+ * once the file image behind the header is complete.
+ */
+struct ShmIndexHeader {
+	uint32_t magic;
+	uint32_t version;
+	volatile uint32_t ready;
+	uint32_t pad;
+	uint64_t len;    // length of the file image
+	uint64_t dev;    // identity of the file it was copied from
+	uint64_t ino;
+	int64_t  mtime;
+};
+
+/**
+ * Return the shared-memory object name for the file described by
+ * 'path' and 'st'.
+ */
+static string shmIndexName(const string& path, const struct stat& st) {
+	char rp[PATH_MAX];
+	string key = (realpath(path.c_str(), rp) != NULL) ? rp : path;
+	char buf[128];
+	snprintf(buf, sizeof(buf), ":%u:%llu:%llu:%llu:%lld", SHM_INDEX_VERSION,
+	         (unsigned long long)st.st_dev, (unsigned long long)st.st_ino,
+	         (unsigned long long)st.st_size, (long long)st.st_mtime);
+	key += buf;
+	uint64_t h = 14695981039346656037ULL; // FNV-1a
+	for(size_t i = 0; i < key.length(); i++) {
+		h = (h ^ (uint8_t)key[i]) * 1099511628211ULL;
+	}
+	snprintf(buf, sizeof(buf), "/hisat-%016llx", (unsigned long long)h);
+	return string(buf);
+}
+
+/**
+ * Create the shared-memory object 'name' and copy the file image into
+ * it.  Returns false if another process created it first.
+ */
+static bool shmIndexPublish(
+	const string& name,
+	const string& fname,
+	int fd,
+	const struct stat& st,
+	bool verbose)
+{
+	int sfd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0644);
+	if(sfd == -1) {
+		if(errno == EEXIST) return false;
+		perror("shm_open");
+		cerr << "Error: Could not create shared-memory object " << name << " for index file " << fname << endl;
+		throw 1;
+	}
+	// Hold an exclusive lock until the image is complete; processes
+	// attaching in the meantime block on it
+	flock(sfd, LOCK_EX);
+	if(verbose) {
+		cerr << "  Publishing " << fname << " as shared-memory object " << name << endl;
+	}
+	size_t len = (size_t)st.st_size;
+	char *p = NULL;
+	if(ftruncate(sfd, (off_t)(SHM_INDEX_HDR + len)) == 0) {
+		p = (char*)mmap(NULL, SHM_INDEX_HDR + len, PROT_READ | PROT_WRITE, MAP_SHARED, sfd, 0);
+		if(p == (char*)MAP_FAILED) p = NULL;
+	}
+	size_t done = 0;
+	while(p != NULL && done < len) {
+		ssize_t r = pread(fd, p + SHM_INDEX_HDR + done, len - done, (off_t)done);
+		if(r <= 0) break;
+		done += (size_t)r;
+	}
+	if(p == NULL || done < len) {
+		int err = errno;
+		if(p != NULL) munmap(p, SHM_INDEX_HDR + len);
+		shm_unlink(name.c_str());
+		close(sfd);
+		cerr << "Error: Could not copy index file " << fname << " into shared memory: "
+		     << strerror(err) << endl
+		     << "Is there enough space in /dev/shm?" << endl;
+		throw 1;
+	}
+	ShmIndexHeader *hdr = (ShmIndexHeader*)p;
+	hdr->magic = SHM_INDEX_MAGIC;
+	hdr->version = SHM_INDEX_VERSION;
+	hdr->len = len;
+	hdr->dev = (uint64_t)st.st_dev;
+	hdr->ino = (uint64_t)st.st_ino;
+	hdr->mtime = (int64_t)st.st_mtime;
+	atomicStore(&hdr->ready, (uint32_t)1);
+	munmap(p, SHM_INDEX_HDR + len);
+	flock(sfd, LOCK_UN);
+	close(sfd);
+	return true;
+}
+
+/**
+ * Map the published object 'name' read-only.  Returns NULL if the
+ * object doesn't exist or its publisher died before finishing it.
+ */
+static char *shmIndexAttach(
+	const string& name,
+	const string& fname,
+	const struct stat& st,
+	bool verbose)
+{
+	int sfd = shm_open(name.c_str(), O_RDONLY, 0);
+	if(sfd == -1) {
+		if(errno == ENOENT) return NULL;
+		perror("shm_open");
+		cerr << "Error: Could not open shared-memory object " << name << " for index file " << fname << endl;
+		throw 1;
+	}
+	// Wait for the publisher, if it's still copying
+	flock(sfd, LOCK_SH);
+	size_t len = (size_t)st.st_size;
+	struct stat sst;
+	char *p = NULL;
+	if(fstat(sfd, &sst) == 0 && (size_t)sst.st_size == SHM_INDEX_HDR + len) {
+		p = (char*)mmap(NULL, SHM_INDEX_HDR + len, PROT_READ, MAP_SHARED, sfd, 0);
+		if(p == (char*)MAP_FAILED) p = NULL;
+	}
+	flock(sfd, LOCK_UN);
+	close(sfd);
+	if(p == NULL) return NULL;
+	const ShmIndexHeader *hdr = (const ShmIndexHeader*)p;
+	if(atomicLoad(&hdr->ready) != 1) {
+		munmap(p, SHM_INDEX_HDR + len);
+		return NULL;
+	}
+	if(hdr->magic != SHM_INDEX_MAGIC ||
+	   hdr->version != SHM_INDEX_VERSION ||
+	   hdr->len != len ||
+	   hdr->ino != (uint64_t)st.st_ino ||
+	   hdr->mtime != (int64_t)st.st_mtime)
+	{
+		munmap(p, SHM_INDEX_HDR + len);
+		cerr << "Error: Shared-memory object " << name << " does not match index file " << fname << endl
+		     << "Please remove /dev/shm" << name << " and try again." << endl;
+		throw 1;
+	}
+	if(verbose) {
+		cerr << "  Attached " << fname << " from shared-memory object " << name << endl;
+	}
+	return p + SHM_INDEX_HDR;
+}
+
+char *mapIndexFile(const string& fname, int fd, IndexFileMap& m, bool shm, bool verbose) {
+	struct stat st;
+	if(fstat(fd, &st) == -1) {
+		perror("stat");
+		cerr << "Error: Could not stat index file " << fname << " prior to memory-mapping" << endl;
+		throw 1;
+	}
+	size_t len = (size_t)st.st_size;
+	if(!shm) {
+		char *p = (char*)mmap((void *)0, len, PROT_READ, MAP_SHARED, fd, 0);
+		if(p == (void *)(-1)) {
+			perror("mmap");
+			cerr << "Error: Could not memory-map the index file " << fname << endl;
+			throw 1;
+		}
+		m.p = m.base = p;
+		m.len = m.mapLen = len;
+		return p;
+	}
+	string name = shmIndexName(fname, st);
+	// A few rounds, in case we open the object in the moment between
+	// its creation and the publisher taking the lock, or its publisher
+	// died and left it unfinished
+	for(int tries = 0; tries < 100; tries++) {
+		char *p = shmIndexAttach(name, fname, st, verbose);
+		if(p != NULL) {
+			m.p = p;
+			m.len = len;
+			m.base = p - SHM_INDEX_HDR;
+			m.mapLen = SHM_INDEX_HDR + len;
+			return p;
+		}
+		if(!shmIndexPublish(name, fname, fd, st, verbose) && tries >= 50) {
+			// Still not finished after a while; assume the publisher
+			// is gone and start over
+			shm_unlink(name.c_str());
+		}
+		if(tries > 0) usleep(10000);
+	}
+	cerr << "Error: Could not attach shared-memory object " << name << " for index file " << fname << endl;
+	throw 1;
+}
+
+void unmapIndexFile(IndexFileMap& m) {
+	if(m.base != NULL) munmap(m.base, m.mapLen);
+	m = IndexFileMap();
+}
+
+bool shmIndexRemove(const string& fname) {
+	struct stat st;
+	if(stat(fname.c_str(), &st) == -1) return false;
+	return shm_unlink(shmIndexName(fname, st).c_str()) == 0;
+}
+
+#else
+
+char *mapIndexFile(const string& fname, int fd, IndexFileMap& m, bool shm, bool verbose) {
+	cerr << "Error: Memory-mapped index files are not supported on this platform" << endl;
+	throw 1;
+}
+
+void unmapIndexFile(IndexFileMap& m) { }
+
+bool shmIndexRemove(const string& fname) { return false; }
+
+#endif
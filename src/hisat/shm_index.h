@@ -0,0 +1,76 @@
+/*
+ * Copyright 2015, Daehwan Kim <infphilo@gmail.com>
+ *
+ * This file is part of HISAT.
+ *
+ * HISAT is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * HISAT is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with HISAT.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SHM_INDEX_H_
+#define SHM_INDEX_H_
+
+#include <stddef.h>
+#include <string>
+
+/**
+ * Memory-maps the index files (.1/.2, .5/.6 and .4) for the --mm code
+ * paths, which use the file images in place.
+ *
+ * Normally each file is mapped directly.  With --shm-index, each file
+ * is published once per machine as a POSIX shared-memory object
+ * (shm_open) instead: the first process to need a file copies it in
+ * behind a header carrying a magic number, a format version, the file's
+ * identity and a ready flag, and every process, that one included, maps
+ * the object read-only.  The object is named after the file's path,
+ * inode, size and modification time, so rebuilding an index publishes a
+ * fresh copy.  Later processes attach without touching the index files'
+ * contents.  Objects outlive the processes that made them; they are
+ * removed with shmIndexRemove() or by deleting /dev/shm/hisat-*.
+ */
+
+/**
+ * One index file mapped by mapIndexFile().  The mapping can start before
+ * the file's bytes (a shared-memory object starts with its header), so
+ * it is recorded as made, and unmapIndexFile() doesn't need to know
+ * how the file was mapped.
+ */
+struct IndexFileMap {
+	IndexFileMap() : p(NULL), len(0), base(NULL), mapLen(0) { }
+
+	char  *p;      // the file's bytes
+	size_t len;    // the file's length
+	char  *base;   // start of the mapping
+	size_t mapLen; // length of the mapping
+};
+
+/**
+ * Map the index file 'fname', open as 'fd', read-only, into 'm' and
+ * return m.p, through shared memory if 'shm' is set.  Prints an error
+ * and throws 1 on failure.
+ */
+char *mapIndexFile(const std::string& fname, int fd, IndexFileMap& m, bool shm, bool verbose);
+
+/**
+ * Unmap 'm', if it's mapped, and reset it.
+ */
+void unmapIndexFile(IndexFileMap& m);
+
+/**
+ * Remove the shared-memory object for index file 'fname', if there is
+ * one.  Processes that have it mapped keep their mappings.  Returns true
+ * iff an object was removed.
+ */
+bool shmIndexRemove(const std::string& fname);
+
+#endif /*SHM_INDEX_H_*/
@@ -607,7 +607,7 @@ void SpliceSiteDB::print_impl(
     if(ss != NULL) ss_list.push_back(*ss);
 }
 
-void SpliceSiteDB::read(ifstream& in, bool known)
+void SpliceSiteDB::read(istream& in, bool known)
 {
     _empty = false;
     assert_eq(_numRefs, _refnames.size());
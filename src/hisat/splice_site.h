@@ -391,7 +391,7 @@ public:
     bool hasSpliceSites(uint32_t ref, uint32_t left1, uint32_t right1, uint32_t left2, uint32_t right2, bool includeNovel = false) const;
     
     void print(ofstream& out);
-    void read(ifstream& in, bool known = false);
+    void read(istream& in, bool known = false);
     
 private:
     void getSpliceSites_recur(
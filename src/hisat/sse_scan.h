@@ -0,0 +1,162 @@
+/*
+ * Copyright 2015, Daehwan Kim <infphilo@gmail.com>
+ *
+ * This file is part of HISAT.
+ *
+ * HISAT is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * HISAT is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with HISAT.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef SSE_SCAN_H_
+#define SSE_SCAN_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <emmintrin.h>
+
+/**
+ * SSE2 routines for scanning and converting read text 16 characters at
+ * a time.  Used to find record boundaries in input buffers and to
+ * convert sequence and quality strings in bulk.
+ */
+
+extern uint8_t asc2dna[];
+
+/**
+ * Return a pointer to the first occurrence of 'c1' or 'c2' in [s, e),
+ * or e if there is none.
+ */
+static inline const char *scanForEither(
+	const char *s,
+	const char *e,
+	char c1,
+	char c2)
+{
+	const __m128i v1 = _mm_set1_epi8(c1);
+	const __m128i v2 = _mm_set1_epi8(c2);
+	while(s + 16 <= e) {
+		__m128i v = _mm_loadu_si128((const __m128i *)s);
+		int m = _mm_movemask_epi8(_mm_or_si128(
+			_mm_cmpeq_epi8(v, v1),
+			_mm_cmpeq_epi8(v, v2)));
+		if(m != 0) return s + __builtin_ctz(m);
+		s += 16;
+	}
+	for(; s < e; s++) {
+		if(*s == c1 || *s == c2) return s;
+	}
+	return e;
+}
+
+/**
+ * Return a pointer to the first '\n' or '\r' in [s, e), or e if there
+ * is none.
+ */
+static inline const char *scanForNewline(const char *s, const char *e) {
+	return scanForEither(s, e, '\n', '\r');
+}
+
+/**
+ * Convert a single sequence character the way the FASTQ parser does:
+ * '.' becomes N and letters are looked up in asc2dna.  Returns -1 for
+ * any other character.
+ */
+static inline int ascToDnaChar(char c) {
+	if(c == '.') return 4;
+	if(isalpha((unsigned char)c)) return asc2dna[(uint8_t)c];
+	return -1;
+}
+
+/**
+ * Convert 'len' sequence characters at 's' into 0-4 nucleotide codes
+ * at 'd'.  A/C/G/T/N in either case are converted 16 at a time; other
+ * characters go through ascToDnaChar().  Returns false, leaving 'd'
+ * partially written, if any character is not a letter or '.'.
+ */
+static inline bool ascToDna(const char *s, size_t len, char *d) {
+	const __m128i lower = _mm_set1_epi8(0x20);
+	const __m128i a = _mm_set1_epi8('a');
+	const __m128i c = _mm_set1_epi8('c');
+	const __m128i g = _mm_set1_epi8('g');
+	const __m128i t = _mm_set1_epi8('t');
+	const __m128i n = _mm_set1_epi8('n');
+	const __m128i one = _mm_set1_epi8(1);
+	const __m128i two = _mm_set1_epi8(2);
+	const __m128i three = _mm_set1_epi8(3);
+	const __m128i four = _mm_set1_epi8(4);
+	size_t i = 0;
+	for(; i + 16 <= len; i += 16) {
+		__m128i v = _mm_or_si128(_mm_loadu_si128((const __m128i *)(s + i)), lower);
+		__m128i ma = _mm_cmpeq_epi8(v, a);
+		__m128i mc = _mm_cmpeq_epi8(v, c);
+		__m128i mg = _mm_cmpeq_epi8(v, g);
+		__m128i mt = _mm_cmpeq_epi8(v, t);
+		__m128i mn = _mm_cmpeq_epi8(v, n);
+		__m128i code = _mm_or_si128(
+			_mm_or_si128(_mm_and_si128(mc, one), _mm_and_si128(mg, two)),
+			_mm_or_si128(_mm_and_si128(mt, three), _mm_and_si128(mn, four)));
+		_mm_storeu_si128((__m128i *)(d + i), code);
+		int known = _mm_movemask_epi8(_mm_or_si128(
+			_mm_or_si128(_mm_or_si128(ma, mc), _mm_or_si128(mg, mt)), mn));
+		if(known != 0xffff) {
+			for(size_t j = 0; j < 16; j++) {
+				if((known >> j) & 1) continue;
+				int cc = ascToDnaChar(s[i + j]);
+				if(cc < 0) return false;
+				d[i + j] = (char)cc;
+			}
+		}
+	}
+	for(; i < len; i++) {
+		int cc = ascToDnaChar(s[i]);
+		if(cc < 0) return false;
+		d[i] = (char)cc;
+	}
+	return true;
+}
+
+/**
+ * Convert 'len' ASCII-encoded qualities at 's' into Phred+33 at 'd'.
+ * Input is Phred+64 if 'phred64' is true, otherwise Phred+33.  Returns
+ * false, leaving 'd' partially written, if any character is below the
+ * encoding's offset; the caller should then fall back on
+ * charToPhred33() to report the offending character.
+ */
+static inline bool ascToPhred33(
+	const char *s,
+	size_t len,
+	char *d,
+	bool phred64)
+{
+	const char lo = phred64 ? 63 : 32;
+	const char shift = phred64 ? (64 - 33) : 0;
+	const __m128i vlo = _mm_set1_epi8(lo);
+	const __m128i vshift = _mm_set1_epi8(shift);
+	size_t i = 0;
+	for(; i + 16 <= len; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+		// Signed compare, so characters >= 128 are rejected too
+		if(_mm_movemask_epi8(_mm_cmpgt_epi8(v, vlo)) != 0xffff) {
+			return false;
+		}
+		_mm_storeu_si128((__m128i *)(d + i), _mm_sub_epi8(v, vshift));
+	}
+	for(; i < len; i++) {
+		if((signed char)s[i] <= lo) return false;
+		d[i] = s[i] - shift;
+	}
+	return true;
+}
+
+#endif /*SSE_SCAN_H_*/
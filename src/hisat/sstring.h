@@ -2015,6 +2015,17 @@ public:
 	 */
 	void clear() { len_ = 0; }
 
+	/**
+	 * Clear the buffer and free its memory.
+	 */
+	void reset() {
+		if(cs_ != NULL) {
+			delete[] cs_;
+			cs_ = NULL;
+		}
+		sz_ = len_ = 0;
+	}
+
 	/**
 	 * Return true iff the buffer is empty.
 	 */
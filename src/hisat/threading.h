@@ -21,6 +21,10 @@
 #define THREADING_H_
 
 #include <iostream>
+#include <limits>
+#include <assert.h>
+#include <stdint.h>
+#include <sys/time.h>
 #include "tinythread.h"
 #include "fast_mutex.h"
 
@@ -31,6 +35,40 @@
 #endif /* NO_SPINLOCK */
 
 
+/**
+ * Atomic operations on plain integer variables, built on the GCC/Clang
+ * __atomic builtins.  Loads acquire, stores release, and read-modify-
+ * write operations are sequentially consistent.  Use atomicFence()
+ * where a store must be ordered before a later load.
+ */
+template<typename T>
+inline T atomicLoad(const volatile T *p) {
+	return __atomic_load_n(p, __ATOMIC_ACQUIRE);
+}
+
+template<typename T>
+inline void atomicStore(volatile T *p, T v) {
+	__atomic_store_n(p, v, __ATOMIC_RELEASE);
+}
+
+template<typename T>
+inline T atomicAdd(volatile T *p, T v) {
+	return __atomic_add_fetch(p, v, __ATOMIC_SEQ_CST);
+}
+
+/**
+ * Set *p to 'desired' if it equals 'expected'; return true iff it did.
+ */
+template<typename T>
+inline bool atomicCas(volatile T *p, T expected, T desired) {
+	return __atomic_compare_exchange_n(
+		p, &expected, desired, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+}
+
+inline void atomicFence() {
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
 /**
  * Wrap a lock; obtain lock upon construction, release upon destruction.
  */
@@ -54,4 +92,132 @@ private:
 	MUTEX_T *ptr_mutex;
 };
 
+/**
+ * Tracks how far each of a set of threads has got through the reads,
+ * which each thread visits in increasing order of read id, and keeps
+ * the minimum over all threads as a low watermark.  A thread that must
+ * not get too far ahead of the slowest one sleeps in waitFor() until the
+ * watermark catches up, rather than polling.
+ *
+ * Only the thread that was at the watermark rescans the positions when
+ * it moves, and the watermark is raised with a CAS, so advance() is
+ * cheap for everyone else.  Position stores and watermark updates are
+ * each followed by a fence before the other is read, so a thread that
+ * moves off the watermark while another thread is rescanning is seen by
+ * one of the two.
+ */
+class ReadIdWatermark {
+
+public:
+
+	ReadIdWatermark() : pos_(NULL), n_(0), min_(0), nwaiting_(0) { }
+
+	~ReadIdWatermark() {
+		delete[] pos_;
+	}
+
+	/**
+	 * Start 'n' threads at read id 0.
+	 */
+	void init(size_t n) {
+		delete[] pos_;
+		pos_ = new uint64_t[n];
+		for(size_t i = 0; i < n; i++) pos_[i] = 0;
+		n_ = n;
+		min_ = 0;
+	}
+
+	/**
+	 * Return the smallest read id reached by any thread.
+	 */
+	uint64_t min() const {
+		return atomicLoad(&min_);
+	}
+
+	/**
+	 * Thread 'i' has reached read id 'rid'.  Only thread 'i' may call
+	 * this for 'i'; positions never move backward.
+	 */
+	void advance(size_t i, uint64_t rid) {
+		assert(pos_ != NULL && i < n_);
+		uint64_t old = pos_[i];
+		if(rid <= old) return;
+		atomicStore(&pos_[i], rid);
+		atomicFence();
+		if(old == atomicLoad(&min_)) {
+			raise();
+		}
+	}
+
+	/**
+	 * Thread 'i' is done and shouldn't hold anyone back any more.
+	 */
+	void finish(size_t i) {
+		advance(i, std::numeric_limits<uint64_t>::max());
+	}
+
+	/**
+	 * Block until the watermark is at least 'bound'.  Returns the number
+	 * of microseconds spent waiting, 0 if it didn't have to.
+	 */
+	uint64_t waitFor(uint64_t bound) {
+		if(min() >= bound) return 0;
+		struct timeval tv_beg, tv_end;
+		gettimeofday(&tv_beg, NULL);
+		mutex_.lock();
+		atomicAdd(&nwaiting_, 1);
+		atomicFence();
+		while(min() < bound) {
+			cv_.wait(mutex_);
+		}
+		atomicAdd(&nwaiting_, -1);
+		mutex_.unlock();
+		gettimeofday(&tv_end, NULL);
+		return (uint64_t)(tv_end.tv_sec - tv_beg.tv_sec) * 1000000 +
+		       tv_end.tv_usec - tv_beg.tv_usec;
+	}
+
+protected:
+
+	/**
+	 * Recompute the minimum position and raise the watermark to it,
+	 * waking waiters if it moved.
+	 */
+	void raise() {
+		bool raised = false;
+		uint64_t cur = atomicLoad(&min_);
+		while(true) {
+			uint64_t m = atomicLoad(&pos_[0]);
+			for(size_t i = 1; i < n_; i++) {
+				uint64_t p = atomicLoad(&pos_[i]);
+				if(p < m) m = p;
+			}
+			if(m <= cur) break;
+			if(atomicCas(&min_, cur, m)) {
+				// Rescan in case a position moved during the scan
+				raised = true;
+				cur = m;
+				atomicFence();
+			} else {
+				cur = atomicLoad(&min_);
+			}
+		}
+		if(raised) {
+			atomicFence();
+			if(atomicLoad(&nwaiting_) > 0) {
+				mutex_.lock();
+				cv_.notify_all();
+				mutex_.unlock();
+			}
+		}
+	}
+
+	uint64_t         *pos_;      // read id reached by each thread
+	size_t            n_;
+	volatile uint64_t min_;      // smallest of pos_
+	volatile int      nwaiting_; // threads blocked in waitFor()
+	tthread::mutex    mutex_;
+	tthread::condition_variable cv_;
+};
+
 #endif
@@ -0,0 +1,141 @@
+#include <string.h>
+#include <vector>
+#define R_NO_REMAP
+#include <R.h>
+#include <Rinternals.h>
+#include <R_ext/Rdynload.h>
+#include "hisat/hisat_api.h"
+
+// .Call entry points for hisat_load_index(), hisat_align_index() and
+// hisat_free_index(): an index stays loaded in this process, behind an
+// external pointer, for as many alignments as R asks for.
+
+static SEXP indexTag() {
+    return Rf_install("HisatIndex");
+}
+
+static HisatIndex *indexAddr(SEXP ptr) {
+    if(TYPEOF(ptr) != EXTPTRSXP || R_ExternalPtrTag(ptr) != indexTag()) {
+        Rf_error("not an index loaded by hisat_load_index()");
+    }
+    HisatIndex *idx = (HisatIndex*)R_ExternalPtrAddr(ptr);
+    if(idx == NULL) {
+        Rf_error("the index has been freed");
+    }
+    return idx;
+}
+
+static void freeIndex(SEXP ptr) {
+    HisatIndex *idx = (HisatIndex*)R_ExternalPtrAddr(ptr);
+    if(idx != NULL) {
+        R_ClearExternalPtr(ptr);
+        hisat_free(idx);
+    }
+}
+
+// NULL-terminated copy of the character vector 'args'; the strings
+// belong to 'args', which .Call keeps alive
+static void argArray(SEXP args, std::vector<const char*>& a) {
+    for(R_xlen_t i = 0; i < XLENGTH(args); i++) {
+        a.push_back(CHAR(STRING_ELT(args, i)));
+    }
+    a.push_back(NULL);
+}
+
+extern "C" SEXP Rhisat_load(SEXP args) {
+    if(!Rf_isString(args)) {
+        Rf_error("args must be a character vector");
+    }
+    HisatIndex *idx;
+    {
+        std::vector<const char*> a;
+        argArray(args, a);
+        HisatOptions opts;
+        hisat_options_init(&opts);
+        opts.args = &a[0];
+        idx = hisat_load(&opts);
+    }
+    if(idx == NULL) {
+        Rf_error("could not load the index");
+    }
+    SEXP ptr = PROTECT(R_MakeExternalPtr(idx, indexTag(), R_NilValue));
+    R_RegisterCFinalizerEx(ptr, freeIndex, TRUE);
+    UNPROTECT(1);
+    return ptr;
+}
+
+// Hands the output of hisat_align() to an R function, one chunk of
+// whole SAM records at a time.  R errors mustn't unwind through the
+// aligner, so each call runs under R_ToplevelExec(), and after the
+// first failure the rest of the output is dropped.
+struct RSink {
+    SEXP fun;
+    const char *buf;
+    size_t len;
+    bool failed;
+};
+
+static void callSink(void *vp) {
+    RSink *s = (RSink*)vp;
+    SEXP chunk = PROTECT(Rf_ScalarString(Rf_mkCharLenCE(s->buf, (int)s->len, CE_NATIVE)));
+    SEXP call = PROTECT(Rf_lang2(s->fun, chunk));
+    Rf_eval(call, R_GlobalEnv);
+    UNPROTECT(2);
+}
+
+static void rSink(void *arg, const char *buf, size_t len) {
+    RSink *s = (RSink*)arg;
+    if(s->failed) return;
+    if(memchr(buf, '\0', len) != NULL) {
+        // BAM, which R strings can't hold
+        s->failed = true;
+        return;
+    }
+    s->buf = buf;
+    s->len = len;
+    if(!R_ToplevelExec(callSink, s)) {
+        s->failed = true;
+    }
+}
+
+extern "C" SEXP Rhisat_align(SEXP ptr, SEXP args, SEXP callback) {
+    HisatIndex *idx = indexAddr(ptr);
+    if(!Rf_isString(args)) {
+        Rf_error("args must be a character vector");
+    }
+    if(callback != R_NilValue && !Rf_isFunction(callback)) {
+        Rf_error("callback must be a function or NULL");
+    }
+    RSink sink = { callback, NULL, 0, false };
+    int status;
+    {
+        std::vector<const char*> a;
+        argArray(args, a);
+        HisatOptions opts;
+        hisat_options_init(&opts);
+        opts.args = &a[0];
+        status = hisat_align(idx, &opts, callback == R_NilValue ? NULL : rSink, &sink);
+    }
+    if(sink.failed) {
+        Rf_error("callback failed; the rest of the output was dropped");
+    }
+    return Rf_ScalarInteger(status);
+}
+
+extern "C" SEXP Rhisat_free(SEXP ptr) {
+    indexAddr(ptr);
+    freeIndex(ptr);
+    return R_NilValue;
+}
+
+static const R_CallMethodDef callMethods[] = {
+    {"hisat_load",  (DL_FUNC) &Rhisat_load,  1},
+    {"hisat_align", (DL_FUNC) &Rhisat_align, 3},
+    {"hisat_free",  (DL_FUNC) &Rhisat_free,  1},
+    {NULL, NULL, 0}
+};
+
+extern "C" void R_init_Rhisat(DllInfo *dll) {
+    R_registerRoutines(dll, NULL, callMethods, NULL, NULL);
+    R_useDynamicSymbols(dll, FALSE);
+}